@@ -0,0 +1,252 @@
+/* aes.c -- portable AES (FIPS-197) encryption for counter mode
+ * Only the encryption direction is here, counter mode does not need
+ * the inverse cipher.  The lookup tables are computed on first use.
+ */
+
+#include <string.h>
+
+#include "aes.h"
+#include "sfs_cpu.h"
+
+#define GETU32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+  ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define PUTU32(p, v) ((p)[0] = (unsigned char)((v) >> 24), \
+  (p)[1] = (unsigned char)((v) >> 16), (p)[2] = (unsigned char)((v) >> 8), \
+  (p)[3] = (unsigned char)(v))
+#define ROTL8(x, n) ((unsigned char)(((x) << (n)) | ((x) >> (8 - (n)))))
+#define XTIME(x) ((unsigned char)(((x) << 1) ^ (((x) & 0x80) ? 0x1b : 0)))
+
+static unsigned char aes_sbox[256];
+static uint32_t aes_te0[256], aes_te1[256], aes_te2[256], aes_te3[256];
+static int aes_tables = 0;
+
+/* S-box from the multiplicative inverse in GF(2^8), 3 is a generator
+ * and p and q walk its powers and their inverses
+ */
+
+static void
+aes_make_tables(void)
+{
+  unsigned char p = 1, q = 1, s;
+  uint32_t t;
+  int i;
+
+  do {
+    p = p ^ XTIME(p);
+    q ^= q << 1;
+    q ^= q << 2;
+    q ^= q << 4;
+    if (q & 0x80)
+      q ^= 0x09;
+    aes_sbox[p] = q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^
+      ROTL8(q, 4) ^ 0x63;
+  } while (p != 1);
+  aes_sbox[0] = 0x63;
+
+  for (i = 0; i < 256; i++) {
+    s = aes_sbox[i];
+    t = ((uint32_t)XTIME(s) << 24) | ((uint32_t)s << 16) |
+      ((uint32_t)s << 8) | (uint32_t)(XTIME(s) ^ s);
+    aes_te0[i] = t;
+    aes_te1[i] = (t >> 8) | (t << 24);
+    aes_te2[i] = (t >> 16) | (t << 16);
+    aes_te3[i] = (t >> 24) | (t << 8);
+  }
+  aes_tables = 1;
+}
+
+/* Key expansion for 128 and 256 bit keys
+ */
+
+int
+aes_set_key(const unsigned char *key, int bits, aes_key_schedule *ks)
+{
+  unsigned char *w = ks->rk, t[4], c, rcon = 1;
+  int nk, i, words;
+
+  if ((bits != 128) && (bits != 256))
+    return -1;
+  if (!aes_tables)
+    aes_make_tables();
+
+  nk = bits / 32;
+  ks->rounds = nk + 6;
+  words = 4 * (ks->rounds + 1);
+  memcpy(w, key, 4 * nk);
+  for (i = nk; i < words; i++) {
+    memcpy(t, w + 4 * (i - 1), 4);
+    if (i % nk == 0) {
+      c = t[0];
+      t[0] = aes_sbox[t[1]] ^ rcon;
+      t[1] = aes_sbox[t[2]];
+      t[2] = aes_sbox[t[3]];
+      t[3] = aes_sbox[c];
+      rcon = XTIME(rcon);
+    } else if ((nk > 6) && (i % nk == 4)) {
+      t[0] = aes_sbox[t[0]]; t[1] = aes_sbox[t[1]];
+      t[2] = aes_sbox[t[2]]; t[3] = aes_sbox[t[3]];
+    }
+    w[4*i] = w[4*(i-nk)] ^ t[0];
+    w[4*i+1] = w[4*(i-nk)+1] ^ t[1];
+    w[4*i+2] = w[4*(i-nk)+2] ^ t[2];
+    w[4*i+3] = w[4*(i-nk)+3] ^ t[3];
+  }
+  return 0;
+}
+
+/* One block, T-table implementation
+ */
+
+void
+aes_encrypt(aes_key_schedule *ks, const unsigned char *in, unsigned char *out)
+{
+  const unsigned char *rk = ks->rk;
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  int r;
+
+  s0 = GETU32(in) ^ GETU32(rk);
+  s1 = GETU32(in + 4) ^ GETU32(rk + 4);
+  s2 = GETU32(in + 8) ^ GETU32(rk + 8);
+  s3 = GETU32(in + 12) ^ GETU32(rk + 12);
+  for (r = 1; r < ks->rounds; r++) {
+    rk += AES_BLOCK_SIZE;
+    t0 = aes_te0[s0 >> 24] ^ aes_te1[(s1 >> 16) & 255] ^
+      aes_te2[(s2 >> 8) & 255] ^ aes_te3[s3 & 255] ^ GETU32(rk);
+    t1 = aes_te0[s1 >> 24] ^ aes_te1[(s2 >> 16) & 255] ^
+      aes_te2[(s3 >> 8) & 255] ^ aes_te3[s0 & 255] ^ GETU32(rk + 4);
+    t2 = aes_te0[s2 >> 24] ^ aes_te1[(s3 >> 16) & 255] ^
+      aes_te2[(s0 >> 8) & 255] ^ aes_te3[s1 & 255] ^ GETU32(rk + 8);
+    t3 = aes_te0[s3 >> 24] ^ aes_te1[(s0 >> 16) & 255] ^
+      aes_te2[(s1 >> 8) & 255] ^ aes_te3[s2 & 255] ^ GETU32(rk + 12);
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+  rk += AES_BLOCK_SIZE;
+  t0 = ((uint32_t)aes_sbox[s0 >> 24] << 24) ^
+    ((uint32_t)aes_sbox[(s1 >> 16) & 255] << 16) ^
+    ((uint32_t)aes_sbox[(s2 >> 8) & 255] << 8) ^
+    (uint32_t)aes_sbox[s3 & 255] ^ GETU32(rk);
+  t1 = ((uint32_t)aes_sbox[s1 >> 24] << 24) ^
+    ((uint32_t)aes_sbox[(s2 >> 16) & 255] << 16) ^
+    ((uint32_t)aes_sbox[(s3 >> 8) & 255] << 8) ^
+    (uint32_t)aes_sbox[s0 & 255] ^ GETU32(rk + 4);
+  t2 = ((uint32_t)aes_sbox[s2 >> 24] << 24) ^
+    ((uint32_t)aes_sbox[(s3 >> 16) & 255] << 16) ^
+    ((uint32_t)aes_sbox[(s0 >> 8) & 255] << 8) ^
+    (uint32_t)aes_sbox[s1 & 255] ^ GETU32(rk + 8);
+  t3 = ((uint32_t)aes_sbox[s3 >> 24] << 24) ^
+    ((uint32_t)aes_sbox[(s0 >> 16) & 255] << 16) ^
+    ((uint32_t)aes_sbox[(s1 >> 8) & 255] << 8) ^
+    (uint32_t)aes_sbox[s2 & 255] ^ GETU32(rk + 12);
+  PUTU32(out, t0);
+  PUTU32(out + 4, t1);
+  PUTU32(out + 8, t2);
+  PUTU32(out + 12, t3);
+}
+
+/* Counter mode, counter block is the 8 byte nonce and big endian index
+ */
+
+void
+aes_ctr_crypt_c(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n)
+{
+  unsigned char ctr[AES_BLOCK_SIZE], pad[AES_BLOCK_SIZE];
+  int i;
+
+  memcpy(ctr, nonce, 8);
+  for (; n > 0; n--, first++, buf += AES_BLOCK_SIZE) {
+    for (i = 0; i < 8; i++)
+      ctr[15 - i] = (unsigned char)(first >> (8 * i));
+    aes_encrypt(ks, ctr, pad);
+    for (i = 0; i < AES_BLOCK_SIZE; i++)
+      buf[i] ^= pad[i];
+  }
+}
+
+/* Kernel selection
+ * The portable kernel has to pass the FIPS-197 examples, AES-NI is used
+ * only if the CPU has it and it gives the same results.
+ */
+
+static aes_ctr_fn aes_kernel = 0;
+static const char *aes_kernel_name = "portable";
+
+static int
+aes_test_fips(void)
+{
+  static const unsigned char pt[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+  static const unsigned char ct128[16] = {
+    0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+    0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+  static const unsigned char ct256[16] = {
+    0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+    0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+  aes_key_schedule ks;
+  unsigned char key[32], out[16];
+  int i;
+
+  for (i = 0; i < 32; i++)
+    key[i] = (unsigned char)i;
+  aes_set_key(key, 128, &ks);
+  aes_encrypt(&ks, pt, out);
+  if (memcmp(out, ct128, 16))
+    return 0;
+  aes_set_key(key, 256, &ks);
+  aes_encrypt(&ks, pt, out);
+  return !memcmp(out, ct256, 16);
+}
+
+static int
+aes_test_kernel(aes_ctr_fn fn)
+{
+  static unsigned char buf1[37*AES_BLOCK_SIZE], buf2[37*AES_BLOCK_SIZE];
+  aes_key_schedule ks;
+  unsigned char key[32], nonce[8];
+  uint32_t seed = 12347;
+  uint64_t first;
+  int i, k, ok = 1;
+
+  for (k = 0; ok && k < 4; k++) {
+    for (i = 0; i < 32; i++)
+      key[i] = (unsigned char)((seed = seed * 1103515245UL + 12345UL) >> 16);
+    for (i = 0; i < 8; i++)
+      nonce[i] = (unsigned char)((seed = seed * 1103515245UL + 12345UL) >> 16);
+    for (i = 0; i < (int)sizeof(buf1); i++)
+      buf1[i] = buf2[i] = (unsigned char)((seed = seed * 1103515245UL + 12345UL) >> 16);
+    /* the index crosses 2^32 in one of the runs */
+    first = (k == 3) ? 0xfffffff0UL : seed;
+    aes_set_key(key, (k & 1) ? 256 : 128, &ks);
+    aes_ctr_crypt_c(&ks, nonce, first, buf1, 37);
+    fn(&ks, nonce, first, buf2, 37);
+    ok = !memcmp(buf1, buf2, sizeof(buf1));
+  }
+  return ok;
+}
+
+const char *
+aes_init_kernel(void)
+{
+  aes_kernel = aes_ctr_crypt_c;
+  aes_kernel_name = "portable";
+  if (!aes_tables)
+    aes_make_tables();
+  if (!aes_test_fips())
+    return "broken";
+  if (aes_ni_compiled() && (sfs_cpu_features() & SFS_CPU_AESNI)
+      && aes_test_kernel(aes_ctr_crypt_ni)) {
+    aes_kernel = aes_ctr_crypt_ni;
+    aes_kernel_name = "aes-ni";
+  }
+  return aes_kernel_name;
+}
+
+void
+aes_ctr_crypt(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n)
+{
+  if (!aes_kernel)
+    aes_init_kernel();
+  aes_kernel(ks, nonce, first, buf, n);
+}
@@ -0,0 +1,41 @@
+/* aes.h -- AES (FIPS-197) encryption for counter mode
+ */
+
+#ifndef _AES_H
+#define _AES_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+
+/* Round keys are kept as bytes in FIPS-197 order, so that every kernel
+ * can use the same schedule.
+ */
+
+typedef struct aes_key_schedule {
+  unsigned char rk[(AES_MAX_ROUNDS+1)*AES_BLOCK_SIZE];
+  int rounds;
+} aes_key_schedule;
+
+/* XORs n blocks of buf with encrypted counter blocks nonce || index,
+ * index is 64 bit big endian and starts at first
+ */
+
+typedef void (*aes_ctr_fn)(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n);
+
+int aes_set_key(const unsigned char *key, int bits, aes_key_schedule *ks);
+void aes_encrypt(aes_key_schedule *ks, const unsigned char *in,
+  unsigned char *out);
+void aes_ctr_crypt(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n);
+void aes_ctr_crypt_c(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n);
+void aes_ctr_crypt_ni(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n);
+int aes_ni_compiled(void);
+const char *aes_init_kernel(void);
+
+#endif /* _AES_H */
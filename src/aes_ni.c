@@ -0,0 +1,74 @@
+/* aes_ni.c -- AES counter mode using the AES-NI instructions
+ * Eight counter blocks go through the rounds together, so that the
+ * latency of aesenc is hidden.
+ */
+
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__AES__) && defined(__SSE2__)
+
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+/* counter block: nonce in the low half, big endian index in the high one */
+#define CTR(i) _mm_set_epi64x((int64_t)__builtin_bswap64(i), (int64_t)nlo)
+
+int
+aes_ni_compiled(void)
+{
+  return 1;
+}
+
+void
+aes_ctr_crypt_ni(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n)
+{
+  __m128i rk[AES_MAX_ROUNDS+1], b[8];
+  uint64_t nlo;
+  int i, j, rounds = ks->rounds;
+
+  memcpy(&nlo, nonce, 8);
+  for (i = 0; i <= rounds; i++)
+    rk[i] = _mm_loadu_si128((const __m128i *)(ks->rk + i * AES_BLOCK_SIZE));
+
+  for (; n >= 8; n -= 8, first += 8, buf += 8 * AES_BLOCK_SIZE) {
+    for (j = 0; j < 8; j++)
+      b[j] = _mm_xor_si128(CTR(first + j), rk[0]);
+    for (i = 1; i < rounds; i++)
+      for (j = 0; j < 8; j++)
+        b[j] = _mm_aesenc_si128(b[j], rk[i]);
+    for (j = 0; j < 8; j++) {
+      b[j] = _mm_aesenclast_si128(b[j], rk[rounds]);
+      _mm_storeu_si128((__m128i *)(buf + j * AES_BLOCK_SIZE), _mm_xor_si128(b[j],
+        _mm_loadu_si128((const __m128i *)(buf + j * AES_BLOCK_SIZE))));
+    }
+  }
+
+  for (; n > 0; n--, first++, buf += AES_BLOCK_SIZE) {
+    b[0] = _mm_xor_si128(CTR(first), rk[0]);
+    for (i = 1; i < rounds; i++)
+      b[0] = _mm_aesenc_si128(b[0], rk[i]);
+    b[0] = _mm_aesenclast_si128(b[0], rk[rounds]);
+    _mm_storeu_si128((__m128i *)buf, _mm_xor_si128(b[0],
+      _mm_loadu_si128((const __m128i *)buf)));
+  }
+}
+
+#else
+
+int
+aes_ni_compiled(void)
+{
+  return 0;
+}
+
+void
+aes_ctr_crypt_ni(aes_key_schedule *ks, const unsigned char *nonce,
+  uint64_t first, unsigned char *buf, size_t n)
+{
+  aes_ctr_crypt_c(ks, nonce, first, buf, n);
+}
+
+#endif
@@ -2,20 +2,23 @@
  * 1994 Risto Paasivirta, paasivir@jyu.fi
  */
 
+#include <string.h>
+
 #include "blowfish.h"
 #include "pixdigits.h"
+#include "sfs_cpu.h"
 
-/* #define LITTLE_ENDIAN if target is Intel etc.
- * default big endian, target Sparc, Motorola 68k etc.
+/* BR() turns a big endian word from memory to the host order and back,
+ * the byte order is fixed at compile time in blowfish.h
  */
 
-#ifdef LITTLE_ENDIAN
-#define BR(x) (((x) >> 24) | (((x) >> 8) & 0xff00) | \
+#ifdef BF_LITTLE_ENDIAN
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 3)))
+#define BR(x) __builtin_bswap32(x)
+#else
+#define BR(x) ((((x) >> 24) & 0xff) | (((x) >> 8) & 0xff00) | \
          (((x) << 8) & 0xff0000) | ((x) << 24))
-/* Thanks for Jamie for correcting this error:
-#define BR(x) (((x) >> 24) | (((x) >> 16) & 0xff00) | \
-        (((x) << 16) & 0xff0000) | ((x) << 24))
-*/
+#endif
 #else
 #define BR(x) (x)
 #endif
@@ -27,7 +30,7 @@ void
 bf_set_key(uchar *key, int len, bf_key_schedule *ks)
 {
   int i;
-  ulong *p;
+  bf_word *p;
   bf_block bk = {0,0};
 
   p = ks->p;
@@ -38,14 +41,14 @@ bf_set_key(uchar *key, int len, bf_key_schedule *ks)
       len = 56;
     p = ks->p;
     for (i = 0; i < (BF_ROUNDS * 4 + 8); i += 4) {
-      *p++ ^= ((ulong)key[i % len] << 24) |
-              ((ulong)key[(i+1) % len] << 16) |
-              ((ulong)key[(i+2) % len] << 8) |
-              (ulong)key[(i+3) % len];
+      *p++ ^= ((bf_word)key[i % len] << 24) |
+              ((bf_word)key[(i+1) % len] << 16) |
+              ((bf_word)key[(i+2) % len] << 8) |
+              (bf_word)key[(i+3) % len];
     }
   }
   p = ks->p;
-  for (i = 0; i < (BF_ROUNDS / 2 + 514); i++) {
+  for (i = 0; i < (BF_ROUNDS / 2 + 513); i++) {
     bf_ecb_encrypt(&bk, &bk, ks, 1);
     *p++ = BR(bk.l);
     *p++ = BR(bk.r);
@@ -59,7 +62,7 @@ void
 bf_ecb_encrypt(bf_block *from, bf_block *to, bf_key_schedule *ks, int encrypt)
 {
   int i;
-  ulong l, r, t;
+  bf_word l, r, t;
 
   l = BR(from->l); r = BR(from->r);
   if (encrypt) {
@@ -84,6 +87,119 @@ bf_ecb_encrypt(bf_block *from, bf_block *to, bf_key_schedule *ks, int encrypt)
   to->l = BR(r); to->r = BR(l);
 }
 
+/* Blowfish electronic code book mode for n blocks
+ * Four blocks go through the rounds side by side, so that S-box loads
+ * of one block overlap the dependency chains of the others.
+ */
+
+#define BF_F(ks, x) ((((ks)->s1[((x) >> 24) & 255] + \
+  (ks)->s2[((x) >> 16) & 255]) ^ (ks)->s3[((x) >> 8) & 255]) + \
+  (ks)->s4[(x) & 255])
+
+#define BF_ROUND4(ks, a, b, k) \
+  a##0 ^= (k); a##1 ^= (k); a##2 ^= (k); a##3 ^= (k); \
+  b##0 ^= BF_F(ks, a##0); b##1 ^= BF_F(ks, a##1); \
+  b##2 ^= BF_F(ks, a##2); b##3 ^= BF_F(ks, a##3)
+
+void
+bf_ecb_encrypt_blocks_c(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt)
+{
+  int i;
+  bf_word l0, l1, l2, l3, r0, r1, r2, r3;
+
+  for (; n >= 4; n -= 4, from += 4, to += 4) {
+    l0 = BR(from[0].l); r0 = BR(from[0].r);
+    l1 = BR(from[1].l); r1 = BR(from[1].r);
+    l2 = BR(from[2].l); r2 = BR(from[2].r);
+    l3 = BR(from[3].l); r3 = BR(from[3].r);
+    /* two rounds per step, l and r swap back in place */
+    if (encrypt) {
+      for (i = 0; i < BF_ROUNDS; i += 2) {
+        BF_ROUND4(ks, l, r, ks->p[i]);
+        BF_ROUND4(ks, r, l, ks->p[i+1]);
+      }
+      l0 ^= ks->p[BF_ROUNDS]; l1 ^= ks->p[BF_ROUNDS];
+      l2 ^= ks->p[BF_ROUNDS]; l3 ^= ks->p[BF_ROUNDS];
+      r0 ^= ks->p[BF_ROUNDS+1]; r1 ^= ks->p[BF_ROUNDS+1];
+      r2 ^= ks->p[BF_ROUNDS+1]; r3 ^= ks->p[BF_ROUNDS+1];
+    } else {
+      for (i = (BF_ROUNDS+1); i > 1; i -= 2) {
+        BF_ROUND4(ks, l, r, ks->p[i]);
+        BF_ROUND4(ks, r, l, ks->p[i-1]);
+      }
+      l0 ^= ks->p[1]; l1 ^= ks->p[1]; l2 ^= ks->p[1]; l3 ^= ks->p[1];
+      r0 ^= ks->p[0]; r1 ^= ks->p[0]; r2 ^= ks->p[0]; r3 ^= ks->p[0];
+    }
+    to[0].l = BR(r0); to[0].r = BR(l0);
+    to[1].l = BR(r1); to[1].r = BR(l1);
+    to[2].l = BR(r2); to[2].r = BR(l2);
+    to[3].l = BR(r3); to[3].r = BR(l3);
+  }
+  for (; n > 0; n--)
+    bf_ecb_encrypt(from++, to++, ks, encrypt);
+}
+
+/* Kernel selection
+ * A SIMD kernel is used only if the CPU has it and it gives the same
+ * results as the portable one on random keys and data.
+ */
+
+static bf_ecb_blocks_fn bf_kernel = 0;
+static const char *bf_kernel_name = "portable";
+
+static bf_word
+bf_test_rand(bf_word *seed)
+{
+  *seed = *seed * 1103515245UL + 12345UL;
+  return (*seed >> 8) & 0xffffffUL;
+}
+
+static int
+bf_test_kernel(bf_ecb_blocks_fn fn)
+{
+  static bf_key_schedule ks;
+  static bf_block in[37], out1[37], out2[37];
+  uchar key[56];
+  bf_word seed = 12347;
+  int i, k, len, ok = 1;
+
+  for (k = 0; ok && k < 4; k++) {
+    len = 1 + bf_test_rand(&seed) % 56;
+    for (i = 0; i < len; i++)
+      key[i] = (uchar)bf_test_rand(&seed);
+    bf_set_key(key, len, &ks);
+    for (i = 0; i < (int)sizeof(in); i++)
+      ((uchar *)in)[i] = (uchar)bf_test_rand(&seed);
+    bf_ecb_encrypt_blocks_c(in, out1, 37, &ks, k & 1);
+    fn(in, out2, 37, &ks, k & 1);
+    ok = !memcmp(out1, out2, sizeof(out1));
+  }
+  return ok;
+}
+
+const char *
+bf_init_kernel(void)
+{
+  bf_kernel = bf_ecb_encrypt_blocks_c;
+  bf_kernel_name = "portable";
+  if (bf_avx2_compiled() && (sfs_cpu_features() & SFS_CPU_AVX2)
+      && bf_test_kernel(bf_ecb_encrypt_blocks_avx2)) {
+    bf_kernel = bf_ecb_encrypt_blocks_avx2;
+    bf_kernel_name = "avx2";
+  }
+  return bf_kernel_name;
+}
+
+void
+bf_ecb_encrypt_blocks(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt)
+{
+  if (!bf_kernel)
+    bf_init_kernel();
+  bf_kernel(from, to, n, ks, encrypt);
+}
+
 /* Blowfish cipher block chaining mode
  */
 
@@ -94,7 +210,7 @@ bf_cbc_encrypt(bf_block *from, bf_block *to, int len,
   int i;
   bf_block bk;
 
-#ifdef LITTLE_ENDIAN
+#ifdef BF_LITTLE_ENDIAN
   ivec->l = BR(ivec->l); ivec->r = BR(ivec->r);
 #endif
   if (encrypt) {
@@ -114,7 +230,7 @@ bf_cbc_encrypt(bf_block *from, bf_block *to, int len,
       to++; from++;
     }
   }
-#ifdef LITTLE_ENDIAN
+#ifdef BF_LITTLE_ENDIAN
   ivec->l = BR(ivec->l); ivec->r = BR(ivec->r);
 #endif
   return i;
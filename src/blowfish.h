@@ -5,27 +5,60 @@
 #ifndef _BLOWFISH_H
 #define _BLOWFISH_H 1
 
+#include <stdint.h>
 #include <sys/types.h>
 
 typedef unsigned char uchar;
 
+/* Blowfish works on 32 bit words, stored big endian in memory.
+ * LITTLE_ENDIAN from the system headers can not tell the byte order,
+ * glibc defines it on every target.
+ */
+
+typedef uint32_t bf_word;
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BF_LITTLE_ENDIAN 1
+#endif
+#else
+#include <endian.h>
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define BF_LITTLE_ENDIAN 1
+#endif
+#endif
+
 #define BF_ROUNDS 16
 
 typedef struct bf_key_schedule {
-  ulong p[BF_ROUNDS+2];
-  ulong s1[256];
-  ulong s2[256];
-  ulong s3[256];
-  ulong s4[256];
+  bf_word p[BF_ROUNDS+2];
+  bf_word s1[256];
+  bf_word s2[256];
+  bf_word s3[256];
+  bf_word s4[256];
 } bf_key_schedule;
 
 typedef struct bf_block {
-  ulong l,r;
+  bf_word l,r;
 } bf_block;
 
+/* compile time check, the block is 8 bytes on every target */
+typedef char bf_block_size_check[(sizeof(bf_block) == 8) ? 1 : -1];
+
 void bf_set_key(uchar *key, int len, bf_key_schedule *ks);
 void bf_ecb_encrypt(bf_block *from, bf_block *to, bf_key_schedule *ks,
   int encrypt);
+typedef void (*bf_ecb_blocks_fn)(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt);
+
+void bf_ecb_encrypt_blocks(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt);
+void bf_ecb_encrypt_blocks_c(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt);
+void bf_ecb_encrypt_blocks_avx2(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt);
+int bf_avx2_compiled(void);
+const char *bf_init_kernel(void);
 int bf_cbc_encrypt(bf_block *input, bf_block *output,
   int len, bf_key_schedule *ks, bf_block *ivec, int encrypt);
 
@@ -0,0 +1,115 @@
+/* blowfish_avx2.c -- blowfish ECB for eight blocks at once using AVX2
+ * The S-box lookups are done by vpgatherdd, each 32 bit lane runs one
+ * block.
+ */
+
+#include "blowfish.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#ifdef BF_LITTLE_ENDIAN
+#define BR8(x) _mm256_shuffle_epi8((x), m_bswap)
+#else
+#define BR8(x) (x)
+#endif
+
+#define SBOX8(s, x, sh) _mm256_i32gather_epi32((const int *)(s), \
+  _mm256_and_si256(_mm256_srli_epi32((x), (sh)), m_ff), 4)
+
+#define F8(ks, x) _mm256_add_epi32(_mm256_xor_si256( \
+  _mm256_add_epi32(SBOX8((ks)->s1, x, 24), SBOX8((ks)->s2, x, 16)), \
+  SBOX8((ks)->s3, x, 8)), SBOX8((ks)->s4, x, 0))
+
+/* two sets of eight blocks, so that gathers of one overlap the other */
+#define ROUND16(ks, a, b, k) \
+  kk = _mm256_set1_epi32((int)(k)); \
+  a##0 = _mm256_xor_si256(a##0, kk); a##1 = _mm256_xor_si256(a##1, kk); \
+  b##0 = _mm256_xor_si256(b##0, F8(ks, a##0)); \
+  b##1 = _mm256_xor_si256(b##1, F8(ks, a##1))
+
+/* eight blocks (l,r) to l0..l7 and r0..r7 */
+#define LOAD8(from, l, r) \
+  a = _mm256_permutevar8x32_epi32( \
+    _mm256_loadu_si256((const __m256i *)(from)), m_split); \
+  b = _mm256_permutevar8x32_epi32( \
+    _mm256_loadu_si256((const __m256i *)((from) + 4)), m_split); \
+  l = BR8(_mm256_permute2x128_si256(a, b, 0x20)); \
+  r = BR8(_mm256_permute2x128_si256(a, b, 0x31))
+
+/* and back, output block is (r,l) */
+#define STORE8(to, l, r) \
+  a = BR8(r); b = BR8(l); \
+  _mm256_storeu_si256((__m256i *)(to), _mm256_permutevar8x32_epi32( \
+    _mm256_permute2x128_si256(a, b, 0x20), m_join)); \
+  _mm256_storeu_si256((__m256i *)((to) + 4), _mm256_permutevar8x32_epi32( \
+    _mm256_permute2x128_si256(a, b, 0x31), m_join))
+
+int
+bf_avx2_compiled(void)
+{
+  return 1;
+}
+
+void
+bf_ecb_encrypt_blocks_avx2(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt)
+{
+  int i;
+  __m256i a, b, l0, l1, r0, r1, kk;
+  const __m256i m_ff = _mm256_set1_epi32(0xff);
+  const __m256i m_split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  const __m256i m_join = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+#ifdef BF_LITTLE_ENDIAN
+  const __m256i m_bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+    11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+    11, 10, 9, 8, 15, 14, 13, 12);
+#endif
+
+  for (; n >= 16; n -= 16, from += 16, to += 16) {
+    LOAD8(from, l0, r0);
+    LOAD8(from + 8, l1, r1);
+    /* two rounds per step, l and r swap back in place */
+    if (encrypt) {
+      for (i = 0; i < BF_ROUNDS; i += 2) {
+        ROUND16(ks, l, r, ks->p[i]);
+        ROUND16(ks, r, l, ks->p[i+1]);
+      }
+      kk = _mm256_set1_epi32((int)ks->p[BF_ROUNDS]);
+      l0 = _mm256_xor_si256(l0, kk); l1 = _mm256_xor_si256(l1, kk);
+      kk = _mm256_set1_epi32((int)ks->p[BF_ROUNDS+1]);
+      r0 = _mm256_xor_si256(r0, kk); r1 = _mm256_xor_si256(r1, kk);
+    } else {
+      for (i = (BF_ROUNDS+1); i > 1; i -= 2) {
+        ROUND16(ks, l, r, ks->p[i]);
+        ROUND16(ks, r, l, ks->p[i-1]);
+      }
+      kk = _mm256_set1_epi32((int)ks->p[1]);
+      l0 = _mm256_xor_si256(l0, kk); l1 = _mm256_xor_si256(l1, kk);
+      kk = _mm256_set1_epi32((int)ks->p[0]);
+      r0 = _mm256_xor_si256(r0, kk); r1 = _mm256_xor_si256(r1, kk);
+    }
+    STORE8(to, l0, r0);
+    STORE8(to + 8, l1, r1);
+  }
+  if (n)
+    bf_ecb_encrypt_blocks_c(from, to, n, ks, encrypt);
+}
+
+#else
+
+int
+bf_avx2_compiled(void)
+{
+  return 0;
+}
+
+void
+bf_ecb_encrypt_blocks_avx2(bf_block *from, bf_block *to, int n,
+  bf_key_schedule *ks, int encrypt)
+{
+  bf_ecb_encrypt_blocks_c(from, to, n, ks, encrypt);
+}
+
+#endif
@@ -48,7 +48,7 @@ dup( int fd )
       errno = SFS_ERRNO;
       return -1;
     }
-    if (rett == SFS_REPLY_ENCRYPTED) {
+    if ((rett == SFS_REPLY_ENCRYPTED) || (rett == SFS_REPLY_STREAM)) {
       sfs_debug( "dup", "cannot dup encrypted file" );
       errno = SFS_ERRNO;
       return -1;
@@ -92,7 +92,7 @@ dup2( int fd, int newfd )
       errno = SFS_ERRNO;
       return -1;
     }
-    if (rett == SFS_REPLY_ENCRYPTED) {
+    if ((rett == SFS_REPLY_ENCRYPTED) || (rett == SFS_REPLY_STREAM)) {
       sfs_debug( "dup2", "cannot dup2 encrypted file" );
       errno = SFS_ERRNO;
       return -1;
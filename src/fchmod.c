@@ -48,7 +48,7 @@ fchmod( int fd, mode_t mode )
       errno = SFS_ERRNO;
       return -1;
     }
-    if (rett == SFS_REPLY_ENCRYPTED) {
+    if ((rett == SFS_REPLY_ENCRYPTED) || (rett == SFS_REPLY_STREAM)) {
       sfs_debug( "fchmod", "cannot fchmod encrypted file" );
       errno = SFS_ERRNO;
       return -1;
@@ -0,0 +1,152 @@
+/*
+ * fsync.c
+ *
+ * Envelope for standard 'fsync' function.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>,
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+#include "sfs_lib.h"
+#include "sfs_debug.h"
+
+#define DE DEB( "fsync" );
+
+
+//----------------------------------------------------------------------------
+// fsync()
+// ~~~~~~~
+// Envelope for 'fsync' function, asks daemon to write size of encrypted
+// file to the disk too
+// Status: finished
+//----------------------------------------------------------------------------
+int
+fsync( int fd )
+{
+  int rett;
+  int sfs_queue = -1, reply_queue = -1, reply_queue_id;
+  struct s_msg msgb;
+  uid_t uid;
+  long auth;
+  char buf[SFS_MAX_PATH];
+  struct new_stat st;
+_DE
+ 
+//  sfs_debug( "fsync", "process %d called fsync(%d)", getpid(), fd );
+
+  uid = getuid();
+ 
+DE
+
+  if (__syscall_fstat( fd, &st ) == -1) {
+    sfs_debug( "fsync", "cannot fstat the fd %d", fd );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  if (S_ISREG( st.st_mode )) {
+    rett = sfs_is_encrypted( fd, uid, getpid() );
+    if (rett == -1) {
+      sfs_debug( "fsync", "cannot get state of the file" );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+  }
+  else
+    rett = SFS_REPLY_OK;
+    
+DE
+
+  if (rett == SFS_REPLY_OK)
+    return __fsync( fd );
+
+DE
+
+ /*
+  * Tell daemon to write the file size it keeps for us
+  *
+  */
+
+  sprintf( buf, "%s/%d", SFS_DIR, uid );
+  auth = sfs_auth( buf );
+  if (auth == -1) {
+    sfs_debug( "fsync", "authorization error" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  msgb.mtype = SFS_MESSAGE;
+  msgb.sfs_msg.sfs_req_type = SFS_SYNC_REQ;
+  msgb.sfs_msg.sfs_req_auth = auth;
+  msgb.sfs_msg.sfs_req_uid = uid;
+  msgb.sfs_msg.sfs_req.sfs_sync.fd = fd;
+  msgb.sfs_msg.sfs_req.sfs_sync.pid = getpid();
+  
+  sfs_queue = msgget( SFS_D_QUEUE_ID, SFS_R_QUEUE_PERM );
+  if (sfs_queue == -1) {
+    sfs_debug( "fsync", "cannot get message queue" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  srand( time( 0 ) );
+  reply_queue_id = rand();
+  reply_queue = msgget( reply_queue_id, SFS_C_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
+  if (reply_queue == -1) {
+    sfs_debug( "fsync", "%d: cannot get reply queue %d", errno, reply_queue_id );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  msgb.sfs_msg.sfs_req_reply_queue = reply_queue_id;
+
+  if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
+    sfs_debug( "fsync", "cannot send message" );
+    msgctl( reply_queue, IPC_RMID, NULL );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
+    sfs_debug( "fsync", "receive message error" );
+    msgctl( reply_queue, IPC_RMID, NULL );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  msgctl( reply_queue, IPC_RMID, NULL );
+
+  if ((msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ) ||
+      (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK)) {
+    sfs_debug( "fsync", "sfsd sync error" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+DE
+
+  return __fsync( fd );
+}
+
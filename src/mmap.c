@@ -50,7 +50,7 @@ mmap( char *start, size_t length, int prot, int flags, int fd, off_t offset )
       errno = SFS_ERRNO;
       return NULL;
     }
-    if (rett == SFS_REPLY_ENCRYPTED) {
+    if ((rett == SFS_REPLY_ENCRYPTED) || (rett == SFS_REPLY_STREAM)) {
       sfs_debug( "mmap", "cannot mmap encrypted file" );
       errno = SFS_ERRNO;
       return NULL;
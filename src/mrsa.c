@@ -7,8 +7,13 @@
 #define MRSA_C 1
 
 #include "mrsa.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifndef MRSA_NO_THREADS
+#include <pthread.h>
+#endif
 
 /*
  * math library stuff
@@ -86,14 +91,33 @@ cu(N a, N b)
 }
 
 /*
- * carry = ad(N a, N b) -- add, a += b
+ * p = pn(N a) -- precision, number of units in use (at least 1)
  */
 
-PRIVATE ULONG
-ad(N a, N b)
+static ULONG
+pn(N a)
 {
-	ULONG c = 0, i = NSIZE;
-	while (i--) {
+	ULONG p = NSIZE;
+	while (p > 1 && !a[p - 1])
+		p--;
+	return p;
+}
+
+/*
+ * The unit loops below take the precision p, the N a ops are them with
+ * p = NSIZE. Internal code passes the precision of its operands, so small
+ * numbers touch only the units they use.
+ */
+
+/*
+ * carry = adp(N a, N b, ULONG p) -- add p units, a += b
+ */
+
+static ULONG
+adp(N a, N b, ULONG p)
+{
+	ULONG c = 0;
+	while (p--) {
 		c = *b++ + *a + c;
 		*a++ = c;
 		c >>= UNIT_BITS;
@@ -102,14 +126,14 @@ ad(N a, N b)
 }
 
 /*
- * carry = sb(N a, N b) -- substract, a -= b
+ * carry = sbp(N a, N b, ULONG p) -- substract p units, a -= b
  */
 
-PRIVATE ULONG
-sb(N a, N b)
+static ULONG
+sbp(N a, N b, ULONG p)
 {
-	ULONG c = 0, i = NSIZE;
-	while (i--) {
+	ULONG c = 0;
+	while (p--) {
 		c = *a - *b++ - c;
 		*a++ = c;
 		c = (c >> UNIT_BITS) & 1;
@@ -117,6 +141,42 @@ sb(N a, N b)
 	return c;
 }
 
+/*
+ * carry = slp(N a, ULONG p) -- shift p units left, a <<= 1
+ */
+
+static ULONG
+slp(N a, ULONG p)
+{
+	ULONG c = 0;
+	while (p--) {
+		c |= (ULONG) * a << 1;
+		*a++ = c;
+		c = (c >> UNIT_BITS) & 1;
+	}
+	return c;
+}
+
+/*
+ * carry = ad(N a, N b) -- add, a += b
+ */
+
+PRIVATE ULONG
+ad(N a, N b)
+{
+	return adp(a, b, NSIZE);
+}
+
+/*
+ * carry = sb(N a, N b) -- substract, a -= b
+ */
+
+PRIVATE ULONG
+sb(N a, N b)
+{
+	return sbp(a, b, NSIZE);
+}
+
 /*
  * carry = sr(N a) -- shift right, a >>= 1
  */
@@ -141,29 +201,27 @@ sr(N a)
 PRIVATE ULONG
 sl(N a)
 {
-	ULONG c = 0, i = NSIZE;
-	while (i--) {
-		c |= (ULONG) * a << 1;
-		*a++ = c;
-		c = (c >> UNIT_BITS) & 1;
-	}
-	return c;
+	return slp(a, NSIZE);
 }
 
 /*
  * dm(N a, N b, N c) -- divide-modulo unsigned, a = a / b, c = a % b
+ * (runs over the units of a in use, the remainder needs one unit more
+ * than b)
  */
 
 PRIVATE void
 dm(N a, N b, N c)
 {
-	ULONG i = NSIZE * UNIT_BITS;
+	ULONG p = pn(a), q = pn(b) + 1, i = p * UNIT_BITS;
+	if (q > NSIZE)
+		q = NSIZE;
 	cl(c);
 	while (i--) {
-		sl(c);
-		*c |= sl(a);
-		if (sb(c, b)) {
-			ad(c, b);
+		slp(c, q);
+		*c |= slp(a, p);
+		if (sbp(c, b, q)) {
+			adp(c, b, q);
 		} else {
 			*a |= 1;
 		}
@@ -177,7 +235,7 @@ dm(N a, N b, N c)
 PRIVATE ULONG
 di(N a, ULONG t)
 {
-	ULONG c = 0, i = NSIZE;
+	ULONG c = 0, i = pn(a);
 	while (i--) {
 		c = (c << UNIT_BITS) | a[i];
 		a[i] = c / t;
@@ -188,20 +246,330 @@ di(N a, ULONG t)
 
 /*
  * mu(N a, N b) -- multiply unsigned, a *= b
+ * (schoolbook on whole units, product fits in ULONG with the carries)
  */
 
 PRIVATE void
 mu(N a, N b)
 {
-	ULONG i = NSIZE * UNIT_BITS;
-	NN c;
-	cl(c);
-	while (i--) {
-		sl(c);
-		if (sl(a))
-			ad(c, b);
+	ULONG c, i, j, p = pn(a), q = pn(b);
+	NN r;
+	cl(r);
+	for (i = 0; i < p; i++) {
+		if (!a[i])
+			continue;
+		for (j = 0, c = 0; j < q && i + j < NSIZE; j++) {
+			c += (ULONG) a[i] * b[j] + r[i + j];
+			r[i + j] = c;
+			c >>= UNIT_BITS;
+		}
+		if (i + j < NSIZE)
+			r[i + j] = c;
 	}
-	cp(a, c);
+	cp(a, r);
+}
+
+/*
+ * Montgomery arithmetic. Numbers are repacked to MW-bit limbs, products
+ * are taken in MD. Used for odd moduli only, which are all RSA ones.
+ */
+
+#ifdef __SIZEOF_INT128__
+typedef uint64_t MW;
+__extension__ typedef unsigned __int128 MD;
+#define MW_BITS 64
+#else
+typedef uint32_t MW;
+typedef uint64_t MD;
+#define MW_BITS 32
+#endif
+
+#define MW_UNITS (MW_BITS / UNIT_BITS)	/* units per limb */
+#define MSIZE ((NSIZE + MW_UNITS - 1) / MW_UNITS)
+
+typedef struct mont {
+	ULONG n;		/* limbs of modulus */
+	MW m[MSIZE];		/* modulus */
+	MW r2[MSIZE];		/* R^2 mod m, R = 2^(n*MW_BITS) */
+	MW mi;			/* -m^{-1} mod 2^MW_BITS */
+} mont;
+
+/*
+ * nw(MW *a, N b, ULONG n) -- pack b to n limbs
+ */
+
+static void
+nw(MW *a, N b, ULONG n)
+{
+	ULONG i, k;
+	for (i = 0; i < n; i++) {
+		a[i] = 0;
+		for (k = 0; k < MW_UNITS && i * MW_UNITS + k < NSIZE; k++)
+			a[i] |= (MW) b[i * MW_UNITS + k] << (k * UNIT_BITS);
+	}
+}
+
+/*
+ * wn(N a, MW *b, ULONG n) -- unpack n limbs to a
+ */
+
+static void
+wn(N a, MW *b, ULONG n)
+{
+	ULONG i, k;
+	cl(a);
+	for (i = 0; i < n; i++)
+		for (k = 0; k < MW_UNITS && i * MW_UNITS + k < NSIZE; k++)
+			a[i * MW_UNITS + k] = b[i] >> (k * UNIT_BITS);
+}
+
+/*
+ * carry = wsb(MW *a, MW *b, ULONG n) -- substract limbs, a -= b
+ */
+
+static MW
+wsb(MW *a, MW *b, ULONG n)
+{
+	MW c = 0, t;
+	ULONG i;
+	for (i = 0; i < n; i++) {
+		t = a[i] - b[i] - c;
+		c = (a[i] < b[i]) || (a[i] == b[i] && c);
+		a[i] = t;
+	}
+	return c;
+}
+
+/*
+ * flag = wcu(MW *a, MW *b, ULONG n) -- compare limbs unsigned
+ */
+
+static int
+wcu(MW *a, MW *b, ULONG n)
+{
+	while (n--)
+		if (a[n] != b[n])
+			return a[n] < b[n] ? -1 : 1;
+	return 0;
+}
+
+/*
+ * flag = mi(mont *t, N m) -- set up Montgomery arithmetic mod m,
+ * returns 0 if m is even (or zero)
+ */
+
+static int
+mi(mont *t, N m)
+{
+	ULONG i, n = NSIZE;
+	MW x, c;
+	if (!(*m & 1))
+		return 0;
+	while (n > 1 && !m[n - 1])
+		n--;
+	t->n = (n + MW_UNITS - 1) / MW_UNITS;
+	nw(t->m, m, t->n);
+	/* Newton iteration, each step doubles the correct low bits */
+	for (x = t->m[0], i = 0; i < 6; i++)
+		x *= 2 - t->m[0] * x;
+	t->mi = 0 - x;
+	/* R^2 mod m by doubling 1 modulo m */
+	for (i = 0; i < t->n; i++)
+		t->r2[i] = 0;
+	*t->r2 = 1;
+	for (i = 0; i < 2 * t->n * MW_BITS; i++) {
+		c = t->r2[t->n - 1] >> (MW_BITS - 1);
+		for (n = t->n - 1; n > 0; n--)
+			t->r2[n] = t->r2[n] << 1 | t->r2[n - 1] >> (MW_BITS - 1);
+		*t->r2 <<= 1;
+		if (c || wcu(t->r2, t->m, t->n) >= 0)
+			wsb(t->r2, t->m, t->n);
+	}
+	return 1;
+}
+
+/*
+ * mr(MW *r, MW *a, MW *b, mont *t) -- Montgomery product, r = a*b/R mod m
+ * (interleaved multiply and reduce, r may be a or b)
+ */
+
+static void
+mr(MW *r, MW *a, MW *b, mont *t)
+{
+	MW v[MSIZE + 2], q, c;
+	MD d;
+	ULONG i, j, n = t->n;
+	for (i = 0; i < n + 2; i++)
+		v[i] = 0;
+	for (i = 0; i < n; i++) {
+		for (j = 0, c = 0; j < n; j++) {
+			d = (MD) a[j] * b[i] + v[j] + c;
+			v[j] = (MW) d;
+			c = (MW) (d >> MW_BITS);
+		}
+		d = (MD) v[n] + c;
+		v[n] = (MW) d;
+		v[n + 1] = (MW) (d >> MW_BITS);
+		q = v[0] * t->mi;
+		d = (MD) q * t->m[0] + v[0];
+		c = (MW) (d >> MW_BITS);
+		for (j = 1; j < n; j++) {
+			d = (MD) q * t->m[j] + v[j] + c;
+			v[j - 1] = (MW) d;
+			c = (MW) (d >> MW_BITS);
+		}
+		d = (MD) v[n] + c;
+		v[n - 1] = (MW) d;
+		v[n] = v[n + 1] + (MW) (d >> MW_BITS);
+	}
+	if (v[n] || wcu(v, t->m, n) >= 0)
+		wsb(v, t->m, n);
+	for (i = 0; i < n; i++)
+		r[i] = v[i];
+}
+
+/*
+ * mf(MW *x, N a, mont *t) -- Montgomery form of a, x = a*R mod m
+ * (a of any size, taken by n limbs from the top as in Horner's scheme)
+ */
+
+static void
+mf(MW *x, N a, mont *t)
+{
+	MW w[2 * MSIZE], y[MSIZE], c;
+	ULONG i, k, n = t->n, p = (pn(a) + MW_UNITS - 1) / MW_UNITS;
+	nw(w, a, p);
+	for (i = p; i < 2 * MSIZE; i++)
+		w[i] = 0;
+	for (i = 0; i < n; i++)
+		x[i] = 0;
+	k = (p + n - 1) / n;
+	while (k--) {
+		mr(x, x, t->r2, t);
+		mr(y, w + k * n, t->r2, t);
+		for (i = 0, c = 0; i < n; i++) {
+			x[i] += c;
+			c = x[i] < c;
+			x[i] += y[i];
+			c += x[i] < y[i];
+		}
+		if (c || wcu(x, t->m, n) >= 0)
+			wsb(x, t->m, n);
+	}
+}
+
+/*
+ * mo(N a, MW *x, mont *t) -- out of Montgomery form, a = x/R mod m
+ */
+
+static void
+mo(N a, MW *x, mont *t)
+{
+	MW y[MSIZE];
+	ULONG i;
+	for (i = 0; i < t->n; i++)
+		y[i] = 0;
+	*y = 1;
+	mr(y, x, y, t);
+	wn(a, y, t->n);
+}
+
+/*
+ * mt(N a, N b, mont *t) -- Montgomery modular multiply, a = a * b mod m
+ */
+
+static void
+mt(N a, N b, mont *t)
+{
+	MW x[MSIZE], y[MSIZE];
+	mf(x, a, t);
+	mf(y, b, t);
+	mr(x, x, y, t);
+	mo(a, x, t);
+}
+
+/*
+ * bits = wk(ULONG bits) -- sliding window size for exponent of bits,
+ * the table has 2^(bits-1) odd powers
+ */
+
+#define WK_MAX 6
+
+static ULONG
+wk(ULONG b)
+{
+	if (b <= 24)
+		return 1;
+	if (b <= 80)
+		return 3;
+	if (b <= 240)
+		return 4;
+	if (b <= 672)
+		return 5;
+	return WK_MAX;
+}
+
+#define EB(e, i) (((e)[(i) / UNIT_BITS] >> ((i) % UNIT_BITS)) & 1)
+
+/*
+ * mxw(MW *x, N a, N e, mont *t) -- Montgomery modular exponentiation,
+ * x = a^e*R mod m, e must not be 0
+ * (left-to-right sliding window over precomputed odd powers of a)
+ */
+
+static void
+mxw(MW *x, N a, N e, mont *t)
+{
+	MW y[MSIZE], w[1 << (WK_MAX - 1)][MSIZE];
+	ULONG n = NSIZE * UNIT_BITS, k, j, v, f = 1;
+	long i, l;
+	while (n && !EB(e, n - 1))
+		n--;
+	k = wk(n);
+	mf(w[0], a, t);
+	if (k > 1) {
+		mr(y, w[0], w[0], t);
+		for (j = 1; j < (1UL << (k - 1)); j++)
+			mr(w[j], w[j - 1], y, t);
+	}
+	for (i = n - 1; i >= 0; i = l - 1) {
+		if (!EB(e, i)) {
+			mr(x, x, x, t);
+			l = i;
+			continue;
+		}
+		l = i + 1 > (long) k ? i + 1 - (long) k : 0;
+		while (!EB(e, l))
+			l++;
+		for (v = 0, j = i + 1; j-- > (ULONG) l;)
+			v = v << 1 | EB(e, j);
+		if (f) {
+			for (j = 0; j < t->n; j++)
+				x[j] = w[v >> 1][j];
+			f = 0;
+			continue;
+		}
+		for (j = l; j <= (ULONG) i; j++)
+			mr(x, x, x, t);
+		mr(x, x, w[v >> 1], t);
+	}
+}
+
+/*
+ * mx(N a, N e, mont *t) -- Montgomery modular exponentiation, a = a^e mod m
+ */
+
+static void
+mx(N a, N e, mont *t)
+{
+	MW x[MSIZE];
+	if (!ts(e)) {
+		cl(a);
+		*a = 1;
+		return;
+	}
+	mxw(x, a, e, t);
+	mo(a, x, t);
 }
 
 /*
@@ -212,7 +580,12 @@ PRIVATE void
 mm(N a, N b, N m)
 {
 	ULONG i = NSIZE * UNIT_BITS;
+	mont t;
 	NN c;
+	if (mi(&t, m)) {
+		mt(a, b, &t);
+		return;
+	}
 	cl(c);
 	while (i--) {
 		sl(c);
@@ -291,14 +664,20 @@ pmm(N aa, N b, N m, ULONG p)
 
 /*
  * em(N a, N b, N m) -- modular exponentation, a = a^b mod n
+ * (pmm() is left for even m)
  */
 
 PRIVATE void
 em(N a, N e, N m)
 {
 	ULONG i = NSIZE, j = UNIT_BITS, p = NSIZE;
+	mont t;
 	NN c;
 	N mp;
+	if (mi(&t, m)) {
+		mx(a, e, &t);
+		return;
+	}
 	cl(c);
 	*c = 1;
 	e += NSIZE;
@@ -491,48 +870,102 @@ sieve_prime(N n)
 }
 
 /*
- * flag = prob_prime(N n) -- test if 2^(n-1) mod n == 1. Returns 0 if
- * test failed, !0 if success. Large n which passes this test is a
- * probable prime. This test does not work well with small value of n. 
- * Because this test is slow, you should first try sieving n.
+ * flag = prob_prime(N n) -- Miller-Rabin test of n with the first
+ * MR_ROUNDS primes as bases. Returns 0 if n is composite, !0 if it is
+ * a probable prime. Because this test is slow, you should first try
+ * sieving n.
  */
 
+#define MR_ROUNDS 8
+
 int
 prob_prime(N m)
 {
-	ULONG i = NSIZE, j = UNIT_BITS, p = NSIZE;
-	NN c, ee;
-	N mp, e = ee + NSIZE;
-	cl(c);
-	*c = 1;
-	cp(ee, m);
-	sb(ee, c);
-	while (!*--e && i)
-		i--;
-	if (i) {
-		while (!(*e & (1 << j)))
-			j--;
-		*c = 2;
+	MW x[MSIZE], one[MSIZE], mone[MSIZE];
+	ULONG i, r, s;
+	mont t;
+	NN b, d;
+	if (!mi(&t, m)) {
+		cl(b);
+		*b = 2;
+		return !cu(m, b);
 	}
-	mp = m + NSIZE;
-	while (!*--mp && p)
-		p--;
-	if (*mp & SIGN_BIT && p < NSIZE)
-		p++;
-	while (i--) {
-		while (j--) {
-			pmm(c, c, m, p);
-			if (*e & (1 << j)) {
-				sl(c);
-				if(sb(c, m)) ad(c, m);
-			}
+	cp(d, m);
+	*d ^= 1;
+	if (!ts(d))
+		return 0;
+	for (s = 0; !(*d & 1); s++)
+		sr(d);
+	cl(b);
+	*b = 1;
+	mf(one, b, &t);
+	for (i = 0; i < t.n; i++)
+		mone[i] = t.m[i];
+	wsb(mone, one, t.n);	/* -1 in Montgomery form */
+	for (i = 0; i < MR_ROUNDS; i++) {
+		cl(b);
+		*b = sp[i];
+		if (cu(b, m) >= 0)
+			break;
+		mxw(x, b, d, &t);
+		if (!wcu(x, one, t.n) || !wcu(x, mone, t.n))
+			continue;
+		for (r = 1; r < s; r++) {
+			mr(x, x, x, &t);
+			if (!wcu(x, mone, t.n))
+				break;
 		}
-		e--;
-		j = UNIT_BITS;
+		if (r == s)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Segmented sieve, candidates a, a+2, ... a+2*(SIEVE_WINDOW-1) are crossed
+ * out by the odd primes below SIEVE_LIMIT at once
+ */
+
+#define SIEVE_LIMIT 16384
+#define SIEVE_WINDOW 4096
+
+static unsigned short sq[SIEVE_LIMIT / 2];	/* odd primes < SIEVE_LIMIT */
+static ULONG nsq;				/* number of them */
+
+/*
+ * sq_init() -- fill the table of sieving primes, done once before
+ * the threads start
+ */
+
+static void
+sq_init(void)
+{
+	static unsigned char c[SIEVE_LIMIT];
+	ULONG i, j;
+	if (nsq)
+		return;
+	for (i = 3; i < SIEVE_LIMIT; i += 2) {
+		if (c[i])
+			continue;
+		sq[nsq++] = i;
+		for (j = i * i; j < SIEVE_LIMIT; j += 2 * i)
+			c[j] = 1;
+	}
+}
+
+/*
+ * ai(N a, ULONG v) -- add small integer, a += v
+ */
+
+static void
+ai(N a, ULONG v)
+{
+	ULONG i;
+	for (i = 0; i < NSIZE && v; i++) {
+		v += a[i];
+		a[i] = v;
+		v >>= UNIT_BITS;
 	}
-	cl(ee);
-	*ee = 1;
-	return (!cu(c,ee));
 }
 
 #ifndef THINK_SILENTLY
@@ -556,27 +989,71 @@ tw(void)
 #endif /* THINK_SILENTLY */
 
 /*
- * next_prime(N a) -- find next probable prime >= a
+ * np(N a, int quiet) -- find next probable prime >= a, a has to be
+ * greater than SIEVE_LIMIT
  */
 
-void
-next_prime(N a)
+static void
+np(N a, int quiet)
 {
-	NN b;
+	unsigned char w[SIEVE_WINDOW];
+	ULONG r, i, j;
+	NN c;
 	*a |= 1;
-	cl(b); *b = 2;
+	sq_init();
 	for (;;) {
 #ifndef THINK_SILENTLY
-		tw();
+		if (!quiet)
+			tw();
 #endif /* THINK_SILENTLY */
-		if (!sieve_prime(a)) {
-			if (prob_prime(a))
+		memset(w, 0, sizeof(w));
+		for (i = 0; i < nsq; i++) {
+			cp(c, a);
+			r = di(c, sq[i]);
+			/* first j with a + 2j = 0 mod q, 1/2 = (q+1)/2 mod q */
+			j = (sq[i] - r) % sq[i] * ((sq[i] + 1) / 2) % sq[i];
+			for (; j < SIEVE_WINDOW; j += sq[i])
+				w[j] = 1;
+		}
+		for (j = 0; j < SIEVE_WINDOW; j++) {
+			if (w[j])
+				continue;
+			cp(c, a);
+			ai(c, 2 * j);
+			if (prob_prime(c)) {
+				cp(a, c);
 				return;
+			}
 		}
-		ad(a, b);
+		ai(a, 2 * SIEVE_WINDOW);
 	}
 }
 
+/*
+ * next_prime(N a) -- find next probable prime >= a
+ */
+
+void
+next_prime(N a)
+{
+	np(a, 0);
+}
+
+#ifndef MRSA_NO_THREADS
+
+/*
+ * np_thread(void *a) -- search for next prime in a thread
+ */
+
+static void *
+np_thread(void *a)
+{
+	np((N) a, 1);
+	return NULL;
+}
+
+#endif
+
 /*
  * bits rsa_gen(rsa_key *key) -- generate a RSA key from key->p and key->q
  * Initialize key->p and key->q either with primes or strong random
@@ -588,8 +1065,19 @@ ULONG
 rsa_gen(rsa_key *k)
 {
 	NN p1, q1, pq1, f, g, t;
-	next_prime(k->p);
-	next_prime(k->q);
+#ifndef MRSA_NO_THREADS
+	pthread_t th;
+	/* p and q are searched at once */
+	sq_init();
+	if (!pthread_create(&th, NULL, np_thread, k->q)) {
+		next_prime(k->p);
+		pthread_join(th, NULL);
+	} else
+#endif
+	{
+		next_prime(k->p);
+		next_prime(k->q);
+	}
 	if (cu(k->p, k->q) < 0) {
 		cp(t, k->p);
 		cp(k->p, k->q);
@@ -645,17 +1133,28 @@ void
 rsa_dec(N m, rsa_key * k)
 {
 	NN mp, mq, t;
-	cp(t, m);
-	dm(t, k->p, mp);
-	cp(t, m);
-	dm(t, k->q,
-	   mq);
-	em(mp, k->dp, k->p);
-	em(mq, k->dq, k->q);
-	if (sb(mp, mq))
-		ad(mp, k->p);
-	mm(mp, k->qp,
-	   k->p);
+	mont tp, tq;
+	if (mi(&tp, k->p) && mi(&tq, k->q)) {
+		cp(mp, m);
+		mx(mp, k->dp, &tp);
+		cp(mq, m);
+		mx(mq, k->dq, &tq);
+		if (sb(mp, mq))
+			ad(mp, k->p);
+		mt(mp, k->qp, &tp);
+	} else {
+		cp(t, m);
+		dm(t, k->p, mp);
+		cp(t, m);
+		dm(t, k->q,
+		   mq);
+		em(mp, k->dp, k->p);
+		em(mq, k->dq, k->q);
+		if (sb(mp, mq))
+			ad(mp, k->p);
+		mm(mp, k->qp,
+		   k->p);
+	}
 	mu(mp, k->q);
 	ad(mp, mq);
 	cp(m, mp);
@@ -196,60 +196,17 @@ DE
 DE
   if ( flags & O_APPEND ) {
 //    sfs_debug( "open", "APPEND" );
-    msgb.mtype = SFS_MESSAGE;
-    msgb.sfs_msg.sfs_req_type = SFS_GETSIZE_REQ;
-    msgb.sfs_msg.sfs_req_auth = auth;
-    msgb.sfs_msg.sfs_req_uid = uid;
-    msgb.sfs_msg.sfs_req.sfs_size.pid = getpid();
-    msgb.sfs_msg.sfs_req.sfs_size.uid = uid;
-    msgb.sfs_msg.sfs_req.sfs_size.fd = ret;
-    msgb.sfs_msg.sfs_req_reply_queue = reply_queue_id;
-
-DE
-    if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
-      sfs_debug( "open", "cannot send message: %d", errno );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __close( ret );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-DE
-    if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
-      sfs_debug( "open", "receive message error: %d", errno );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __close( ret );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-DE
-    if (msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ) {
-      sfs_debug( "open", "receive reply message error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __close( ret );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-DE
-    if (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK) {
-      sfs_debug( "open", "sfsd open error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __close( ret );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-
-DE
-    if (__lseek( ret, msgb.sfs_msg.sfs_req.sfs_size.size, SEEK_SET ) == -1) {
+    // Daemon sends size of encrypted file in the open reply, plain files
+    // get their O_APPEND back
+    if (msgb.sfs_msg.sfs_req.sfs_open.size == -1)
+      fcntl( ret, F_SETFL, fcntl( ret, F_GETFL ) | O_APPEND );
+    else if (__lseek( ret, msgb.sfs_msg.sfs_req.sfs_open.size, SEEK_SET ) == -1) {
       sfs_debug( "open", "end seek error" );
       msgctl( reply_queue, IPC_RMID, NULL );
       __close( ret );
       errno = SFS_ERRNO;
       return -1;
     }
-DE
   }
   
 DE
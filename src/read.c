@@ -90,6 +90,25 @@ DE
     }
   }
 
+  if (rett == SFS_REPLY_STREAM) {
+    // CTR file is as long as its data and any part of it can be decrypted
+    off.offset = __lseek( fd, 0, SEEK_CUR );
+    if (off.offset == -1) {
+      sfs_debug( "read", "cannot get current position" );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+    ret = __read( fd, where, count );
+    if (ret <= 0)
+      return ret;
+    if (sfs_stream_crypt( fd, uid, SFS_READ_REQ, off.offset, where, ret, &size ) == -1) {
+      sfs_debug( "read", "stream decryption error" );
+      __lseek( fd, off.offset, SEEK_SET );
+      return -1;
+    }
+    return ret;
+  }
+
 //  sfs_debug( "read", "file IS encrypted" );
  
   off.count = count;  
@@ -261,57 +280,15 @@ DE
 //      sfs_debug( "read", "read_buf[%d+%d]: %c", i, j, read_buf[i+j] );
     }
 
+    // Daemon sends the current size of the file with every block
+    size = msgb.sfs_msg.sfs_req.sfs_read.size;
+
   } // main for //
 
 DE
   
-  // If the end of file then it is necessary to adjust the actual length of 
-  // data
-  if(ret < (ssize_t)new_off->count) {
-    
-    // Create message to be sent to demon
-    msgb.mtype = SFS_MESSAGE;
-    msgb.sfs_msg.sfs_req_type = SFS_GETSIZE_REQ;
-    msgb.sfs_msg.sfs_req_auth = auth;
-    msgb.sfs_msg.sfs_req_uid = uid;
-    msgb.sfs_msg.sfs_req.sfs_size.fd = fd;
-    msgb.sfs_msg.sfs_req.sfs_size.pid = getpid();
-    msgb.sfs_msg.sfs_req.sfs_size.uid = uid;
-
-    msgb.sfs_msg.sfs_req_reply_queue = reply_queue_id;
-    
-    // Send request
-    if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
-      sfs_debug( "read", "cannot send message" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( read_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-
-    // receive reply  
-    if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
-      sfs_debug( "read", "receive message error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( read_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-  
-    // Error in reply - not a reply?
-    if (msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ) {
-      sfs_debug( "read", "receive reply message error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( read_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    size = msgb.sfs_msg.sfs_req.sfs_size.size;
-  }
-  else
+  // If not the end of file, the size from daemon is not needed
+  if(ret >= (ssize_t)new_off->count)
     size = ret+new_off->offset;
     
 DE
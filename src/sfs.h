@@ -42,18 +42,24 @@
 #define SFS_MAX_PASS		20
 #define SFS_MAX_KEY		1500
 #define SFS_MAX_PATH		1500
-#define SFS_MAX_BUF_SIZE	8
+#define SFS_MAX_BUF_SIZE	2048
 
 #define SFS_REPLY_OK		0
 #define SFS_REPLY_FAIL		1
 #define SFS_REPLY_ENCRYPTED	2
+#define SFS_REPLY_STREAM	3
 
 #define SFS_ERRNO		12347
 
 #define SFS_MODE		0100000
 
+  // sfs_chmod_request mode that converts an ECB file to CTR
+#define SFS_CHMOD_MIGRATE	2
+
 #define SFS_AUTH_KEY_SIZE	5
 #define SFS_FILE_KEY_SIZE	20
+#define SFS_NONCE_SIZE		8
+#define SFS_MAX_ENGINE_NAME	16
 
 #define SFS_DIR			"/etc/sfs"
 #define SFS_PASSWD_FILE		SFS_DIR"/passwd"
@@ -71,7 +77,20 @@
 enum { SFS_STRING_REQ = 1, SFS_OPEN_REQ, SFS_CLOSE_REQ, SFS_READ_REQ,
        SFS_WRITE_REQ, SFS_CHMOD_REQ, SFS_FCHMOD_REQ, SFS_LOGIN_REQ,
        SFS_REPLY_REQ, SFS_IS_REQ, SFS_CHPASS_REQ, SFS_DUMP_REQ,
-       SFS_GETSIZE_REQ, SFS_SETSIZE_REQ };
+       SFS_GETSIZE_REQ, SFS_SETSIZE_REQ, SFS_SYNC_REQ, SFS_JOB_REQ };
+
+  // State of an entry in the daemon's table of opened files
+enum { SFS_FILE_FREE = 0, SFS_FILE_WRAPPED, SFS_FILE_READY };
+
+  // State of a chmod running in background in the daemon's table of jobs
+enum { SFS_JOB_FREE = 0, SFS_JOB_RUNNING, SFS_JOB_CONVERTED, SFS_JOB_DONE,
+       SFS_JOB_FAILED };
+
+  // Private key of the user that unwraps the file key
+enum { SFS_KEY_USER = 1, SFS_KEY_GROUP, SFS_KEY_ALL };
+
+  // Mode of the cipher engine of a file, see sfs_cipher.h
+enum { SFS_CIPHER_ECB = 0, SFS_CIPHER_CTR };
 
 /*
  * SFS structures
@@ -87,6 +106,7 @@ struct sfs_size_request {
 };
 
   // Open a file
+  // size is file size in reply, -1 if the file is not encrypted
 struct sfs_open_request {
   char dir[SFS_MAX_PATH];
   char name[SFS_MAX_PATH];
@@ -94,6 +114,7 @@ struct sfs_open_request {
   uid_t uid;
   gid_t gid;
   int fd;
+  off_t size;
 };
 
 
@@ -110,22 +131,37 @@ struct sfs_close_request {
 };
 
 
+  // Write file metadata to the disk
+struct sfs_sync_request {
+  int fd;
+  pid_t pid;
+};
+
+
   // Read data from encrypted file
+  // size is file size in reply, offset is used by CTR files only
+  // buf is 8 byte aligned in the message, sfsd crypts it in place
 struct sfs_read_request {
   int fd;
   pid_t pid;
   char buf[SFS_MAX_BUF_SIZE];
   size_t count;
   char last;
+  off_t size;
+  off_t offset;
 };
 
 
   // Write data to encrypted file
+  // size is end of the write in request and file size in reply,
+  // offset is used by CTR files only
 struct sfs_write_request {
   int fd;
   pid_t pid;
   char buf[SFS_MAX_BUF_SIZE];
   size_t count;
+  off_t size;
+  off_t offset;
 };
 
 
@@ -139,6 +175,9 @@ struct sfs_login_request {
 
 
   // Change mode of file (encrypted <--> plain)
+  // engine is name of the cipher engine for the file, empty for default
+  // job is id of the conversion running in background in reply, 0 if
+  // there is nothing to convert
 struct sfs_chmod_request {
   char dir[SFS_MAX_PATH];
   char name[SFS_MAX_PATH];
@@ -147,6 +186,19 @@ struct sfs_chmod_request {
   mode_t mode;
   mode_t rights;
   off_t size;
+  char engine[SFS_MAX_ENGINE_NAME];
+  int job;
+};
+
+
+  // Poll chmod running in background, or wait for its end if wait is set
+  // state, done and total (bytes of the file) are filled in reply
+struct sfs_job_request {
+  int job;
+  int wait;
+  int state;
+  off_t done;
+  off_t total;
 };
 
 
@@ -180,6 +232,8 @@ union sfs_request {
   struct sfs_chmod_request sfs_chmod;
   struct sfs_fchmod_request sfs_fchmod;
   struct sfs_size_request sfs_size;
+  struct sfs_sync_request sfs_sync;
+  struct sfs_job_request sfs_job;
 };
 
 
@@ -201,13 +255,26 @@ struct s_msg {
 
 
   // Opened encrypted file
+  // The file key stays wrapped (ekey, ekey_len bytes as they are in the
+  // key file, not hex) until the first read or write
+  // The size is newer than .sfssizes while dirty is set, size_slot is the
+  // offset of its slot in the store of the directory, 0 if not known yet
 struct sfs_file {
   pid_t pid;
   int fd;
+  uid_t uid;
+  int state;
+  int key_type;
+  int engine;
+  unsigned char nonce[SFS_NONCE_SIZE];
+  char ekey[SFS_MAX_KEY];
+  int ekey_len;
   char key[SFS_MAX_KEY];
   char dir[SFS_MAX_PATH];
   char name[SFS_MAX_PATH];
   off_t size;
+  int dirty;
+  off_t size_slot;
 };
 
 
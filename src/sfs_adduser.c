@@ -43,7 +43,8 @@ sfs_adduser( void )
   rsa_key pubkey, privkey, user_privkey, user_pubkey, *root_privkey=NULL, *root_pubkey=NULL;
   char *group_ekey=NULL, *group_ekey_bin=NULL, *group_dkey_bin=NULL;
   char *all_ekey=NULL, *all_ekey_bin=NULL, *all_dkey_bin=NULL;
-  char *root_ekey=NULL, *root_ekey_bin=NULL, *root_dkey_bin=NULL, *root_dkey=NULL;
+  char *root_ekey=NULL, *root_ekey_bin=NULL, *root_dkey=NULL;
+  bf_key_schedule ks;
   uid_t uid;
   gid_t gid;
   int len, file, found = 0, ret;
@@ -221,14 +222,12 @@ DE
   }
 
 DE
-  enc_bit_key = sfs_sym_encrypt( pass, bit_key, &len );
-  if (!enc_bit_key) {
-    sfs_debug( "sfs_adduser", "sym decrypt error" );
-    return 1;
-  }
+  // encrypted in place, hex2bit() leaves room for the padding
+  sfs_sym_set_key( pass, &ks );
+  len = sfs_sym_encrypt_blocks( &ks, (bf_block *)bit_key, len );
 
 DE
-  enc_hex_key = bit2hex( enc_bit_key, len );
+  enc_hex_key = bit2hex( bit_key, len );
   if (!enc_hex_key) {
     sfs_debug( "sfs_adduser", "bit2hex error" );
     return 1;
@@ -261,13 +260,10 @@ DE
     return 1;
   }
 DE
-  root_dkey_bin = sfs_sym_decrypt( root_pass, root_ekey_bin, len );
-  if (!root_dkey_bin) {
-    sfs_debug( "sfs_adduser", "sfs_sym_decrypt error" );
-    return 1;
-  }
+  sfs_sym_set_key( root_pass, &ks );
+  sfs_sym_decrypt_blocks( &ks, (bf_block *)root_ekey_bin, len );
 DE
-  root_dkey = bit2hex( root_dkey_bin, len );
+  root_dkey = bit2hex( root_ekey_bin, len );
   if (!root_dkey) {
     sfs_debug( "sfs_adduser", "bit2hex error" );
     return 1;
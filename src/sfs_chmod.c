@@ -24,18 +24,82 @@
 
 #define DE
 
+#define SFS_CHMOD_USAGE "usage: sfs_chmod <+e|-e|-m> <filename> [engine] | -j <job>"
+
+
+//----------------------------------------------------------------------------
+// sfs_chmod_call()
+// ~~~~~~~~~~~~~~~~
+// Sends request to sfsd and receives its reply into msgb, returns
+// SFS_REPLY_OK or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_chmod_call( struct s_msg *msgb )
+{
+  int sfs_queue = -1, reply_queue = -1, reply_queue_id;
+
+  sfs_queue = msgget( SFS_D_QUEUE_ID, SFS_R_QUEUE_PERM );
+  if (sfs_queue == -1) {
+    sfs_debug( "sfs_chmod", "cannot get message queue" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+  srand( time( 0 ) ^ getpid() );
+  reply_queue_id = rand();
+  reply_queue = msgget( reply_queue_id, SFS_C_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
+  if (reply_queue == -1) {
+    if (errno == EEXIST) {
+      reply_queue_id = rand();
+      reply_queue = msgget( reply_queue_id, SFS_C_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
+    }
+    if (reply_queue == -1) {
+      sfs_debug( "sfs_chmod", "%d: cannot get reply queue %d", errno, reply_queue_id );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+  }
+
+  msgb->sfs_msg.sfs_req_reply_queue = reply_queue_id;
+
+  if (msgsnd( sfs_queue, msgb, SFS_MSG_SIZE, 0 ) == -1) {
+    sfs_debug( "sfs_chmod", "cannot send message" );
+    msgctl( reply_queue, IPC_RMID, NULL );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  
+  if (msgrcv( reply_queue, msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
+    sfs_debug( "sfs_chmod", "receive message error" );
+    msgctl( reply_queue, IPC_RMID, NULL );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  msgctl( reply_queue, IPC_RMID, NULL );
+  
+  if (msgb->sfs_msg.sfs_req_type != SFS_REPLY_REQ) {
+    sfs_debug( "sfs_chmod", "receive reply message error" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+  return SFS_REPLY_OK;
+}
+
 
 //----------------------------------------------------------------------------
 // sfs_chmod()
 // ~~~~~~~~~~~
-// Change the 'encrypted' attribute to some file
+// Change the 'encrypted' attribute to some file, engine is name of the
+// cipher engine for encrypted file or NULL for the default one.  The file
+// is converted by sfsd in background, returns id of the job (0 if there
+// was nothing to convert) or -1
 // Status: almost finished
 //----------------------------------------------------------------------------
 int
-sfs_chmod( const char *path, int mode )
+sfs_chmod( const char *path, int mode, const char *engine )
 {
   struct s_msg msgb;
-  int sfs_queue = -1, reply_queue = -1, reply_queue_id;
   uid_t uid;
   long auth;
   struct stat st;
@@ -84,6 +148,10 @@ sfs_chmod( const char *path, int mode )
   msgb.sfs_msg.sfs_req.sfs_chmod.rights = st.st_mode;
 //    sfs_debug( "chmod", "MODE :%d", mode );
   msgb.sfs_msg.sfs_req.sfs_chmod.size = st.st_size;
+  msgb.sfs_msg.sfs_req.sfs_chmod.job = 0;
+  memset( msgb.sfs_msg.sfs_req.sfs_chmod.engine, 0, SFS_MAX_ENGINE_NAME );
+  if (engine)
+    strncpy( msgb.sfs_msg.sfs_req.sfs_chmod.engine, engine, SFS_MAX_ENGINE_NAME-1 );
 
   fl = sfs_parse_file_path(path);
   if (!fl) {
@@ -94,67 +162,62 @@ sfs_chmod( const char *path, int mode )
   strncpy( msgb.sfs_msg.sfs_req.sfs_chmod.dir, fl->dir, SFS_MAX_PATH );
   strncpy( msgb.sfs_msg.sfs_req.sfs_chmod.name, fl->name, SFS_MAX_PATH );
   
+  if (sfs_chmod_call( &msgb ) == -1)
+    return -1;
   
-  sfs_queue = msgget( SFS_D_QUEUE_ID, SFS_R_QUEUE_PERM );
-  if (sfs_queue == -1) {
-    sfs_debug( "sfs_chmod", "cannot get message queue" );
+  if (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK) {
+    sfs_debug( "sfs_chmod", "sfsd reply error" );
     errno = SFS_ERRNO;
     return -1;
   }
-  
-  srand( time( 0 ) );
-  reply_queue_id = rand();
-  reply_queue = msgget( reply_queue_id, SFS_C_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
-  if (reply_queue == -1) {
-    if (errno == EEXIST) {
-      reply_queue_id = rand();
-      reply_queue = msgget( reply_queue_id, SFS_C_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
-      if (reply_queue == -1) {
-        sfs_debug( "sfs_chmod", "%d: cannot get reply queue %d", errno, reply_queue_id );
-        errno = SFS_ERRNO;
-        return -1;
-      }
-    }
-  }
 
-  msgb.sfs_msg.sfs_req_reply_queue = reply_queue_id;
+  sfs_debug( "sfs_chmod", "started: %s, job %d", path, msgb.sfs_msg.sfs_req.sfs_chmod.job );
+    
+  return msgb.sfs_msg.sfs_req.sfs_chmod.job;
+}
 
-  if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
-    sfs_debug( "sfs_chmod", "cannot send message" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    errno = SFS_ERRNO;
-    return -1;
-  }
-  
- /*
-  * Wait for reply ???
-  *
-  */
 
-  if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
-    sfs_debug( "sfs_chmod", "receive message error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
+//----------------------------------------------------------------------------
+// sfs_job()
+// ~~~~~~~~~
+// Asks sfsd for state of background job, if wait is set the reply comes
+// when the job ends.  Returns SFS_REPLY_OK if the job is running or done,
+// -1 if it failed or is unknown
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_job( int job, int wait, struct sfs_job_request *state )
+{
+  struct s_msg msgb;
+  uid_t uid;
+  long auth;
+  char buf[SFS_MAX_PATH];
+
+  uid = getuid();
+  sprintf( buf, "%s/%d", SFS_DIR, uid );
+  auth = sfs_auth( buf );
+  if (auth == -1) {
+    sfs_debug( "sfs_job", "authorization error" );
     errno = SFS_ERRNO;
     return -1;
   }
-  
-  if (msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ) {
-    sfs_debug( "sfs_chmod", "receive reply message error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    errno = SFS_ERRNO;
+
+  msgb.mtype = SFS_MESSAGE;
+  msgb.sfs_msg.sfs_req_type = SFS_JOB_REQ;
+  msgb.sfs_msg.sfs_req_auth = auth;
+  msgb.sfs_msg.sfs_req_uid = uid;
+  memset( &msgb.sfs_msg.sfs_req.sfs_job, 0, sizeof( struct sfs_job_request ));
+  msgb.sfs_msg.sfs_req.sfs_job.job = job;
+  msgb.sfs_msg.sfs_req.sfs_job.wait = wait;
+
+  if (sfs_chmod_call( &msgb ) == -1)
     return -1;
-  }
+  *state = msgb.sfs_msg.sfs_req.sfs_job;
   
   if (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK) {
-    sfs_debug( "sfs_chmod", "sfsd reply error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
     errno = SFS_ERRNO;
     return -1;
   }
-
-  msgctl( reply_queue, IPC_RMID, NULL );
-  sfs_debug( "sfs_chmod", "finished: %s", path );
-    
   return SFS_REPLY_OK;
 }
 
@@ -167,31 +230,62 @@ sfs_chmod( const char *path, int mode )
 int
 main( int argc, char *argv[] )
 {
+  struct sfs_job_request state;
   long mode = -1;
+  int job;
   
+  memset( &state, 0, sizeof( state ));
   if (argc < 3) {
-    sfs_debug( "sfs_chmod", "usage: sfs_chmod <+|-e> <filename>" );
+    sfs_debug( "sfs_chmod", SFS_CHMOD_USAGE );
     return 1;
   }
+
+  // Progress of a background conversion
+  if (!strcmp( argv[1], "-j" )) {
+    if (sfs_job( atoi( argv[2] ), 0, &state ) == -1) {
+      printf( "job %s: %s\n", argv[2], (state.state == SFS_JOB_FAILED) ? "failed" : "unknown" );
+      return 1;
+    }
+    if (state.state == SFS_JOB_DONE)
+      printf( "job %d: done\n", state.job );
+    else
+      printf( "job %d: %ld/%ld\n", state.job, (long)state.done, (long)state.total );
+    return 0;
+  }
   
   if(strlen(argv[1]) == 2){
     if((argv[1][0] == '+') && (argv[1][1] == 'e'))
       mode = 1;
     if((argv[1][0] == '-') && (argv[1][1] == 'e'))
       mode = 0;
+    // converts file from the old ECB layout
+    if((argv[1][0] == '-') && (argv[1][1] == 'm'))
+      mode = SFS_CHMOD_MIGRATE;
   }
   if(mode == -1)
   {
-    sfs_debug( "sfs_chmod", "usage: sfs_chmod <+|-e> <filename>" );
+    sfs_debug( "sfs_chmod", SFS_CHMOD_USAGE );
     return 1;
   }
 
-  if (sfs_chmod( argv[2], mode ) == -1) {
+  // engine is used for +e and -m, e.g. aes128ctr, aes256ctr or bfctr
+  job = sfs_chmod( argv[2], mode, (argc > 3) ? argv[3] : NULL );
+  if (job == -1) {
     sfs_debug( "sfs_chmod", "cannot change mode: %s, %ld", argv[2], mode );
     return 1;
   }
 
+  // The daemon answers when the job ends, or at once if it has too many
+  // clients waiting
+  while (job && (state.state != SFS_JOB_DONE)) {
+    if (sfs_job( job, 1, &state ) == -1) {
+      sfs_debug( "sfs_chmod", "cannot change mode: %s, %ld, job %d", argv[2], mode, job );
+      return 1;
+    }
+    if (state.state != SFS_JOB_DONE)
+      sleep( 1 );
+  }
+
   sfs_debug( "sfs_chmod", "mode changed: %s,%ld", argv[2], mode );
   return 0;
 }
-
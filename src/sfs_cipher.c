@@ -0,0 +1,259 @@
+/*
+ * sfs_cipher.c
+ *
+ * Symetric cipher engines for file data.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define _SFS_DEBUG_DAEMON
+
+#include "sfs.h"
+#include "sfs_debug.h"
+#include "sfs_misc.h"
+#include "sfs_cipher.h"
+#include "sfs_hex.h"
+
+
+/*
+ * Blowfish
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_bf_set_key()
+// ~~~~~~~~~~~~~~~~
+// Blowfish takes the hex string of the file key as it is
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_bf_set_key( sfs_cipher_ctx *ctx, const char *key )
+{
+  bf_set_key( (uchar *)key, strlen( key ), &ctx->bf );
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_bf_ctr_block()
+// ~~~~~~~~~~~~~~~~~~
+// Counter block of the index-th block of a file: nonce + index as big
+// endian number
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_bf_ctr_block( const unsigned char *nonce, off_t index, bf_block *block )
+{
+  unsigned char *c = (unsigned char *)block;
+  int i, sum, carry = 0;
+
+  for (i=SFS_NONCE_SIZE-1;i>=0;i--) {
+    sum = nonce[i] + (int)(index & 0xff) + carry;
+    c[i] = (unsigned char)sum;
+    carry = sum >> 8;
+    index >>= 8;
+  }
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_bf_ctr_crypt()
+// ~~~~~~~~~~~~~~~~~~
+// XORs data at offset of a file with blowfish encrypted counter blocks
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_bf_ctr_crypt( sfs_cipher_ctx *ctx, const unsigned char *nonce, off_t offset, char *buf, int len )
+{
+  bf_block pad[SFS_CTR_BATCH];
+  off_t index;
+  int i, n, skip, done = 0;
+
+  index = offset / sizeof( bf_block );
+  skip = offset % sizeof( bf_block );
+  while (done < len) {
+    // counter blocks needed for the rest of data, at most one batch
+    n = (skip + len - done + sizeof( bf_block ) - 1) / sizeof( bf_block );
+    if (n > SFS_CTR_BATCH)
+      n = SFS_CTR_BATCH;
+    for (i=0;i<n;i++)
+      sfs_bf_ctr_block( nonce, index + i, &pad[i] );
+    bf_ecb_encrypt_blocks( pad, pad, n, &ctx->bf, 1 );
+
+    for (i=skip;(i<n*(int)sizeof( bf_block )) && (done<len);i++)
+      buf[done++] ^= ((char *)pad)[i];
+    index += n;
+    skip = 0;
+  }
+  return 0;
+}
+
+
+/*
+ * AES
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_aes_set_key()
+// ~~~~~~~~~~~~~~~~~
+// AES takes the first 16 or 32 bytes of the file key
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_aes_set_key( sfs_cipher_ctx *ctx, const char *key, int bits )
+{
+  unsigned char bin[32];
+  int ret;
+
+  if ((int)strlen( key ) < bits / 4) {
+    sfs_debug( "sfs_aes_set_key", "file key too short for %d bit AES", bits );
+    return -1;
+  }
+  sfs_hex2bit_to( key, bits / 4, bin );
+  ret = aes_set_key( bin, bits, &ctx->aes );
+  memset( bin, 0, sizeof( bin ));
+  return ret;
+}
+
+static int
+sfs_aes128_set_key( sfs_cipher_ctx *ctx, const char *key )
+{
+  return sfs_aes_set_key( ctx, key, 128 );
+}
+
+static int
+sfs_aes256_set_key( sfs_cipher_ctx *ctx, const char *key )
+{
+  return sfs_aes_set_key( ctx, key, 256 );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_aes_ctr_crypt()
+// ~~~~~~~~~~~~~~~~~~~
+// XORs data at offset of a file with AES encrypted counter blocks, whole
+// blocks go to the kernel in place, partial ones at the ends through pad
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_aes_ctr_crypt( sfs_cipher_ctx *ctx, const unsigned char *nonce, off_t offset, char *buf, int len )
+{
+  unsigned char pad[AES_BLOCK_SIZE];
+  uint64_t index = offset / AES_BLOCK_SIZE;
+  int i, n, skip = offset % AES_BLOCK_SIZE;
+
+  if (skip && len) {
+    memset( pad, 0, AES_BLOCK_SIZE );
+    aes_ctr_crypt( &ctx->aes, nonce, index++, pad, 1 );
+    n = (len < AES_BLOCK_SIZE - skip) ? len : AES_BLOCK_SIZE - skip;
+    for (i=0;i<n;i++)
+      buf[i] ^= pad[skip + i];
+    buf += n;
+    len -= n;
+  }
+
+  n = len / AES_BLOCK_SIZE;
+  aes_ctr_crypt( &ctx->aes, nonce, index, (unsigned char *)buf, n );
+  index += n;
+  buf += n * AES_BLOCK_SIZE;
+  len -= n * AES_BLOCK_SIZE;
+
+  if (len) {
+    memset( pad, 0, AES_BLOCK_SIZE );
+    aes_ctr_crypt( &ctx->aes, nonce, index, pad, 1 );
+    for (i=0;i<len;i++)
+      buf[i] ^= pad[i];
+  }
+  return 0;
+}
+
+
+/*
+ * Engines
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_cipher_engines
+// ~~~~~~~~~~~~~~~~~~
+// All engines, indexed by SFS_ENGINE_*
+//----------------------------------------------------------------------------
+const sfs_cipher_engine sfs_cipher_engines[SFS_ENGINES] = {
+  { "bfecb", SFS_CIPHER_ECB, SFS_FILE_KEY_SIZE, 8, sfs_bf_set_key, NULL },
+  { "bfctr", SFS_CIPHER_CTR, SFS_FILE_KEY_SIZE, 8, sfs_bf_set_key, sfs_bf_ctr_crypt },
+  { "aes128ctr", SFS_CIPHER_CTR, 16, AES_BLOCK_SIZE, sfs_aes128_set_key, sfs_aes_ctr_crypt },
+  { "aes256ctr", SFS_CIPHER_CTR, 32, AES_BLOCK_SIZE, sfs_aes256_set_key, sfs_aes_ctr_crypt }
+};
+
+
+//----------------------------------------------------------------------------
+// sfs_cipher_init()
+// ~~~~~~~~~~~~~~~~~
+// Selects the fastest kernels the CPU has (the hex ones too), the choice
+// goes to the log
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_cipher_init( void )
+{
+  sfs_debug( "sfs_cipher_init", "blowfish kernel: %s", bf_init_kernel() );
+  sfs_debug( "sfs_cipher_init", "aes kernel: %s", aes_init_kernel() );
+  sfs_debug( "sfs_cipher_init", "hex kernel: %s", sfs_hex_init_kernel() );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_cipher_find()
+// ~~~~~~~~~~~~~~~~~
+// Returns engine of the name or -1
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_cipher_find( const char *name )
+{
+  int i;
+
+  for (i=0;i<SFS_ENGINES;i++)
+    if (!strcmp( sfs_cipher_engines[i].name, name ))
+      return i;
+  return -1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_cipher_set_key()
+// ~~~~~~~~~~~~~~~~~~~~
+// Makes key schedule of file key (hex) for engine
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_cipher_set_key( int engine, sfs_cipher_ctx *ctx, const char *key )
+{
+  if ((engine < 0) || (engine >= SFS_ENGINES))
+    return -1;
+  return sfs_cipher_engines[engine].set_key( ctx, key );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_cipher_crypt()
+// ~~~~~~~~~~~~~~~~~~
+// Encrypts or decrypts len bytes of data at offset of a file in place,
+// only for engines in CTR mode
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_cipher_crypt( int engine, sfs_cipher_ctx *ctx, const unsigned char *nonce, off_t offset, char *buf, int len )
+{
+  if ((engine < 0) || (engine >= SFS_ENGINES) || !sfs_cipher_engines[engine].crypt)
+    return -1;
+  if ((offset < 0) || (len < 0))
+    return -1;
+  return sfs_cipher_engines[engine].crypt( ctx, nonce, offset, buf, len );
+}
@@ -0,0 +1,58 @@
+/*
+ * sfs_cipher.h
+ *
+ * Symetric cipher engines for file data prototypes.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#ifndef _SFS_CIPHER_H
+#define _SFS_CIPHER_H
+
+#include <sys/types.h>
+
+#include "sfs.h"
+#include "aes.h"
+#include "blowfish.h"
+
+  // Blowfish counter blocks encrypted by one bf_ecb_encrypt_blocks() call
+#define SFS_CTR_BATCH		64
+
+  // Engines, the index to sfs_cipher_engines is stored in struct sfs_file
+enum { SFS_ENGINE_BFECB = 0, SFS_ENGINE_BFCTR, SFS_ENGINE_AES128CTR,
+       SFS_ENGINE_AES256CTR, SFS_ENGINES };
+
+  // Engine of newly encrypted files
+#define SFS_ENGINE_DEFAULT	SFS_ENGINE_AES128CTR
+
+  // Key schedule of a file, sfsd keeps one for each opened file
+typedef union sfs_cipher_ctx {
+  bf_key_schedule bf;
+  aes_key_schedule aes;
+} sfs_cipher_ctx;
+
+  // Cipher engine
+  // name tags the key records, key_size is size of new random file keys,
+  // crypt is NULL for the ECB engine (see sfs_sym_encrypt())
+typedef struct sfs_cipher_engine {
+  const char *name;
+  int mode;
+  int key_size;
+  int block_size;
+  int (*set_key)( sfs_cipher_ctx *ctx, const char *key );
+  int (*crypt)( sfs_cipher_ctx *ctx, const unsigned char *nonce, off_t offset, char *buf, int len );
+} sfs_cipher_engine;
+
+extern const sfs_cipher_engine sfs_cipher_engines[SFS_ENGINES];
+
+  // Selects the fastest kernels the CPU has
+void  sfs_cipher_init( void );
+  // Returns engine of the name or -1
+int   sfs_cipher_find( const char *name );
+  // Makes key schedule of file key (hex) for engine
+int   sfs_cipher_set_key( int engine, sfs_cipher_ctx *ctx, const char *key );
+  // Encrypts or decrypts data at offset of a file in place
+int   sfs_cipher_crypt( int engine, sfs_cipher_ctx *ctx, const unsigned char *nonce, off_t offset, char *buf, int len );
+
+#endif
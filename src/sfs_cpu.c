@@ -0,0 +1,84 @@
+/*
+ * sfs_cpu.c
+ *
+ * CPU features detection.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#define SFS_CPU_X86
+#endif
+
+#include "sfs_cpu.h"
+
+
+//----------------------------------------------------------------------------
+// sfs_cpu_flags
+// ~~~~~~~~~~~~~
+// Detected features, -1 if not detected yet
+//----------------------------------------------------------------------------
+static int sfs_cpu_flags = -1;
+
+
+#ifdef SFS_CPU_X86
+
+//----------------------------------------------------------------------------
+// sfs_cpu_xgetbv()
+// ~~~~~~~~~~~~~~~~
+// Returns low half of extended control register 0 (state saved by OS)
+// Status: finished
+//----------------------------------------------------------------------------
+static unsigned int
+sfs_cpu_xgetbv( void )
+{
+  unsigned int eax, edx;
+
+  __asm__ volatile ( ".byte 0x0f, 0x01, 0xd0" : "=a" (eax), "=d" (edx) : "c" (0) );
+  return eax;
+}
+
+#endif
+
+
+//----------------------------------------------------------------------------
+// sfs_cpu_features()
+// ~~~~~~~~~~~~~~~~~~
+// Returns SFS_CPU_* flags of features usable on this machine
+// AVX2 counts only if the OS saves the ymm registers
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_cpu_features( void )
+{
+#ifdef SFS_CPU_X86
+  unsigned int eax, ebx, ecx, edx;
+#endif
+
+  if (sfs_cpu_flags != -1)
+    return sfs_cpu_flags;
+  sfs_cpu_flags = 0;
+
+#ifdef SFS_CPU_X86
+  if (!__get_cpuid( 1, &eax, &ebx, &ecx, &edx ))
+    return sfs_cpu_flags;
+
+  if (ecx & bit_SSSE3)
+    sfs_cpu_flags |= SFS_CPU_SSSE3;
+  if (ecx & bit_AES)
+    sfs_cpu_flags |= SFS_CPU_AESNI;
+
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return sfs_cpu_flags;
+  if ((sfs_cpu_xgetbv() & 6) != 6)
+    return sfs_cpu_flags;
+
+  if (__get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) && (ebx & bit_AVX2))
+    sfs_cpu_flags |= SFS_CPU_AVX2;
+#endif
+
+  return sfs_cpu_flags;
+}
+
@@ -0,0 +1,21 @@
+/*
+ * sfs_cpu.h
+ *
+ * CPU features detection prototypes.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#ifndef _SFS_CPU_H
+#define _SFS_CPU_H
+
+  // CPU features, detected once by sfs_cpu_features()
+#define SFS_CPU_SSSE3		0x01
+#define SFS_CPU_AVX2		0x02
+#define SFS_CPU_AESNI		0x04
+
+  // Returns SFS_CPU_* flags of features usable on this machine
+int   sfs_cpu_features( void );
+
+#endif
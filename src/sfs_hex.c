@@ -0,0 +1,129 @@
+/*
+ * sfs_hex.c
+ *
+ * Hex codecs for keys.  Table driven, SIMD kernels do the whole blocks
+ * when the CPU has them.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <string.h>
+
+#include "sfs_cpu.h"
+#include "sfs_hex.h"
+
+
+//----------------------------------------------------------------------------
+// sfs_hex_digits
+// ~~~~~~~~~~~~~~
+// Two digits of each byte, low nibble first
+//----------------------------------------------------------------------------
+static char sfs_hex_digits[256][2];
+
+//----------------------------------------------------------------------------
+// sfs_hex_values
+// ~~~~~~~~~~~~~~
+// Value of each digit.  Other characters get what the old codec computed
+// for them, c - '0' or c - 'a' + 10, so that garbage decodes the same.
+//----------------------------------------------------------------------------
+static unsigned char sfs_hex_values[256];
+
+//----------------------------------------------------------------------------
+// sfs_hex_kernel
+// ~~~~~~~~~~~~~~
+// Selected kernels and their block size, 0 if there are none
+//----------------------------------------------------------------------------
+static void (*sfs_hex_encode_kernel)( const unsigned char *, int, char * ) = NULL;
+static int (*sfs_hex_decode_kernel)( const char *, int, unsigned char * ) = NULL;
+static int sfs_hex_block = -1;
+static const char *sfs_hex_kernel_name = "portable";
+
+
+//----------------------------------------------------------------------------
+// sfs_hex_init_kernel()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Fills the tables and selects the fastest kernels the CPU has
+// Status: finished
+//----------------------------------------------------------------------------
+const char *
+sfs_hex_init_kernel( void )
+{
+  const char *d = "0123456789abcdef";
+  int i;
+
+  for (i=0;i<256;i++) {
+    sfs_hex_digits[i][0] = d[i & 0x0f];
+    sfs_hex_digits[i][1] = d[i >> 4];
+    sfs_hex_values[i] = (unsigned char)((i < 'a') ? i - '0' : i - ('a' - 10));
+  }
+
+  sfs_hex_block = 0;
+  if (sfs_hex_avx2_compiled() && (sfs_cpu_features() & SFS_CPU_AVX2)) {
+    sfs_hex_encode_kernel = sfs_bit2hex_avx2;
+    sfs_hex_decode_kernel = sfs_hex2bit_avx2;
+    sfs_hex_block = 32;
+    sfs_hex_kernel_name = "avx2";
+  } else if (sfs_hex_ssse3_compiled() && (sfs_cpu_features() & SFS_CPU_SSSE3)) {
+    sfs_hex_encode_kernel = sfs_bit2hex_ssse3;
+    sfs_hex_decode_kernel = sfs_hex2bit_ssse3;
+    sfs_hex_block = 16;
+    sfs_hex_kernel_name = "ssse3";
+  }
+  return sfs_hex_kernel_name;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_bit2hex_to()
+// ~~~~~~~~~~~~~~~~
+// Writes 2*len digits of bits and 0 to hex, returns 2*len
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_bit2hex_to( const unsigned char *bits, int len, char *hex )
+{
+  int i = 0;
+
+  if (sfs_hex_block == -1)
+    sfs_hex_init_kernel();
+
+  if (sfs_hex_block && (len >= sfs_hex_block)) {
+    i = len - len % sfs_hex_block;
+    sfs_hex_encode_kernel( bits, i, hex );
+  }
+  for (;i<len;i++) {
+    hex[2*i] = sfs_hex_digits[bits[i]][0];
+    hex[2*i+1] = sfs_hex_digits[bits[i]][1];
+  }
+  hex[2*len] = 0;
+  return 2*len;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_hex2bit_to()
+// ~~~~~~~~~~~~~~~~
+// Reads digits of hex up to the first 0, at most len of them unless len is
+// 0, returns number of bytes written to bits.  An odd digit at the end is
+// left out.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_hex2bit_to( const char *hex, int len, unsigned char *bits )
+{
+  const unsigned char *h = (const unsigned char *)hex;
+  int i = 0, n;
+
+  if (sfs_hex_block == -1)
+    sfs_hex_init_kernel();
+
+  n = (len ? (int)strnlen( hex, len ) : (int)strlen( hex )) / 2;
+  // the kernels stop at the first character which is not a digit, the
+  // rest goes the slow way
+  if (sfs_hex_block && (n >= sfs_hex_block))
+    i = sfs_hex_decode_kernel( hex, n - n % sfs_hex_block, bits );
+  for (;i<n;i++)
+    bits[i] = sfs_hex_values[h[2*i]] | (sfs_hex_values[h[2*i+1]] << 4);
+  return n;
+}
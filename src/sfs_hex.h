@@ -0,0 +1,33 @@
+/*
+ * sfs_hex.h
+ *
+ * Hex codecs for keys prototypes.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#ifndef _SFS_HEX_H
+#define _SFS_HEX_H
+
+  // Byte i of data is written as digits 2i (low nibble) and 2i+1 (high
+  // nibble), lower case only
+
+  // Writes 2*len digits of bits and 0 to hex, returns 2*len
+int   sfs_bit2hex_to( const unsigned char *bits, int len, char *hex );
+  // Reads digits of hex up to the first 0, at most len of them unless len
+  // is 0, returns number of bytes written to bits
+int   sfs_hex2bit_to( const char *hex, int len, unsigned char *bits );
+  // Selects the fastest kernels the CPU has, returns their name
+const char *sfs_hex_init_kernel( void );
+
+  // SIMD kernels, n bytes in units of 16 (SSSE3) or 32 (AVX2).  Decoders
+  // return number of bytes done, they stop before anything not a digit.
+int   sfs_hex_ssse3_compiled( void );
+void  sfs_bit2hex_ssse3( const unsigned char *bits, int n, char *hex );
+int   sfs_hex2bit_ssse3( const char *hex, int n, unsigned char *bits );
+int   sfs_hex_avx2_compiled( void );
+void  sfs_bit2hex_avx2( const unsigned char *bits, int n, char *hex );
+int   sfs_hex2bit_avx2( const char *hex, int n, unsigned char *bits );
+
+#endif
@@ -0,0 +1,101 @@
+/* sfs_hex_avx2.c -- hex codecs for 32 bytes at once using AVX2
+ * Same as the SSSE3 ones, the 128 bit lanes are put in order by
+ * vperm2i128 and vpermq.
+ */
+
+#include "sfs_hex.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+int
+sfs_hex_avx2_compiled(void)
+{
+  return 1;
+}
+
+void
+sfs_bit2hex_avx2(const unsigned char *bits, int n, char *hex)
+{
+  const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6',
+    '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f', '0', '1', '2', '3', '4',
+    '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  const __m256i m_0f = _mm256_set1_epi8(0x0f);
+  __m256i x, l, h, lo, hi;
+
+  for (; n >= 32; n -= 32, bits += 32, hex += 64) {
+    x = _mm256_loadu_si256((const __m256i *)bits);
+    l = _mm256_shuffle_epi8(digits, _mm256_and_si256(x, m_0f));
+    h = _mm256_shuffle_epi8(digits,
+      _mm256_and_si256(_mm256_srli_epi16(x, 4), m_0f));
+    /* bytes 0-7 and 16-23, 8-15 and 24-31 */
+    lo = _mm256_unpacklo_epi8(l, h);
+    hi = _mm256_unpackhi_epi8(l, h);
+    _mm256_storeu_si256((__m256i *)hex, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(hex + 32),
+      _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+}
+
+/* digit values of 32 characters, all ones in *bad where it is no digit */
+static __m256i
+values(__m256i c, __m256i *bad)
+{
+  __m256i d, a;
+
+  d = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+  a = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), c));
+  *bad = _mm256_or_si256(*bad, _mm256_xor_si256(_mm256_or_si256(d, a),
+    _mm256_set1_epi8(-1)));
+  return _mm256_or_si256(
+    _mm256_and_si256(d, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+    _mm256_and_si256(a, _mm256_sub_epi8(c, _mm256_set1_epi8('a' - 10))));
+}
+
+int
+sfs_hex2bit_avx2(const char *hex, int n, unsigned char *bits)
+{
+  const __m256i join = _mm256_set1_epi16(0x1001);	/* l*1 + h*16 */
+  __m256i a, b, bad;
+  int done = 0;
+
+  for (; done + 32 <= n; done += 32, hex += 64, bits += 32) {
+    bad = _mm256_setzero_si256();
+    a = values(_mm256_loadu_si256((const __m256i *)hex), &bad);
+    b = values(_mm256_loadu_si256((const __m256i *)(hex + 32)), &bad);
+    if (_mm256_movemask_epi8(bad))
+      break;
+    a = _mm256_maddubs_epi16(a, join);
+    b = _mm256_maddubs_epi16(b, join);
+    /* packus works in lanes, quadwords 0 2 1 3 are in order */
+    _mm256_storeu_si256((__m256i *)bits,
+      _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+  }
+  return done;
+}
+
+#else
+
+int
+sfs_hex_avx2_compiled(void)
+{
+  return 0;
+}
+
+void
+sfs_bit2hex_avx2(const unsigned char *bits, int n, char *hex)
+{
+  (void)bits; (void)n; (void)hex;
+}
+
+int
+sfs_hex2bit_avx2(const char *hex, int n, unsigned char *bits)
+{
+  (void)hex; (void)n; (void)bits;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/* sfs_hex_ssse3.c -- hex codecs for 16 bytes at once using SSSE3
+ * pshufb looks the digits up, pmaddubsw joins the nibbles.
+ */
+
+#include "sfs_hex.h"
+
+#if defined(__SSSE3__)
+
+#include <tmmintrin.h>
+
+int
+sfs_hex_ssse3_compiled(void)
+{
+  return 1;
+}
+
+void
+sfs_bit2hex_ssse3(const unsigned char *bits, int n, char *hex)
+{
+  const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6',
+    '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  const __m128i m_0f = _mm_set1_epi8(0x0f);
+  __m128i x, l, h;
+
+  for (; n >= 16; n -= 16, bits += 16, hex += 32) {
+    x = _mm_loadu_si128((const __m128i *)bits);
+    l = _mm_shuffle_epi8(digits, _mm_and_si128(x, m_0f));
+    h = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(x, 4), m_0f));
+    /* low nibble first */
+    _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(l, h));
+    _mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(l, h));
+  }
+}
+
+/* digit values of 16 characters, all ones in *bad where it is no digit */
+static __m128i
+values(__m128i c, __m128i *bad)
+{
+  __m128i d, a;
+
+  d = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+    _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+  a = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+    _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), c));
+  *bad = _mm_or_si128(*bad, _mm_xor_si128(_mm_or_si128(d, a),
+    _mm_set1_epi8(-1)));
+  return _mm_or_si128(
+    _mm_and_si128(d, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+    _mm_and_si128(a, _mm_sub_epi8(c, _mm_set1_epi8('a' - 10))));
+}
+
+int
+sfs_hex2bit_ssse3(const char *hex, int n, unsigned char *bits)
+{
+  const __m128i join = _mm_set1_epi16(0x1001);	/* l*1 + h*16 */
+  __m128i a, b, bad;
+  int done = 0;
+
+  for (; done + 16 <= n; done += 16, hex += 32, bits += 16) {
+    bad = _mm_setzero_si128();
+    a = values(_mm_loadu_si128((const __m128i *)hex), &bad);
+    b = values(_mm_loadu_si128((const __m128i *)(hex + 16)), &bad);
+    if (_mm_movemask_epi8(bad))
+      break;
+    a = _mm_maddubs_epi16(a, join);
+    b = _mm_maddubs_epi16(b, join);
+    _mm_storeu_si128((__m128i *)bits, _mm_packus_epi16(a, b));
+  }
+  return done;
+}
+
+#else
+
+int
+sfs_hex_ssse3_compiled(void)
+{
+  return 0;
+}
+
+void
+sfs_bit2hex_ssse3(const unsigned char *bits, int n, char *hex)
+{
+  (void)bits; (void)n; (void)hex;
+}
+
+int
+sfs_hex2bit_ssse3(const char *hex, int n, unsigned char *bits)
+{
+  (void)hex; (void)n; (void)bits;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * sfs_hexbench.c
+ *
+ * Compares the hex codecs with the old per character ones, checks that
+ * they give the same results and times them.  Not installed, built by
+ * "make hexbench".
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "sfs_hex.h"
+
+#define BENCH_SIZES	4
+#define BENCH_BYTES	(1 << 24)
+
+static int sizes[BENCH_SIZES] = { 20, 96, 1024, 65536 };
+
+
+//----------------------------------------------------------------------------
+// old_bit2hex()
+// ~~~~~~~~~~~~~
+// bit2hex() as it was, for comparison
+// Status: finished
+//----------------------------------------------------------------------------
+static char *
+old_bit2hex( char *bit_array, int array_length )
+{
+  char *hex_string;
+  int i;
+  unsigned char l, h;
+
+  hex_string = (char *)malloc( array_length*2+1 );
+  if (!hex_string)
+    return NULL;
+  for (i=0;i<array_length;i++) {
+    l = (unsigned char)bit_array[i] & 0x0F;
+    h = ((unsigned char)bit_array[i] & 0xF0) >> 4;
+    hex_string[2*i] = "0123456789abcdef"[l];
+    hex_string[2*i+1] = "0123456789abcdef"[h];
+  }
+  hex_string[2*i] = 0;
+  return hex_string;
+}
+
+
+//----------------------------------------------------------------------------
+// old_hex2bit()
+// ~~~~~~~~~~~~~
+// hex2bit() as it was, for comparison
+// Status: finished
+//----------------------------------------------------------------------------
+static char *
+old_hex2bit( char *hex_string, int array_length )
+{
+  char *bit_array;
+  int i = 0;
+  unsigned char l, h;
+
+  if (array_length == 0)
+    array_length = strlen( hex_string );
+  bit_array = (char *)malloc( array_length*2+1 );
+  if (!bit_array)
+    return NULL;
+  while ((l = hex_string[i]) && (h = hex_string[i+1])) {
+    l = l < 'a' ? l - '0' : l - ('a' - 10);
+    h = h < 'a' ? h - '0' : h - ('a' - 10);
+    bit_array[i/2] = l | (h << 4);
+    i += 2;
+  }
+  return bit_array;
+}
+
+
+//----------------------------------------------------------------------------
+// bench_time()
+// ~~~~~~~~~~~~
+// Returns time in seconds
+// Status: finished
+//----------------------------------------------------------------------------
+static double
+bench_time( void )
+{
+  struct timeval tv;
+
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+//----------------------------------------------------------------------------
+// bench_check()
+// ~~~~~~~~~~~~~
+// Compares the codecs on random data of all lengths up to max, with some
+// garbage in the hex strings too.  Returns number of differences.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+bench_check( int max )
+{
+  unsigned char *bits, *out;
+  char *hex, *old;
+  int len, i, n, bad = 0;
+
+  bits = malloc( max );
+  out = malloc( max + 1 );
+  hex = malloc( 2*max + 1 );
+  for (len=0;len<=max;len++) {
+    for (i=0;i<len;i++)
+      bits[i] = rand();
+    n = sfs_bit2hex_to( bits, len, hex );
+    old = old_bit2hex( (char *)bits, len );
+    if ((n != 2*len) || strcmp( hex, old ))
+      bad++;
+    free( old );
+
+    // some strings get a character which is no digit
+    if (len && (rand() & 1))
+      hex[rand() % (2*len)] = "A/:g`~\x80 "[rand() % 8];
+    n = sfs_hex2bit_to( hex, 0, out );
+    old = old_hex2bit( hex, 0 );
+    if ((n != len) || memcmp( out, old, n ))
+      bad++;
+    free( old );
+  }
+  free( bits );
+  free( out );
+  free( hex );
+  return bad;
+}
+
+
+//----------------------------------------------------------------------------
+// main()
+// ~~~~~~
+// Prints MB/s of the old and new codecs for some key lengths
+//----------------------------------------------------------------------------
+int
+main( void )
+{
+  unsigned char *bits, *out;
+  char *hex, *p;
+  double t, t_old, t_enc, t_dec, t_old_dec;
+  int s, i, rounds, bad;
+
+  printf( "kernel: %s\n", sfs_hex_init_kernel() );
+  bad = bench_check( 1024 );
+  printf( "check: %s\n", bad ? "FAILED" : "ok" );
+
+  bits = malloc( sizes[BENCH_SIZES-1] );
+  out = malloc( sizes[BENCH_SIZES-1] );
+  hex = malloc( 2*sizes[BENCH_SIZES-1] + 1 );
+  for (i=0;i<sizes[BENCH_SIZES-1];i++)
+    bits[i] = rand();
+
+  printf( "%8s %12s %12s %12s %12s\n", "bytes", "old enc", "new enc", "old dec", "new dec" );
+  for (s=0;s<BENCH_SIZES;s++) {
+    rounds = BENCH_BYTES / sizes[s];
+
+    t = bench_time();
+    for (i=0;i<rounds;i++)
+      free( old_bit2hex( (char *)bits, sizes[s] ));
+    t_old = bench_time() - t;
+
+    t = bench_time();
+    for (i=0;i<rounds;i++)
+      sfs_bit2hex_to( bits, sizes[s], hex );
+    t_enc = bench_time() - t;
+
+    t = bench_time();
+    for (i=0;i<rounds;i++) {
+      p = old_hex2bit( hex, 0 );
+      free( p );
+    }
+    t_old_dec = bench_time() - t;
+
+    t = bench_time();
+    for (i=0;i<rounds;i++)
+      sfs_hex2bit_to( hex, 0, out );
+    t_dec = bench_time() - t;
+
+    printf( "%8d %9.0f MB/s %7.0f MB/s %7.0f MB/s %7.0f MB/s\n", sizes[s],
+            BENCH_BYTES / t_old / 1e6, BENCH_BYTES / t_enc / 1e6,
+            BENCH_BYTES / t_old_dec / 1e6, BENCH_BYTES / t_dec / 1e6 );
+  }
+  free( bits );
+  free( out );
+  free( hex );
+  return bad ? 1 : 0;
+}
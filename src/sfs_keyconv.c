@@ -0,0 +1,646 @@
+/*
+ * sfs_keyconv.c
+ *
+ * Conversion of key files between the text and the binary format, and
+ * migration of the metadata files of directories to their stores.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+#include "sfs_misc.h"
+#include "sfs_debug.h"
+#include "sfs_keyfile.h"
+#include "sfs_meta.h"
+
+#define SFS_KEYCONV_USAGE "usage: sfs_keyconv [-t] [-e] [-m] [directory ...]"
+
+  // Key file and its kind
+struct sfs_keyconv_file {
+  const char *name;
+  int kind;
+};
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_etc, sfs_keyconv_dir
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Key files of /etc/sfs and of each directory with encrypted files
+//----------------------------------------------------------------------------
+static const struct sfs_keyconv_file sfs_keyconv_etc[] = {
+  { SFS_PASSWD_FILE, SFS_KEYFILE_PASSWD },
+  { SFS_SHADOW_FILE, SFS_KEYFILE_SHADOW },
+  { SFS_GROUPS_FILE, SFS_KEYFILE_GROUPS },
+  { SFS_GSHADOW_FILE, SFS_KEYFILE_GSHADOW },
+  { SFS_ALL_FILE, SFS_KEYFILE_ALL },
+  { SFS_ASHADOW_FILE, SFS_KEYFILE_ASHADOW },
+  { NULL, 0 }
+};
+
+static const struct sfs_keyconv_file sfs_keyconv_dir[] = {
+  { SFS_UDIR_FILE, SFS_KEYFILE_UDIR },
+  { SFS_GDIR_FILE, SFS_KEYFILE_GDIR },
+  { SFS_ADIR_FILE, SFS_KEYFILE_ADIR },
+  { NULL, 0 }
+};
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_parse()
+// ~~~~~~~~~~~~~~~~~~~
+// Splits line of text key file of kind to ids, name and key (text form),
+// name and text have SFS_MAX_PATH bytes.  Returns 0 or -1.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_parse( int kind, char *line, uid_t *id, uid_t *id2, char *name, char *text )
+{
+  void *l = NULL;
+
+  *id = *id2 = 0;
+  name[0] = 0;
+  switch (kind) {
+    case SFS_KEYFILE_UDIR:
+    case SFS_KEYFILE_GDIR:
+      if ((l = sfs_parse_sfsdir_line( line ))) {
+        *id = ((sfsdir_line *)l)->uid;
+        strncpy( name, ((sfsdir_line *)l)->file_name, SFS_MAX_PATH );
+        strncpy( text, ((sfsdir_line *)l)->file_key, SFS_MAX_PATH );
+      }
+      break;
+    case SFS_KEYFILE_ADIR:
+      if ((l = sfs_parse_sfsadir_line( line ))) {
+        strncpy( name, ((sfsadir_line *)l)->file_name, SFS_MAX_PATH );
+        strncpy( text, ((sfsadir_line *)l)->file_key, SFS_MAX_PATH );
+      }
+      break;
+    case SFS_KEYFILE_GROUPS:
+      if ((l = sfs_parse_groups_line( line ))) {
+        *id = ((groups_line *)l)->gid;
+        strncpy( text, ((groups_line *)l)->group_public_key, SFS_MAX_PATH );
+      }
+      break;
+    case SFS_KEYFILE_GSHADOW:
+      if ((l = sfs_parse_gshadow_line( line ))) {
+        *id = ((gshadow_line *)l)->gid;
+        *id2 = ((gshadow_line *)l)->uid;
+        strncpy( text, ((gshadow_line *)l)->group_private_key, SFS_MAX_PATH );
+      }
+      break;
+    case SFS_KEYFILE_ALL:
+      strncpy( text, line, SFS_MAX_PATH );
+      return 0;
+    default:
+      if ((l = sfs_parse_passwd_line( line ))) {
+        *id = ((passwd_line *)l)->uid;
+        strncpy( text, ((passwd_line *)l)->user_private_key, SFS_MAX_PATH );
+      }
+      break;
+  }
+  if (!l)
+    return -1;
+  free( l );
+  name[SFS_MAX_PATH-1] = text[SFS_MAX_PATH-1] = 0;
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_to_binary()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Converts text key file to the binary format.  Keys which would not come
+// back the same are not converted, the file is left as it is then.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_to_binary( const char *path, int kind )
+{
+  char *line, name[SFS_MAX_PATH], text[SFS_MAX_PATH], *buf = NULL, *back, *p;
+  unsigned char key[SFS_MAX_KEY];
+  sfs_key_entry e;
+  sfs_reader r;
+  size_t len = 0;
+  int ret, n = 0, lineno = 0;
+
+  if (sfs_reader_open( &r, path ) == -1)
+    return (errno == ENOENT) ? 0 : -1;
+  if (sfs_keyfile_format( path ) == SFS_KEYFILE_BINARY) {
+    sfs_reader_close( &r );
+    printf( "%s: binary already\n", path );
+    return 0;
+  }
+
+  while ((ret = sfs_reader_line( &r, &line, NULL )) > 0) {
+    lineno++;
+    if (!line[0])
+      continue;
+    memset( &e, 0, sizeof( e ));
+    if ((sfs_keyconv_parse( kind, line, &e.id, &e.id2, name, text ) == -1)
+        || (sfs_keyfile_parse_text( text, &e, key, SFS_MAX_KEY ) == -1)) {
+      sfs_debug( "sfs_keyconv", "%s:%d: bad key", path, lineno );
+      ret = -1;
+      break;
+    }
+    e.name = name;
+    e.name_len = strlen( name );
+
+    back = sfs_keyfile_text( &e );
+    if (!back || strcmp( back, text )) {
+      sfs_debug( "sfs_keyconv", "%s:%d: key cannot be converted", path, lineno );
+      free( back );
+      ret = -1;
+      break;
+    }
+    free( back );
+
+    p = (char *)realloc( buf, len + sfs_keyfile_record_size( &e ));
+    if (!p) {
+      sfs_debug( "sfs_keyconv", "memory error" );
+      ret = -1;
+      break;
+    }
+    buf = p;
+    len += sfs_keyfile_pack( buf + len, &e );
+    n++;
+  }
+  sfs_reader_close( &r );
+
+  if (ret != -1)
+    ret = sfs_keyfile_save( path, kind, buf, len );
+  if (ret != -1)
+    printf( "%s: %d keys\n", path, n );
+  if (buf) {
+    memset( buf, 0, len );
+    free( buf );
+  }
+  memset( key, 0, sizeof( key ));
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_to_text()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Converts binary key file back to the text format
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_to_text( const char *path, int kind )
+{
+  sfs_keyfile kf;
+  sfs_key_entry e;
+  size_t pos = 0, len = 0;
+  char *buf = NULL, *text, *p;
+  int ret, n = 0;
+
+  ret = sfs_keyfile_load( path, &kf );
+  if (ret == SFS_KEYFILE_TEXT) {
+    printf( "%s: text already\n", path );
+    return 0;
+  }
+  if (ret == -1)
+    return (errno == ENOENT) ? 0 : -1;
+
+  while ((ret = sfs_keyfile_next( &kf, &pos, &e )) == 1) {
+    text = sfs_keyfile_text( &e );
+    p = text ? (char *)realloc( buf, len + e.name_len + strlen( text ) + 32 ) : NULL;
+    if (!p) {
+      sfs_debug( "sfs_keyconv", "memory error" );
+      free( text );
+      ret = -1;
+      break;
+    }
+    buf = p;
+    switch (kind) {
+      case SFS_KEYFILE_UDIR:
+      case SFS_KEYFILE_GDIR:
+        len += sprintf( buf + len, "%d%s%s%s%s\n", (int)e.id, SFS_DELIMITER, e.name, SFS_DELIMITER, text );
+        break;
+      case SFS_KEYFILE_ADIR:
+        len += sprintf( buf + len, "%s%s%s\n", e.name, SFS_DELIMITER, text );
+        break;
+      case SFS_KEYFILE_GSHADOW:
+        len += sprintf( buf + len, "%d%s%d%s%s\n", (int)e.id, SFS_DELIMITER, (int)e.id2, SFS_DELIMITER, text );
+        break;
+      case SFS_KEYFILE_ALL:
+        len += sprintf( buf + len, "%s\n", text );
+        break;
+      default:
+        len += sprintf( buf + len, "%d%s%s\n", (int)e.id, SFS_DELIMITER, text );
+        break;
+    }
+    free( text );
+    n++;
+  }
+
+  if (ret != -1)
+    ret = sfs_keyfile_save( path, 0, buf, len );
+  if (ret != -1)
+    printf( "%s: %d keys\n", path, n );
+  if (buf) {
+    memset( buf, 0, len );
+    free( buf );
+  }
+  sfs_keyfile_free( &kf );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_path()
+// ~~~~~~~~~~~~~~~~~~
+// Makes path of file name in dir
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_keyconv_path( char *path, const char *dir, const char *name )
+{
+  snprintf( path, SFS_MAX_PATH, "%s%s%s", dir,
+            (dir[0] && (dir[strlen( dir ) - 1] == '/')) ? "" : "/", name );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_add()
+// ~~~~~~~~~~~~~~~~~
+// Adds copy of record of kind to the records of a store, e is NULL for
+// sizes
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_add( sfs_meta_record **recs, int *n, int kind, const sfs_key_entry *e, const char *name, off_t size )
+{
+  sfs_meta_record *p;
+  unsigned char *key = NULL;
+
+  p = (sfs_meta_record *)realloc( *recs, (*n + 1) * sizeof( **recs ));
+  if (!p) {
+    sfs_debug( "sfs_keyconv", "memory error" );
+    return -1;
+  }
+  *recs = p;
+  p += *n;
+  memset( p, 0, sizeof( *p ));
+  p->kind = kind;
+  p->size = size;
+  if (e) {
+    p->e = *e;
+    if ((e->key_len > 0) && (key = (unsigned char *)malloc( e->key_len )))
+      memcpy( key, e->key, e->key_len );
+    p->e.key = key;
+  }
+  p->e.name = strdup( name );
+  if (!p->e.name || (e && (e->key_len > 0) && !key)) {
+    sfs_debug( "sfs_keyconv", "memory error" );
+    free( (char *)p->e.name );
+    free( key );
+    return -1;
+  }
+  (*n)++;
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_load_keys()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Adds records of key file of directory, binary or text one, to the
+// records of a store.  A missing file has none, a bad key stops it.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_load_keys( const char *path, int kind, sfs_meta_record **recs, int *n )
+{
+  char *line, name[SFS_MAX_PATH], text[SFS_MAX_PATH];
+  unsigned char key[SFS_MAX_KEY];
+  int meta_kind = SFS_META_USER + kind - SFS_KEYFILE_UDIR;
+  sfs_keyfile kf;
+  sfs_key_entry e;
+  sfs_reader r;
+  size_t pos = 0;
+  uid_t id2;
+  int ret, lineno = 0;
+
+  switch (sfs_keyfile_load( path, &kf )) {
+    case SFS_KEYFILE_BINARY:
+      while ((ret = sfs_keyfile_next( &kf, &pos, &e )) == 1)
+        if (sfs_keyconv_add( recs, n, meta_kind, &e, e.name, 0 ) == -1) {
+          ret = -1;
+          break;
+        }
+      sfs_keyfile_free( &kf );
+      return ret;
+    case SFS_KEYFILE_TEXT:
+      break;
+    default:
+      return (errno == ENOENT) ? 0 : -1;
+  }
+
+  if (sfs_reader_open( &r, path ) == -1)
+    return (errno == ENOENT) ? 0 : -1;
+  while ((ret = sfs_reader_line( &r, &line, NULL )) > 0) {
+    lineno++;
+    if (!line[0])
+      continue;
+    memset( &e, 0, sizeof( e ));
+    if ((sfs_keyconv_parse( kind, line, &e.id, &id2, name, text ) == -1)
+        || (sfs_keyfile_parse_text( text, &e, key, SFS_MAX_KEY ) == -1)) {
+      sfs_debug( "sfs_keyconv", "%s:%d: bad key", path, lineno );
+      ret = -1;
+      break;
+    }
+    if (sfs_keyconv_add( recs, n, meta_kind, &e, name, 0 ) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  sfs_reader_close( &r );
+  memset( key, 0, sizeof( key ));
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_load_sizes()
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Adds sizes of .sfssizes to the records of a store
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_load_sizes( const char *path, sfs_meta_record **recs, int *n )
+{
+  sfssizes_line *sl;
+  sfs_reader r;
+  char *line;
+  int ret, lineno = 0;
+
+  if (sfs_reader_open( &r, path ) == -1)
+    return (errno == ENOENT) ? 0 : -1;
+  while ((ret = sfs_reader_line( &r, &line, NULL )) > 0) {
+    lineno++;
+    if (!line[0])
+      continue;
+    if (!(sl = sfs_parse_sfssizes_line( line ))) {
+      sfs_debug( "sfs_keyconv", "%s:%d: bad size", path, lineno );
+      ret = -1;
+      break;
+    }
+    ret = sfs_keyconv_add( recs, n, SFS_META_SIZE, NULL, sl->file_name, sl->size );
+    free( sl );
+    if (ret == -1)
+      break;
+  }
+  sfs_reader_close( &r );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_free()
+// ~~~~~~~~~~~~~~~~~~
+// Frees records of a store
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_keyconv_free( sfs_meta_record *recs, int n )
+{
+  int i;
+
+  for (i=0;i<n;i++) {
+    if (recs[i].e.key) {
+      memset( (unsigned char *)recs[i].e.key, 0, recs[i].e.key_len );
+      free( (unsigned char *)recs[i].e.key );
+    }
+    free( (char *)recs[i].e.name );
+  }
+  free( recs );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_to_meta()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Migrates .sfsdir, .sfsgdir, .sfsadir and .sfssizes of directory to its
+// store.  The files are removed once the store is in place, nothing
+// changes if any of them cannot be read whole.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_to_meta( const char *dir )
+{
+  char path[SFS_MAX_PATH];
+  sfs_meta_record *recs = NULL;
+  struct stat st;
+  int i, n = 0, ret = 0;
+
+  sfs_keyconv_path( path, dir, SFS_META_FILE );
+  if (stat( path, &st ) != -1) {
+    printf( "%s: store already\n", path );
+    return 0;
+  }
+
+  for (i=0;sfs_keyconv_dir[i].name && (ret != -1);i++) {
+    sfs_keyconv_path( path, dir, sfs_keyconv_dir[i].name );
+    ret = sfs_keyconv_load_keys( path, sfs_keyconv_dir[i].kind, &recs, &n );
+  }
+  if (ret != -1) {
+    sfs_keyconv_path( path, dir, SFS_SIZES_FILE );
+    ret = sfs_keyconv_load_sizes( path, &recs, &n );
+  }
+
+  sfs_keyconv_path( path, dir, SFS_META_FILE );
+  if (ret != -1)
+    ret = sfs_meta_save( path, recs, n );
+  sfs_keyconv_free( recs, n );
+  if (ret == -1)
+    return -1;
+  printf( "%s: %d records\n", path, n );
+
+  for (i=0;sfs_keyconv_dir[i].name;i++) {
+    sfs_keyconv_path( path, dir, sfs_keyconv_dir[i].name );
+    unlink( path );
+  }
+  sfs_keyconv_path( path, dir, SFS_SIZES_FILE );
+  unlink( path );
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv_from_meta()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Writes records of the store of directory back to text .sfsdir,
+// .sfsgdir, .sfsadir and .sfssizes and removes the store
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv_from_meta( const char *dir )
+{
+  static const char *names[SFS_META_KINDS] = {
+    NULL, SFS_UDIR_FILE, SFS_GDIR_FILE, SFS_ADIR_FILE, SFS_SIZES_FILE
+  };
+  char path[SFS_MAX_PATH], *buf[SFS_META_KINDS], *text, *p;
+  size_t len[SFS_META_KINDS];
+  sfs_meta_record r;
+  struct stat st;
+  sfs_meta m;
+  uint32_t slot = 0;
+  int i, n = 0, ret = 0;
+
+  sfs_keyconv_path( path, dir, SFS_META_FILE );
+  if (sfs_meta_open( &m, path, 0 ) == -1) {
+    if (errno != ENOENT)
+      return -1;
+    printf( "%s: no store\n", path );
+    return 0;
+  }
+  for (i=SFS_META_USER;i<SFS_META_KINDS;i++) {
+    sfs_keyconv_path( path, dir, names[i] );
+    if (stat( path, &st ) != -1) {
+      sfs_debug( "sfs_keyconv", "%s exists", path );
+      sfs_meta_close( &m );
+      return -1;
+    }
+  }
+
+  memset( buf, 0, sizeof( buf ));
+  memset( len, 0, sizeof( len ));
+  while (sfs_meta_next( &m, &slot, &r )) {
+    text = NULL;
+    p = NULL;
+    if ((r.kind == SFS_META_SIZE) || (text = sfs_keyfile_text( &r.e )))
+      p = (char *)realloc( buf[r.kind], len[r.kind] + r.e.name_len + (text ? strlen( text ) : 0) + 64 );
+    if (!p) {
+      sfs_debug( "sfs_keyconv", "memory error" );
+      free( text );
+      ret = -1;
+      break;
+    }
+    buf[r.kind] = p;
+    p += len[r.kind];
+    switch (r.kind) {
+      case SFS_META_USER:
+      case SFS_META_GROUP:
+        len[r.kind] += sprintf( p, "%d%s%s%s%s\n", (int)r.e.id, SFS_DELIMITER, r.e.name, SFS_DELIMITER, text );
+        break;
+      case SFS_META_ALL:
+        len[r.kind] += sprintf( p, "%s%s%s\n", r.e.name, SFS_DELIMITER, text );
+        break;
+      default:
+        len[r.kind] += sprintf( p, "%s%s%ld\n", r.e.name, SFS_DELIMITER, (long)r.size );
+        break;
+    }
+    free( text );
+    n++;
+  }
+  sfs_meta_close( &m );
+
+  for (i=SFS_META_USER;(i<SFS_META_KINDS) && (ret != -1);i++) {
+    sfs_keyconv_path( path, dir, names[i] );
+    if (buf[i])
+      ret = sfs_keyfile_save( path, 0, buf[i], len[i] );
+  }
+  for (i=SFS_META_USER;i<SFS_META_KINDS;i++) {
+    if (buf[i]) {
+      memset( buf[i], 0, len[i] );
+      free( buf[i] );
+    }
+    if (ret == -1) {
+      sfs_keyconv_path( path, dir, names[i] );
+      unlink( path );
+    }
+  }
+  if (ret == -1)
+    return -1;
+
+  sfs_keyconv_path( path, dir, SFS_META_FILE );
+  printf( "%s: %d records\n", path, n );
+  return unlink( path );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyconv()
+// ~~~~~~~~~~~~~
+// Converts key files of the list, in directory dir unless it is NULL
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyconv( const char *dir, const struct sfs_keyconv_file *files, int to_text )
+{
+  char path[SFS_MAX_PATH];
+  int i, ret = 0;
+
+  for (i=0;files[i].name;i++) {
+    if (dir)
+      sfs_keyconv_path( path, dir, files[i].name );
+    else
+      snprintf( path, SFS_MAX_PATH, "%s", files[i].name );
+
+    if ((to_text ? sfs_keyconv_to_text( path, files[i].kind )
+                 : sfs_keyconv_to_binary( path, files[i].kind )) == -1) {
+      sfs_debug( "sfs_keyconv", "%s not converted", path );
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// main()
+// ~~~~~~
+// SFS key file converter main() function, sfsd should not run meanwhile.
+// With -m the directories get their metadata files migrated to a store
+// (back to text files with -t) instead of their key files converted.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+main( int argc, char *argv[] )
+{
+  int i, to_text = 0, etc = 0, meta = 0, dirs = 0, ret = 0;
+
+  for (i=1;i<argc;i++) {
+    if (!strcmp( argv[i], "-t" ))
+      to_text = 1;
+    else if (!strcmp( argv[i], "-e" ))
+      etc = 1;
+    else if (!strcmp( argv[i], "-m" ))
+      meta = 1;
+    else if (argv[i][0] == '-') {
+      sfs_debug( "sfs_keyconv", SFS_KEYCONV_USAGE );
+      return 1;
+    }
+    else
+      dirs++;
+  }
+  if (!etc && !dirs) {
+    sfs_debug( "sfs_keyconv", SFS_KEYCONV_USAGE );
+    return 1;
+  }
+
+  if (etc && (sfs_keyconv( NULL, sfs_keyconv_etc, to_text ) == -1))
+    ret = 1;
+  for (i=1;i<argc;i++) {
+    if (argv[i][0] == '-')
+      continue;
+    if (meta) {
+      if ((to_text ? sfs_keyconv_from_meta( argv[i] ) : sfs_keyconv_to_meta( argv[i] )) == -1) {
+        sfs_debug( "sfs_keyconv", "%s not migrated", argv[i] );
+        ret = 1;
+      }
+    }
+    else if (sfs_keyconv( argv[i], sfs_keyconv_dir, to_text ) == -1)
+      ret = 1;
+  }
+  return ret;
+}
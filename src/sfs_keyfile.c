@@ -0,0 +1,641 @@
+/*
+ * sfs_keyfile.c
+ *
+ * Binary key files.  The keys are stored as they are, with their lengths,
+ * so that a file is read by a single pread and its keys are used in place
+ * without hex decoding.  Text key files are read by sfs_misc.c as before.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define _SFS_DEBUG_DAEMON
+
+#include "sfs.h"
+#include "sfs_debug.h"
+#include "sfs_cipher.h"
+#include "sfs_hex.h"
+#include "sfs_keyfile.h"
+#include "sfs_secure.h"
+
+
+#define SFS_KF_ID		1
+#define SFS_KF_ID2		2
+#define SFS_KF_NAME		4
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_match
+// ~~~~~~~~~~~~~~~~~
+// Fields of the records that identify the key, for each kind of file
+//----------------------------------------------------------------------------
+static const int sfs_keyfile_match[SFS_KEYFILE_KINDS] = {
+  0,
+  SFS_KF_ID | SFS_KF_NAME,	// .sfsdir
+  SFS_KF_ID | SFS_KF_NAME,	// .sfsgdir
+  SFS_KF_NAME,			// .sfsadir
+  SFS_KF_ID,			// passwd
+  SFS_KF_ID,			// shadow
+  SFS_KF_ID,			// groups
+  SFS_KF_ID | SFS_KF_ID2,	// gshadow
+  0,				// all, there is one key only
+  SFS_KF_ID			// ashadow
+};
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_write_all()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Writes whole buffer, returns 0 or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyfile_write_all( int fd, const char *buf, size_t len )
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = __write( fd, buf, len );
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_format()
+// ~~~~~~~~~~~~~~~~~~~~
+// Tells format of a key file by its header, missing and empty files get
+// the format of new files
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_format( const char *path )
+{
+  struct sfs_keyfile_header h;
+  ssize_t ret;
+  int fd;
+
+  fd = __open( path, O_RDONLY );
+  if (fd == -1)
+    return (errno == ENOENT) ? SFS_KEYFILE_NEW : SFS_KEYFILE_TEXT;
+  ret = pread( fd, &h, sizeof( h ), 0 );
+  __close( fd );
+
+  if (ret == 0)
+    return SFS_KEYFILE_NEW;
+  if ((ret == sizeof( h )) && !memcmp( h.magic, SFS_KEYFILE_MAGIC, 4 ))
+    return SFS_KEYFILE_BINARY;
+  return SFS_KEYFILE_TEXT;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_load()
+// ~~~~~~~~~~~~~~~~~~
+// Reads whole key file by one pread, the records are used in place then.
+// Returns SFS_KEYFILE_BINARY, SFS_KEYFILE_TEXT if the file is not binary
+// (nothing is loaded) or -1 if it cannot be read.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_load( const char *path, sfs_keyfile *kf )
+{
+  struct sfs_keyfile_header *h;
+  struct stat st;
+  ssize_t ret = 0;
+  size_t len = 0;
+  int fd;
+
+  memset( kf, 0, sizeof( sfs_keyfile ));
+  fd = __open( path, O_RDONLY );
+  if (fd == -1)
+    return -1;
+  if (fstat( fd, &st ) == -1) {
+    __close( fd );
+    return -1;
+  }
+  if (st.st_size < (off_t)sizeof( struct sfs_keyfile_header )) {
+    __close( fd );
+    return SFS_KEYFILE_TEXT;
+  }
+
+  kf->buf = (char *)malloc( st.st_size );
+  if (!kf->buf) {
+    sfs_debug( "sfs_keyfile_load", "memory error" );
+    __close( fd );
+    return -1;
+  }
+  // a file being appended to may be shorter than fstat said
+  while (len < (size_t)st.st_size) {
+    ret = pread( fd, kf->buf + len, st.st_size - len, len );
+    if ((ret == -1) && (errno == EINTR))
+      continue;
+    if (ret <= 0)
+      break;
+    len += ret;
+  }
+  __close( fd );
+
+  h = (struct sfs_keyfile_header *)kf->buf;
+  if ((len < sizeof( *h )) || memcmp( h->magic, SFS_KEYFILE_MAGIC, 4 )) {
+    sfs_keyfile_free( kf );
+    return (ret == -1) ? -1 : SFS_KEYFILE_TEXT;
+  }
+  if ((h->version != SFS_KEYFILE_VERSION) || !h->kind || (h->kind >= SFS_KEYFILE_KINDS)) {
+    sfs_debug( "sfs_keyfile_load", "%s: unknown version %d or kind %d", path, h->version, h->kind );
+    sfs_keyfile_free( kf );
+    errno = EINVAL;
+    return -1;
+  }
+  kf->kind = h->kind;
+  kf->len = len;
+  return SFS_KEYFILE_BINARY;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_free()
+// ~~~~~~~~~~~~~~~~~~
+// Frees loaded key file, the keys in it are wiped
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_keyfile_free( sfs_keyfile *kf )
+{
+  if (kf->buf) {
+    memset( kf->buf, 0, kf->len );
+    free( kf->buf );
+  }
+  memset( kf, 0, sizeof( sfs_keyfile ));
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_next()
+// ~~~~~~~~~~~~~~~~~~
+// Gets record at *pos (0 for the first one) and moves pos to the next one.
+// Returns 1, 0 at the end of file or -1 if the record is broken.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_next( const sfs_keyfile *kf, size_t *pos, sfs_key_entry *e )
+{
+  const struct sfs_keyfile_record *r;
+  const char *p;
+
+  if (*pos < sizeof( struct sfs_keyfile_header ))
+    *pos = sizeof( struct sfs_keyfile_header );
+  if (*pos >= kf->len)
+    return 0;
+
+  p = kf->buf + *pos;
+  r = (const struct sfs_keyfile_record *)p;
+  if ((kf->len - *pos < sizeof( *r )) || (r->len % SFS_KEYFILE_ALIGN)
+      || (r->len > kf->len - *pos)
+      || (sizeof( *r ) + r->name_len + 1 + r->key_len > r->len)
+      || p[sizeof( *r ) + r->name_len]) {
+    sfs_debug( "sfs_keyfile_next", "broken record at %lu", (unsigned long)*pos );
+    return -1;
+  }
+
+  e->id = r->id;
+  e->id2 = r->id2;
+  e->engine = r->engine;
+  memcpy( e->nonce, r->nonce, SFS_NONCE_SIZE );
+  e->name = p + sizeof( *r );
+  e->name_len = r->name_len;
+  e->key = (const unsigned char *)p + sizeof( *r ) + r->name_len + 1;
+  e->key_len = r->key_len;
+  *pos += r->len;
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_matches()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Tells if record is the key of (id, id2, name) in file of kind
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_keyfile_matches( int kind, const sfs_key_entry *e, uid_t id, uid_t id2, const char *name )
+{
+  int m = sfs_keyfile_match[kind];
+
+  if ((m & SFS_KF_ID) && (e->id != id))
+    return 0;
+  if ((m & SFS_KF_ID2) && (e->id2 != id2))
+    return 0;
+  if ((m & SFS_KF_NAME) && strcmp( e->name, name ))
+    return 0;
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_find()
+// ~~~~~~~~~~~~~~~~~~
+// Finds record of (id, id2, name), fields not used by the kind of file are
+// ignored.  Returns 1, 0 if there is none or -1 if the file is broken.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_find( const sfs_keyfile *kf, uid_t id, uid_t id2, const char *name, sfs_key_entry *e )
+{
+  size_t pos = 0;
+  int ret;
+
+  while ((ret = sfs_keyfile_next( kf, &pos, e )) == 1)
+    if (sfs_keyfile_matches( kf->kind, e, id, id2, name ))
+      return 1;
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_record_size()
+// ~~~~~~~~~~~~~~~~~~~~~~~~~
+// Returns length of record of entry including the padding
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_record_size( const sfs_key_entry *e )
+{
+  int len = sizeof( struct sfs_keyfile_record ) + e->name_len + 1 + e->key_len;
+
+  return (len + SFS_KEYFILE_ALIGN - 1) & ~(SFS_KEYFILE_ALIGN - 1);
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_pack()
+// ~~~~~~~~~~~~~~~~~~
+// Writes record of entry to buf, returns its length
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_pack( char *buf, const sfs_key_entry *e )
+{
+  struct sfs_keyfile_record *r = (struct sfs_keyfile_record *)buf;
+  int len = sfs_keyfile_record_size( e );
+
+  memset( buf, 0, len );
+  r->len = len;
+  r->id = e->id;
+  r->id2 = e->id2;
+  r->name_len = e->name_len;
+  r->key_len = e->key_len;
+  r->engine = e->engine;
+  memcpy( r->nonce, e->nonce, SFS_NONCE_SIZE );
+  memcpy( buf + sizeof( *r ), e->name, e->name_len );
+  memcpy( buf + sizeof( *r ) + e->name_len + 1, e->key, e->key_len );
+  return len;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_header()
+// ~~~~~~~~~~~~~~~~~~~~
+// Fills header of key file of kind
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_keyfile_header( struct sfs_keyfile_header *h, int kind )
+{
+  memset( h, 0, sizeof( *h ));
+  memcpy( h->magic, SFS_KEYFILE_MAGIC, 4 );
+  h->version = SFS_KEYFILE_VERSION;
+  h->kind = kind;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_add()
+// ~~~~~~~~~~~~~~~~~
+// Appends record of entry to key file by one write, a new file gets the
+// header too, an old one must be of the same kind.  The file of all users
+// holds one key, it is replaced.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_add( const char *path, int kind, const sfs_key_entry *e )
+{
+  struct sfs_keyfile_header h;
+  struct stat st;
+  char *buf;
+  int fd, len = 0, ret;
+
+  buf = (char *)malloc( sizeof( struct sfs_keyfile_header ) + sfs_keyfile_record_size( e ));
+  if (!buf) {
+    sfs_debug( "sfs_keyfile_add", "memory error" );
+    return -1;
+  }
+
+  fd = __open( path, O_RDWR|O_APPEND|O_CREAT|((kind == SFS_KEYFILE_ALL) ? O_TRUNC : 0), S_IREAD|S_IWRITE );
+  if ((fd == -1) || (fstat( fd, &st ) == -1)) {
+    sfs_debug( "sfs_keyfile_add", "cannot open key file: %s.", path );
+    if (fd != -1)
+      __close( fd );
+    free( buf );
+    return -1;
+  }
+
+  if (!st.st_size) {
+    sfs_keyfile_header( (struct sfs_keyfile_header *)buf, kind );
+    len = sizeof( struct sfs_keyfile_header );
+  }
+  else if ((pread( fd, &h, sizeof( h ), 0 ) != sizeof( h ))
+           || memcmp( h.magic, SFS_KEYFILE_MAGIC, 4 ) || (h.kind != kind)) {
+    sfs_debug( "sfs_keyfile_add", "%s is not a key file of kind %d", path, kind );
+    __close( fd );
+    free( buf );
+    return -1;
+  }
+  len += sfs_keyfile_pack( buf + len, e );
+  ret = sfs_keyfile_write_all( fd, buf, len );
+  if (ret == -1)
+    sfs_debug( "sfs_keyfile_add", "cannot write to %s: %d", path, errno );
+
+  __close( fd );
+  memset( buf, 0, len );
+  free( buf );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_save()
+// ~~~~~~~~~~~~~~~~~~
+// Replaces key file by header and len bytes of records in buf, kind 0
+// writes buf alone (text key files).  The new file is written aside and
+// renamed over the old one, which keeps owner and mode.  The directory may
+// be writable by users, so the temporary file is created anew through an
+// fd of the directory and an existing one (a planted link) fails the save.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_save( const char *path, int kind, const char *buf, size_t len )
+{
+  struct sfs_keyfile_header h;
+  struct stat st;
+  char dir[SFS_MAX_PATH], temp[SFS_MAX_PATH];
+  const char *base;
+  int dfd, fd, old;
+
+  base = strrchr( path, '/' );
+  if (base) {
+    if ((size_t)(base - path) >= SFS_MAX_PATH) {
+      sfs_debug( "sfs_keyfile_save", "path too long: %s", path );
+      return -1;
+    }
+    memcpy( dir, path, base - path );
+    dir[base - path] = 0;
+    if (!dir[0])
+      strcpy( dir, "/" );
+    base++;
+  }
+  else {
+    strcpy( dir, "." );
+    base = path;
+  }
+  if (snprintf( temp, SFS_MAX_PATH, "%s.%d", base, (int)getpid() ) >= SFS_MAX_PATH) {
+    sfs_debug( "sfs_keyfile_save", "path too long: %s", path );
+    return -1;
+  }
+
+  dfd = __open( dir, O_RDONLY|O_DIRECTORY );
+  if (dfd == -1) {
+    sfs_debug( "sfs_keyfile_save", "cannot open %s: %d", dir, errno );
+    return -1;
+  }
+  old = (fstatat( dfd, base, &st, AT_SYMLINK_NOFOLLOW ) != -1) && S_ISREG( st.st_mode );
+
+  fd = openat( dfd, temp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IREAD|S_IWRITE );
+  if (fd == -1) {
+    sfs_debug( "sfs_keyfile_save", "cannot create %s/%s: %d", dir, temp, errno );
+    __close( dfd );
+    return -1;
+  }
+  if (old) {
+    fchown( fd, st.st_uid, st.st_gid );
+    fchmod( fd, st.st_mode & 07777 );
+  }
+
+  sfs_keyfile_header( &h, kind );
+  // the rename must not expose a short file
+  if ((kind && (sfs_keyfile_write_all( fd, (char *)&h, sizeof( h )) == -1))
+      || (sfs_keyfile_write_all( fd, buf, len ) == -1) || (fsync( fd ) == -1)) {
+    sfs_debug( "sfs_keyfile_save", "cannot write to %s/%s: %d", dir, temp, errno );
+    __close( fd );
+    unlinkat( dfd, temp, 0 );
+    __close( dfd );
+    return -1;
+  }
+  __close( fd );
+
+  if (renameat( dfd, temp, dfd, base ) == -1) {
+    sfs_debug( "sfs_keyfile_save", "rename error: %d", errno );
+    unlinkat( dfd, temp, 0 );
+    __close( dfd );
+    return -1;
+  }
+  __close( dfd );
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_delete()
+// ~~~~~~~~~~~~~~~~~~~~
+// Deletes record of (id, id2, name) from binary key file, the other
+// records are moved over it in the loaded file.  Returns -1 if there is
+// no such record.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_delete( const char *path, int kind, uid_t id, uid_t id2, const char *name )
+{
+  sfs_keyfile kf;
+  sfs_key_entry e;
+  size_t pos = 0, start, out;
+  int ret, found = 0;
+
+  if (sfs_keyfile_load( path, &kf ) != SFS_KEYFILE_BINARY) {
+    sfs_debug( "sfs_keyfile_delete", "cannot load key file: %s.", path );
+    return -1;
+  }
+  if (kf.kind != kind) {
+    sfs_debug( "sfs_keyfile_delete", "%s: kind %d, expected %d", path, kf.kind, kind );
+    sfs_keyfile_free( &kf );
+    return -1;
+  }
+
+  out = sizeof( struct sfs_keyfile_header );
+  for (;;) {
+    start = (pos < out) ? out : pos;
+    if ((ret = sfs_keyfile_next( &kf, &pos, &e )) != 1)
+      break;
+    if (sfs_keyfile_matches( kind, &e, id, id2, name )) {
+      found = 1;
+      continue;
+    }
+    if (start != out)
+      memmove( kf.buf + out, kf.buf + start, pos - start );
+    out += pos - start;
+  }
+
+  if ((ret == -1) || !found) {
+    if (!found)
+      sfs_debug( "sfs_keyfile_delete", "key not found in %s", path );
+    sfs_keyfile_free( &kf );
+    return -1;
+  }
+
+  ret = sfs_keyfile_save( path, kind, kf.buf + sizeof( struct sfs_keyfile_header ),
+                          out - sizeof( struct sfs_keyfile_header ));
+  sfs_keyfile_free( &kf );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_parse_text()
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Fills engine, nonce and key of entry from the text form of a key.  Keys
+// of /etc/sfs are plain hex like the records of ECB files.  Texts which
+// would not come back the same from sfs_keyfile_text() are refused.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_parse_text( const char *text, sfs_key_entry *e, unsigned char *key, int max )
+{
+  char *copy, *hex;
+  int i, n, ret = -1;
+
+  copy = strdup( text );
+  if (!copy) {
+    sfs_debug( "sfs_keyfile_parse_text", "memory error" );
+    return -1;
+  }
+
+  hex = sfs_sym_parse_blob( copy, &e->engine, e->nonce );
+  if (hex) {
+    n = strlen( hex );
+    for (i=0;i<n;i++)
+      if (!(((hex[i] >= '0') && (hex[i] <= '9')) || ((hex[i] >= 'a') && (hex[i] <= 'f'))))
+        break;
+    if ((i == n) && !(n % 2) && (n / 2 <= max)) {
+      e->key_len = sfs_hex2bit_to( hex, 0, key );
+      e->key = key;
+      ret = 0;
+    }
+  }
+
+  memset( copy, 0, strlen( copy ));
+  free( copy );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_text()
+// ~~~~~~~~~~~~~~~~~~
+// Makes the text form of key of entry, as it would be in a text key file
+// Status: finished
+//----------------------------------------------------------------------------
+char *
+sfs_keyfile_text( const sfs_key_entry *e )
+{
+  char *hex, *blob;
+
+  hex = (char *)malloc( 2*e->key_len + 1 );
+  if (!hex) {
+    sfs_debug( "sfs_keyfile_text", "memory error" );
+    return NULL;
+  }
+  sfs_bit2hex_to( e->key, e->key_len, hex );
+  if (e->engine == SFS_ENGINE_BFECB)
+    return hex;
+
+  blob = sfs_sym_make_blob( e->engine, e->nonce, hex );
+  free( hex );
+  return blob;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_read_text()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Finds key of (id, id2, name) in key file and gives it in text form, for
+// the functions of sfs_misc.c working with hex keys.  Returns format of the
+// file, text files are left to the caller.  *text is NULL if there is no
+// such key, a file of another kind gives -1.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_read_text( const char *path, int kind, uid_t id, uid_t id2, const char *name, char **text )
+{
+  sfs_keyfile kf;
+  sfs_key_entry e;
+  int ret;
+
+  *text = NULL;
+  ret = sfs_keyfile_load( path, &kf );
+  if (ret != SFS_KEYFILE_BINARY)
+    return ret;
+  if (kf.kind != kind) {
+    sfs_debug( "sfs_keyfile_read_text", "%s: kind %d, expected %d", path, kf.kind, kind );
+    sfs_keyfile_free( &kf );
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sfs_keyfile_find( &kf, id, id2, name, &e ) == 1)
+    *text = sfs_keyfile_text( &e );
+  sfs_keyfile_free( &kf );
+  return SFS_KEYFILE_BINARY;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_keyfile_write_text()
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Appends key of (id, id2, name) given in text form to binary key file
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_keyfile_write_text( const char *path, int kind, uid_t id, uid_t id2, const char *name, const char *text )
+{
+  unsigned char key[SFS_MAX_KEY];
+  sfs_key_entry e;
+  int ret;
+
+  memset( &e, 0, sizeof( e ));
+  if (sfs_keyfile_parse_text( text, &e, key, SFS_MAX_KEY ) == -1) {
+    sfs_debug( "sfs_keyfile_write_text", "bad key for %s", path );
+    return -1;
+  }
+  e.id = id;
+  e.id2 = id2;
+  e.name = name ? name : "";
+  e.name_len = strlen( e.name );
+
+  ret = sfs_keyfile_add( path, kind, &e );
+  memset( key, 0, e.key_len );
+  return ret;
+}
@@ -0,0 +1,120 @@
+/*
+ * sfs_keyfile.h
+ *
+ * Binary key files prototypes.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#ifndef _SFS_KEYFILE_H
+#define _SFS_KEYFILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+
+  // Format of a key file, see sfs_keyfile_format()
+enum { SFS_KEYFILE_TEXT = 0, SFS_KEYFILE_BINARY };
+
+  // Format of key files created from now on, existing files keep theirs
+  // until sfs_keyconv converts them
+#ifndef SFS_KEYFILE_NEW
+#define SFS_KEYFILE_NEW		SFS_KEYFILE_BINARY
+#endif
+
+  // Kind of a key file, tells which fields of the records are the key
+enum { SFS_KEYFILE_UDIR = 1, SFS_KEYFILE_GDIR, SFS_KEYFILE_ADIR,
+       SFS_KEYFILE_PASSWD, SFS_KEYFILE_SHADOW, SFS_KEYFILE_GROUPS,
+       SFS_KEYFILE_GSHADOW, SFS_KEYFILE_ALL, SFS_KEYFILE_ASHADOW,
+       SFS_KEYFILE_KINDS };
+
+#define SFS_KEYFILE_MAGIC	"SFSK"
+#define SFS_KEYFILE_VERSION	1
+  // Records start and end at multiples of it
+#define SFS_KEYFILE_ALIGN	8
+
+  // Header of a binary key file
+  // Numbers are in the byte order of the host, like the keys themselves
+struct sfs_keyfile_header {
+  char magic[4];
+  uint8_t version;
+  uint8_t kind;
+  uint8_t reserved[10];
+};
+
+  // Record of a binary key file
+  // len is the length of the whole record, the name (0 terminated, not
+  // counted in name_len) and the key follow the header and padding up to
+  // SFS_KEYFILE_ALIGN ends it.  id is uid or gid, id2 is uid in gshadow.
+  // engine and nonce are set in the records of encrypted files only.
+struct sfs_keyfile_record {
+  uint32_t len;
+  uint32_t id;
+  uint32_t id2;
+  uint16_t name_len;
+  uint16_t key_len;
+  uint8_t engine;
+  uint8_t reserved[7];
+  uint8_t nonce[SFS_NONCE_SIZE];
+};
+
+  // Key file loaded by sfs_keyfile_load()
+typedef struct sfs_keyfile {
+  int kind;
+  char *buf;
+  size_t len;
+} sfs_keyfile;
+
+  // Record of a key file, name and key point into the loaded file
+typedef struct sfs_key_entry {
+  uid_t id;
+  uid_t id2;
+  int engine;
+  unsigned char nonce[SFS_NONCE_SIZE];
+  const char *name;
+  int name_len;
+  const unsigned char *key;
+  int key_len;
+} sfs_key_entry;
+
+
+  // Tells format of a key file, missing files have SFS_KEYFILE_NEW
+int   sfs_keyfile_format( const char *path );
+  // Loads binary key file by a single pread, returns SFS_KEYFILE_BINARY,
+  // SFS_KEYFILE_TEXT (nothing is loaded then) or -1
+int   sfs_keyfile_load( const char *path, sfs_keyfile *kf );
+  // Frees loaded key file
+void  sfs_keyfile_free( sfs_keyfile *kf );
+  // Gets record at *pos and moves pos to the next one, returns 1, 0 at the
+  // end or -1 if the file is broken
+int   sfs_keyfile_next( const sfs_keyfile *kf, size_t *pos, sfs_key_entry *e );
+  // Finds record of (id, id2, name) as far as the kind of file uses them,
+  // returns 1, 0 if there is none or -1
+int   sfs_keyfile_find( const sfs_keyfile *kf, uid_t id, uid_t id2, const char *name, sfs_key_entry *e );
+
+  // Length of record of entry, including padding
+int   sfs_keyfile_record_size( const sfs_key_entry *e );
+  // Writes record of entry to buf, returns its length
+int   sfs_keyfile_pack( char *buf, const sfs_key_entry *e );
+  // Appends record to key file, creates the file if needed
+int   sfs_keyfile_add( const char *path, int kind, const sfs_key_entry *e );
+  // Deletes record of (id, id2, name), -1 if there is none
+int   sfs_keyfile_delete( const char *path, int kind, uid_t id, uid_t id2, const char *name );
+  // Replaces key file by header and len bytes of records in buf, the
+  // header is left out for kind 0
+int   sfs_keyfile_save( const char *path, int kind, const char *buf, size_t len );
+
+  // Fills engine, nonce and key (max bytes) of entry from the text form of
+  // a key (hex key or key record of sfs_sym_make_blob()), returns 0 or -1
+int   sfs_keyfile_parse_text( const char *text, sfs_key_entry *e, unsigned char *key, int max );
+  // Makes the text form of key of entry
+char *sfs_keyfile_text( const sfs_key_entry *e );
+  // Finds key of (id, id2, name) in text form if the file is binary,
+  // returns format of the file, *text is NULL if there is no such key
+int   sfs_keyfile_read_text( const char *path, int kind, uid_t id, uid_t id2, const char *name, char **text );
+  // Appends key of (id, id2, name) given in text form to binary key file
+int   sfs_keyfile_write_text( const char *path, int kind, uid_t id, uid_t id2, const char *name, const char *text );
+
+#endif
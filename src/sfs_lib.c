@@ -28,7 +28,8 @@ int sfs_lib_srand = 0;
 //****************************************************************************
 // sfs_is_encrypted()
 // ~~~~~~~~~~~~~~~~~~
-// Ask sfs daemon if the file is encrypted or not
+// Ask sfs daemon if the file is encrypted or not, SFS_REPLY_STREAM means
+// encrypted in CTR mode
 // Status: finished
 //****************************************************************************
 int
@@ -113,6 +114,10 @@ sfs_is_encrypted( int fd, uid_t uid, pid_t pid )
     msgctl( reply_queue, IPC_RMID, NULL );
     return SFS_REPLY_ENCRYPTED;
   }
+  if (msgb.sfs_msg.sfs_req_auth == SFS_REPLY_STREAM) {
+    msgctl( reply_queue, IPC_RMID, NULL );
+    return SFS_REPLY_STREAM;
+  }
 
   msgctl( reply_queue, IPC_RMID, NULL );
   sfs_debug( "sfs_is_encrypted", "reply error %d.", msgb.sfs_msg.sfs_req_auth );
@@ -120,6 +125,117 @@ sfs_is_encrypted( int fd, uid_t uid, pid_t pid )
 }
 
  
+//****************************************************************************
+// sfs_stream_crypt()
+// ~~~~~~~~~~~~~~~~~~
+// Asks sfs daemon to decrypt (SFS_READ_REQ) or encrypt (SFS_WRITE_REQ) data
+// of a CTR file in place.  Data at any offset go in messages of
+// SFS_MAX_BUF_SIZE bytes, the last write message tells the end given in
+// size, 0 tells none and a message with no data only tells the end.
+// Size of the file from the last reply goes to size.
+// Status: finished
+//****************************************************************************
+int
+sfs_stream_crypt( int fd, uid_t uid, int type, off_t offset, char *buf, size_t count, off_t *size )
+{
+  int sfs_queue = -1, reply_queue = -1, reply_queue_id;
+  struct s_msg msgb;
+  long auth;
+  char path[SFS_MAX_PATH];
+  size_t i, n;
+
+  sprintf( path, "%s/%d", SFS_DIR, uid );
+  auth = sfs_auth( path );
+  if (auth == -1) {
+    sfs_debug( "sfs_stream_crypt", "authorization error" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+
+  sfs_queue = msgget( SFS_D_QUEUE_ID, SFS_R_QUEUE_PERM );
+  if (sfs_queue == -1) {
+    sfs_debug( "sfs_stream_crypt", "cannot get message queue" );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+
+  if (!sfs_lib_srand) {
+    srand( time( 0 ) );
+    sfs_lib_srand = 1;
+  }
+  reply_queue_id = rand();
+  reply_queue = msgget( reply_queue_id, SFS_C_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
+  if (reply_queue == -1) {
+    sfs_debug( "sfs_stream_crypt", "cannot get reply queue %d", reply_queue_id );
+    errno = SFS_ERRNO;
+    return -1;
+  }
+
+  i = 0;
+  do {
+    n = count - i;
+    if (n > SFS_MAX_BUF_SIZE)
+      n = SFS_MAX_BUF_SIZE;
+
+    msgb.mtype = SFS_MESSAGE;
+    msgb.sfs_msg.sfs_req_type = type;
+    msgb.sfs_msg.sfs_req_auth = auth;
+    msgb.sfs_msg.sfs_req_uid = uid;
+    msgb.sfs_msg.sfs_req_reply_queue = reply_queue_id;
+    if (type == SFS_READ_REQ) {
+      msgb.sfs_msg.sfs_req.sfs_read.fd = fd;
+      msgb.sfs_msg.sfs_req.sfs_read.pid = getpid();
+      msgb.sfs_msg.sfs_req.sfs_read.count = n;
+      msgb.sfs_msg.sfs_req.sfs_read.offset = offset + i;
+      memcpy( msgb.sfs_msg.sfs_req.sfs_read.buf, buf + i, n );
+    }
+    else {
+      msgb.sfs_msg.sfs_req.sfs_write.fd = fd;
+      msgb.sfs_msg.sfs_req.sfs_write.pid = getpid();
+      msgb.sfs_msg.sfs_req.sfs_write.count = n;
+      msgb.sfs_msg.sfs_req.sfs_write.offset = offset + i;
+      msgb.sfs_msg.sfs_req.sfs_write.size = (i+n >= count) ? *size : 0;
+      memcpy( msgb.sfs_msg.sfs_req.sfs_write.buf, buf + i, n );
+    }
+
+    if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
+      sfs_debug( "sfs_stream_crypt", "cannot send message" );
+      msgctl( reply_queue, IPC_RMID, NULL );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+
+    if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
+      sfs_debug( "sfs_stream_crypt", "receive message error" );
+      msgctl( reply_queue, IPC_RMID, NULL );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+
+    if ((msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ)
+        || (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK)) {
+      sfs_debug( "sfs_stream_crypt", "reply error %d", msgb.sfs_msg.sfs_req_auth );
+      msgctl( reply_queue, IPC_RMID, NULL );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+
+    if (type == SFS_READ_REQ) {
+      memcpy( buf + i, msgb.sfs_msg.sfs_req.sfs_read.buf, n );
+      *size = msgb.sfs_msg.sfs_req.sfs_read.size;
+    }
+    else {
+      memcpy( buf + i, msgb.sfs_msg.sfs_req.sfs_write.buf, n );
+      *size = msgb.sfs_msg.sfs_req.sfs_write.size;
+    }
+    i += n;
+  } while (i < count);
+
+  msgctl( reply_queue, IPC_RMID, NULL );
+  return 0;
+}
+
+
 //****************************************************************************
 // sfs_auth()
 // ~~~~~~~~~~
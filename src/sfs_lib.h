@@ -34,6 +34,9 @@ file_location *sfs_parse_file_path( const char *path );
   // Ask daemon if the opened file is encrypted or not
 int  sfs_is_encrypted( int fd, uid_t uid, pid_t pid );
 
+  // Ask daemon to decrypt or encrypt data of a CTR file in place
+int  sfs_stream_crypt( int fd, uid_t uid, int type, off_t offset, char *buf, size_t count, off_t *size );
+
   // Return authorization key
 long sfs_auth( const char *path );
 
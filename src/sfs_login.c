@@ -40,7 +40,8 @@ int
 sfs_login( void )
 {
   char *buf=NULL, path[SFS_MAX_PATH];
-  char *ekey=NULL, *ekey_bin=NULL, *dkey_bin=NULL, *dkey=NULL;
+  char *ekey=NULL, *ekey_bin=NULL, *dkey=NULL;
+  bf_key_schedule ks;
   struct s_msg msgb;
   int sfs_queue = -1, reply_queue = -1, reply_queue_id, len;
   long auth=0;
@@ -132,13 +133,10 @@ DE
     return 1;
   }
   len = strlen( ekey )/2;
-  dkey_bin = sfs_sym_decrypt( buf, ekey_bin, len );
-  if (!dkey_bin) {
-    sfs_debug( "sfs_login", "sfs_sym_decrypt error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    return 1;
-  }
-  dkey = bit2hex( dkey_bin, len );
+  // decrypted in place, ekey_bin comes from malloc so it is aligned
+  sfs_sym_set_key( buf, &ks );
+  sfs_sym_decrypt_blocks( &ks, (bf_block *)ekey_bin, len );
+  dkey = bit2hex( ekey_bin, len );
   if (!dkey ) {
     sfs_debug( "sfs_login", "bit2hex error" );
     msgctl( reply_queue, IPC_RMID, NULL );
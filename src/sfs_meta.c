@@ -0,0 +1,978 @@
+/*
+ * sfs_meta.c
+ *
+ * Metadata store of a directory.  The key records of user, group and all
+ * and the sizes of the encrypted files of a directory are kept in one
+ * file, a hash table of fixed slots with a heap of names and keys behind
+ * it.  The file is mapped, so a lookup reads a slot or two and the data it
+ * points to.  Changes are written in place by pwrite: a record gets its
+ * data appended to the heap and synced before its slot is written, so a
+ * crash leaves either the old or the new record.  A slot torn by a crash
+ * fails its sum and counts as deleted.  Sizes are left out of the sum, a
+ * size changes by a pwrite of its 8 bytes.  When the table fills up the store
+ * is written again with twice the slots and renamed over the old one.
+ *
+ * sfsd puts its stores in batch mode, the changes of a batch of requests
+ * are then synced by one fdatasync() in sfs_meta_commit() and the old
+ * records of replaced keys are deleted after it.  A slot written before
+ * its data reached the disk fails its data sum, so a crash in the middle
+ * of a batch still leaves the old or the new record of each key.
+ *
+ * A transaction makes more changes count all or none.  Its slots carry its
+ * number and count when the number is written to the header, a deletion
+ * writes a tomb slot which hides the key until the old slots are deleted.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define _SFS_DEBUG_DAEMON
+
+#include "sfs.h"
+#include "sfs_debug.h"
+#include "sfs_keyfile.h"
+#include "sfs_meta.h"
+
+
+#define SFS_META_FNV		2166136261U
+#define SFS_META_TABLE(slots)	((off_t)sizeof( struct sfs_meta_header ) + (off_t)(slots) * (off_t)sizeof( struct sfs_meta_slot ))
+#define SFS_META_PAD(len)	(((len) + SFS_META_ALIGN - 1) & ~(off_t)(SFS_META_ALIGN - 1))
+  // Deleted data the heap may hold before the store is written again
+#define SFS_META_MAX_GARBAGE	65536
+
+
+/*
+ * Slots
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_meta_fnv()
+// ~~~~~~~~~~~~~~
+// Adds len bytes to FNV-1a hash h
+// Status: finished
+//----------------------------------------------------------------------------
+static uint32_t
+sfs_meta_fnv( uint32_t h, const void *p, size_t len )
+{
+  const unsigned char *c = (const unsigned char *)p;
+
+  while (len--)
+    h = (h ^ *c++) * 16777619U;
+  return h;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_hash()
+// ~~~~~~~~~~~~~~~
+// Hash of (kind, id, name)
+// Status: finished
+//----------------------------------------------------------------------------
+static uint32_t
+sfs_meta_hash( int kind, uid_t id, const char *name )
+{
+  unsigned char k = kind;
+  uint32_t i = id, h;
+
+  h = sfs_meta_fnv( SFS_META_FNV, &k, 1 );
+  h = sfs_meta_fnv( h, &i, sizeof( i ));
+  return sfs_meta_fnv( h, name, strlen( name ));
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_sum()
+// ~~~~~~~~~~~~~~
+// Sum of slot, of all but the sum itself and the size, which is written
+// alone
+// Status: finished
+//----------------------------------------------------------------------------
+static uint32_t
+sfs_meta_sum( const struct sfs_meta_slot *s )
+{
+  struct sfs_meta_slot t = *s;
+
+  t.size = 0;
+  return sfs_meta_fnv( SFS_META_FNV, (const char *)&t + sizeof( t.sum ),
+                       sizeof( t ) - sizeof( t.sum ));
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_slot_at()
+// ~~~~~~~~~~~~~~~~~~
+// Returns slot i of the mapped table
+// Status: finished
+//----------------------------------------------------------------------------
+static const struct sfs_meta_slot *
+sfs_meta_slot_at( const sfs_meta *m, uint32_t i )
+{
+  return (const struct sfs_meta_slot *)(m->map + SFS_META_TABLE( i ));
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_valid()
+// ~~~~~~~~~~~~~~~~
+// Tells whether slot holds a record, its sums and data have to be right.
+// The data offset of a forged store may be anything, it is checked
+// without overflow before it is used.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_valid( const sfs_meta *m, const struct sfs_meta_slot *s )
+{
+  off_t len = s->name_len + 1 + s->key_len;
+
+  if ((s->state != SFS_META_USED) || (s->sum != sfs_meta_sum( s )))
+    return 0;
+  if (s->txn && (s->txn != m->txn)
+      && (s->txn > ((const struct sfs_meta_header *)m->map)->txn))
+    return 0;
+  if ((s->kind < SFS_META_USER) || (s->kind >= SFS_META_KINDS)
+      || (s->data < (uint64_t)SFS_META_TABLE( m->slots ))
+      || (s->data > (uint64_t)m->end) || ((uint64_t)len > (uint64_t)m->end - s->data)
+      || m->map[s->data + s->name_len])
+    return 0;
+  return s->data_sum == sfs_meta_fnv( SFS_META_FNV, m->map + s->data, len );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_probe()
+// ~~~~~~~~~~~~~~~~
+// Walks the chain of hash h, gets the record of (kind, id, name) with the
+// highest seq to *best and the first slot that can take a record to *hole,
+// -1 if there is none
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_meta_probe( const sfs_meta *m, int kind, uid_t id, const char *name, uint32_t h, int64_t *best, int64_t *hole )
+{
+  const struct sfs_meta_slot *s;
+  size_t len = strlen( name );
+  uint32_t i, n;
+
+  *best = *hole = -1;
+  for (n=0,i=h&(m->slots-1);n<m->slots;n++,i=(i+1)&(m->slots-1)) {
+    s = sfs_meta_slot_at( m, i );
+    if (s->state == SFS_META_EMPTY) {
+      if (*hole == -1)
+        *hole = i;
+      return;
+    }
+    if (!sfs_meta_valid( m, s )) {
+      if (*hole == -1)
+        *hole = i;
+      continue;
+    }
+    if ((s->hash == h) && (s->kind == kind) && (s->id == (uint32_t)id)
+        && (s->name_len == len) && !memcmp( m->map + s->data, name, len )
+        && ((*best == -1) || (s->seq > sfs_meta_slot_at( m, *best )->seq)))
+      *best = i;
+  }
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_unpack()
+// ~~~~~~~~~~~~~~~~~
+// Fills record from slot, name and key point into the mapped file
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_meta_unpack( const sfs_meta *m, const struct sfs_meta_slot *s, sfs_meta_record *r )
+{
+  memset( r, 0, sizeof( *r ));
+  r->kind = s->kind;
+  r->size = s->size;
+  r->e.id = s->id;
+  r->e.engine = s->engine;
+  memcpy( r->e.nonce, s->nonce, SFS_NONCE_SIZE );
+  r->e.name = m->map + s->data;
+  r->e.name_len = s->name_len;
+  r->e.key = (const unsigned char *)m->map + s->data + s->name_len + 1;
+  r->e.key_len = s->key_len;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_fill()
+// ~~~~~~~~~~~~~~~
+// Fills slot of record r with data at off in the heap of m, in the open
+// transaction of m
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_meta_fill( const sfs_meta *m, struct sfs_meta_slot *s, const sfs_meta_record *r, int flags, uint32_t h, uint32_t seq, off_t off )
+{
+  memset( s, 0, sizeof( *s ));
+  s->state = SFS_META_USED;
+  s->kind = r->kind;
+  s->engine = r->e.engine;
+  s->flags = flags;
+  s->txn = m->txn;
+  s->hash = h;
+  s->id = (r->kind == SFS_META_USER || r->kind == SFS_META_GROUP) ? r->e.id : 0;
+  s->seq = seq;
+  s->name_len = strlen( r->e.name );
+  s->key_len = (r->kind == SFS_META_SIZE) ? 0 : r->e.key_len;
+  s->data = off;
+  s->size = (r->kind == SFS_META_SIZE) ? r->size : 0;
+  memcpy( s->nonce, r->e.nonce, SFS_NONCE_SIZE );
+  s->data_sum = sfs_meta_fnv( SFS_META_FNV, m->map + off, s->name_len + 1 + s->key_len );
+  s->sum = sfs_meta_sum( s );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_data()
+// ~~~~~~~~~~~~~~~
+// Copies name and key of record to buf, returns their length with padding
+// Status: finished
+//----------------------------------------------------------------------------
+static off_t
+sfs_meta_data( char *buf, const sfs_meta_record *r )
+{
+  size_t name_len = strlen( r->e.name );
+  int key_len = (r->kind == SFS_META_SIZE) ? 0 : r->e.key_len;
+  off_t len = SFS_META_PAD( name_len + 1 + key_len );
+
+  memset( buf, 0, len );
+  memcpy( buf, r->e.name, name_len );
+  if (key_len)
+    memcpy( buf + name_len + 1, r->e.key, key_len );
+  return len;
+}
+
+
+/*
+ * Store
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_meta_write_at()
+// ~~~~~~~~~~~~~~~~~~~
+// Writes whole buffer at off, returns 0 or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_write_at( int fd, const void *buf, size_t len, off_t off )
+{
+  const char *p = (const char *)buf;
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = pwrite( fd, p, len, off );
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += ret;
+    off += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_map()
+// ~~~~~~~~~~~~~~
+// Maps the store up to its end, again after the heap has grown
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_map( sfs_meta *m )
+{
+  void *map;
+
+  if (m->map)
+    munmap( m->map, m->map_len );
+  m->map = NULL;
+  m->map_len = 0;
+  map = mmap( NULL, m->end, PROT_READ, MAP_SHARED, m->fd, 0 );
+  if (map == MAP_FAILED) {
+    sfs_debug( "sfs_meta_map", "cannot map store: %d", errno );
+    return -1;
+  }
+  m->map = (char *)map;
+  m->map_len = m->end;
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_open()
+// ~~~~~~~~~~~~~~~
+// Opens and maps store and counts its slots, the heap ends at the end of
+// the file.  An empty store is created if there is none and create is set.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_open( sfs_meta *m, const char *path, int create )
+{
+  const struct sfs_meta_header *h;
+  const struct sfs_meta_slot *s;
+  unsigned char state = SFS_META_DELETED;
+  uint32_t i;
+
+  memset( m, 0, sizeof( *m ));
+  m->fd = __open( path, O_RDWR|O_NOFOLLOW );
+  if ((m->fd == -1) && (errno == ENOENT) && create) {
+    if (sfs_meta_save( path, NULL, 0 ) == -1)
+      return -1;
+    m->fd = __open( path, O_RDWR|O_NOFOLLOW );
+  }
+  if (m->fd == -1)
+    return -1;
+
+  if (fstat( m->fd, &m->st ) == -1) {
+    sfs_debug( "sfs_meta_open", "cannot stat %s", path );
+    sfs_meta_close( m );
+    return -1;
+  }
+  m->end = m->st.st_size;
+  if ((m->end < (off_t)sizeof( struct sfs_meta_header )) || (sfs_meta_map( m ) == -1)) {
+    sfs_debug( "sfs_meta_open", "bad store %s", path );
+    sfs_meta_close( m );
+    errno = EINVAL;
+    return -1;
+  }
+
+  h = (const struct sfs_meta_header *)m->map;
+  m->slots = h->slots;
+  if (memcmp( h->magic, SFS_META_MAGIC, 4 ) || (h->version != SFS_META_VERSION)
+      || !m->slots || (m->slots & (m->slots - 1))
+      || (SFS_META_TABLE( m->slots ) > m->end)) {
+    sfs_debug( "sfs_meta_open", "bad store %s", path );
+    sfs_meta_close( m );
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i=0;i<m->slots;i++) {
+    s = sfs_meta_slot_at( m, i );
+    if (sfs_meta_valid( m, s )) {
+      m->used++;
+      m->live += SFS_META_PAD( s->name_len + 1 + s->key_len );
+    }
+    else if (s->state != SFS_META_EMPTY) {
+      m->dead++;
+      // Slot of a transaction cut by a crash, its number comes again
+      if ((s->state == SFS_META_USED) && (s->txn > h->txn))
+        sfs_meta_write_at( m->fd, &state, 1, SFS_META_TABLE( i ) + 4 );
+    }
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_close()
+// ~~~~~~~~~~~~~~~~
+// Commits, unmaps and closes store
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_meta_close( sfs_meta *m )
+{
+  if (m->txn)
+    sfs_meta_abort( m );
+  if (m->dirty)
+    sfs_meta_commit( m );
+  if (m->map)
+    munmap( m->map, m->map_len );
+  if (m->fd != -1)
+    __close( m->fd );
+  memset( m, 0, sizeof( *m ));
+  m->fd = -1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_find()
+// ~~~~~~~~~~~~~~~
+// Finds record of (kind, id, name), id is ignored for all and sizes.
+// Returns 1, 0 if there is none.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_find( const sfs_meta *m, int kind, uid_t id, const char *name, sfs_meta_record *r )
+{
+  int64_t best, hole;
+
+  if ((kind != SFS_META_USER) && (kind != SFS_META_GROUP))
+    id = 0;
+  sfs_meta_probe( m, kind, id, name, sfs_meta_hash( kind, id, name ), &best, &hole );
+  if ((best == -1) || (sfs_meta_slot_at( m, best )->flags & SFS_META_TOMB))
+    return 0;
+  sfs_meta_unpack( m, sfs_meta_slot_at( m, best ), r );
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_next()
+// ~~~~~~~~~~~~~~~
+// Gets the record at *slot or the next one, records left behind by a crash
+// in favour of a newer one and tombs are skipped.  Returns 1 or 0 at the
+// end.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_next( const sfs_meta *m, uint32_t *slot, sfs_meta_record *r )
+{
+  const struct sfs_meta_slot *s;
+  int64_t best, hole;
+
+  for (;*slot<m->slots;(*slot)++) {
+    s = sfs_meta_slot_at( m, *slot );
+    if (!sfs_meta_valid( m, s ))
+      continue;
+    sfs_meta_probe( m, s->kind, s->id, m->map + s->data, s->hash, &best, &hole );
+    if ((best != *slot) || (s->flags & SFS_META_TOMB))
+      continue;
+    sfs_meta_unpack( m, s, r );
+    (*slot)++;
+    return 1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_size_slot()
+// ~~~~~~~~~~~~~~~~~~~~
+// Returns offset of the slot with size of name, 0 if there is none
+// Status: finished
+//----------------------------------------------------------------------------
+off_t
+sfs_meta_size_slot( const sfs_meta *m, const char *name )
+{
+  int64_t best, hole;
+
+  sfs_meta_probe( m, SFS_META_SIZE, 0, name, sfs_meta_hash( SFS_META_SIZE, 0, name ), &best, &hole );
+  if ((best == -1) || (sfs_meta_slot_at( m, best )->flags & SFS_META_TOMB))
+    return 0;
+  return SFS_META_TABLE( best );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_set_size()
+// ~~~~~~~~~~~~~~~~~~~
+// Changes size in slot at offset slot by one pwrite of the 8 bytes.  The
+// slot is checked to hold the size of name still, -1 if it does not.
+// The size is not synced, sfsd checks it against the length of the file
+// when it is opened again.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_set_size( sfs_meta *m, off_t slot, const char *name, off_t size )
+{
+  const struct sfs_meta_slot *s;
+  size_t len = strlen( name );
+  int64_t value = size;
+
+  if ((slot < SFS_META_TABLE( 0 )) || (slot >= SFS_META_TABLE( m->slots ))
+      || ((slot - SFS_META_TABLE( 0 )) % sizeof( struct sfs_meta_slot )))
+    return -1;
+  s = (const struct sfs_meta_slot *)(m->map + slot);
+  if (!sfs_meta_valid( m, s ) || (s->kind != SFS_META_SIZE) || (s->flags & SFS_META_TOMB)
+      || (s->name_len != len) || memcmp( m->map + s->data, name, len ))
+    return -1;
+  if (s->size == value)
+    return 0;
+  if (sfs_meta_write_at( m->fd, &value, sizeof( value ), slot + offsetof( struct sfs_meta_slot, size )) == -1) {
+    sfs_debug( "sfs_meta_set_size", "cannot write to store: %d", errno );
+    return -1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_drop()
+// ~~~~~~~~~~~~~~~
+// Marks valid slot i deleted.  The state is a single byte, so it is
+// written whole.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_drop( sfs_meta *m, uint32_t i )
+{
+  const struct sfs_meta_slot *s = sfs_meta_slot_at( m, i );
+  unsigned char state = SFS_META_DELETED;
+
+  if (sfs_meta_write_at( m->fd, &state, 1, SFS_META_TABLE( i ) + 4 ) == -1)
+    return -1;
+  m->used--;
+  m->dead++;
+  m->live -= SFS_META_PAD( s->name_len + 1 + s->key_len );
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_kill()
+// ~~~~~~~~~~~~~~~
+// Marks slots of (kind, id, name) deleted but slot keep, returns their
+// number or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_kill( sfs_meta *m, int kind, uid_t id, const char *name, uint32_t h, int64_t keep )
+{
+  const struct sfs_meta_slot *s;
+  size_t len = strlen( name );
+  uint32_t i, n;
+  int count = 0;
+
+  for (n=0,i=h&(m->slots-1);n<m->slots;n++,i=(i+1)&(m->slots-1)) {
+    s = sfs_meta_slot_at( m, i );
+    if (s->state == SFS_META_EMPTY)
+      break;
+    if ((i == keep) || !sfs_meta_valid( m, s ) || (s->hash != h) || (s->kind != kind)
+        || (s->id != (uint32_t)id) || (s->name_len != len) || memcmp( m->map + s->data, name, len ))
+      continue;
+    if (sfs_meta_drop( m, i ) == -1)
+      return -1;
+    count++;
+  }
+  return count;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_grow()
+// ~~~~~~~~~~~~~~~
+// Writes the store again with room for more records and without deleted
+// ones, and maps the new file
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_grow( sfs_meta *m, const char *path )
+{
+  sfs_meta_record *recs;
+  uint32_t slot = 0;
+  int n = 0, ret, batch = m->batch;
+
+  recs = (sfs_meta_record *)malloc( (m->used + 1) * sizeof( *recs ));
+  if (!recs) {
+    sfs_debug( "sfs_meta_grow", "memory error" );
+    return -1;
+  }
+  while ((n < (int)m->used) && sfs_meta_next( m, &slot, &recs[n] ))
+    n++;
+  ret = sfs_meta_save( path, recs, n );
+  free( recs );
+  if (ret == -1)
+    return -1;
+
+  // The new file holds the changes of the batch and is synced
+  m->dirty = 0;
+  m->npending = 0;
+  sfs_meta_close( m );
+  ret = sfs_meta_open( m, path, 0 );
+  m->batch = batch;
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_write()
+// ~~~~~~~~~~~~~~~~
+// Writes new slot of record r with flags, which wins over the old records
+// of its key.  Name and key are appended to the heap and synced before the
+// slot is written, so that the slot never points to data which is not
+// there.  The old record is deleted when the new one is on the disk.  In
+// batch mode and in a transaction both wait for the commit.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_write( sfs_meta *m, const char *path, const sfs_meta_record *r, int flags )
+{
+  struct sfs_meta_slot s;
+  char *buf;
+  uid_t id = (r->kind == SFS_META_USER || r->kind == SFS_META_GROUP) ? r->e.id : 0;
+  uint32_t h = sfs_meta_hash( r->kind, id, r->e.name );
+  int64_t best, hole;
+  off_t off, len;
+  int reused, nosync = m->batch || m->txn;
+
+  if ((r->kind < SFS_META_USER) || (r->kind >= SFS_META_KINDS)
+      || (strlen( r->e.name ) > 0xffff) || ((r->kind != SFS_META_SIZE) && (r->e.key_len > 0xffff))) {
+    sfs_debug( "sfs_meta_put", "bad record" );
+    return -1;
+  }
+
+  // In batch mode the heap is cleaned by sfs_meta_tidy() later, a
+  // transaction must not be written to a new file half done
+  off = m->end - SFS_META_TABLE( m->slots ) - m->live;
+  if ((4 * (m->used + m->dead + 1) > 3 * m->slots)
+      || (!nosync && (off > SFS_META_MAX_GARBAGE) && (off > m->live))) {
+    if (m->txn) {
+      sfs_debug( "sfs_meta_put", "store %s is full in transaction", path );
+      return -1;
+    }
+    if (sfs_meta_grow( m, path ) == -1) {
+      sfs_debug( "sfs_meta_put", "cannot grow %s", path );
+      return -1;
+    }
+  }
+
+  sfs_meta_probe( m, r->kind, id, r->e.name, h, &best, &hole );
+  if (hole == -1) {
+    sfs_debug( "sfs_meta_put", "store %s is full", path );
+    return -1;
+  }
+  if ((best != -1) && m->txn && (m->npending == SFS_META_PENDING)) {
+    sfs_debug( "sfs_meta_put", "too many changes in transaction" );
+    return -1;
+  }
+
+  buf = (char *)malloc( SFS_META_PAD( strlen( r->e.name ) + 1 + ((r->kind == SFS_META_SIZE) ? 0 : r->e.key_len )));
+  if (!buf) {
+    sfs_debug( "sfs_meta_put", "memory error" );
+    return -1;
+  }
+  len = sfs_meta_data( buf, r );
+  off = SFS_META_PAD( m->end );
+  if ((sfs_meta_write_at( m->fd, buf, len, off ) == -1)
+      || (!nosync && (fdatasync( m->fd ) == -1))) {
+    sfs_debug( "sfs_meta_put", "cannot write to %s: %d", path, errno );
+    memset( buf, 0, len );
+    free( buf );
+    return -1;
+  }
+  memset( buf, 0, len );
+  free( buf );
+  m->end = off + len;
+  if (sfs_meta_map( m ) == -1)
+    return -1;
+
+  sfs_meta_fill( m, &s, r, flags, h, (best == -1) ? 0 : sfs_meta_slot_at( m, best )->seq + 1, off );
+  reused = (sfs_meta_slot_at( m, hole )->state != SFS_META_EMPTY);
+  if ((sfs_meta_write_at( m->fd, &s, sizeof( s ), SFS_META_TABLE( hole )) == -1)
+      || (!nosync && (fdatasync( m->fd ) == -1))) {
+    sfs_debug( "sfs_meta_put", "cannot write to %s: %d", path, errno );
+    return -1;
+  }
+  if (reused)
+    m->dead--;
+  m->used++;
+  m->live += len;
+  if (nosync)
+    m->dirty = 1;
+
+  if (best == -1)
+    return 0;
+  if (nosync) {
+    if ((m->npending == SFS_META_PENDING) && (sfs_meta_commit( m ) == -1))
+      return -1;
+    m->pending[m->npending].slot = best;
+    m->pending[m->npending].data = sfs_meta_slot_at( m, best )->data;
+    m->npending++;
+    return 0;
+  }
+  if ((sfs_meta_kill( m, r->kind, id, r->e.name, h, hole ) == -1)
+      || (fdatasync( m->fd ) == -1)) {
+    sfs_debug( "sfs_meta_put", "cannot delete old record in %s: %d", path, errno );
+    return -1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_put()
+// ~~~~~~~~~~~~~~
+// Adds record, or replaces the record of its (kind, id, name).  Sizes have
+// no data but the name and are changed in their slot by
+// sfs_meta_set_size(), but in a transaction.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_put( sfs_meta *m, const char *path, const sfs_meta_record *r )
+{
+  off_t slot;
+
+  if ((r->kind == SFS_META_SIZE) && !m->txn && (slot = sfs_meta_size_slot( m, r->e.name )))
+    return sfs_meta_set_size( m, slot, r->e.name, r->size );
+  return sfs_meta_write( m, path, r, 0 );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_delete()
+// ~~~~~~~~~~~~~~~~~
+// Deletes record of (kind, id, name), returns -1 if there is none.  A
+// transaction writes a tomb over the record instead.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_delete( sfs_meta *m, int kind, uid_t id, const char *name )
+{
+  sfs_meta_record r;
+  int ret;
+
+  if ((kind != SFS_META_USER) && (kind != SFS_META_GROUP))
+    id = 0;
+  if (m->txn) {
+    if (sfs_meta_find( m, kind, id, name, &r ) != 1)
+      return -1;
+    memset( &r, 0, sizeof( r ));
+    r.kind = kind;
+    r.e.id = id;
+    r.e.name = name;
+    return sfs_meta_write( m, "store", &r, SFS_META_TOMB );
+  }
+
+  ret = sfs_meta_kill( m, kind, id, name, sfs_meta_hash( kind, id, name ), -1 );
+  if ((ret > 0) && m->batch)
+    m->dirty = 1;
+  else if ((ret > 0) && (fdatasync( m->fd ) == -1))
+    ret = -1;
+  if (ret == -1)
+    sfs_debug( "sfs_meta_delete", "cannot write to store: %d", errno );
+  return (ret > 0) ? 0 : -1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_settle()
+// ~~~~~~~~~~~~~~~~~
+// Deletes the old records of the keys replaced since the last commit, and
+// the keys which got a tomb
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_meta_settle( sfs_meta *m )
+{
+  const struct sfs_meta_slot *s, *b;
+  int64_t best, hole;
+  int i, ret = 0;
+
+  for (i=0;i<m->npending;i++) {
+    s = sfs_meta_slot_at( m, m->pending[i].slot );
+    if (!sfs_meta_valid( m, s ) || (s->data != m->pending[i].data))
+      continue;
+    sfs_meta_probe( m, s->kind, s->id, m->map + s->data, s->hash, &best, &hole );
+    if ((best == -1) || (best == m->pending[i].slot))
+      continue;
+    b = sfs_meta_slot_at( m, best );
+    if (sfs_meta_kill( m, s->kind, s->id, m->map + s->data, s->hash,
+                       (b->flags & SFS_META_TOMB) ? -1 : best ) == -1) {
+      sfs_debug( "sfs_meta_commit", "cannot delete old record: %d", errno );
+      ret = -1;
+    }
+  }
+  m->npending = 0;
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_commit()
+// ~~~~~~~~~~~~~~~~~
+// Syncs the changes made in batch mode by one fdatasync() and then deletes
+// the old records of the replaced keys.  The deletions are not synced, if
+// they are lost the newer record wins by its seq.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_commit( sfs_meta *m )
+{
+  if (!m->dirty || m->txn)
+    return 0;
+  if (fdatasync( m->fd ) == -1) {
+    sfs_debug( "sfs_meta_commit", "cannot sync store: %d", errno );
+    return -1;
+  }
+  m->dirty = 0;
+  return sfs_meta_settle( m );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_begin()
+// ~~~~~~~~~~~~~~~~
+// Starts transaction of at most n changes.  The changes made before are
+// committed and the table grows first if it has no room for n slots.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_begin( sfs_meta *m, const char *path, int n )
+{
+  const struct sfs_meta_header *h;
+
+  if (m->txn || (n > SFS_META_PENDING)) {
+    sfs_debug( "sfs_meta_begin", "cannot start transaction" );
+    return -1;
+  }
+  if (sfs_meta_commit( m ) == -1)
+    return -1;
+  if ((4 * (m->used + m->dead + n) > 3 * m->slots) && (sfs_meta_grow( m, path ) == -1)) {
+    sfs_debug( "sfs_meta_begin", "cannot grow %s", path );
+    return -1;
+  }
+  h = (const struct sfs_meta_header *)m->map;
+  m->txn = h->txn + 1;
+  if (!m->txn)
+    m->txn = 1;
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_end()
+// ~~~~~~~~~~~~~~
+// Commits transaction: its slots are synced, then its number is written to
+// the header and synced, which makes all of them count at once.  The old
+// records are deleted after that.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_end( sfs_meta *m )
+{
+  uint32_t txn = m->txn;
+
+  if (!txn)
+    return -1;
+  if ((fdatasync( m->fd ) == -1)
+      || (sfs_meta_write_at( m->fd, &txn, sizeof( txn ), offsetof( struct sfs_meta_header, txn )) == -1)
+      || (fdatasync( m->fd ) == -1)) {
+    sfs_debug( "sfs_meta_end", "cannot commit transaction: %d", errno );
+    sfs_meta_abort( m );
+    return -1;
+  }
+  m->txn = 0;
+  m->dirty = 0;
+  return sfs_meta_settle( m );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_abort()
+// ~~~~~~~~~~~~~~~~
+// Deletes the slots of the open transaction, its number is used again by
+// the next one
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_meta_abort( sfs_meta *m )
+{
+  const struct sfs_meta_slot *s;
+  uint32_t i;
+
+  if (!m->txn)
+    return;
+  for (i=0;i<m->slots;i++) {
+    s = sfs_meta_slot_at( m, i );
+    if ((s->txn == m->txn) && sfs_meta_valid( m, s ) && (sfs_meta_drop( m, i ) == -1))
+      sfs_debug( "sfs_meta_abort", "cannot delete slot %u: %d", i, errno );
+  }
+  m->txn = 0;
+  m->npending = 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_tidy()
+// ~~~~~~~~~~~~~~~
+// Writes store again without the deleted data if they take more of the
+// heap than the live records and more than SFS_META_MAX_GARBAGE.  Run by
+// sfsd when it is idle, instead of in the middle of a change.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_tidy( sfs_meta *m, const char *path )
+{
+  off_t garbage = m->end - SFS_META_TABLE( m->slots ) - m->live;
+
+  if ((garbage <= SFS_META_MAX_GARBAGE) || (garbage <= m->live))
+    return 0;
+  if (sfs_meta_grow( m, path ) == -1) {
+    sfs_debug( "sfs_meta_tidy", "cannot write %s again", path );
+    return -1;
+  }
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_meta_save()
+// ~~~~~~~~~~~~~~~
+// Builds new store of n records in memory with the table at most half
+// full and replaces the file by it through sfs_keyfile_save().  A record
+// of (kind, id, name) which is there already is left out, like the later
+// records of a text key file are never found.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_meta_save( const char *path, const sfs_meta_record *recs, int n )
+{
+  struct sfs_meta_header *h;
+  struct sfs_meta_slot s;
+  sfs_meta m;
+  off_t len;
+  uint32_t hash;
+  uid_t id;
+  int64_t best, hole;
+  int i, ret;
+
+  memset( &m, 0, sizeof( m ));
+  m.slots = SFS_META_MIN_SLOTS;
+  while (m.slots < 2 * (uint32_t)n + 2)
+    m.slots *= 2;
+  len = SFS_META_TABLE( m.slots );
+  for (i=0;i<n;i++)
+    len += SFS_META_PAD( strlen( recs[i].e.name ) + 1 + ((recs[i].kind == SFS_META_SIZE) ? 0 : recs[i].e.key_len ));
+
+  m.map = (char *)calloc( 1, len );
+  if (!m.map) {
+    sfs_debug( "sfs_meta_save", "memory error" );
+    return -1;
+  }
+  h = (struct sfs_meta_header *)m.map;
+  memcpy( h->magic, SFS_META_MAGIC, 4 );
+  h->version = SFS_META_VERSION;
+  h->slots = m.slots;
+  m.end = SFS_META_TABLE( m.slots );
+
+  for (i=0;i<n;i++) {
+    if ((recs[i].kind < SFS_META_USER) || (recs[i].kind >= SFS_META_KINDS)) {
+      sfs_debug( "sfs_meta_save", "bad record" );
+      continue;
+    }
+    id = (recs[i].kind == SFS_META_USER || recs[i].kind == SFS_META_GROUP) ? recs[i].e.id : 0;
+    hash = sfs_meta_hash( recs[i].kind, id, recs[i].e.name );
+    sfs_meta_probe( &m, recs[i].kind, id, recs[i].e.name, hash, &best, &hole );
+    if (best != -1)
+      continue;
+    len = sfs_meta_data( m.map + m.end, &recs[i] );
+    sfs_meta_fill( &m, &s, &recs[i], 0, hash, 0, m.end );
+    memcpy( m.map + SFS_META_TABLE( hole ), &s, sizeof( s ));
+    m.end += len;
+  }
+
+  ret = sfs_keyfile_save( path, 0, m.map, m.end );
+  memset( m.map, 0, m.end );
+  free( m.map );
+  return ret;
+}
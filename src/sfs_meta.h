@@ -0,0 +1,161 @@
+/*
+ * sfs_meta.h
+ *
+ * Metadata store of a directory prototypes.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#ifndef _SFS_META_H
+#define _SFS_META_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+#include "sfs_keyfile.h"
+
+  // Store holding the key records and sizes of the files of a directory,
+  // it replaces .sfsdir, .sfsgdir, .sfsadir and .sfssizes
+#define SFS_META_FILE		".sfsmeta"
+
+  // Directories without any metadata file get a store on the first key
+  // record, the others keep their files until sfs_keyconv -m migrates them
+#ifndef SFS_META_NEW
+#define SFS_META_NEW		1
+#endif
+
+#define SFS_META_MAGIC		"SFSM"
+#define SFS_META_VERSION	3
+  // Slots of a new store, the table grows by doubling
+#define SFS_META_MIN_SLOTS	64
+  // Records of the heap start at multiples of it
+#define SFS_META_ALIGN		8
+  // Replaced records a store in batch mode keeps until it is committed
+#define SFS_META_PENDING	64
+
+  // Kind of a record, the key records use the SFS_KEY_* numbers
+enum { SFS_META_USER = SFS_KEY_USER, SFS_META_GROUP = SFS_KEY_GROUP,
+       SFS_META_ALL = SFS_KEY_ALL, SFS_META_SIZE, SFS_META_KINDS };
+
+  // State of a slot, slots with a bad sum count as deleted
+enum { SFS_META_EMPTY = 0, SFS_META_USED, SFS_META_DELETED };
+
+  // Flags of a slot, a tomb deletes the records of its key in a transaction
+#define SFS_META_TOMB		1
+
+  // Header of a store, the slot table follows it and the heap with names
+  // and keys follows the table up to the end of the file
+  // Numbers are in the byte order of the host, like in key files.  txn is
+  // the last committed transaction.
+struct sfs_meta_header {
+  char magic[4];
+  uint8_t version;
+  uint8_t reserved[3];
+  uint32_t slots;
+  uint32_t txn;
+  uint8_t reserved2[48];
+};
+
+  // Slot of the hash table, one record (kind, id, name)
+  // sum covers the rest of the slot but size, data_sum the name (0
+  // terminated, not counted in name_len) and the key at data in the heap.
+  // A changed key gets a new slot with seq one higher before the old slot
+  // is deleted, the highest seq wins if a crash leaves both.  size of a
+  // SFS_META_SIZE record is changed alone, in place.  A slot written by
+  // transaction txn (0 if none) counts when the header has txn committed.
+struct sfs_meta_slot {
+  uint32_t sum;
+  uint8_t state;
+  uint8_t kind;
+  uint8_t engine;
+  uint8_t flags;
+  uint32_t hash;
+  uint32_t id;
+  uint32_t seq;
+  uint32_t data_sum;
+  uint16_t name_len;
+  uint16_t key_len;
+  uint32_t txn;
+  uint64_t data;
+  int64_t size;
+  uint8_t nonce[SFS_NONCE_SIZE];
+  uint8_t reserved3[8];
+};
+
+  // Old record of a key replaced in batch mode, deleted by the commit if
+  // the slot still holds the data at data
+struct sfs_meta_pending {
+  uint32_t slot;
+  uint64_t data;
+};
+
+  // Store opened by sfs_meta_open()
+  // The file is mapped read only, changes are written by pwrite.  used
+  // and dead count live and deleted slots, live the heap bytes in use.
+  // With batch set changes are not synced one by one: dirty tells that
+  // there are some since sfs_meta_commit(), pending holds the old records
+  // of replaced keys until then.  txn is the open transaction or 0.
+typedef struct sfs_meta {
+  int fd;
+  char *map;
+  size_t map_len;
+  off_t end;
+  uint32_t slots;
+  uint32_t used;
+  uint32_t dead;
+  off_t live;
+  struct stat st;
+  int batch;
+  int dirty;
+  int npending;
+  struct sfs_meta_pending pending[SFS_META_PENDING];
+  uint32_t txn;
+} sfs_meta;
+
+  // Record of a store, size is set in SFS_META_SIZE records only.  Name
+  // and key of e point into the mapped file until the next change.
+typedef struct sfs_meta_record {
+  int kind;
+  off_t size;
+  sfs_key_entry e;
+} sfs_meta_record;
+
+
+  // Opens and maps store, an empty one is created if create is set,
+  // returns 0 or -1 (errno ENOENT if there is none)
+int   sfs_meta_open( sfs_meta *m, const char *path, int create );
+  // Unmaps and closes store
+void  sfs_meta_close( sfs_meta *m );
+  // Finds record of (kind, id, name), returns 1, 0 if there is none or -1
+int   sfs_meta_find( const sfs_meta *m, int kind, uid_t id, const char *name, sfs_meta_record *r );
+  // Gets record at *slot or after it and moves slot past it, returns 1 or
+  // 0 at the end
+int   sfs_meta_next( const sfs_meta *m, uint32_t *slot, sfs_meta_record *r );
+  // Adds or replaces record, path is needed when the table grows
+int   sfs_meta_put( sfs_meta *m, const char *path, const sfs_meta_record *r );
+  // Returns offset of the slot with size of name, 0 if there is none
+off_t sfs_meta_size_slot( const sfs_meta *m, const char *name );
+  // Changes size of name in slot at offset slot, -1 if the slot does not
+  // hold it
+int   sfs_meta_set_size( sfs_meta *m, off_t slot, const char *name, off_t size );
+  // Deletes record of (kind, id, name), -1 if there is none
+int   sfs_meta_delete( sfs_meta *m, int kind, uid_t id, const char *name );
+  // Syncs changes made in batch mode and deletes the replaced records
+int   sfs_meta_commit( sfs_meta *m );
+  // Writes store again if most of its heap is deleted data, returns 1 if
+  // it did, 0 or -1
+int   sfs_meta_tidy( sfs_meta *m, const char *path );
+  // Starts transaction of at most n changes, they count all or none
+int   sfs_meta_begin( sfs_meta *m, const char *path, int n );
+  // Commits transaction
+int   sfs_meta_end( sfs_meta *m );
+  // Drops changes of transaction
+void  sfs_meta_abort( sfs_meta *m );
+  // Writes new store of n records, later duplicates of a record are left
+  // out.  The file is written aside and renamed over the old one.
+int   sfs_meta_save( const char *path, const sfs_meta_record *recs, int n );
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * sfs_metatest.c
+ *
+ * Checks that the stores and binary key files of sfsd are not written
+ * through links planted by users in their directories.  Not installed,
+ * built and run by "make metatest".
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+#include "sfs_keyfile.h"
+#include "sfs_meta.h"
+
+#define TEST_DIR	"metatest.d"
+#define TEST_VICTIM	TEST_DIR "/victim"
+#define TEST_STORE	TEST_DIR "/" SFS_META_FILE
+
+static int failed = 0;
+
+
+//----------------------------------------------------------------------------
+// check()
+// ~~~~~~~
+// Reports result of one check
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+check( const char *what, int ok )
+{
+  printf( "%-48s %s\n", what, ok ? "ok" : "FAILED" );
+  if (!ok)
+    failed = 1;
+}
+
+
+//----------------------------------------------------------------------------
+// victim_intact()
+// ~~~~~~~~~~~~~~~
+// Tells if the file the planted link points to still has its contents
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+victim_intact( void )
+{
+  char buf[16];
+  FILE *f;
+  size_t n;
+
+  f = fopen( TEST_VICTIM, "r" );
+  if (!f)
+    return 0;
+  n = fread( buf, 1, sizeof( buf ), f );
+  fclose( f );
+  return (n == 6) && !memcmp( buf, "secret", 6 );
+}
+
+
+//----------------------------------------------------------------------------
+// plant()
+// ~~~~~~~
+// Makes the victim file and a link to it where path would be saved aside
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+plant( const char *path )
+{
+  char temp[SFS_MAX_PATH];
+  FILE *f;
+
+  f = fopen( TEST_VICTIM, "w" );
+  if (f) {
+    fputs( "secret", f );
+    fclose( f );
+  }
+  snprintf( temp, SFS_MAX_PATH, "%s.%d", path, (int)getpid() );
+  unlink( temp );
+  if (symlink( "victim", temp ) == -1)
+    perror( temp );
+}
+
+
+int
+main( void )
+{
+  char temp[SFS_MAX_PATH];
+  sfs_meta m;
+
+  mkdir( TEST_DIR, 0700 );
+  unlink( TEST_STORE );
+
+  plant( TEST_STORE );
+  check( "new store through planted link refused", sfs_meta_open( &m, TEST_STORE, 1 ) == -1 );
+  check( "linked file left alone", victim_intact() );
+
+  plant( TEST_DIR "/keys" );
+  check( "key file through planted link refused", sfs_keyfile_save( TEST_DIR "/keys", SFS_KEYFILE_UDIR, "", 0 ) == -1 );
+  check( "linked file left alone", victim_intact() );
+
+  snprintf( temp, SFS_MAX_PATH, "%s.%d", TEST_STORE, (int)getpid() );
+  unlink( temp );
+  check( "new store created", sfs_meta_open( &m, TEST_STORE, 1 ) == 0 );
+  sfs_meta_close( &m );
+
+  system( "rm -rf " TEST_DIR );
+  return failed;
+}
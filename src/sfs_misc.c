@@ -26,6 +26,8 @@
 #include "sfs_misc.h"
 #include "sfs_debug.h"
 #include "sfs_secure.h"
+#include "sfs_hex.h"
+#include "sfs_keyfile.h"
 
 
 //****************************************************************************
@@ -35,15 +37,14 @@
 // *********************************************************************** 
 // bit2hex()
 // ~~~~~~~~~
-// Converts bit array to null terminated string with hex notation of array
+// Converts bit array to null terminated string with hex notation of array,
+// see sfs_bit2hex_to() for the code without malloc
 // Status: finished
 // *********************************************************************** 
 char *
 bit2hex(char * bit_array, int array_length)
 {
   char *hex_string;
-  int i =0;
-  uchar l=0,h=0;
   
   hex_string = (char*) malloc(array_length*2+1);
   if (!hex_string) {
@@ -51,18 +52,7 @@ bit2hex(char * bit_array, int array_length)
     return NULL;
   }
   
-  for(i=0;i<array_length;i++)
-  {
-    l = (uchar)bit_array[i] & 0x0F;
-    h = (uchar)bit_array[i] & 0xF0;
-    h >>= 4;
-    l = (uchar)("0123456789abcdef"[l]);
-    h = (uchar)("0123456789abcdef"[h]);
-    hex_string[2*i]=(char)l;
-    hex_string[2*i+1]=(char)h;
-  }
-  hex_string[2*i] = 0;
-  
+  sfs_bit2hex_to( (uchar *)bit_array, array_length, hex_string );
   return hex_string;
 }
 
@@ -70,41 +60,26 @@ bit2hex(char * bit_array, int array_length)
 // *********************************************************************** 
 // hex2bit()
 // ~~~~~~~~~
-// Converts null terminated string with hex notation to an array
+// Converts null terminated string with hex notation to an array, the
+// array has room for padding of the data (see sfs_adduser.c), see
+// sfs_hex2bit_to() for the code without malloc
 // Status: finished
 // *********************************************************************** 
 char*
 hex2bit(char *hex_string, int array_length)
 {
   char *bit_array;
-  int i =0;
-  uchar l,h;
   
   if(array_length == 0)
     array_length = strlen(hex_string);
 
   bit_array = (char*) malloc(array_length*2+1);
-  if (!hex_string) {
+  if (!bit_array) {
     // sfs_debug( "hex2bit", "memory error" );
     return NULL;
   }
 
-  if(bit_array == NULL)
-    bit_array = (char *)malloc(array_length);
-
-  while((l = hex_string[i]) && (h = hex_string[i+1]))
-  {
-    l = l < 'a' ? l - '0' : l - ('a' - 10);
-    h = h < 'a' ? h - '0' : h - ('a' - 10);
-    h = (uchar)h;
-    l = (uchar)l;
-    h<<=4;
-    bit_array[i/2] = l | h;
-    
-    i =  i + 2 ;
-  }
-  array_length = i / 2;
-  
+  sfs_hex2bit_to( hex_string, 0, (uchar *)bit_array );
   return bit_array;
 }
 
@@ -122,25 +97,27 @@ hex2bit(char *hex_string, int array_length)
 char*
 sfs_read_file_key(const char *dir, const char *name, uid_t uid)
 {
-  int key_file;
-  char sfsdir_file[SFS_MAX_PATH], line[SFS_MAX_PATH];
+  sfs_reader key_file;
+  char sfsdir_file[SFS_MAX_PATH], *line, *key;
   sfsdir_line * sfsdir_line;
    
   strncpy( sfsdir_file, dir, SFS_MAX_PATH );
   strcat( sfsdir_file, SFS_UDIR_FILE );
+
+  if (sfs_keyfile_read_text( sfsdir_file, SFS_KEYFILE_UDIR, uid, 0, name, &key ) != SFS_KEYFILE_TEXT)
+    return key;
   
 //  sfs_debug( "sfs_read_file_key", "sfsdir_file: %s", sfsdir_file );
 
-  key_file = __open( sfsdir_file, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, sfsdir_file ) == -1) {
     sfs_debug( "sfs_read_file_key", "cannot open key file: %s.", sfsdir_file );
     return NULL;
   }
 
   for(;;) {  
-    if (sfs_read_line( key_file, line, SFS_MAX_PATH ) == -1) {
+    if (sfs_reader_line( &key_file, &line, NULL ) == -1) {
       sfs_debug( "sfs_read_file_key", "cannot read from key file." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return NULL;
     }
     
@@ -148,7 +125,7 @@ sfs_read_file_key(const char *dir, const char *name, uid_t uid)
     
     if ((sfsdir_line = sfs_parse_sfsdir_line( line )) == NULL) {
       sfs_debug( "sfs_read_file_key", "cannot found key." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return NULL;
     }
     
@@ -161,7 +138,7 @@ sfs_read_file_key(const char *dir, const char *name, uid_t uid)
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   return strdup( sfsdir_line->file_key );
 }
 
@@ -178,13 +155,11 @@ sfs_write_file_key( const char *dir, const char *name, uid_t uid, const char *ke
   int key_file;
   char buf[SFS_MAX_PATH];
 
-  if (sfs_read_file_key( dir, name, uid )) {
-    sfs_debug( "sfs_write_file_key", "key already exists" );
-    return -1;
-  }
-  
   strncpy( buf, dir, SFS_MAX_PATH );
   strcat( buf, SFS_UDIR_FILE );
+
+  if (sfs_keyfile_format( buf ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( buf, SFS_KEYFILE_UDIR, uid, 0, name, key );
   
 //  sfs_debug( "sfs_write_file_key", "buf: %s", buf );
 
@@ -216,19 +191,17 @@ sfs_write_file_key( const char *dir, const char *name, uid_t uid, const char *ke
 int
 sfs_delete_file_key( const char *dir, const char *name, uid_t uid )
 {
-  int key_file, tmp_file, ret, found = 0, len;
-  char keyfn[SFS_MAX_PATH], *tmpfn=NULL, buf[SFS_MAX_PATH], read_buf[SFS_MAX_PATH];
+  sfs_reader key_file;
+  int tmp_file, ret, found = 0, len;
+  char keyfn[SFS_MAX_PATH], *tmpfn=NULL, buf[SFS_MAX_PATH], *read_buf;
   
-  if (!sfs_read_file_key( dir, name, uid )) {
-    sfs_debug( "sfs_delete_file_key", "key not found" );
-    return -1;
-  }
-
   strncpy( keyfn, dir, SFS_MAX_PATH );
   strcat( keyfn, SFS_UDIR_FILE );
+
+  if (sfs_keyfile_format( keyfn ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( keyfn, SFS_KEYFILE_UDIR, uid, 0, name );
   
-  key_file = __open( keyfn, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, keyfn ) == -1) {
     sfs_debug( "sfs_delete_file_key", "cannot open key file: %s.", keyfn );
     return -1;
   }
@@ -245,7 +218,7 @@ sfs_delete_file_key( const char *dir, const char *name, uid_t uid )
   tmp_file = __open( tmpfn, O_CREAT|O_EXCL|O_WRONLY, S_IREAD|S_IWRITE );
   if (tmp_file == -1) {
     sfs_debug( "sfs_delete_file_key", "cannot open tmp file: %s.", tmpfn );
-    __close( key_file );
+    sfs_reader_close( &key_file );
     return -1;
   }
   
@@ -254,18 +227,19 @@ sfs_delete_file_key( const char *dir, const char *name, uid_t uid )
 /* copy to another file, without line consisting of "buf..." */
 
   for (;;) {
-    ret = sfs_read_line( key_file, read_buf, SFS_MAX_PATH );
+    ret = sfs_reader_line( &key_file, &read_buf, &len );
     if (ret == -1) {
       sfs_debug( "sfs_delete_file_key", "read_line error: %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_delete_file_key", "file not found: %s%s/%d.", dir, name, uid );
-        __close( key_file );
+        sfs_reader_close( &key_file );
         __close( tmp_file );
+        unlink( tmpfn );
         return -1;
       }
       else
@@ -277,18 +251,16 @@ sfs_delete_file_key( const char *dir, const char *name, uid_t uid )
       found = 1;
       continue;
     }
-    len = strlen( read_buf );
     read_buf[len++] = '\n';
-    read_buf[len] = 0;
     if (__write( tmp_file, read_buf, len ) == -1) {
       sfs_debug( "sfs_delete_file_key", "write error %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   __close( tmp_file );
   
 //  sfs_debug( "sfs_delete_file_key", "done: %s, %s.", keyfn, tmpfn );
@@ -321,25 +293,27 @@ sfs_delete_file_key( const char *dir, const char *name, uid_t uid )
 char*
 sfs_read_g_file_key(const char *dir, const char *name, gid_t gid)
 {
-  int key_file;
-  char sfsdir_file[SFS_MAX_PATH], line[SFS_MAX_PATH];
+  sfs_reader key_file;
+  char sfsdir_file[SFS_MAX_PATH], *line, *key;
   sfsgdir_line * sfsdir_line;
    
   strncpy( sfsdir_file, dir, SFS_MAX_PATH );
   strcat( sfsdir_file, SFS_GDIR_FILE );
+
+  if (sfs_keyfile_read_text( sfsdir_file, SFS_KEYFILE_GDIR, gid, 0, name, &key ) != SFS_KEYFILE_TEXT)
+    return key;
   
 //  sfs_debug( "sfs_read_g_file_key", "sfsdir_file: %s", sfsdir_file );
 
-  key_file = __open( sfsdir_file, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, sfsdir_file ) == -1) {
     sfs_debug( "sfs_read_g_file_key", "cannot open key file: %s.", sfsdir_file );
     return NULL;
   }
 
   for(;;) {  
-    if (sfs_read_line( key_file, line, SFS_MAX_PATH ) == -1) {
+    if (sfs_reader_line( &key_file, &line, NULL ) == -1) {
       sfs_debug( "sfs_read_g_file_key", "cannot read from key file." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return NULL;
     }
     
@@ -347,7 +321,7 @@ sfs_read_g_file_key(const char *dir, const char *name, gid_t gid)
     
     if ((sfsdir_line = (sfsgdir_line*) sfs_parse_sfsdir_line( line )) == NULL) {
       sfs_debug( "sfs_read_g_file_key", "cannot found key." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return NULL;
     }
     
@@ -360,7 +334,7 @@ sfs_read_g_file_key(const char *dir, const char *name, gid_t gid)
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   return strdup( sfsdir_line->file_key );
 }
 
@@ -376,13 +350,11 @@ sfs_write_g_file_key( const char *dir, const char *name, gid_t gid, const char *
   int key_file;
   char buf[SFS_MAX_PATH];
 
-  if (sfs_read_g_file_key( dir, name, gid )) {
-    sfs_debug( "sfs_write_file_key", "key already exists" );
-    return -1;
-  }
-  
   strncpy( buf, dir, SFS_MAX_PATH );
   strcat( buf, SFS_GDIR_FILE );
+
+  if (sfs_keyfile_format( buf ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( buf, SFS_KEYFILE_GDIR, gid, 0, name, key );
   
 //  sfs_debug( "sfs_write_g_file_key", "buf: %s", buf );
 
@@ -414,19 +386,17 @@ sfs_write_g_file_key( const char *dir, const char *name, gid_t gid, const char *
 int
 sfs_delete_g_file_key( const char *dir, const char *name, gid_t gid )
 {
-  int key_file, tmp_file, ret, found = 0, len;
-  char keyfn[SFS_MAX_PATH], *tmpfn=NULL, buf[SFS_MAX_PATH], read_buf[SFS_MAX_PATH];
+  sfs_reader key_file;
+  int tmp_file, ret, found = 0, len;
+  char keyfn[SFS_MAX_PATH], *tmpfn=NULL, buf[SFS_MAX_PATH], *read_buf;
   
-  if (!sfs_read_g_file_key( dir, name, gid )) {
-    sfs_debug( "sfs_delete_g_file_key", "key not found" );
-    return -1;
-  }
-
   strncpy( keyfn, dir, SFS_MAX_PATH );
   strcat( keyfn, SFS_GDIR_FILE );
+
+  if (sfs_keyfile_format( keyfn ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( keyfn, SFS_KEYFILE_GDIR, gid, 0, name );
   
-  key_file = __open( keyfn, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, keyfn ) == -1) {
     sfs_debug( "sfs_delete_g_file_key", "cannot open key file: %s.", keyfn );
     return -1;
   }
@@ -443,7 +413,7 @@ sfs_delete_g_file_key( const char *dir, const char *name, gid_t gid )
   tmp_file = __open( tmpfn, O_CREAT|O_EXCL|O_WRONLY, S_IREAD|S_IWRITE );
   if (tmp_file == -1) {
     sfs_debug( "sfs_delete_g_file_key", "cannot open tmp file: %s.", tmpfn );
-    __close( key_file );
+    sfs_reader_close( &key_file );
     return -1;
   }
   
@@ -452,18 +422,19 @@ sfs_delete_g_file_key( const char *dir, const char *name, gid_t gid )
 /* copy to another file, without line consisting of "buf..." */
 
   for (;;) {
-    ret = sfs_read_line( key_file, read_buf, SFS_MAX_PATH );
+    ret = sfs_reader_line( &key_file, &read_buf, &len );
     if (ret == -1) {
       sfs_debug( "sfs_delete_g_file_key", "read_line error: %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_delete_g_file_key", "file not found: %s%s/%d.", dir, name, gid );
-        __close( key_file );
+        sfs_reader_close( &key_file );
         __close( tmp_file );
+        unlink( tmpfn );
         return -1;
       }
       else
@@ -475,18 +446,16 @@ sfs_delete_g_file_key( const char *dir, const char *name, gid_t gid )
       found = 1;
       continue;
     }
-    len = strlen( read_buf );
     read_buf[len++] = '\n';
-    read_buf[len] = 0;
     if (__write( tmp_file, read_buf, len ) == -1) {
       sfs_debug( "sfs_delete_g_file_key", "write error %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   __close( tmp_file );
   
 //  sfs_debug( "sfs_delete_g_file_key", "done: %s, %s.", keyfn, tmpfn );
@@ -517,25 +486,27 @@ sfs_delete_g_file_key( const char *dir, const char *name, gid_t gid )
 char*
 sfs_read_a_file_key(const char *dir, const char *name )
 {
-  int key_file;
-  char sfsdir_file[SFS_MAX_PATH], line[SFS_MAX_PATH];
+  sfs_reader key_file;
+  char sfsdir_file[SFS_MAX_PATH], *line, *key;
   sfsadir_line * sfsdir_line;
    
   strncpy( sfsdir_file, dir, SFS_MAX_PATH );
   strcat( sfsdir_file, SFS_ADIR_FILE );
+
+  if (sfs_keyfile_read_text( sfsdir_file, SFS_KEYFILE_ADIR, 0, 0, name, &key ) != SFS_KEYFILE_TEXT)
+    return key;
   
 //  sfs_debug( "sfs_read_a_file_key", "sfsdir_file: %s", sfsdir_file );
 
-  key_file = __open( sfsdir_file, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, sfsdir_file ) == -1) {
     sfs_debug( "sfs_read_a_file_key", "cannot open key file: %s.", sfsdir_file );
     return NULL;
   }
 
   for(;;) {  
-    if (sfs_read_line( key_file, line, SFS_MAX_PATH ) == -1) {
+    if (sfs_reader_line( &key_file, &line, NULL ) == -1) {
       sfs_debug( "sfs_read_a_file_key", "cannot read from key file." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return NULL;
     }
     
@@ -543,7 +514,7 @@ sfs_read_a_file_key(const char *dir, const char *name )
     
     if ((sfsdir_line = sfs_parse_sfsadir_line( line )) == NULL) {
       sfs_debug( "sfs_read_a_file_key", "cannot found key." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return NULL;
     }
     
@@ -555,7 +526,7 @@ sfs_read_a_file_key(const char *dir, const char *name )
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   return strdup( sfsdir_line->file_key );
 }
 
@@ -571,13 +542,11 @@ sfs_write_a_file_key( const char *dir, const char *name, const char *key )
   int key_file;
   char buf[SFS_MAX_PATH];
 
-  if (sfs_read_a_file_key( dir, name )) {
-    sfs_debug( "sfs_write_file_key", "key already exists" );
-    return -1;
-  }
-  
   strncpy( buf, dir, SFS_MAX_PATH );
   strcat( buf, SFS_ADIR_FILE );
+
+  if (sfs_keyfile_format( buf ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( buf, SFS_KEYFILE_ADIR, 0, 0, name, key );
   
 //  sfs_debug( "sfs_write_a_file_key", "buf: %s", buf );
 
@@ -609,19 +578,17 @@ sfs_write_a_file_key( const char *dir, const char *name, const char *key )
 int
 sfs_delete_a_file_key( const char *dir, const char *name )
 {
-  int key_file, tmp_file, ret, found = 0, len;
-  char keyfn[SFS_MAX_PATH], *tmpfn=NULL, buf[SFS_MAX_PATH], read_buf[SFS_MAX_PATH];
+  sfs_reader key_file;
+  int tmp_file, ret, found = 0, len;
+  char keyfn[SFS_MAX_PATH], *tmpfn=NULL, buf[SFS_MAX_PATH], *read_buf;
   
-  if (!sfs_read_a_file_key( dir, name )) {
-    sfs_debug( "sfs_delete_a_file_key", "key not found" );
-    return -1;
-  }
-
   strncpy( keyfn, dir, SFS_MAX_PATH );
   strcat( keyfn, SFS_ADIR_FILE );
+
+  if (sfs_keyfile_format( keyfn ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( keyfn, SFS_KEYFILE_ADIR, 0, 0, name );
   
-  key_file = __open( keyfn, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, keyfn ) == -1) {
     sfs_debug( "sfs_delete_a_file_key", "cannot open key file: %s.", keyfn );
     return -1;
   }
@@ -638,7 +605,7 @@ sfs_delete_a_file_key( const char *dir, const char *name )
   tmp_file = __open( tmpfn, O_CREAT|O_EXCL|O_WRONLY, S_IREAD|S_IWRITE );
   if (tmp_file == -1) {
     sfs_debug( "sfs_delete_a_file_key", "cannot open tmp file: %s.", tmpfn );
-    __close( key_file );
+    sfs_reader_close( &key_file );
     return -1;
   }
   
@@ -647,18 +614,19 @@ sfs_delete_a_file_key( const char *dir, const char *name )
 /* copy to another file, without line consisting of "buf..." */
 
   for (;;) {
-    ret = sfs_read_line( key_file, read_buf, SFS_MAX_PATH );
+    ret = sfs_reader_line( &key_file, &read_buf, &len );
     if (ret == -1) {
       sfs_debug( "sfs_delete_a_file_key", "read_line error: %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_delete_a_file_key", "file not found: %s%s/%d.", dir, name );
-        __close( key_file );
+        sfs_reader_close( &key_file );
         __close( tmp_file );
+        unlink( tmpfn );
         return -1;
       }
       else
@@ -670,18 +638,16 @@ sfs_delete_a_file_key( const char *dir, const char *name )
       found = 1;
       continue;
     }
-    len = strlen( read_buf );
     read_buf[len++] = '\n';
-    read_buf[len] = 0;
     if (__write( tmp_file, read_buf, len ) == -1) {
       sfs_debug( "sfs_delete_a_file_key", "write error %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   __close( tmp_file );
   
 //  sfs_debug( "sfs_delete_a_file_key", "done: %s, %s.", keyfn, tmpfn );
@@ -712,8 +678,8 @@ sfs_delete_a_file_key( const char *dir, const char *name )
 off_t
 sfs_read_file_size( const char *dir, const char *name )
 {
-  int key_file;
-  char sfsdir_file[SFS_MAX_PATH], line[SFS_MAX_PATH];
+  sfs_reader key_file;
+  char sfsdir_file[SFS_MAX_PATH], *line;
   sfssizes_line * sfsdir_line;
    
   strncpy( sfsdir_file, dir, SFS_MAX_PATH );
@@ -721,16 +687,15 @@ sfs_read_file_size( const char *dir, const char *name )
   
 //  sfs_debug( "sfs_read_file_size", "sfsdir_file: %s", sfsdir_file );
 
-  key_file = __open( sfsdir_file, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, sfsdir_file ) == -1) {
     sfs_debug( "sfs_read_file_size", "cannot open key file: %s.", sfsdir_file );
     return -1;
   }
 
   for(;;) {  
-    if (sfs_read_line( key_file, line, SFS_MAX_PATH ) == -1) {
+    if (sfs_reader_line( &key_file, &line, NULL ) == -1) {
       sfs_debug( "sfs_read_file_size", "cannot read from key file." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return -1;
     }
     
@@ -738,7 +703,7 @@ sfs_read_file_size( const char *dir, const char *name )
     
     if ((sfsdir_line = sfs_parse_sfssizes_line( line )) == NULL) {
       sfs_debug( "sfs_read_file_size", "cannot found size." );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       return -1;
     }
     
@@ -750,7 +715,7 @@ sfs_read_file_size( const char *dir, const char *name )
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   return sfsdir_line->size;
 }
 
@@ -758,7 +723,7 @@ sfs_read_file_size( const char *dir, const char *name )
 //****************************************************************************
 // sfs_write_file_size()
 // ~~~~~~~~~~~~~~~~~~~~~
-// Stores file size to .sfssizes
+// Stores file size to .sfssizes, the caller deletes the old one first
 // Status: finished
 //****************************************************************************
 int
@@ -767,14 +732,6 @@ sfs_write_file_size( const char *dir, const char *name, off_t size )
   int key_file;
   char buf[SFS_MAX_PATH];
 
-  if (sfs_read_file_size( dir, name ) != -1) {
-    sfs_debug( "sfs_write_file_size", "key already exists" );
-    if (sfs_delete_file_size( dir, name ) == -1) {
-      sfs_debug( "sfs_write_file_size", "deleting error" );
-      return -1;
-    }
-  }
-  
   strncpy( buf, dir, SFS_MAX_PATH );
   strcat( buf, SFS_SIZES_FILE );
   
@@ -808,19 +765,14 @@ sfs_write_file_size( const char *dir, const char *name, off_t size )
 int
 sfs_delete_file_size( const char *dir, const char *name )
 {
-  int key_file, tmp_file, ret, found = 0, len;
-  char keyfn[SFS_MAX_PATH], *tmpfn, buf[SFS_MAX_PATH], read_buf[SFS_MAX_PATH];
+  sfs_reader key_file;
+  int tmp_file, ret, found = 0, len;
+  char keyfn[SFS_MAX_PATH], *tmpfn, buf[SFS_MAX_PATH], *read_buf;
   
-  if (sfs_read_file_size( dir, name ) == -1) {
-    sfs_debug( "sfs_delete_file_size", "key not found" );
-    return -1;
-  }
-
   strncpy( keyfn, dir, SFS_MAX_PATH );
   strcat( keyfn, SFS_SIZES_FILE );
   
-  key_file = __open( keyfn, O_RDONLY );
-  if (key_file == -1) {
+  if (sfs_reader_open( &key_file, keyfn ) == -1) {
     sfs_debug( "sfs_delete_file_size", "cannot open key file: %s.", keyfn );
     return -1;
   }
@@ -838,7 +790,7 @@ sfs_delete_file_size( const char *dir, const char *name )
   tmp_file = __open( tmpfn, O_CREAT|O_EXCL|O_WRONLY, S_IREAD|S_IWRITE );
   if (tmp_file == -1) {
     sfs_debug( "sfs_delete_file_size", "cannot open tmp file: %s.", tmpfn );
-    __close( key_file );
+    sfs_reader_close( &key_file );
     return -1;
   }
   
@@ -847,18 +799,19 @@ sfs_delete_file_size( const char *dir, const char *name )
 /* copy to another file, without line consisting of "buf..." */
 
   for (;;) {
-    ret = sfs_read_line( key_file, read_buf, SFS_MAX_PATH );
+    ret = sfs_reader_line( &key_file, &read_buf, &len );
     if (ret == -1) {
       sfs_debug( "sfs_delete_file_size", "read_line error: %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_delete_file_size", "file not found: %s%s.", dir, name );
-        __close( key_file );
+        sfs_reader_close( &key_file );
         __close( tmp_file );
+        unlink( tmpfn );
         return -1;
       }
       else
@@ -870,18 +823,16 @@ sfs_delete_file_size( const char *dir, const char *name )
       found = 1;
       continue;
     }
-    len = strlen( read_buf );
     read_buf[len++] = '\n';
-    read_buf[len] = 0;
     if (__write( tmp_file, read_buf, len ) == -1) {
       sfs_debug( "sfs_delete_file_size", "write error %d.", errno );
-      __close( key_file );
+      sfs_reader_close( &key_file );
       __close( tmp_file );
       return -1;
     }
   }
 
-  __close( key_file );
+  sfs_reader_close( &key_file );
   __close( tmp_file );
   
 //  sfs_debug( "sfs_delete_file_size", "done: %s, %s.", keyfn, tmpfn );
@@ -1286,46 +1237,42 @@ DE
 char*
 sfs_read_user_public_key( uid_t uid )
 {
-  int passwd, ret;
+  sfs_reader passwd;
+  int ret;
   char *line;
   passwd_line *pl;
+  char *key;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_read_user_public_public_key", "memory error" );
-    return NULL;
-  }
-  
-  passwd = __open( SFS_PASSWD_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_read_text( SFS_PASSWD_FILE, SFS_KEYFILE_PASSWD, uid, 0, NULL, &key ) != SFS_KEYFILE_TEXT)
+    return key;
+
+  if (sfs_reader_open( &passwd, SFS_PASSWD_FILE ) == -1) {
     sfs_debug( "sfs_read_user_public_key", "error opening %s", SFS_PASSWD_FILE );
     return NULL;
   }
 
   for(;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, NULL );
     if (ret == -1) {
       sfs_debug( "sfs_read_user_public_key", "read error" );
-      free( line );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if (!ret) {
       sfs_debug( "sfs_read_user_public_key", "eof" );
-      free( line );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if ((pl = sfs_parse_passwd_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_public_key", "eof???" );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if (pl->uid == uid)
       break;
   }
 
-  __close( passwd );
+  sfs_reader_close( &passwd );
   return pl->user_private_key;
 }
 
@@ -1346,6 +1293,9 @@ sfs_write_user_public_key( uid_t uid, const char *hex_public_key )
   if (sfs_read_user_public_key( uid ))
     sfs_delete_user_public_key( uid );
     
+  if (sfs_keyfile_format( SFS_PASSWD_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( SFS_PASSWD_FILE, SFS_KEYFILE_PASSWD, uid, 0, NULL, hex_public_key );
+
   sprintf( buf, "%d%s%s\n", uid, SFS_DELIMITER, hex_public_key );
   passwd = __open( SFS_PASSWD_FILE, O_CREAT|O_APPEND|O_WRONLY, S_IREAD|S_IWRITE );
   if (passwd == -1) {
@@ -1373,54 +1323,46 @@ sfs_write_user_public_key( uid_t uid, const char *hex_public_key )
 int
 sfs_delete_user_public_key( uid_t uid )
 {
-  int passwd, tempfile, ret, found = 0;
-  char *line, *temppath, buf[SFS_MAX_PATH];
+  sfs_reader passwd;
+  int tempfile, ret, found = 0, len;
+  char *line, *temppath;
   passwd_line *pl;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_delete_user_public_key", "memory error" );
-    return -1;
-  }
-  
-  passwd = __open( SFS_PASSWD_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_format( SFS_PASSWD_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( SFS_PASSWD_FILE, SFS_KEYFILE_PASSWD, uid, 0, NULL );
+
+  if (sfs_reader_open( &passwd, SFS_PASSWD_FILE ) == -1) {
     sfs_debug( "sfs_delete_user_public_key", "error opening %s", SFS_PASSWD_FILE );
-    free( line );
     return -1;
   }
 
   temppath = tempnam(NULL, "sfs");
   if (temppath == NULL) {
     sfs_debug( "sfs_delete_user_public_key", "error getting tempname" );
-    free( line );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return -1;
   }
  
   tempfile = __open( temppath, O_RDWR|O_CREAT|O_EXCL, S_IREAD|S_IWRITE );
-  if (passwd == -1) {
+  if (tempfile == -1) {
     sfs_debug( "sfs_delete_user_public_key", "error opening %s", temppath );
-    __close( passwd );
-    free( line );
+    sfs_reader_close( &passwd );
     return -1;
   }
 
   for(;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, &len );
     if (ret == -1) {
       sfs_debug( "sfs_read_user_public_key", "read error" );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       __close( tempfile );
-      free( line );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_read_user_public_key", "eof" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-        free( line );
         return -1;
       }
       else
@@ -1428,9 +1370,8 @@ sfs_delete_user_public_key( uid_t uid )
     }
     if ((pl = sfs_parse_passwd_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_public_key", "eof???" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-      free( line );
       return -1;
     }
 
@@ -1439,12 +1380,12 @@ sfs_delete_user_public_key( uid_t uid )
       continue;
     }
     else {
-      sprintf( buf, "%s\n", line);
-      __write( tempfile, buf, strlen( buf ) );
+      line[len++] = '\n';
+      __write( tempfile, line, len );
     }
   }
   __close( tempfile );
-  __close( passwd );
+  sfs_reader_close( &passwd );
   ////////////////////////////////////////////////////unlink() ??????
   ret = rename( temppath, SFS_PASSWD_FILE );
   if (ret == -1) {
@@ -1469,47 +1410,42 @@ sfs_delete_user_public_key( uid_t uid )
 char*
 sfs_read_user_private_key( uid_t uid )
 {
-  int passwd, ret;
+  sfs_reader passwd;
+  int ret;
   char *line;
   passwd_line *pl;
+  char *key;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_read_user_private_private_key", "memory error" );
-    return NULL;
-  }
-  
-  passwd = __open( SFS_SHADOW_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_read_text( SFS_SHADOW_FILE, SFS_KEYFILE_SHADOW, uid, 0, NULL, &key ) != SFS_KEYFILE_TEXT)
+    return key;
+
+  if (sfs_reader_open( &passwd, SFS_SHADOW_FILE ) == -1) {
     sfs_debug( "sfs_read_user_private_key", "error openning %s", SFS_SHADOW_FILE );
-    free( line );
     return NULL;
   }
 
   for (;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, NULL );
     if (ret == -1) {
       sfs_debug( "sfs_read_user_private_key", "read error" );
-      __close( passwd );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if (!ret) {
       sfs_debug( "sfs_read_user_private_key", "eof" );
-      __close( passwd );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if ((pl = sfs_parse_passwd_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_private_key", "eof???" );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if (pl->uid == uid)
       break;
   }
 
-  __close( passwd );
+  sfs_reader_close( &passwd );
   return pl->user_private_key;
 }
 
@@ -1530,6 +1466,9 @@ sfs_write_user_private_key( uid_t uid, const char *hex_private_key )
   if (sfs_read_user_private_key( uid ))
     sfs_delete_user_private_key( uid );
 
+  if (sfs_keyfile_format( SFS_SHADOW_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( SFS_SHADOW_FILE, SFS_KEYFILE_SHADOW, uid, 0, NULL, hex_private_key );
+
   sprintf( buf, "%d%s%s\n", uid, SFS_DELIMITER, hex_private_key);
   passwd = __open( SFS_SHADOW_FILE, O_CREAT|O_APPEND|O_WRONLY, S_IREAD|S_IWRITE );
   if (passwd == -1) {
@@ -1557,54 +1496,46 @@ sfs_write_user_private_key( uid_t uid, const char *hex_private_key )
 int
 sfs_delete_user_private_key( uid_t uid )
 {
-  int passwd, tempfile, ret, found = 0;
-  char *line, *temppath, buf[SFS_MAX_PATH];
+  sfs_reader passwd;
+  int tempfile, ret, found = 0, len;
+  char *line, *temppath;
   passwd_line *pl;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_delete_user_private_key", "memory error" );
-    return -1;
-  }
-  
-  passwd = __open( SFS_SHADOW_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_format( SFS_SHADOW_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( SFS_SHADOW_FILE, SFS_KEYFILE_SHADOW, uid, 0, NULL );
+
+  if (sfs_reader_open( &passwd, SFS_SHADOW_FILE ) == -1) {
     sfs_debug( "sfs_delete_user_private_key", "error opening %s", SFS_SHADOW_FILE );
-    free( line );
     return -1;
   }
 
   temppath = tempnam(NULL, "sfs");
   if (temppath == NULL) {
     sfs_debug( "sfs_delete_user_private_key", "error getting tempname" );
-    free( line );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return -1;
   }
  
   tempfile = __open( temppath, O_RDWR|O_CREAT|O_EXCL, S_IREAD|S_IWRITE );
-  if (passwd == -1) {
+  if (tempfile == -1) {
     sfs_debug( "sfs_delete_user_private_key", "error opening %s", temppath );
-    __close( passwd );
-    free( line );
+    sfs_reader_close( &passwd );
     return -1;
   }
 
   for(;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, &len );
     if (ret == -1) {
       sfs_debug( "sfs_read_user_private_key", "read error" );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       __close( tempfile );
-      free( line );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_read_user_private_key", "eof" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-        free( line );
         return -1;
       }
       else
@@ -1612,9 +1543,8 @@ sfs_delete_user_private_key( uid_t uid )
     }
     if ((pl = sfs_parse_passwd_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_private_key", "eof???" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-      free( line );
       return -1;
     }
 
@@ -1623,12 +1553,12 @@ sfs_delete_user_private_key( uid_t uid )
       continue;
     }
     else {
-      sprintf( buf, "%s\n", line);
-      __write( tempfile, buf, strlen( buf ) );
+      line[len++] = '\n';
+      __write( tempfile, line, len );
     }
   }
   __close( tempfile );
-  __close( passwd );
+  sfs_reader_close( &passwd );
   ////////////////////////////////////////////////////unlink() ??????
   ret = rename( temppath, SFS_SHADOW_FILE );
   if (ret == -1) {
@@ -1653,45 +1583,42 @@ sfs_delete_user_private_key( uid_t uid )
 char*
 sfs_read_group_public_key( gid_t gid )
 {
-  int groups, ret;
+  sfs_reader groups;
+  int ret;
   char *line=NULL;
   groups_line *gl=NULL;
+  char *key;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_read_group_public_key", "memory error" );
-    return NULL;
-  }
-  
-  groups = __open( SFS_GROUPS_FILE, O_RDONLY );
-  if (groups == -1) {
+  if (sfs_keyfile_read_text( SFS_GROUPS_FILE, SFS_KEYFILE_GROUPS, gid, 0, NULL, &key ) != SFS_KEYFILE_TEXT)
+    return key;
+
+  if (sfs_reader_open( &groups, SFS_GROUPS_FILE ) == -1) {
     sfs_debug( "sfs_read_group_public_key", "%s open error", SFS_GROUPS_FILE );
-    free( line );
     return NULL;
   }
 
   for (;;) {
-    ret = sfs_read_line( groups, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &groups, &line, NULL );
     if (ret == -1) {
       sfs_debug( "sfs_read_group_public_key", "read error" );
-      free( line );
+      sfs_reader_close( &groups );
       return NULL;
     }
     if (!ret) {
       sfs_debug( "sfs_read_group_public_key", "eof" );
-      free( line );
+      sfs_reader_close( &groups );
       return NULL;
     }
     if ((gl = sfs_parse_groups_line( line )) == NULL ) {
       sfs_debug( "sfs_read_group_public_key", "eof???" );
-      free( line );
+      sfs_reader_close( &groups );
       return NULL;
     }
     if (gl->gid == gid)
       break;
   }
 
-  __close( groups );
+  sfs_reader_close( &groups );
   return gl->group_public_key;
 }
 
@@ -1712,6 +1639,9 @@ sfs_write_group_public_key( gid_t gid, const char *hex_public_key )
   if (sfs_read_group_public_key( gid ))
     sfs_delete_group_public_key( gid );
 
+  if (sfs_keyfile_format( SFS_GROUPS_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( SFS_GROUPS_FILE, SFS_KEYFILE_GROUPS, gid, 0, NULL, hex_public_key );
+
   groups = __open( SFS_GROUPS_FILE, O_APPEND|O_CREAT|O_WRONLY, S_IREAD|S_IWRITE );
   if (groups == -1) {
     sfs_debug( "sfs_write_group_public_key", "%s open error", SFS_GROUPS_FILE );
@@ -1734,54 +1664,46 @@ sfs_write_group_public_key( gid_t gid, const char *hex_public_key )
 int
 sfs_delete_group_public_key( gid_t gid )
 {
-  int passwd, tempfile, ret, found = 0;
-  char *line=NULL, *temppath=NULL, buf[SFS_MAX_PATH];
+  sfs_reader passwd;
+  int tempfile, ret, found = 0, len;
+  char *line=NULL, *temppath=NULL;
   groups_line *pl=NULL;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_delete_group_public_key", "memory error" );
-    return -1;
-  }
-  
-  passwd = __open( SFS_GROUPS_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_format( SFS_GROUPS_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( SFS_GROUPS_FILE, SFS_KEYFILE_GROUPS, gid, 0, NULL );
+
+  if (sfs_reader_open( &passwd, SFS_GROUPS_FILE ) == -1) {
     sfs_debug( "sfs_delete_group_public_key", "error opening %s", SFS_GROUPS_FILE );
-    free( line );
     return -1;
   }
 
   temppath = tempnam(NULL, "sfs");
   if (temppath == NULL) {
     sfs_debug( "sfs_delete_group_public_key", "error getting tempname" );
-    free( line );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return -1;
   }
  
   tempfile = __open( temppath, O_RDWR|O_CREAT|O_EXCL, S_IREAD|S_IWRITE );
-  if (passwd == -1) {
+  if (tempfile == -1) {
     sfs_debug( "sfs_delete_group_public_key", "error opening %s", temppath );
-    __close( passwd );
-    free( line );
+    sfs_reader_close( &passwd );
     return -1;
   }
 
   for(;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, &len );
     if (ret == -1) {
       sfs_debug( "sfs_read_group_public_key", "read error" );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       __close( tempfile );
-      free( line );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_read_group_public_key", "eof" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-        free( line );
         return -1;
       }
       else
@@ -1789,9 +1711,8 @@ sfs_delete_group_public_key( gid_t gid )
     }
     if ((pl = sfs_parse_groups_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_public_key", "eof???" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-      free( line );
       return -1;
     }
 
@@ -1800,12 +1721,12 @@ sfs_delete_group_public_key( gid_t gid )
       continue;
     }
     else {
-      sprintf( buf, "%s\n", line);
-      __write( tempfile, buf, strlen( buf ) );
+      line[len++] = '\n';
+      __write( tempfile, line, len );
     }
   }
   __close( tempfile );
-  __close( passwd );
+  sfs_reader_close( &passwd );
   ////////////////////////////////////////////////////unlink() ??????
   ret = rename( temppath, SFS_GROUPS_FILE );
   if (ret == -1) {
@@ -1832,48 +1753,42 @@ sfs_delete_group_public_key( gid_t gid )
 char*
 sfs_read_group_private_key( gid_t gid, uid_t uid )
 {
-  int groups, ret;
+  sfs_reader groups;
+  int ret;
   char *line=NULL;
   gshadow_line *gl=NULL;
+  char *key;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_read_group_private_key", "memory error" );
-    return NULL;
-  }
-  
-  groups = __open( SFS_GSHADOW_FILE, O_RDONLY );
-  if (groups == -1) {
+  if (sfs_keyfile_read_text( SFS_GSHADOW_FILE, SFS_KEYFILE_GSHADOW, gid, uid, NULL, &key ) != SFS_KEYFILE_TEXT)
+    return key;
+
+  if (sfs_reader_open( &groups, SFS_GSHADOW_FILE ) == -1) {
     sfs_debug( "sfs_read_group_private_key", "error openning %s", SFS_GSHADOW_FILE );
-    free( line );
     return NULL;
   }
 
   for (;;) {
-    ret = sfs_read_line( groups, line, SFS_MAX_PATH );
+    ret = sfs_reader_line( &groups, &line, NULL );
     if (ret == -1) {
       sfs_debug( "sfs_read_group_private_key", "read error" );
-      free( line );
-      __close( groups );
+      sfs_reader_close( &groups );
       return NULL;
     }
     if (!ret) {
       sfs_debug( "sfs_read_group_private_key", "eof" );
-      free( line );
-      __close( groups );
+      sfs_reader_close( &groups );
       return NULL;
     }
     if ((gl = sfs_parse_gshadow_line( line )) == NULL ) {
       sfs_debug( "sfs_read_group_private_key", "eof???: %s", line );
-      free( line );
-      __close( groups );
+      sfs_reader_close( &groups );
       return NULL;
     }
     if ((gl->gid == gid) && (gl->uid == uid ))
       break;
   }
 
-  __close( groups );
+  sfs_reader_close( &groups );
   return gl->group_private_key;
 }
 
@@ -1897,6 +1812,9 @@ DE
     sfs_delete_group_private_key( gid, uid );
 
 DE
+  if (sfs_keyfile_format( SFS_GSHADOW_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( SFS_GSHADOW_FILE, SFS_KEYFILE_GSHADOW, gid, uid, NULL, hex_private_key );
+
   groups = __open( SFS_GSHADOW_FILE, O_APPEND|O_CREAT|O_RDWR, S_IREAD|S_IWRITE );
   if (groups == -1) {
     sfs_debug( "sfs_write_group_private_key", "error openning %s", SFS_GSHADOW_FILE );
@@ -1928,54 +1846,46 @@ DE
 int
 sfs_delete_group_private_key( gid_t gid, uid_t uid )
 {
-  int passwd, tempfile, ret, found = 0;
-  char *line=NULL, *temppath=NULL, buf[SFS_MAX_PATH];
+  sfs_reader passwd;
+  int tempfile, ret, found = 0, len;
+  char *line=NULL, *temppath=NULL;
   gshadow_line *pl=NULL;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_delete_group_private_key", "memory error" );
-    return -1;
-  }
-  
-  passwd = __open( SFS_GSHADOW_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_format( SFS_GSHADOW_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( SFS_GSHADOW_FILE, SFS_KEYFILE_GSHADOW, gid, uid, NULL );
+
+  if (sfs_reader_open( &passwd, SFS_GSHADOW_FILE ) == -1) {
     sfs_debug( "sfs_delete_group_private_key", "error opening %s", SFS_GSHADOW_FILE );
-    free( line );
     return -1;
   }
 
   temppath = tempnam(NULL, "sfs");
   if (temppath == NULL) {
     sfs_debug( "sfs_delete_group_private_key", "error getting tempname" );
-    free( line );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return -1;
   }
  
   tempfile = __open( temppath, O_RDWR|O_CREAT|O_EXCL, S_IREAD|S_IWRITE );
-  if (passwd == -1) {
+  if (tempfile == -1) {
     sfs_debug( "sfs_delete_group_private_key", "error opening %s", temppath );
-    __close( passwd );
-    free( line );
+    sfs_reader_close( &passwd );
     return -1;
   }
 
   for(;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, &len );
     if (ret == -1) {
       sfs_debug( "sfs_read_group_private_key", "read error" );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       __close( tempfile );
-      free( line );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_read_group_private_key", "eof" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-        free( line );
         return -1;
       }
       else
@@ -1983,9 +1893,8 @@ sfs_delete_group_private_key( gid_t gid, uid_t uid )
     }
     if ((pl = sfs_parse_gshadow_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_private_key", "eof???" );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         __close( tempfile );
-      free( line );
       return -1;
     }
 
@@ -1994,12 +1903,12 @@ sfs_delete_group_private_key( gid_t gid, uid_t uid )
       continue;
     }
     else {
-      sprintf( buf, "%s\n", line);
-      __write( tempfile, buf, strlen( buf ) );
+      line[len++] = '\n';
+      __write( tempfile, line, len );
     }
   }
   __close( tempfile );
-  __close( passwd );
+  sfs_reader_close( &passwd );
   ////////////////////////////////////////////////////unlink() ??????
   ret = rename( temppath, SFS_GSHADOW_FILE );
   if (ret == -1) {
@@ -2024,30 +1933,26 @@ sfs_delete_group_private_key( gid_t gid, uid_t uid )
 char*
 sfs_read_all_public_key()
 {
-  int passwd;
+  sfs_reader passwd;
   char *line=NULL;
+  char *key;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_read_all_public_public_key", "memory error" );
-    return NULL;
-  }
-  
-  passwd = __open( SFS_ALL_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_read_text( SFS_ALL_FILE, SFS_KEYFILE_ALL, 0, 0, NULL, &key ) != SFS_KEYFILE_TEXT)
+    return key;
+
+  if (sfs_reader_open( &passwd, SFS_ALL_FILE ) == -1) {
     sfs_debug( "sfs_read_all_public_key", "error openning %s", SFS_ALL_FILE );
-    free( line );
     return NULL;
   }
 
-  if (sfs_read_line( passwd, line, SFS_MAX_PATH ) == -1) {
+  if (sfs_reader_line( &passwd, &line, NULL ) == -1) {
     sfs_debug( "sfs_read_all_public_key", "read error" );
-    free( line );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return NULL;
   }
 
-  __close( passwd );
+  line = strdup( line );
+  sfs_reader_close( &passwd );
   return line;
 }
 
@@ -2064,6 +1969,9 @@ sfs_write_all_public_key( const char *hex_public_key )
   int passwd, ret;
   char buf[SFS_MAX_PATH+200];
 
+  if (sfs_keyfile_format( SFS_ALL_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( SFS_ALL_FILE, SFS_KEYFILE_ALL, 0, 0, NULL, hex_public_key );
+
   passwd = __open( SFS_ALL_FILE, O_TRUNC|O_CREAT|O_RDWR, S_IREAD|S_IWRITE );
   if (passwd == -1) {
     sfs_debug( "sfs_write_all_public_key", "error openning %s", SFS_ALL_FILE );
@@ -2104,47 +2012,42 @@ sfs_delete_all_public_key()
 char*
 sfs_read_all_private_key( uid_t uid )
 {
-  int passwd, ret;
+  sfs_reader passwd;
+  int ret;
   char *line=NULL;
   passwd_line *pl=NULL;
+  char *key;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_read_all_private_private_key", "memory error" );
-    return NULL;
-  }
-  
-  passwd = __open( SFS_ASHADOW_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_read_text( SFS_ASHADOW_FILE, SFS_KEYFILE_ASHADOW, uid, 0, NULL, &key ) != SFS_KEYFILE_TEXT)
+    return key;
+
+  if (sfs_reader_open( &passwd, SFS_ASHADOW_FILE ) == -1) {
     sfs_debug( "sfs_read_all_private_key", "error openning %s", SFS_ASHADOW_FILE );
     return NULL;
   }
 
   for(;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, NULL );
     if (ret == -1) {
       sfs_debug( "sfs_read_all_private_key", "read error" );
-      __close( passwd );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if (!ret) {
       sfs_debug( "sfs_read_all_private_key", "eof" );
-      __close( passwd );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if ((pl = sfs_parse_passwd_line( line )) == NULL ) {
       sfs_debug( "sfs_read_passwd_private_key", "eof???" );
-      __close( passwd );
-      free( line );
+      sfs_reader_close( &passwd );
       return NULL;
     }
     if (pl->uid == uid)
       break;
   }
 
-  __close( passwd );
+  sfs_reader_close( &passwd );
   return pl->user_private_key;
 }
 
@@ -2165,6 +2068,9 @@ sfs_write_all_private_key( uid_t uid, const char *hex_private_key )
   if (sfs_read_all_private_key( uid ))
     sfs_delete_all_private_key( uid );
 
+  if (sfs_keyfile_format( SFS_ASHADOW_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_write_text( SFS_ASHADOW_FILE, SFS_KEYFILE_ASHADOW, uid, 0, NULL, hex_private_key );
+
   sprintf( buf, "%d%s%s\n", uid, SFS_DELIMITER, hex_private_key );
   passwd = __open( SFS_ASHADOW_FILE, O_APPEND|O_CREAT|O_WRONLY, S_IREAD|S_IWRITE );
   if (passwd == -1) {
@@ -2187,18 +2093,15 @@ sfs_write_all_private_key( uid_t uid, const char *hex_private_key )
 int
 sfs_delete_all_private_key( uid_t uid )
 {
-  int passwd, tempfile, ret, found = 0;
-  char *line=NULL, *temppath=NULL, buf[SFS_MAX_PATH];
+  sfs_reader passwd;
+  int tempfile, ret, found = 0, len;
+  char *line=NULL, *temppath=NULL;
   passwd_line *pl=NULL;
 
-  line = (char*) malloc( SFS_MAX_PATH );
-  if (!line) {
-    sfs_debug( "sfs_delete_all_private_private_key", "memory error" );
-    return -1;
-  }
-  
-  passwd = __open( SFS_ASHADOW_FILE, O_RDONLY );
-  if (passwd == -1) {
+  if (sfs_keyfile_format( SFS_ASHADOW_FILE ) == SFS_KEYFILE_BINARY)
+    return sfs_keyfile_delete( SFS_ASHADOW_FILE, SFS_KEYFILE_ASHADOW, uid, 0, NULL );
+
+  if (sfs_reader_open( &passwd, SFS_ASHADOW_FILE ) == -1) {
     sfs_debug( "sfs_delete_all_private_key", "error openning %s", SFS_ASHADOW_FILE );
     return -1;
   }
@@ -2206,32 +2109,30 @@ sfs_delete_all_private_key( uid_t uid )
   temppath = tempnam( NULL, "sfs" );
   if (temppath == NULL) {
     sfs_debug( "sfs_delete_all_private_key", "error getting tempname" );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return -1;
   }
  
   tempfile = __open( temppath, O_RDWR|O_CREAT|O_EXCL, S_IREAD|S_IWRITE );
-  if (passwd == -1) {
+  if (tempfile == -1) {
     sfs_debug( "sfs_delete_all_private_key", "error openning %s", temppath );
-    __close( passwd );
+    sfs_reader_close( &passwd );
     return -1;
   }
 
   for (;;) {
-    ret = sfs_read_line( passwd, line ,SFS_MAX_PATH );
+    ret = sfs_reader_line( &passwd, &line, &len );
     if (ret == -1) {
       sfs_debug( "sfs_delete_all_private_key", "read error" );
-      free( line );
       __close( tempfile );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       return -1;
     }
     if (!ret) {
       if (!found) {
         sfs_debug( "sfs_delete_all_private_key", "eof" );
-        free( line );
         __close( tempfile );
-        __close( passwd );
+        sfs_reader_close( &passwd );
         return -1;
       }
       else
@@ -2239,9 +2140,8 @@ sfs_delete_all_private_key( uid_t uid )
     }
     if ((pl = sfs_parse_passwd_line( line )) == NULL ) {
       sfs_debug( "sfs_delete_passwd_private_key", "eof???" );
-      free( line );
       __close( tempfile );
-      __close( passwd );
+      sfs_reader_close( &passwd );
       return -1;
     }
 
@@ -2250,14 +2150,13 @@ sfs_delete_all_private_key( uid_t uid )
       continue;
     }
     else {
-      sprintf( buf, "%s\n", line );
-      __write( tempfile, buf, strlen( buf ) );
+      line[len++] = '\n';
+      __write( tempfile, line, len );
     }
   }
 
   __close( tempfile );
-  __close( passwd );
-  free( line );
+  sfs_reader_close( &passwd );
   ////////////////////////////////////////////////unlink() ???
   ret = rename( temppath, SFS_ASHADOW_FILE );
   if (ret == -1) {
@@ -2274,39 +2173,100 @@ sfs_delete_all_private_key( uid_t uid )
 //****************************************************************************
 
 //****************************************************************************
-// sfs_read_line()
-// ~~~~~~~~~~~~~~~
-// Reads a single line from file - without \n
+// sfs_reader_open()
+// ~~~~~~~~~~~~~~~~~
+// Opens file for reading by lines, SFS_READER_SIZE bytes per read
+// Status: finished
+//****************************************************************************
+int
+sfs_reader_open( sfs_reader *r, const char *path )
+{
+  r->start = r->end = r->eof = 0;
+  r->buf = (char*) malloc( SFS_READER_SIZE + 1 );
+  if (!r->buf) {
+    sfs_debug( "sfs_reader_open", "memory error" );
+    r->fd = -1;
+    return -1;
+  }
+  r->fd = __open( path, O_RDONLY );
+  if (r->fd == -1) {
+    free( r->buf );
+    r->buf = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+//****************************************************************************
+// sfs_reader_close()
+// ~~~~~~~~~~~~~~~~~~
+// Closes file opened by sfs_reader_open(), lines read are gone then
+// Status: finished
+//****************************************************************************
+void
+sfs_reader_close( sfs_reader *r )
+{
+  if (r->fd != -1)
+    __close( r->fd );
+  free( r->buf );
+  r->buf = NULL;
+  r->fd = -1;
+}
+
+
+//****************************************************************************
+// sfs_reader_line()
+// ~~~~~~~~~~~~~~~~~
+// Gets next line - without \n - in place in the buffer of reader, it is
+// valid until the next call.  There is one spare byte after the line, so
+// line[len] = '\n' may be used to write it back.  Returns 1, 0 at the end
+// of file (line is empty then) or -1.
 // Status: finished
 //****************************************************************************
 int
-sfs_read_line( int file, char *buf, int max )
+sfs_reader_line( sfs_reader *r, char **line, int *len )
 {
-  int i = 0;
-  char b;
+  char *nl;
   ssize_t ret;
-  
-  while (i < (max-1)) {
-    if ((ret = __read( file, &b, 1)) == -1) {
-      sfs_debug( "sfs_read_line", "read error" );
-      return -1;
-    }
-    if (b == '\n') {
-      buf[i++] = 0;
-      return i;
-    }
-    else
-      buf[i++] = b;
-    if (!ret) {
-      buf[--i] = 0;
+  int l;
+
+  for (;;) {
+    nl = (char*) memchr( r->buf + r->start, '\n', r->end - r->start );
+    if (nl || r->eof || (!r->start && (r->end == SFS_READER_SIZE)))
       break;
+    if (r->start) {
+      memmove( r->buf, r->buf + r->start, r->end - r->start );
+      r->end -= r->start;
+      r->start = 0;
     }
+    ret = __read( r->fd, r->buf + r->end, SFS_READER_SIZE - r->end );
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      sfs_debug( "sfs_reader_line", "read error" );
+      return -1;
+    }
+    if (!ret)
+      r->eof = 1;
+    r->end += ret;
+  }
+
+  *line = r->buf + r->start;
+  if (nl) {
+    l = nl - *line;
+    r->start += l + 1;
   }
-  if (i == (max-1)) {
-    sfs_debug( "sfs_read_line", "maximum reached" );
-    buf[i++] = 0;
+  else {
+    l = r->end - r->start;
+    r->start = r->end;
+    if (!r->eof)
+      sfs_debug( "sfs_reader_line", "maximum reached" );
   }
-  return i;
+  (*line)[l] = 0;
+  if (len)
+    *len = l;
+  return (nl || l) ? 1 : 0;
 }
 
 
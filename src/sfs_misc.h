@@ -73,6 +73,16 @@ typedef struct gshadow_line {
 } gshadow_line;
 
 
+  // File read by lines, see sfs_reader_line()
+#define SFS_READER_SIZE		65536
+typedef struct sfs_reader {
+  int fd;
+  char *buf;
+  int start, end;
+  int eof;
+} sfs_reader;
+
+
 /*
  * Functions parsing different config files
  *
@@ -100,8 +110,12 @@ gshadow_line * sfs_parse_gshadow_line(char * line);
 passwd_line * sfs_parse_passwd_line(char * line);
 
 
-  // Reads in a line from file
-int sfs_read_line( int file, char *buf, int max );
+  // Opens file for reading by lines
+int  sfs_reader_open( sfs_reader *r, const char *path );
+  // Gets next line in place, returns 1, 0 at the end or -1
+int  sfs_reader_line( sfs_reader *r, char **line, int *len );
+  // Closes file read by lines
+void sfs_reader_close( sfs_reader *r );
 
   // Makes a temporary file name
 char *sfs_tempname( const char *dir );
@@ -120,7 +134,8 @@ char *hex2bit(char *hex_string, int array_length);
   // from sfsdir decrypts the symetric file key
 char *sfs_read_file_key(const char *dir, const char *name, uid_t uid);
 
-  // to sfsdir writes the symetric file key - encrypted
+  // to sfsdir writes the symetric file key - encrypted,
+  // the caller checks that there is none yet
 int   sfs_write_file_key(const char *dir, const char *name, uid_t uid, const char *key);
 
   // from sfsdir deletes the symetric file key for specified user 
@@ -135,7 +150,8 @@ int   sfs_delete_file_key(const char *dir, const char *name, uid_t uid);
   // from sfsgdir decrypts the symetric file key
 char *sfs_read_g_file_key(const char *dir, const char *name, gid_t gid);
 
-  // to sfsgdir writes the symetric file key - encrypted
+  // to sfsgdir writes the symetric file key - encrypted,
+  // the caller checks that there is none yet
 int sfs_write_g_file_key(const char *dir, const char *name, gid_t gid, const char *key);
 
   // from sfsgdir deletes the symetric file key for specified group
@@ -150,7 +166,8 @@ int   sfs_delete_g_file_key(const char *dir, const char *name, gid_t gid);
   // from sfsadir decrypts the symetric file key
 char *sfs_read_a_file_key(const char *dir, const char *name );
 
-  // to sfsadir writes the symetric file key - encrypted
+  // to sfsadir writes the symetric file key - encrypted,
+  // the caller checks that there is none yet
 int   sfs_write_a_file_key(const char *dir, const char *name, const char *key);
 
   // from sfsadir deletes the symetric file key for all 
@@ -165,7 +182,7 @@ int   sfs_delete_a_file_key(const char *dir, const char *name );
   // from sfssizes reads the file size
 off_t sfs_read_file_size( const char *dir, const char *name );
 
-  // to sfsdir writes the symetric file key - encrypted
+  // to sfssizes appends the file size, the caller deletes the old one
 int   sfs_write_file_size( const char *dir, const char *name, const off_t size );
 
   // from sfsdir deletes the symetric file key for specified user 
@@ -26,7 +26,8 @@ int
 sfs_passwd( void )
 {
   char *old_pass, *new_pass;
-  char *dkey_bin, *ekey, *ekey_bin;
+  char *ekey, *ekey_bin;
+  bf_key_schedule ks;
   uid_t uid;
   int len;
 
@@ -52,18 +53,16 @@ sfs_passwd( void )
   }
   len = strlen( ekey )/2;
   ekey_bin = hex2bit( ekey, 0 );
-  dkey_bin = sfs_sym_decrypt( old_pass, ekey_bin, len );
-  if(dkey_bin == NULL)
-  {
-    sfs_debug("sfs_passwd","error decrypting user private key");
-    return 1;
-  }
-  ekey_bin = sfs_sym_encrypt( new_pass, dkey_bin, &len );
   if(ekey_bin == NULL)
   {
-    sfs_debug("sfs_passwd","error reencrypting user private key");
+    sfs_debug("sfs_passwd","error decrypting user private key");
     return 1;
   }
+  // reencrypted in place, hex2bit() leaves room for the padding
+  sfs_sym_set_key( old_pass, &ks );
+  sfs_sym_decrypt_blocks( &ks, (bf_block *)ekey_bin, len );
+  sfs_sym_set_key( new_pass, &ks );
+  len = sfs_sym_encrypt_blocks( &ks, (bf_block *)ekey_bin, len );
   ekey = bit2hex( ekey_bin, len );
   if(ekey == NULL)
   {
@@ -23,51 +23,104 @@
 #include "sfs.h"
 #include "sfs_debug.h"
 #include "sfs_secure.h"
+#include "sfs_hex.h"
+#include "sfs_cipher.h"
 
 
 // *********************************************************************** 
-// sfs_sym_encrypt()
+// sfs_sym_set_key()
 // ~~~~~~~~~~~~~~~~~
-// Produces block of data rounded up to next multiple of BF_BLOCK_SIZE 
+// Makes blowfish key schedule for the functions working on blocks below
 // *********************************************************************** 
-char*
-sfs_sym_encrypt( char* sym_key, char *what, int *length_what )
+void
+sfs_sym_set_key( char *sym_key, bf_key_schedule *ks )
 {
-  char *temp = (char*)malloc((((*length_what)/BF_BLOCK_SIZE)+1)*BF_BLOCK_SIZE);
-  bf_block block;   
-  bf_key_schedule ks;
-  int i = 0, k = 0;
+  bf_set_key((unsigned char *)sym_key, strlen(sym_key), ks);
+}
 
-  // prepare key
-  bf_set_key((unsigned char *)sym_key, strlen(sym_key), &ks);
-  
-  while(i < ((*length_what)-BF_BLOCK_SIZE+1)){
 
-    for(k=0;k<BF_BLOCK_SIZE;k++)
-      ((unsigned char*)&block)[k] = what[i+k];
+// *********************************************************************** 
+// sfs_sym_encrypt_blocks()
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Encrypts length bytes of blocks in place, last block is padded by zeros
+// so blocks must have room for it. Returns length rounded up to next
+// multiple of BF_BLOCK_SIZE
+// *********************************************************************** 
+int
+sfs_sym_encrypt_blocks( bf_key_schedule *ks, bf_block *blocks, int length )
+{
+  int n, tail;
 
-    bf_ecb_encrypt(&block, &block, &ks, 1);
+  n = (length + BF_BLOCK_SIZE - 1) / BF_BLOCK_SIZE;
+  tail = length % BF_BLOCK_SIZE;
+  if (tail)
+    memset((char *)blocks + length, 0, BF_BLOCK_SIZE - tail);
+  bf_ecb_encrypt_blocks(blocks, blocks, n, ks, 1);
 
-    for(k=0;k<BF_BLOCK_SIZE;k++)
-      temp[i+k] = ((unsigned char*)&block)[k];
+  return n*BF_BLOCK_SIZE;
+}
 
-    i += BF_BLOCK_SIZE;
-  }
 
-  if(i<(*length_what))
-  {
-    for(k=0;k+i<(*length_what);k++)
-      ((unsigned char*)&block)[k] = what[i+k];
-    for(;k<BF_BLOCK_SIZE;k++)
-      ((unsigned char*)&block)[k] = 0;
+// *********************************************************************** 
+// sfs_sym_decrypt_blocks()
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypts whole blocks of length bytes in place, the rest is left as it
+// is. Returns length
+// *********************************************************************** 
+int
+sfs_sym_decrypt_blocks( bf_key_schedule *ks, bf_block *blocks, int length )
+{
+  bf_ecb_encrypt_blocks(blocks, blocks, length / BF_BLOCK_SIZE, ks, 0);
 
-    bf_ecb_encrypt(&block, &block, &ks, 1);
+  return length;
+}
 
-    for(k=0;k<BF_BLOCK_SIZE;k++)
-      temp[i+k] = ((unsigned char*)&block)[k];
-  }
 
-  *length_what = i+k;
+// *********************************************************************** 
+// sfs_sym_encrypt_to()
+// ~~~~~~~~~~~~~~~~~~~~
+// Encrypts length bytes of what to caller's blocks, see
+// sfs_sym_encrypt_blocks()
+// *********************************************************************** 
+int
+sfs_sym_encrypt_to( bf_key_schedule *ks, const char *what, int length, bf_block *out )
+{
+  memcpy(out, what, length);
+  return sfs_sym_encrypt_blocks(ks, out, length);
+}
+
+
+// *********************************************************************** 
+// sfs_sym_decrypt_to()
+// ~~~~~~~~~~~~~~~~~~~~
+// Decrypts length bytes of what to caller's blocks, see
+// sfs_sym_decrypt_blocks()
+// *********************************************************************** 
+int
+sfs_sym_decrypt_to( bf_key_schedule *ks, const char *what, int length, bf_block *out )
+{
+  memcpy(out, what, length);
+  return sfs_sym_decrypt_blocks(ks, out, length);
+}
+
+
+// *********************************************************************** 
+// sfs_sym_encrypt()
+// ~~~~~~~~~~~~~~~~~
+// Produces block of data rounded up to next multiple of BF_BLOCK_SIZE 
+// *********************************************************************** 
+char*
+sfs_sym_encrypt( char* sym_key, char *what, int *length_what )
+{
+  char *temp = (char*)malloc((((*length_what)/BF_BLOCK_SIZE)+1)*BF_BLOCK_SIZE);
+  bf_key_schedule ks;
+
+  if (!temp)
+    return NULL;
+
+  // temp comes from malloc so it is aligned
+  sfs_sym_set_key(sym_key, &ks);
+  *length_what = sfs_sym_encrypt_to(&ks, what, *length_what, (bf_block*)temp);
   
   return temp;
 }
@@ -82,26 +135,14 @@ sfs_sym_encrypt( char* sym_key, char *what, int *length_what )
 char*
 sfs_sym_decrypt( char *sym_key, char *what, int length_what )
 {
-  int i = 0, k = 0;
   char * temp = (char *)malloc(length_what);
-  bf_block block;   
   bf_key_schedule ks;
 
-  // prepare key
-  bf_set_key((unsigned char *)sym_key, strlen(sym_key), &ks);
-  
-  while(i <= length_what-BF_BLOCK_SIZE){
-    
-    for(k=0;k<BF_BLOCK_SIZE;k++)
-      ((unsigned char*)&block)[k] = what[i+k];
-
-    bf_ecb_encrypt(&block, &block, &ks, 0);
-
-    for(k=0;k<BF_BLOCK_SIZE;k++)
-      temp[i+k] = ((unsigned char*)&block)[k];
+  if (!temp)
+    return NULL;
 
-    i += BF_BLOCK_SIZE;
-  }
+  sfs_sym_set_key(sym_key, &ks);
+  sfs_sym_decrypt_to(&ks, what, length_what, (bf_block*)temp);
 
   // length_what = i;
   
@@ -109,6 +150,41 @@ sfs_sym_decrypt( char *sym_key, char *what, int length_what )
 }
 
 
+// *********************************************************************** 
+// sfs_random_bytes()
+// ~~~~~~~~~~~~~~~~~~
+// Fills buf with len random bytes, from /dev/urandom if it is there
+// *********************************************************************** 
+int
+sfs_random_bytes( unsigned char *buf, int len )
+{
+  static int init = 0;
+  int fd, i, n = 0;
+
+  fd = __open( "/dev/urandom", O_RDONLY );
+  if (fd != -1) {
+    while (n < len) {
+      i = __read( fd, buf + n, len - n );
+      if (i <= 0)
+        break;
+      n += i;
+    }
+    __close( fd );
+    if (n == len)
+      return 0;
+  }
+
+  sfs_debug( "sfs_random_bytes", "no /dev/urandom, using rand()" );
+  if (!init) {
+    srand(time(0) ^ getpid());
+    init = 1;
+  }
+  for (i=0;i<len;i++)
+    buf[i] = (unsigned char)rand();
+  return 0;
+}
+
+
 // *********************************************************************** 
 // sfs_sym_generate_key()
 // ~~~~~~~~~~~~~~~~~~~~~~
@@ -117,26 +193,93 @@ sfs_sym_decrypt( char *sym_key, char *what, int length_what )
 char*
 sfs_sym_generate_key( int size )
 {
-  int i=0;
-  static init = 0;
   char *array_key, *sym_key;
-  sym_key = (char*)malloc(size*2+1);
   array_key = (char *)malloc(size);
-  if(!init)
-  {
-    srand(time(0));
-    init = 1;
-  }
-  while (i<size) {
-    array_key[i] = (char)rand();
-    i++;
-  }
+  if (!array_key)
+    return NULL;
+  sfs_random_bytes( (unsigned char *)array_key, size );
   sym_key = bit2hex(array_key, size);
+  memset(array_key, 0, size);
   free(array_key);
   return sym_key; 
 }
 
 
+// *********************************************************************** 
+// sfs_sym_generate_nonce()
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Fills nonce with SFS_NONCE_SIZE random bytes, from /dev/urandom if it
+// is there
+// *********************************************************************** 
+int
+sfs_sym_generate_nonce( unsigned char *nonce )
+{
+  return sfs_random_bytes( nonce, SFS_NONCE_SIZE );
+}
+
+
+// *********************************************************************** 
+// sfs_sym_make_blob()
+// ~~~~~~~~~~~~~~~~~~~
+// Makes a key record for .sfsdir.  ECB records are the wrapped key alone,
+// the others are <engine name>-<nonce>-<wrapped key>
+// *********************************************************************** 
+char*
+sfs_sym_make_blob( int engine, const unsigned char *nonce, const char *ekey )
+{
+  const char *name;
+  char *blob, nonce_hex[2*SFS_NONCE_SIZE+1];
+  int len;
+
+  if (engine == SFS_ENGINE_BFECB)
+    return strdup( ekey );
+  if ((engine < 0) || (engine >= SFS_ENGINES))
+    return NULL;
+  name = sfs_cipher_engines[engine].name;
+
+  sfs_bit2hex_to( nonce, SFS_NONCE_SIZE, nonce_hex );
+
+  len = strlen( name ) + strlen( nonce_hex ) + strlen( ekey ) + 3;
+  blob = (char *)malloc( len );
+  if (blob)
+    sprintf( blob, "%s-%s-%s", name, nonce_hex, ekey );
+  return blob;
+}
+
+
+// *********************************************************************** 
+// sfs_sym_parse_blob()
+// ~~~~~~~~~~~~~~~~~~~~
+// Finds out the engine and nonce from a key record made by
+// sfs_sym_make_blob(), returns pointer to the wrapped key inside the
+// record or NULL if the record is broken or the engine unknown
+// *********************************************************************** 
+char*
+sfs_sym_parse_blob( char *blob, int *engine, unsigned char *nonce )
+{
+  char *tag_end;
+
+  // Hex keys have no dash, such records are ECB
+  tag_end = strchr( blob, '-' );
+  if (!tag_end) {
+    *engine = SFS_ENGINE_BFECB;
+    memset( nonce, 0, SFS_NONCE_SIZE );
+    return blob;
+  }
+
+  *tag_end = 0;
+  *engine = sfs_cipher_find( blob );
+  *tag_end++ = '-';
+  if ((*engine == -1) || (*engine == SFS_ENGINE_BFECB))
+    return NULL;
+
+  if ((strlen( tag_end ) <= 2*SFS_NONCE_SIZE) || (tag_end[2*SFS_NONCE_SIZE] != '-'))
+    return NULL;
+  sfs_hex2bit_to( tag_end, 2*SFS_NONCE_SIZE, nonce );
+  return tag_end + 2*SFS_NONCE_SIZE + 1;
+}
+
+
 // *********************************************************************** 
 // sfs_asym_encrypt()
 // ~~~~~~~~~~~~~~~~~~
@@ -247,16 +390,15 @@ void
 sfs_asym_generate_key( rsa_key * pub_key, rsa_key * priv_key )
 {
   int i = 0,size = 0;
-  float real;
-  static int init =0;
-  if(!init)
-  {
-    srand(time(0));
-    init = 1;
-  }
-  real = rand();
-  real /= RAND_MAX; 
-  size = 80 + real*20; 
+  unsigned char r;
+
+  // 80 to 100 bit primes for 256 bit numbers, the modulus has to stay
+  // above RSA_EF_BLOCK_SIZE bytes and below RSA_BLOCK_SIZE
+  sfs_random_bytes( &r, 1 );
+  size = (80 + (r % 21)) * (NSIZE * UNIT_BITS) / 256; 
+  // randomize() expects strong random bits in p and q
+  sfs_random_bytes( (unsigned char *)pub_key->p, sizeof(NN) );
+  sfs_random_bytes( (unsigned char *)pub_key->q, sizeof(NN) );
   randomize(pub_key->p,size); 
   randomize(pub_key->q,size); 
  
@@ -300,25 +442,20 @@ sfs_asym_generate_key( rsa_key * pub_key, rsa_key * priv_key )
 rsa_key*
 sfs_asym_parse_key( char * key_string )
 {
-  uint i = 0;
-  char * bit_key = NULL;
-  rsa_key * temp_key = (rsa_key *)malloc(sizeof(rsa_key));
+  rsa_key * temp_key;
   
   uint len = strlen(key_string);
   if((len/2) < sizeof(rsa_key))
   {
-    free(temp_key);
-    sfs_debug("sfs_asym_parse_key","hex key too short to fill rsa_key.");
+    sfs_debug("sfs_asym_parse_key","hex key too short to fill rsa_key (NSIZE %d).", NSIZE);
     return NULL;
   }
 
-  bit_key = hex2bit(key_string,len);
-  len = len / 2;
-
-  for(i=0;i<sizeof(rsa_key);i++)
-    ((char *)temp_key)[i] = bit_key[i];
-
-  free(bit_key);
+  temp_key = (rsa_key *)malloc(sizeof(rsa_key));
+  if (!temp_key)
+    return NULL;
+  // decoded straight into the key
+  sfs_hex2bit_to( key_string, 2*sizeof(rsa_key), (uchar *)temp_key );
   return temp_key;
 
 }
@@ -31,12 +31,30 @@
  *
  */
 
+  // Makes blowfish key schedule of symetric key
+void  sfs_sym_set_key( char *sym_key, bf_key_schedule *ks );
+  // Encrypts data in place using blowfish, returns padded length
+int   sfs_sym_encrypt_blocks( bf_key_schedule *ks, bf_block *blocks, int length );
+  // Decrypts data in place using blowfish
+int   sfs_sym_decrypt_blocks( bf_key_schedule *ks, bf_block *blocks, int length );
+  // Encrypts data to caller's buffer using blowfish, returns padded length
+int   sfs_sym_encrypt_to( bf_key_schedule *ks, const char *what, int length, bf_block *out );
+  // Decrypts data to caller's buffer using blowfish
+int   sfs_sym_decrypt_to( bf_key_schedule *ks, const char *what, int length, bf_block *out );
   // Encrypts data using blowfish
 char *sfs_sym_encrypt(char* sym_key, char*what, int *length_what);
   // Decrypts data using blowfish
 char *sfs_sym_decrypt(char* sym_key, char*what, int length_what);
+  // Fills buffer with random bytes, from /dev/urandom if it is there
+int   sfs_random_bytes( unsigned char *buf, int len );
   // Generates symetric key of specified length
 char *sfs_sym_generate_key( int length );
+  // Generates random nonce of SFS_NONCE_SIZE bytes for CTR mode
+int   sfs_sym_generate_nonce( unsigned char *nonce );
+  // Makes a key record for .sfsdir from wrapped file key
+char *sfs_sym_make_blob( int engine, const unsigned char *nonce, const char *ekey );
+  // Splits key record from .sfsdir, returns the wrapped file key in it
+char *sfs_sym_parse_blob( char *blob, int *engine, unsigned char *nonce );
 
   // Encrypts data using RSA
 char *sfs_asym_encrypt(rsa_key * pub_key, char *what, int *length_what); 
@@ -7,6 +7,9 @@
  *
  */
  
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
@@ -14,6 +17,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/msg.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,6 +29,7 @@
 #include "sfs_misc.h"
 #include "sfs_debug.h"
 #include "sfs_secure.h"
+#include "sfs_cipher.h"
 
 
 /*
@@ -46,12 +51,89 @@ int sfsd_queue = -1;
 //----------------------------------------------------------------------------
 int sfsd_daemon = 1;
 
+//----------------------------------------------------------------------------
+// sfsd_tick
+// ~~~~~~~~~
+// Set by timer signal, housekeeping should be done
+//----------------------------------------------------------------------------
+volatile sig_atomic_t sfsd_tick = 0;
+
+//----------------------------------------------------------------------------
+// sfsd_restarting
+// ~~~~~~~~~~~~~~~
+// Set by SIGHUP, daemon should restart itself
+//----------------------------------------------------------------------------
+volatile sig_atomic_t sfsd_restarting = 0;
+
+//----------------------------------------------------------------------------
+// sfsd_jobs_done
+// ~~~~~~~~~~~~~~
+// Set by SIGUSR1 from a job thread, converted files should be switched over
+//----------------------------------------------------------------------------
+volatile sig_atomic_t sfsd_jobs_done = 0;
+
+//----------------------------------------------------------------------------
+// sfsd_exiting
+// ~~~~~~~~~~~~
+// Set to the signal number by SIGTERM, SIGINT or SIGQUIT, daemon should exit
+//----------------------------------------------------------------------------
+volatile sig_atomic_t sfsd_exiting = 0;
+
+//----------------------------------------------------------------------------
+// sfsd_state_fd
+// ~~~~~~~~~~~~~
+// State inherited from the previous daemon or -1
+//----------------------------------------------------------------------------
+int sfsd_state_fd = -1;
+
+//----------------------------------------------------------------------------
+// sfsd_restarted
+// ~~~~~~~~~~~~~~
+// Started by sfsd_restart() of the previous daemon, even if its state was
+// refused, the queue of the previous daemon is taken over
+//----------------------------------------------------------------------------
+int sfsd_restarted = 0;
+
+//----------------------------------------------------------------------------
+// sfsd_replies, sfsd_nreplies
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Replies of the requests of the current batch, sent after the commit
+//----------------------------------------------------------------------------
+struct sfsd_reply sfsd_replies[SFSD_BATCH];
+int sfsd_nreplies = 0;
+
 
 /*
  * SFS daemon functions
  *
  */
 
+//----------------------------------------------------------------------------
+// sfsd_queue_takeover()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Gets the queue left by the previous daemon, which exec'd this process.
+// The queue has to belong to the daemon user and be read last by this
+// process, not by another daemon still running.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfsd_queue_takeover( void )
+{
+  struct msqid_ds ds;
+  int queue;
+
+  queue = msgget( SFS_D_QUEUE_ID, SFS_D_QUEUE_PERM|IPC_CREAT );
+  if ((queue == -1) || (msgctl( queue, IPC_STAT, &ds ) == -1))
+    return -1;
+  if ((ds.msg_perm.uid != geteuid()) || (ds.msg_perm.cuid != geteuid())
+      || (ds.msg_lrpid && (ds.msg_lrpid != getpid()))) {
+    sfs_debug( "sfsd_queue_takeover", "queue is not of the previous daemon." );
+    return -1;
+  }
+  return queue;
+}
+
+
 //----------------------------------------------------------------------------
 // sfsd_init()
 // ~~~~~~~~~~~
@@ -61,21 +143,51 @@ int sfsd_daemon = 1;
 int
 sfsd_init( void )
 {
+  struct sigaction sa;
+
   sfs_debug( "sfsd_init", "initializing sfsd." );
-  signal( SIGHUP, (void(*)(int))sfsd_restart );  
-  signal( SIGTERM, sfsd_signal );  
-  signal( SIGINT, sfsd_signal );  
-  signal( SIGQUIT, sfsd_signal );  
-  sfsd_queue = msgget( SFS_D_QUEUE_ID, SFS_D_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
+
+  // SA_RESTART keeps the periodic timer from failing reads, writes and
+  // syncs with EINTR, msgrcv() and msgsnd() are interrupted regardless so
+  // exit, timer and restart still wake up the main loop
+  memset( &sa, 0, sizeof( sa ));
+  sigemptyset( &sa.sa_mask );
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = sfsd_signal;
+  sigaction( SIGTERM, &sa, NULL );
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGQUIT, &sa, NULL );
+  sa.sa_handler = sfsd_alarm;
+  sigaction( SIGALRM, &sa, NULL );
+  sa.sa_handler = sfsd_hup;
+  sigaction( SIGHUP, &sa, NULL );
+  sa.sa_handler = sfsd_job_signal;
+  sigaction( SIGUSR1, &sa, NULL );
+  alarm( SFSD_REAP_INTERVAL );
+
+  // Restarted daemon takes over the queue of the previous one, also when
+  // the state is lost
+  if (sfsd_restarted)
+    sfsd_queue = sfsd_queue_takeover();
+  else
+    sfsd_queue = msgget( SFS_D_QUEUE_ID, SFS_D_QUEUE_PERM|IPC_CREAT|IPC_EXCL );
   if (sfsd_queue == -1) {
     sfs_debug( "sfsd_init", "cannot get message queue." );
     return 1;
   }
   sfs_debug( "sfsd_init", "MSG_MAX: %d MSG_SIZE: %d", SFS_MSG_MAX, SFS_MSG_SIZE );
+  sfs_cipher_init();
   if (sfs_init_requests() != SFS_REPLY_OK) {
     sfs_debug( "sfsd_init", "initializing requests error." );
     return 1;
   }
+
+  if (sfsd_state_fd != -1) {
+    if (sfs_load_state( sfsd_state_fd ) != SFS_REPLY_OK)
+      sfs_debug( "sfsd_init", "previous state lost." );
+    close( sfsd_state_fd );
+    sfsd_state_fd = -1;
+  }
   sfs_debug( "sfsd_init", "initialized." );
   return 0;
 }
@@ -110,23 +222,105 @@ sfsd_destroy( void )
 void
 sfsd_restart( void )
 {
+  char buf[32];
+  int fd;
+
   sfs_debug( "sfsd_restart", "restarting." );
-  sfs_debug( "sfsd_restart", "restarted." );
+
+  // State is written to anonymous memory, or to a root only file which is
+  // unlinked at once, so it is reachable only through the inherited fd
+#ifdef MFD_ALLOW_SEALING
+  fd = memfd_create( "sfsd.state", MFD_ALLOW_SEALING );
+#else
+  fd = -1;
+#endif
+  if (fd == -1) {
+    unlink( SFSD_STATE_FILE );
+    fd = open( SFSD_STATE_FILE, O_RDWR|O_CREAT|O_EXCL, S_IREAD|S_IWRITE );
+    if (fd == -1) {
+      sfs_debug( "sfsd_restart", "cannot create state file: %d", errno );
+      return;
+    }
+    unlink( SFSD_STATE_FILE );
+  }
+
+  if (sfs_save_state( fd ) != SFS_REPLY_OK) {
+    sfs_debug( "sfsd_restart", "cannot save state, not restarted." );
+    close( fd );
+    return;
+  }
+#ifdef F_ADD_SEALS
+  fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL );
+#endif
+  lseek( fd, 0, SEEK_SET );
+  fcntl( fd, F_SETFD, 0 );
+
+  sprintf( buf, "%d", fd );
+
+  // Timer must not fire before the new image installs its handler
+  alarm( 0 );
+  execl( SFSD_BINARY, "sfsd", SFSD_STATE_ARG, buf, (char*)NULL );
+  execl( "/proc/self/exe", "sfsd", SFSD_STATE_ARG, buf, (char*)NULL );
+
+  sfs_debug( "sfsd_restart", "exec failed: %d, not restarted.", errno );
+  close( fd );
+  alarm( SFSD_REAP_INTERVAL );
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_hup()
+// ~~~~~~~~~~
+// Handles SIGHUP, the restart itself is done in the main loop
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfsd_hup( int signum )
+{
+  (void)signum;
+  sfsd_restarting = 1;
 }
 
 
 //----------------------------------------------------------------------------
 // sfsd_signal()
 // ~~~~~~~~~~~~~
-// Handles signals to SFS daemon
+// Handles signals to SFS daemon, the exit itself is done in the main loop
 // Status: finished
 //----------------------------------------------------------------------------
 void
 sfsd_signal( int signum )
 {
-  sfsd_destroy();
-  sfs_debug( "sfsd_signal", "exitting on signal %d", signum );
-  exit( 0 );
+  sfsd_exiting = signum;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_alarm()
+// ~~~~~~~~~~~~
+// Handles timer signal, the work itself is done in the main loop
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfsd_alarm( int signum )
+{
+  (void)signum;
+  sfsd_tick = 1;
+  alarm( SFSD_REAP_INTERVAL );
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_job_signal()
+// ~~~~~~~~~~~~~~~~~
+// Handles end of a background job, the job is finished in the main loop
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfsd_job_signal( int signum )
+{
+  (void)signum;
+  sfsd_jobs_done = 1;
 }
 
 
@@ -135,10 +329,59 @@ sfsd_signal( int signum )
 #undef _DE
 #define _DE
 
+//----------------------------------------------------------------------------
+// sfsd_send()
+// ~~~~~~~~~~~
+// Sends reply to the queue, msgsnd() interrupted by a signal is repeated
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfsd_send( int queue, struct s_msg *msgb )
+{
+  int ret;
+
+  do
+    ret = msgsnd( queue, msgb, SFS_MSG_SIZE, 0 );
+  while ((ret == -1) && (errno == EINTR));
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_reply_flush()
+// ~~~~~~~~~~~~~~~~~~
+// Commits the stores changed by the requests of the batch and sends their
+// replies.  Requests whose changes were not synced are reported failed.
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfsd_reply_flush( void )
+{
+  unsigned long failed;
+  int i;
+
+  if (!sfsd_nreplies)
+    return;
+  sfs_dir_commit();
+  failed = sfs_dir_failed();
+  for (i=0;i<sfsd_nreplies;i++) {
+    if (failed & (1UL << i))
+      sfsd_replies[i].msgb.sfs_msg.sfs_req_auth = SFS_REPLY_FAIL;
+    if (sfsd_send( sfsd_replies[i].queue, &sfsd_replies[i].msgb ) == -1)
+      sfs_debug( "sfsd_reply_flush", "cannot send reply." );
+  }
+  sfsd_nreplies = 0;
+}
+
+
 //----------------------------------------------------------------------------
 // sfsd_main()
 // ~~~~~~~~~~~
 // SFS daemon main loop
+// Requests waiting in the queue are handled as one batch: their replies
+// are held until the queue is empty or SFSD_BATCH of them are there, then
+// the changed stores are synced at once and the replies are sent.
+// Returns 0 when the daemon is told to exit by a signal.
 // Status: finished
 //----------------------------------------------------------------------------
 int
@@ -152,8 +395,49 @@ _DE
 
 //  sfs_debug( "sfsd_main", "entering the main loop." );
   for (;;) {
-    if (msgrcv( sfsd_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
+    sfs_dir_request( -1 );
+    // Held replies are sent, main() destroys the queue then
+    if (sfsd_exiting) {
+      sfsd_reply_flush();
+      sfs_flush_files();
+      sfs_debug( "sfsd_main", "exitting on signal %d", (int)sfsd_exiting );
+      return 0;
+    }
+
+    if (sfsd_jobs_done) {
+      sfsd_jobs_done = 0;
+      sfs_finish_jobs();
+    }
+
+    // Threads of running jobs would not survive exec(), restart waits
+    if (sfsd_restarting && !sfs_jobs_active()) {
+      sfsd_restarting = 0;
+      sfsd_reply_flush();
+      sfsd_restart();
+    }
+
+    if (sfsd_tick) {
+      sfsd_tick = 0;
+      sfsd_reply_flush();
+      // signal of a job may come just before msgrcv()
+      sfs_finish_jobs();
+      sfs_reap_files( SFSD_REAP_COUNT );
+      sfs_flush_files();
+      sfs_dir_tidy();
+    }
+
+    if (sfsd_nreplies == SFSD_BATCH)
+      sfsd_reply_flush();
+
+    if (msgrcv( sfsd_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, sfsd_nreplies ? IPC_NOWAIT : 0 ) == -1) {
+      if (errno == ENOMSG) {
+        sfsd_reply_flush();
+        continue;
+      }
+      if (errno == EINTR)
+        continue;
       sfs_debug( "sfsd_main", "message queue receive error." );
+      sfsd_reply_flush();
       return 1;
     }
 
@@ -180,7 +464,7 @@ DE
     if (auth == -1) {
       sfs_debug( "sfsd_main", "authorization error" );
       msgb.sfs_msg.sfs_req_auth = SFS_REPLY_FAIL;
-      if (msgsnd( reply_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1)
+      if (sfsd_send( reply_queue, &msgb ) == -1)
         sfs_debug( "sfsd_main", "cannot send error reply." );
       continue;
     }
@@ -190,13 +474,15 @@ DE
     if (auth != msgb.sfs_msg.sfs_req_auth) {
       sfs_debug( "sfsd_main", "authorization error" );
       msgb.sfs_msg.sfs_req_auth = SFS_REPLY_FAIL;
-      if (msgsnd( reply_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1)
+      if (sfsd_send( reply_queue, &msgb ) == -1)
         sfs_debug( "sfsd_main", "cannot send error reply." );
       continue;
     }
     
 DE
 
+    // Changes of the stores are told to the reply, it waits for their sync
+    sfs_dir_request( sfsd_nreplies );
     switch (msgb.sfs_msg.sfs_req_type) {
       case SFS_IS_REQ:
         ret = sfs_is_request( &(msgb.sfs_msg.sfs_req.sfs_is) );
@@ -237,6 +523,13 @@ DE
       case SFS_SETSIZE_REQ:
         ret = sfs_setsize_request( &(msgb.sfs_msg.sfs_req.sfs_size));
         break;
+      case SFS_SYNC_REQ:
+        ret = sfs_sync_request( &(msgb.sfs_msg.sfs_req.sfs_sync));
+        break;
+      case SFS_JOB_REQ:
+        ret = sfs_job_request( &(msgb.sfs_msg.sfs_req.sfs_job),
+                               msgb.sfs_msg.sfs_req_uid, reply_queue_id );
+        break;
       default:
         sfs_debug( "sfsd_main", "are you making jokes? (unknown type: %ld)", 
                msgb.sfs_msg.sfs_req_type );
@@ -245,6 +538,10 @@ DE
 
 DE
 
+    // Client waiting for a job gets the reply when the job ends
+    if (ret == SFSD_REPLY_LATER)
+      continue;
+
     /*
      * Return O.K. or Fail Reply
      *
@@ -259,11 +556,9 @@ DE
       
 DE
 
-    if (msgsnd( reply_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
-      sfs_debug( "sfsd_main", "cannot send reply." );
-      continue;
-    }
-    
+    sfsd_replies[sfsd_nreplies].queue = reply_queue;
+    sfsd_replies[sfsd_nreplies].msgb = msgb;
+    sfsd_nreplies++;
   }
 }
 
@@ -302,6 +597,34 @@ sfsd_daemon_setup(void)
 }
 
 
+//----------------------------------------------------------------------------
+// sfsd_state_check()
+// ~~~~~~~~~~~~~~~~~~
+// Checks that fd is state left by sfsd_restart(), an unlinked file of root,
+// sealed memfd or the state file readable by root only.  Anything else
+// might come from the user running the daemon, it is not trusted.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfsd_state_check( int fd )
+{
+  struct stat st;
+#ifdef F_GET_SEALS
+  int seals;
+#endif
+
+  if ((fd <= 2) || (fstat( fd, &st ) == -1) || !S_ISREG( st.st_mode )
+      || (st.st_uid != 0) || (st.st_nlink != 0))
+    return -1;
+#ifdef F_GET_SEALS
+  seals = fcntl( fd, F_GET_SEALS );
+  if ((seals != -1) && ((seals & (F_SEAL_WRITE|F_SEAL_SEAL)) == (F_SEAL_WRITE|F_SEAL_SEAL)))
+    return 0;
+#endif
+  return (st.st_mode & 077) ? -1 : 0;
+}
+
+
 #undef DE
 #define DE //DEB( "sfsd" );
 
@@ -312,11 +635,22 @@ sfsd_daemon_setup(void)
 // Status: finished
 //----------------------------------------------------------------------------
 int
-main()
+main( int argc, char *argv[] )
 {
+  int fd;
 _DE
 DE
-  if (sfsd_daemon)
+  // Restarted by SIGHUP, already running as daemon.  Only root restarts
+  // the daemon, sfsd run by users through the set-uid bit gets no state.
+  if ((argc == 3) && !strcmp( argv[1], SFSD_STATE_ARG )) {
+    sfsd_restarted = 1;
+    fd = atoi( argv[2] );
+    if ((getuid() == 0) && (sfsd_state_check( fd ) == 0))
+      sfsd_state_fd = fd;
+    else
+      sfs_debug( "sfsd", "state fd %s refused.", argv[2] );
+  }
+  if (!sfsd_restarted && sfsd_daemon)
     if (sfsd_daemon_setup())
       return 1;
 DE
@@ -328,7 +662,7 @@ DE
     return 1;
   }
 
-  sfsd_destroy();  /* never reached */
+  sfsd_destroy();
   return 0;
 }
 
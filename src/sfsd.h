@@ -11,7 +11,163 @@
 #ifndef _SFSD_H
 #define _SFSD_H
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include "sfs.h"
+#include "sfs_cipher.h"
+#include "sfs_meta.h"
+
+  // Seconds between two runs of the reaper
+#define SFSD_REAP_INTERVAL	5
+  // Files checked by one run of the reaper
+#define SFSD_REAP_COUNT		32
+
+  // Installed daemon executed on restart, so that reload picks up upgrades
+#define SFSD_BINARY		"/usr/sbin/sfsd"
+  // Argument before fd of the state passed to restarted daemon
+#define SFSD_STATE_ARG		"--state-fd"
+  // State file used if memfd_create() is not available
+#define SFSD_STATE_FILE		SFS_DIR"/.sfsd.state"
+#define SFSD_STATE_MAGIC	0x53465344L
+#define SFSD_STATE_VERSION	3
+  // Bytes converted at once by one thread when a file is encrypted or
+  // decrypted, a multiple of the block sizes of all ciphers
+#define SFSD_CONV_CHUNK		(1024*1024)
+  // Most threads converting one file
+#define SFSD_CONV_THREADS	8
+  // Most chmod conversions running in background at once
+#define SFSD_MAX_JOBS		8
+  // Most clients waiting for the end of one job
+#define SFSD_JOB_WAITERS	4
+  // Request returns it when the reply is sent later by sfs_finish_jobs()
+#define SFSD_REPLY_LATER	-1
+  // Most directories with metadata indexed at once
+#define SFSD_MAX_DIRS		64
+  // Most requests answered by one commit of the stores, at most the bits
+  // of unsigned long (see struct sfsd_dir)
+#define SFSD_BATCH		32
+
+
+/*
+ * SFS daemon structures
+ *
+ */
+
+  // Header of the daemon state passed over restart, users and files follow
+struct sfsd_state {
+  long magic;
+  int version;
+  int user_size;
+  int file_size;
+  int last_user;
+  int last_file;
+  long reaped_files;
+};
+
+
+  // Converts chunk of file data at offset in place, see sfsd_convert()
+typedef int (*sfsd_conv_fn)( void *arg, off_t offset, char *buf, int len );
+
+  // Ciphers of file converted by chmod request, ecb is key of old ECB
+  // data or NULL, engine crypts the data after that
+struct sfs_conv_arg {
+  int engine;
+  sfs_cipher_ctx *ctx;
+  const unsigned char *nonce;
+  bf_key_schedule *ecb;
+};
+
+
+  // Metadata files of a directory indexed by sfsd_dir.c
+enum { SFSD_DIR_UDIR = 0, SFSD_DIR_GDIR, SFSD_DIR_ADIR, SFSD_DIR_SIZES, SFSD_DIR_FILES };
+
+  // Record of an indexed metadata file, name and key are offsets in data
+  // of the index.  key_len is -1 for key records which cannot be read.
+struct sfsd_dir_entry {
+  uid_t id;
+  int engine;
+  unsigned char nonce[SFS_NONCE_SIZE];
+  int name;
+  int key;
+  int key_len;
+  off_t size;
+  unsigned int hash;
+  int next;
+};
+
+  // Index of one metadata file, valid while the file has the same stat
+  // (exists, ino, size, mtime and ctime)
+struct sfsd_dir_index {
+  int loaded;
+  int exists;
+  struct stat st;
+  struct sfsd_dir_entry *entries;
+  int count;
+  int max;
+  char *data;
+  int data_len;
+  int data_max;
+  int *heads;
+  int buckets;
+};
+
+  // Directory with indexed metadata files, or with its store mapped if
+  // store is set.  batch has bit i set if reply i of the batch waits for
+  // a change of the store to be synced.
+struct sfsd_dir {
+  char dir[SFS_MAX_PATH];
+  unsigned long used;
+  struct sfsd_dir_index files[SFSD_DIR_FILES];
+  int store;
+  sfs_meta meta;
+  unsigned long batch;
+};
+
+
+  // Change of a record of a file for sfs_dir_apply(), kind is SFS_META_*.
+  // text is a key in text form, size the size of SFS_META_SIZE.  Text NULL
+  // or size -1 deletes the record.
+struct sfsd_dir_change {
+  int kind;
+  uid_t id;
+  const char *text;
+  off_t size;
+};
+
+  // Reply held until the changes of its request are committed
+struct sfsd_reply {
+  int queue;
+  struct s_msg msgb;
+};
+
+
+  // Chmod conversion running in background
+  // The conversion thread writes only done and state (SFS_JOB_CONVERTED),
+  // the rest belongs to the main thread.  Keys used by conv are copied
+  // here, wkey is the wrapped file key of a migrated file.
+struct sfs_job {
+  int state;
+  int id;
+  struct sfs_chmod_request req;
+  int in;
+  int out;
+  char *temppath;
+  off_t limit;
+  off_t total;
+  off_t done;
+  off_t size;
+  int result;
+  struct sfs_conv_arg conv;
+  sfs_cipher_ctx ctx;
+  bf_key_schedule ecb;
+  unsigned char nonce[SFS_NONCE_SIZE];
+  char *wkey;
+  pthread_t thread;
+  int waiters[SFSD_JOB_WAITERS];
+  int nwaiters;
+};
 
 
 /*
@@ -29,8 +185,20 @@ int   sfsd_destroy( void );
 void  sfsd_restart( void );
   // Signal handling
 void  sfsd_signal( int signum );
+  // Restart signal handling
+void  sfsd_hup( int signum );
+  // Timer signal handling
+void  sfsd_alarm( int signum );
   // Start up as a daemon
 int   sfsd_daemon_setup( void );
+  // Checks that fd is state left by sfsd_restart()
+int   sfsd_state_check( int fd );
+  // Converts data of file in to file out using more threads
+off_t sfsd_convert( int in, int out, off_t limit, sfsd_conv_fn fn, void *arg, off_t *done );
+  // Job signal handling
+void  sfsd_job_signal( int signum );
+  // Commits the stores and sends the held replies
+void  sfsd_reply_flush( void );
 
 
 /*
@@ -40,6 +208,10 @@ int   sfsd_daemon_setup( void );
 
   // Initializing request
 int   sfs_init_requests( void );
+  // Writes users and files to fd
+int   sfs_save_state( int fd );
+  // Reads users and files from fd
+int   sfs_load_state( int fd );
   // Open file request
 int   sfs_open_request( struct sfs_open_request *req );
   // Close file request
@@ -50,6 +222,18 @@ int   sfs_read_request( struct sfs_read_request *req );
 int   sfs_write_request( struct sfs_write_request *req );
   // File chmod request
 int   sfs_chmod_request( struct sfs_chmod_request *req );
+  // Converts chunk of file data in chmod request
+int   sfs_conv_crypt( void *arg, off_t offset, char *buf, int len );
+  // Engine for new file in chmod request
+int   sfs_chmod_engine( struct sfs_chmod_request *req );
+  // Converts ECB file to CTR, part of chmod request
+int   sfs_migrate_file( struct sfs_chmod_request *req );
+  // Switches converted file over when its job ends
+int   sfs_chmod_finish( struct sfs_job *job );
+  // Removes key records of file that failed to get encrypted
+void  sfs_chmod_undo_keys( struct sfs_chmod_request *req );
+  // Tags key records of migrated file when its job ends
+int   sfs_migrate_finish( struct sfs_job *job );
   // File fchmod request
 int   sfs_fchmod_request( struct sfs_fchmod_request *req );
   // User login request
@@ -66,6 +250,10 @@ int   sfs_is_request( struct sfs_is_request *req );
 int   sfs_setsize_request( struct sfs_size_request *req );
   // Get file size request
 int   sfs_getsize_request( struct sfs_size_request *req );
+  // Write file metadata request
+int   sfs_sync_request( struct sfs_sync_request *req );
+  // Poll or wait for background chmod request
+int   sfs_job_request( struct sfs_job_request *req, uid_t uid, int reply_queue_id );
 
 
 /*
@@ -74,7 +262,13 @@ int   sfs_getsize_request( struct sfs_size_request *req );
  */
 
   // Adds file to internal demon structures
-int   sfs_add_file( pid_t pid, int fd, const char *key, off_t size, const char *dir, const char *name );
+int   sfs_add_file( pid_t pid, int fd, uid_t uid, int key_type, int engine, const unsigned char *nonce, const char *ekey, int ekey_len, off_t size, const char *dir, const char *name );
+
+  // Returns index of file in internal demon structures
+int   sfs_find_file( pid_t pid, int fd );
+
+  // Returns index of any instance of the file in internal demon structures
+int   sfs_find_file_path( const char *dir, const char *name );
 
 
 /*
@@ -82,12 +276,18 @@ int   sfs_add_file( pid_t pid, int fd, const char *key, off_t size, const char *
  *
  */
 
+  // Unwraps file key in internal demon structures
+int   sfs_unwrap_file_key( int i );
+
   // Returns file key from internal demon structures
 char *sfs_get_file_key( pid_t pid, int fd );
 
   // Deletes file key from internal demon structures
 int   sfs_del_file_key( pid_t pid, int fd );
 
+  // Releases files of dead processes from internal demon structures
+int   sfs_reap_files( int count );
+
 
 /*
  * Functions working with internal demon structure containing file sizes
@@ -100,6 +300,83 @@ int   sfs_get_file_size( pid_t pid, int fd, off_t *size );
   // Adds file key to internal demon structures
 int   sfs_set_file_size( pid_t pid, int fd, off_t size );
 
+  // Writes changed file size to the disk
+int   sfs_flush_file_size( int i );
+
+  // Writes all changed file sizes to the disk
+int   sfs_flush_files( void );
+
+  // Checks file size read from the disk against the file length, the tail
+  // of ECB data is read from the last block by ks if it is given
+off_t sfs_recover_file_size( const char *dir, const char *name, int mode, off_t size, bf_key_schedule *ks );
+
+
+/*
+ * Functions working with internal demon structure containing jobs
+ *
+ */
+
+  // Starts background conversion of file for chmod request
+int   sfs_start_job( struct sfs_chmod_request *req, int in, int out, char *temppath, off_t limit, struct sfs_conv_arg *conv, const char *wkey );
+
+  // Returns index of job converting the file or -1
+int   sfs_find_job_path( const char *dir, const char *name );
+
+  // Switches over files of ended conversions and answers waiting clients
+void  sfs_finish_jobs( void );
+
+  // Returns number of conversions still running
+int   sfs_jobs_active( void );
+
+
+/*
+ * Functions working with internal demon structure containing metadata
+ *
+ */
+
+  // Finds wrapped file key in the index of dir, returns its length, 0 if
+  // there is none or -1
+int   sfs_dir_file_key( const char *dir, const char *name, int key_type, uid_t id, int *engine, unsigned char *nonce, unsigned char *ekey, int max );
+
+  // Tells whether file has key record in the index of dir
+int   sfs_dir_has_key( const char *dir, const char *name, int key_type, uid_t id );
+
+  // Returns wrapped file key in text form from the index of dir or NULL
+char *sfs_dir_file_key_text( const char *dir, const char *name, int key_type, uid_t id );
+
+  // Returns file size from the index of dir or -1
+off_t sfs_dir_file_size( const char *dir, const char *name );
+
+  // Writes wrapped file key given in text form to the store of dir or to
+  // its key file, the old one is replaced
+int   sfs_dir_write_key( const char *dir, const char *name, int key_type, uid_t id, const char *text );
+
+  // Deletes file key record, -1 if there is none
+int   sfs_dir_delete_key( const char *dir, const char *name, int key_type, uid_t id );
+
+  // Writes size of file, the old one is replaced.  *slot (if slot is not
+  // NULL) remembers where it is in the store for the next time.
+int   sfs_dir_write_size( const char *dir, const char *name, off_t size, off_t *slot );
+
+  // Deletes size of file, -1 if there is none
+int   sfs_dir_delete_size( const char *dir, const char *name );
+
+  // Makes n changes of records of file at once, in one transaction of the
+  // store of dir
+int   sfs_dir_apply( const char *dir, const char *name, const struct sfsd_dir_change *c, int n );
+
+  // Tells which reply of the batch the next changes belong to, -1 none
+void  sfs_dir_request( int reply );
+
+  // Syncs changes of the stores, once for all requests since the last time
+int   sfs_dir_commit( void );
+
+  // Returns replies of the batch whose changes were not synced, as bits
+unsigned long sfs_dir_failed( void );
+
+  // Writes again stores with too much deleted data
+void  sfs_dir_tidy( void );
+
 
 /*
  * Functions working with internal demon structure containing users
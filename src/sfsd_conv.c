@@ -0,0 +1,368 @@
+/*
+ * sfsd_conv.c
+ *
+ * SFS daemon whole file conversion used when files get encrypted or
+ * decrypted.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define _SFS_DEBUG_DAEMON
+
+#include "sfs.h"
+#include "sfsd.h"
+#include "sfs_debug.h"
+
+
+/*
+ * The file goes through a ring of chunks: the reader thread fills them in
+ * file order, worker threads convert any filled chunk and the calling
+ * thread writes the converted ones in file order again.
+ *
+ */
+
+#define SFSD_CONV_EMPTY		0
+#define SFSD_CONV_READ		1
+#define SFSD_CONV_BUSY		2
+#define SFSD_CONV_DONE		3
+
+struct sfsd_conv_chunk {
+  char *buf;
+  off_t offset;
+  int len;
+  int state;
+};
+
+struct sfsd_conv {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct sfsd_conv_chunk chunks[2*SFSD_CONV_THREADS];
+  int nchunks;
+  long next_read, next_crypt, next_write;
+  int eof, error;
+  int in;
+  sfsd_conv_fn fn;
+  void *arg;
+};
+
+
+//----------------------------------------------------------------------------
+// sfsd_conv_read()
+// ~~~~~~~~~~~~~~~~
+// Reads whole chunk unless the file ends, returns its length or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfsd_conv_read( int fd, char *buf, int size )
+{
+  int len = 0, ret;
+
+  while (len < size) {
+    ret = __read( fd, buf + len, size - len );
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (ret == 0)
+      break;
+    len += ret;
+  }
+  return len;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_conv_write()
+// ~~~~~~~~~~~~~~~~~
+// Writes whole buffer, returns 0 or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfsd_conv_write( int fd, const char *buf, int size )
+{
+  int len = 0, ret;
+
+  while (len < size) {
+    ret = __write( fd, buf + len, size - len );
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    len += ret;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_conv_reader()
+// ~~~~~~~~~~~~~~~~~~
+// Reader thread, fills empty chunks in file order
+// Status: finished
+//----------------------------------------------------------------------------
+static void *
+sfsd_conv_reader( void *p )
+{
+  struct sfsd_conv *cv = p;
+  struct sfsd_conv_chunk *c;
+  off_t offset = 0;
+  int len;
+
+  for (;;) {
+    pthread_mutex_lock( &cv->lock );
+    while (!cv->error && (cv->next_read - cv->next_write >= cv->nchunks))
+      pthread_cond_wait( &cv->cond, &cv->lock );
+    if (cv->error) {
+      pthread_mutex_unlock( &cv->lock );
+      break;
+    }
+    c = &cv->chunks[cv->next_read % cv->nchunks];
+    pthread_mutex_unlock( &cv->lock );
+
+    len = sfsd_conv_read( cv->in, c->buf, SFSD_CONV_CHUNK );
+
+    pthread_mutex_lock( &cv->lock );
+    if (len <= 0) {
+      if (len == -1) {
+        sfs_debug( "sfsd_conv_reader", "read error: %d", errno );
+        cv->error = 1;
+      }
+      cv->eof = 1;
+      pthread_cond_broadcast( &cv->cond );
+      pthread_mutex_unlock( &cv->lock );
+      break;
+    }
+    c->offset = offset;
+    c->len = len;
+    c->state = SFSD_CONV_READ;
+    cv->next_read++;
+    pthread_cond_broadcast( &cv->cond );
+    pthread_mutex_unlock( &cv->lock );
+    offset += len;
+  }
+  return NULL;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_conv_worker()
+// ~~~~~~~~~~~~~~~~~~
+// Worker thread, converts read chunks in any order
+// Status: finished
+//----------------------------------------------------------------------------
+static void *
+sfsd_conv_worker( void *p )
+{
+  struct sfsd_conv *cv = p;
+  struct sfsd_conv_chunk *c;
+  int ret;
+
+  for (;;) {
+    pthread_mutex_lock( &cv->lock );
+    while (!cv->error && !cv->eof && (cv->next_crypt == cv->next_read))
+      pthread_cond_wait( &cv->cond, &cv->lock );
+    if (cv->error || (cv->next_crypt == cv->next_read)) {
+      pthread_mutex_unlock( &cv->lock );
+      break;
+    }
+    c = &cv->chunks[cv->next_crypt % cv->nchunks];
+    c->state = SFSD_CONV_BUSY;
+    cv->next_crypt++;
+    pthread_mutex_unlock( &cv->lock );
+
+    ret = cv->fn( cv->arg, c->offset, c->buf, c->len );
+
+    pthread_mutex_lock( &cv->lock );
+    if (ret == -1)
+      cv->error = 1;
+    c->state = SFSD_CONV_DONE;
+    pthread_cond_broadcast( &cv->cond );
+    pthread_mutex_unlock( &cv->lock );
+  }
+  return NULL;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_threads()
+// ~~~~~~~~~~~~~~
+// Returns number of worker threads for conversion
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfsd_threads( void )
+{
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+
+  if (n < 1)
+    return 1;
+  if (n > SFSD_CONV_THREADS)
+    return SFSD_CONV_THREADS;
+  return (int)n;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_convert_serial()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Converts file in the calling thread, for small files and machines with
+// one CPU
+// Status: finished
+//----------------------------------------------------------------------------
+static off_t
+sfsd_convert_serial( int in, int out, off_t limit, sfsd_conv_fn fn, void *arg, char *buf, off_t *done )
+{
+  off_t offset = 0;
+  int len;
+
+  while ((len = sfsd_conv_read( in, buf, SFSD_CONV_CHUNK )) > 0) {
+    if (fn( arg, offset, buf, len ) == -1)
+      return -1;
+    if ((limit != -1) && (offset + len > limit))
+      len = limit - offset;
+    if ((len > 0) && (sfsd_conv_write( out, buf, len ) == -1)) {
+      sfs_debug( "sfsd_convert", "write error: %d", errno );
+      return -1;
+    }
+    if (len > 0)
+      offset += len;
+    if (done)
+      __atomic_store_n( done, offset, __ATOMIC_RELAXED );
+    if ((limit != -1) && (offset >= limit))
+      break;
+  }
+  if (len == -1) {
+    sfs_debug( "sfsd_convert", "read error: %d", errno );
+    return -1;
+  }
+  return offset;
+}
+
+
+//----------------------------------------------------------------------------
+// sfsd_convert()
+// ~~~~~~~~~~~~~~
+// Converts data of file in by fn into file out, chunks of SFSD_CONV_CHUNK
+// bytes are converted in parallel.  Output stops at limit bytes unless it
+// is -1.  Bytes written so far are stored to done unless it is NULL, it
+// can be read by other threads.  Returns number of bytes written or -1.
+// Status: finished
+//----------------------------------------------------------------------------
+off_t
+sfsd_convert( int in, int out, off_t limit, sfsd_conv_fn fn, void *arg, off_t *done )
+{
+  struct sfsd_conv cv;
+  struct sfsd_conv_chunk *c;
+  pthread_t reader, workers[SFSD_CONV_THREADS];
+  struct stat st;
+  off_t offset = 0;
+  int i, threads, started = 0, len;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise( in, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+  threads = sfsd_threads();
+  if ((fstat( in, &st ) == -1) || (st.st_size <= SFSD_CONV_CHUNK))
+    threads = 1;
+
+  memset( &cv, 0, sizeof( cv ) );
+  cv.nchunks = (threads == 1) ? 1 : 2*threads;
+  for (i=0;i<cv.nchunks;i++) {
+    // malloc() aligns the chunks for the block ciphers
+    cv.chunks[i].buf = malloc( SFSD_CONV_CHUNK );
+    if (!cv.chunks[i].buf) {
+      sfs_debug( "sfsd_convert", "memory error" );
+      cv.nchunks = i;
+      offset = -1;
+      goto out;
+    }
+  }
+
+  if (threads == 1) {
+    offset = sfsd_convert_serial( in, out, limit, fn, arg, cv.chunks[0].buf, done );
+    goto out;
+  }
+
+  pthread_mutex_init( &cv.lock, NULL );
+  pthread_cond_init( &cv.cond, NULL );
+  cv.in = in;
+  cv.fn = fn;
+  cv.arg = arg;
+
+  if (pthread_create( &reader, NULL, sfsd_conv_reader, &cv )) {
+    sfs_debug( "sfsd_convert", "cannot start reader" );
+    offset = sfsd_convert_serial( in, out, limit, fn, arg, cv.chunks[0].buf, done );
+    goto destroy;
+  }
+  for (i=0;i<threads;i++)
+    if (!pthread_create( &workers[started], NULL, sfsd_conv_worker, &cv ))
+      started++;
+  if (!started) {
+    // nobody would convert the chunks
+    pthread_mutex_lock( &cv.lock );
+    cv.error = 1;
+    pthread_cond_broadcast( &cv.cond );
+    pthread_mutex_unlock( &cv.lock );
+  }
+
+  // Writes converted chunks in file order
+  pthread_mutex_lock( &cv.lock );
+  for (;;) {
+    c = &cv.chunks[cv.next_write % cv.nchunks];
+    while (!cv.error && (c->state != SFSD_CONV_DONE)
+           && !(cv.eof && (cv.next_write == cv.next_read)))
+      pthread_cond_wait( &cv.cond, &cv.lock );
+    if (cv.error || (c->state != SFSD_CONV_DONE))
+      break;
+    pthread_mutex_unlock( &cv.lock );
+
+    len = c->len;
+    if ((limit != -1) && (c->offset + len > limit))
+      len = (c->offset < limit) ? limit - c->offset : 0;
+    i = (len > 0) ? sfsd_conv_write( out, c->buf, len ) : 0;
+    if (i != -1)
+      offset += len;
+    if (done)
+      __atomic_store_n( done, offset, __ATOMIC_RELAXED );
+
+    pthread_mutex_lock( &cv.lock );
+    if (i == -1) {
+      sfs_debug( "sfsd_convert", "write error: %d", errno );
+      cv.error = 1;
+      break;
+    }
+    c->state = SFSD_CONV_EMPTY;
+    cv.next_write++;
+    pthread_cond_broadcast( &cv.cond );
+  }
+  if (cv.error) {
+    offset = -1;
+    pthread_cond_broadcast( &cv.cond );
+  }
+  pthread_mutex_unlock( &cv.lock );
+
+  pthread_join( reader, NULL );
+  for (i=0;i<started;i++)
+    pthread_join( workers[i], NULL );
+
+destroy:
+  pthread_cond_destroy( &cv.cond );
+  pthread_mutex_destroy( &cv.lock );
+out:
+  for (i=0;i<cv.nchunks;i++)
+    free( cv.chunks[i].buf );
+  return offset;
+}
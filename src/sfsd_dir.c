@@ -0,0 +1,1085 @@
+/*
+ * sfsd_dir.c
+ *
+ * SFS daemon metadata of directories.  A directory with a store has it
+ * mapped, the metadata files of the others are indexed.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define _SFS_DEBUG_DAEMON
+
+#include "sfs.h"
+#include "sfsd.h"
+#include "sfs_misc.h"
+#include "sfs_debug.h"
+#include "sfs_keyfile.h"
+#include "sfs_meta.h"
+
+
+/*
+ * Internal structures
+ *
+ */
+
+//----------------------------------------------------------------------------
+// dirs
+// ~~~~
+// Internal structure containing directories with mapped stores or indexed
+// metadata files, the least recently used one is replaced when it is full
+//----------------------------------------------------------------------------
+struct sfsd_dir dirs[SFSD_MAX_DIRS];
+
+//----------------------------------------------------------------------------
+// dir_clock
+// ~~~~~~~~~
+// Time of the last use of a directory, counted in lookups
+//----------------------------------------------------------------------------
+unsigned long dir_clock = 0;
+
+//----------------------------------------------------------------------------
+// dir_reply, dir_failed
+// ~~~~~~~~~~~~~~~~~~~~~
+// Reply of the batch whose request is being handled or -1, and the replies
+// whose changes were lost because a store could not be synced
+//----------------------------------------------------------------------------
+int dir_reply = -1;
+unsigned long dir_failed = 0;
+
+//----------------------------------------------------------------------------
+// sfs_dir_names, sfs_dir_kinds
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Metadata files and their kinds of key file, indexed by SFSD_DIR_*
+//----------------------------------------------------------------------------
+static const char *sfs_dir_names[SFSD_DIR_FILES] = {
+  SFS_UDIR_FILE, SFS_GDIR_FILE, SFS_ADIR_FILE, SFS_SIZES_FILE
+};
+static const int sfs_dir_kinds[SFSD_DIR_FILES] = {
+  SFS_KEYFILE_UDIR, SFS_KEYFILE_GDIR, SFS_KEYFILE_ADIR, 0
+};
+
+
+/*
+ * Index of one metadata file
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_dir_hash()
+// ~~~~~~~~~~~~~~
+// FNV-1a hash of (id, name)
+// Status: finished
+//----------------------------------------------------------------------------
+static unsigned int
+sfs_dir_hash( uid_t id, const char *name )
+{
+  unsigned int h = 2166136261U;
+  int i;
+
+  for (i=0;i<(int)sizeof( id );i++)
+    h = (h ^ ((id >> (8*i)) & 0xff)) * 16777619U;
+  while (*name)
+    h = (h ^ (unsigned char)*name++) * 16777619U;
+  return h;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_clear()
+// ~~~~~~~~~~~~~~~
+// Frees index, it is loaded again on the next lookup
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_dir_clear( struct sfsd_dir_index *ix )
+{
+  if (ix->data)
+    memset( ix->data, 0, ix->data_max );
+  free( ix->entries );
+  free( ix->data );
+  free( ix->heads );
+  memset( ix, 0, sizeof( *ix ));
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_data()
+// ~~~~~~~~~~~~~~
+// Copies len bytes to data of index, returns their offset or -1
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_data( struct sfsd_dir_index *ix, const void *p, int len )
+{
+  char *data;
+  int max, off;
+
+  if (ix->data_len + len > ix->data_max) {
+    max = ix->data_max ? 2*ix->data_max : 4096;
+    while (max < ix->data_len + len)
+      max *= 2;
+    data = (char *)realloc( ix->data, max );
+    if (!data)
+      return -1;
+    ix->data = data;
+    ix->data_max = max;
+  }
+  off = ix->data_len;
+  memcpy( ix->data + off, p, len );
+  ix->data_len += len;
+  return off;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_add()
+// ~~~~~~~~~~~~~
+// Adds record to index, e is NULL for .sfssizes
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_add( struct sfsd_dir_index *ix, uid_t id, const char *name, const sfs_key_entry *e, off_t size )
+{
+  struct sfsd_dir_entry *entries, *en;
+  int max;
+
+  if (ix->count == ix->max) {
+    max = ix->max ? 2*ix->max : 64;
+    entries = (struct sfsd_dir_entry *)realloc( ix->entries, max * sizeof( *entries ));
+    if (!entries)
+      return -1;
+    ix->entries = entries;
+    ix->max = max;
+  }
+
+  en = &ix->entries[ix->count];
+  memset( en, 0, sizeof( *en ));
+  en->id = id;
+  en->size = size;
+  en->hash = sfs_dir_hash( id, name );
+  en->name = sfs_dir_data( ix, name, strlen( name ) + 1 );
+  if (en->name == -1)
+    return -1;
+  en->key_len = -1;
+  if (e && (e->key_len >= 0)) {
+    en->engine = e->engine;
+    memcpy( en->nonce, e->nonce, SFS_NONCE_SIZE );
+    en->key = sfs_dir_data( ix, e->key, e->key_len );
+    if (en->key == -1)
+      return -1;
+    en->key_len = e->key_len;
+  }
+  ix->count++;
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_hash_entries()
+// ~~~~~~~~~~~~~~~~~~~~~~
+// Makes hash chains of index.  Entries are chained from the last one, so
+// that the first record of a name in the file is found like by a scan.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_hash_entries( struct sfsd_dir_index *ix )
+{
+  int i, b;
+
+  ix->buckets = 16;
+  while (ix->buckets < 2*ix->count)
+    ix->buckets *= 2;
+  ix->heads = (int *)malloc( ix->buckets * sizeof( int ));
+  if (!ix->heads)
+    return -1;
+  for (i=0;i<ix->buckets;i++)
+    ix->heads[i] = -1;
+  for (i=ix->count-1;i>=0;i--) {
+    b = ix->entries[i].hash & (ix->buckets - 1);
+    ix->entries[i].next = ix->heads[b];
+    ix->heads[b] = i;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_load_keys()
+// ~~~~~~~~~~~~~~~~~~~
+// Loads records of key file of kind, binary or text one
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_load_keys( struct sfsd_dir_index *ix, const char *path, int kind )
+{
+  unsigned char key[SFS_MAX_KEY];
+  sfs_keyfile kf;
+  sfs_key_entry e;
+  sfs_reader r;
+  sfsdir_line *dl;
+  sfsadir_line *al;
+  size_t pos = 0;
+  char *line;
+  int ret;
+
+  switch (sfs_keyfile_load( path, &kf )) {
+    case SFS_KEYFILE_BINARY:
+      while ((ret = sfs_keyfile_next( &kf, &pos, &e )) == 1)
+        if (sfs_dir_add( ix, (kind == SFS_KEYFILE_ADIR) ? 0 : e.id, e.name, &e, 0 ) == -1) {
+          ret = -1;
+          break;
+        }
+      sfs_keyfile_free( &kf );
+      return ret;
+    case SFS_KEYFILE_TEXT:
+      break;
+    default:
+      return -1;
+  }
+
+  if (sfs_reader_open( &r, path ) == -1)
+    return -1;
+  while ((ret = sfs_reader_line( &r, &line, NULL )) == 1) {
+    if (!line[0])
+      continue;
+    memset( &e, 0, sizeof( e ));
+    if (kind == SFS_KEYFILE_ADIR) {
+      if (!(al = sfs_parse_sfsadir_line( line )))
+        continue;
+      if (sfs_keyfile_parse_text( al->file_key, &e, key, SFS_MAX_KEY ) == -1)
+        e.key_len = -1;
+      ret = sfs_dir_add( ix, 0, al->file_name, &e, 0 );
+      free( al );
+    }
+    else {
+      if (!(dl = sfs_parse_sfsdir_line( line )))
+        continue;
+      if (sfs_keyfile_parse_text( dl->file_key, &e, key, SFS_MAX_KEY ) == -1)
+        e.key_len = -1;
+      ret = sfs_dir_add( ix, dl->uid, dl->file_name, &e, 0 );
+      free( dl );
+    }
+    if (ret == -1)
+      break;
+  }
+  sfs_reader_close( &r );
+  memset( key, 0, sizeof( key ));
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_load_sizes()
+// ~~~~~~~~~~~~~~~~~~~~
+// Loads records of .sfssizes
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_load_sizes( struct sfsd_dir_index *ix, const char *path )
+{
+  sfssizes_line *sl;
+  sfs_reader r;
+  char *line;
+  int ret;
+
+  if (sfs_reader_open( &r, path ) == -1)
+    return -1;
+  while ((ret = sfs_reader_line( &r, &line, NULL )) == 1) {
+    if (!line[0] || !(sl = sfs_parse_sfssizes_line( line )))
+      continue;
+    ret = sfs_dir_add( ix, 0, sl->file_name, NULL, sl->size );
+    free( sl );
+    if (ret == -1)
+      break;
+  }
+  sfs_reader_close( &r );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_same()
+// ~~~~~~~~~~~~~~
+// Tells whether the file still has the stat it was loaded with
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_same( const struct stat *a, const struct stat *b )
+{
+  return (a->st_dev == b->st_dev) && (a->st_ino == b->st_ino)
+      && (a->st_size == b->st_size)
+      && (a->st_mtime == b->st_mtime) && (a->st_ctime == b->st_ctime);
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_path()
+// ~~~~~~~~~~~~~~
+// Makes path of metadata file in dir, -1 (errno ENAMETOOLONG) if it does
+// not fit to SFS_MAX_PATH
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_path( char *path, const char *dir, const char *file )
+{
+  int len = snprintf( path, SFS_MAX_PATH, "%s%s", dir, file );
+
+  if ((len < 0) || (len >= SFS_MAX_PATH)) {
+    sfs_debug( "sfs_dir_path", "path too long: %s%s", dir, file );
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_touch()
+// ~~~~~~~~~~~~~~~
+// Marks the store of directory changed by the request being handled
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_dir_touch( struct sfsd_dir *d )
+{
+  if (dir_reply != -1)
+    d->batch |= 1UL << dir_reply;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_sync()
+// ~~~~~~~~~~~~~~
+// Syncs changes of the store of directory, the replies waiting for them
+// are failed if it cannot be done
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_sync( struct sfsd_dir *d )
+{
+  if (sfs_meta_commit( &d->meta ) == -1) {
+    sfs_debug( "sfs_dir_sync", "cannot commit store of %s", d->dir );
+    dir_failed |= d->batch;
+    d->batch = 0;
+    return -1;
+  }
+  if (!d->meta.dirty)
+    d->batch = 0;
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_close()
+// ~~~~~~~~~~~~~~~
+// Unmaps the store of directory, its changes are synced first
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_dir_close( struct sfsd_dir *d )
+{
+  if (d->store) {
+    if (d->meta.txn)
+      sfs_meta_abort( &d->meta );
+    sfs_dir_sync( d );
+    sfs_meta_close( &d->meta );
+  }
+  d->store = 0;
+  d->batch = 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_lookup()
+// ~~~~~~~~~~~~~~~~
+// Returns entry of dir, the least recently used one is taken over if dir
+// has none
+// Status: finished
+//----------------------------------------------------------------------------
+static struct sfsd_dir *
+sfs_dir_lookup( const char *dir )
+{
+  struct sfsd_dir *d = NULL;
+  int i;
+
+  for (i=0;i<SFSD_MAX_DIRS;i++)
+    if (dirs[i].used && !strcmp( dirs[i].dir, dir )) {
+      d = &dirs[i];
+      break;
+    }
+  if (!d) {
+    d = &dirs[0];
+    for (i=1;(i<SFSD_MAX_DIRS) && d->used;i++)
+      if (dirs[i].used < d->used)
+        d = &dirs[i];
+    for (i=0;i<SFSD_DIR_FILES;i++)
+      sfs_dir_clear( &d->files[i] );
+    sfs_dir_close( d );
+    strncpy( d->dir, dir, SFS_MAX_PATH );
+    d->dir[SFS_MAX_PATH-1] = 0;
+  }
+  d->used = ++dir_clock;
+  return d;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_get()
+// ~~~~~~~~~~~~~
+// Returns index of metadata file of directory, loads it if it is not
+// loaded yet or the file has changed since.  NULL if it cannot be read.
+// Status: finished
+//----------------------------------------------------------------------------
+static struct sfsd_dir_index *
+sfs_dir_get( struct sfsd_dir *d, int file )
+{
+  struct sfsd_dir_index *ix = &d->files[file];
+  char path[SFS_MAX_PATH];
+  struct stat st;
+  int exists, ret;
+
+  if (sfs_dir_path( path, d->dir, sfs_dir_names[file] ) == -1)
+    return NULL;
+  if (stat( path, &st ) == -1) {
+    if (errno != ENOENT) {
+      sfs_debug( "sfs_dir_get", "cannot stat %s", path );
+      return NULL;
+    }
+    exists = 0;
+  }
+  else
+    exists = 1;
+
+  if (ix->loaded && (ix->exists == exists) && (!exists || sfs_dir_same( &ix->st, &st )))
+    return ix;
+
+  sfs_dir_clear( ix );
+  if (exists) {
+    ret = (file == SFSD_DIR_SIZES) ? sfs_dir_load_sizes( ix, path )
+                                   : sfs_dir_load_keys( ix, path, sfs_dir_kinds[file] );
+    if ((ret == -1) && (errno != ENOENT)) {
+      sfs_debug( "sfs_dir_get", "cannot load %s", path );
+      sfs_dir_clear( ix );
+      return NULL;
+    }
+  }
+  if (sfs_dir_hash_entries( ix ) == -1) {
+    sfs_debug( "sfs_dir_get", "memory error" );
+    sfs_dir_clear( ix );
+    return NULL;
+  }
+  ix->st = st;
+  ix->exists = exists;
+  ix->loaded = 1;
+  return ix;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_entry()
+// ~~~~~~~~~~~~~~~
+// Returns record of (id, name) in index or NULL
+// Status: finished
+//----------------------------------------------------------------------------
+static struct sfsd_dir_entry *
+sfs_dir_entry( struct sfsd_dir_index *ix, uid_t id, const char *name )
+{
+  struct sfsd_dir_entry *en;
+  unsigned int h = sfs_dir_hash( id, name );
+  int i;
+
+  for (i=ix->heads[h & (ix->buckets - 1)];i!=-1;i=en->next) {
+    en = &ix->entries[i];
+    if ((en->hash == h) && (en->id == id) && !strcmp( ix->data + en->name, name ))
+      return en;
+  }
+  return NULL;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_forget()
+// ~~~~~~~~~~~~~~~~
+// Drops index of metadata file of directory the daemon has just changed.
+// The stat check would notice the change as well, but not one within the
+// resolution of the file times that leaves the size as it was.
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_dir_forget( struct sfsd_dir *d, int file )
+{
+  sfs_dir_clear( &d->files[file] );
+}
+
+
+/*
+ * Store of a directory
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_dir_legacy()
+// ~~~~~~~~~~~~~~~~
+// Tells whether dir has any of the metadata files used before the store
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_legacy( const char *dir )
+{
+  char path[SFS_MAX_PATH];
+  struct stat st;
+  int i;
+
+  for (i=0;i<SFSD_DIR_FILES;i++) {
+    if ((sfs_dir_path( path, dir, sfs_dir_names[i] ) == -1)
+        || (stat( path, &st ) != -1) || (errno != ENOENT))
+      return 1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_store()
+// ~~~~~~~~~~~~~~~
+// Returns mapped store of directory, it is mapped again if the file has
+// been replaced.  A change (create set) in a directory without any
+// metadata file creates the store if SFS_META_NEW is set.  NULL with errno
+// ENOENT if the directory keeps its metadata files.
+// Status: finished
+//----------------------------------------------------------------------------
+static sfs_meta *
+sfs_dir_store( struct sfsd_dir *d, int create )
+{
+  char path[SFS_MAX_PATH];
+  struct stat st;
+
+  if (sfs_dir_path( path, d->dir, SFS_META_FILE ) == -1)
+    return NULL;
+  if (stat( path, &st ) == -1) {
+    if (errno != ENOENT) {
+      sfs_debug( "sfs_dir_store", "cannot stat %s", path );
+      return NULL;
+    }
+    if (!create || !SFS_META_NEW || sfs_dir_legacy( d->dir )) {
+      sfs_dir_close( d );
+      errno = ENOENT;
+      return NULL;
+    }
+  }
+  else if (d->store && (st.st_dev == d->meta.st.st_dev) && (st.st_ino == d->meta.st.st_ino))
+    return &d->meta;
+
+  sfs_dir_close( d );
+  if (sfs_meta_open( &d->meta, path, create ) == -1) {
+    if (errno != ENOENT)
+      sfs_debug( "sfs_dir_store", "cannot open %s", path );
+    return NULL;
+  }
+  // Changes are synced by sfs_dir_commit() before the replies are sent
+  d->meta.batch = 1;
+  d->store = 1;
+  return &d->meta;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_put()
+// ~~~~~~~~~~~~~
+// Writes record to the store of directory, the store is mapped again on
+// the next use if it fails
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_put( struct sfsd_dir *d, const sfs_meta_record *r )
+{
+  char path[SFS_MAX_PATH];
+
+  sfs_dir_touch( d );
+  if ((sfs_dir_path( path, d->dir, SFS_META_FILE ) == -1)
+      || (sfs_meta_put( &d->meta, path, r ) == -1)) {
+    sfs_dir_close( d );
+    return -1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_find()
+// ~~~~~~~~~~~~~~
+// Finds record of (kind, id, name) in the store of dir, or in the index of
+// its metadata file if it has no store.  Returns 1, 0 if there is none or
+// -1.  Name and key of the record are valid until the next change.
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_find( const char *dir, int kind, uid_t id, const char *name, sfs_meta_record *r )
+{
+  struct sfsd_dir *d = sfs_dir_lookup( dir );
+  struct sfsd_dir_index *ix;
+  struct sfsd_dir_entry *en;
+  sfs_meta *m;
+
+  if ((m = sfs_dir_store( d, 0 )))
+    return sfs_meta_find( m, kind, id, name, r );
+  if (errno != ENOENT)
+    return -1;
+
+  if (!(ix = sfs_dir_get( d, kind - SFS_META_USER )))
+    return -1;
+  if (!(en = sfs_dir_entry( ix, ((kind == SFS_META_USER) || (kind == SFS_META_GROUP)) ? id : 0, name )))
+    return 0;
+  memset( r, 0, sizeof( *r ));
+  r->kind = kind;
+  r->size = en->size;
+  r->e.id = en->id;
+  r->e.engine = en->engine;
+  memcpy( r->e.nonce, en->nonce, SFS_NONCE_SIZE );
+  r->e.name = ix->data + en->name;
+  r->e.name_len = strlen( r->e.name );
+  r->e.key = (const unsigned char *)ix->data + en->key;
+  r->e.key_len = en->key_len;
+  return 1;
+}
+
+
+/*
+ * Lookups
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_dir_file_key()
+// ~~~~~~~~~~~~~~~~~~
+// Finds wrapped file key of key_type for id (ignored for all), returns its
+// length, 0 if there is none or -1
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_file_key( const char *dir, const char *name, int key_type, uid_t id, int *engine, unsigned char *nonce, unsigned char *ekey, int max )
+{
+  sfs_meta_record r;
+  int ret;
+
+  if ((key_type < SFS_KEY_USER) || (key_type > SFS_KEY_ALL))
+    return -1;
+  if ((ret = sfs_dir_find( dir, key_type, id, name, &r )) != 1)
+    return ret;
+  if ((r.e.key_len <= 0) || (r.e.key_len > max)) {
+    sfs_debug( "sfs_dir_file_key", "bad key record of %s%s", dir, name );
+    return -1;
+  }
+  *engine = r.e.engine;
+  memcpy( nonce, r.e.nonce, SFS_NONCE_SIZE );
+  memcpy( ekey, r.e.key, r.e.key_len );
+  return r.e.key_len;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_has_key()
+// ~~~~~~~~~~~~~~~~~
+// Tells whether file has key record of key_type for id, -1 if the store or
+// the key file cannot be read
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_has_key( const char *dir, const char *name, int key_type, uid_t id )
+{
+  sfs_meta_record r;
+
+  if ((key_type < SFS_KEY_USER) || (key_type > SFS_KEY_ALL))
+    return -1;
+  return sfs_dir_find( dir, key_type, id, name, &r );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_file_key_text()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Returns wrapped file key of key_type for id in the text form of
+// sfs_read_file_key(), NULL if there is none
+// Status: finished
+//----------------------------------------------------------------------------
+char *
+sfs_dir_file_key_text( const char *dir, const char *name, int key_type, uid_t id )
+{
+  unsigned char ekey[SFS_MAX_KEY];
+  sfs_key_entry e;
+  int len;
+
+  memset( &e, 0, sizeof( e ));
+  len = sfs_dir_file_key( dir, name, key_type, id, &e.engine, e.nonce, ekey, SFS_MAX_KEY );
+  if (len <= 0)
+    return NULL;
+  e.key = ekey;
+  e.key_len = len;
+  return sfs_keyfile_text( &e );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_file_size()
+// ~~~~~~~~~~~~~~~~~~~
+// Returns size of file from the store or .sfssizes, -1 if there is none
+// Status: finished
+//----------------------------------------------------------------------------
+off_t
+sfs_dir_file_size( const char *dir, const char *name )
+{
+  sfs_meta_record r;
+
+  if (sfs_dir_find( dir, SFS_META_SIZE, 0, name, &r ) != 1)
+    return -1;
+  return r.size;
+}
+
+
+/*
+ * Changes
+ *
+ */
+
+//----------------------------------------------------------------------------
+// sfs_dir_write_key()
+// ~~~~~~~~~~~~~~~~~~~
+// Writes wrapped file key of key_type for id given in text form to the
+// store of dir, which replaces the old key in one step.  A key file gets
+// the key appended, the old one is deleted first.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_write_key( const char *dir, const char *name, int key_type, uid_t id, const char *text )
+{
+  unsigned char key[SFS_MAX_KEY];
+  struct sfsd_dir *d;
+  sfs_meta_record r;
+  int ret = 0;
+
+  if ((key_type < SFS_KEY_USER) || (key_type > SFS_KEY_ALL))
+    return -1;
+  d = sfs_dir_lookup( dir );
+  if (sfs_dir_store( d, 1 )) {
+    memset( &r, 0, sizeof( r ));
+    if (sfs_keyfile_parse_text( text, &r.e, key, SFS_MAX_KEY ) == -1) {
+      sfs_debug( "sfs_dir_write_key", "bad key record of %s%s", dir, name );
+      return -1;
+    }
+    r.kind = key_type;
+    r.e.id = id;
+    r.e.name = name;
+    ret = sfs_dir_put( d, &r );
+    memset( key, 0, sizeof( key ));
+    return ret;
+  }
+  if (errno != ENOENT)
+    return -1;
+
+  if (sfs_dir_find( dir, key_type, id, name, &r ) == 1)
+    ret = sfs_dir_delete_key( dir, name, key_type, id );
+  if (ret == -1)
+    return -1;
+  switch (key_type) {
+    case SFS_KEY_USER:
+      ret = sfs_write_file_key( dir, name, id, text );
+      break;
+    case SFS_KEY_GROUP:
+      ret = sfs_write_g_file_key( dir, name, id, text );
+      break;
+    default:
+      ret = sfs_write_a_file_key( dir, name, text );
+      break;
+  }
+  sfs_dir_forget( d, key_type - SFS_KEY_USER );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_delete_key()
+// ~~~~~~~~~~~~~~~~~~~~
+// Deletes wrapped file key of key_type for id, -1 if there is none
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_delete_key( const char *dir, const char *name, int key_type, uid_t id )
+{
+  struct sfsd_dir *d;
+  sfs_meta *m;
+  int ret;
+
+  if ((key_type < SFS_KEY_USER) || (key_type > SFS_KEY_ALL))
+    return -1;
+  d = sfs_dir_lookup( dir );
+  if ((m = sfs_dir_store( d, 0 ))) {
+    sfs_dir_touch( d );
+    return sfs_meta_delete( m, key_type, id, name );
+  }
+  if (errno != ENOENT)
+    return -1;
+
+  switch (key_type) {
+    case SFS_KEY_USER:
+      ret = sfs_delete_file_key( dir, name, id );
+      break;
+    case SFS_KEY_GROUP:
+      ret = sfs_delete_g_file_key( dir, name, id );
+      break;
+    default:
+      ret = sfs_delete_a_file_key( dir, name );
+      break;
+  }
+  sfs_dir_forget( d, key_type - SFS_KEY_USER );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_write_size()
+// ~~~~~~~~~~~~~~~~~~~~
+// Writes size of file to the store of dir or to .sfssizes, the old size
+// is replaced.  In the store the size has a slot of its own, which is
+// written in place.  Its offset goes to *slot, so that the next size of
+// the file is written there without a lookup (the slot is checked to
+// belong to the file still).  .sfssizes gets the old line deleted and the
+// new one appended, *slot is 0 then.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_write_size( const char *dir, const char *name, off_t size, off_t *slot )
+{
+  struct sfsd_dir *d = sfs_dir_lookup( dir );
+  sfs_meta_record r;
+  sfs_meta *m;
+  int ret = 0;
+
+  if ((m = sfs_dir_store( d, 1 ))) {
+    sfs_dir_touch( d );
+    if (slot && *slot && (sfs_meta_set_size( m, *slot, name, size ) != -1))
+      return 0;
+    memset( &r, 0, sizeof( r ));
+    r.kind = SFS_META_SIZE;
+    r.size = size;
+    r.e.name = name;
+    if (sfs_dir_put( d, &r ) == -1)
+      return -1;
+    if (slot)
+      *slot = sfs_meta_size_slot( &d->meta, name );
+    return 0;
+  }
+  if (errno != ENOENT)
+    return -1;
+
+  if (slot)
+    *slot = 0;
+  if (sfs_dir_find( dir, SFS_META_SIZE, 0, name, &r ) == 1)
+    ret = sfs_delete_file_size( dir, name );
+  if (ret != -1)
+    ret = sfs_write_file_size( dir, name, size );
+  sfs_dir_forget( d, SFSD_DIR_SIZES );
+  return (ret == -1) ? -1 : 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_delete_size()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Deletes size of file, -1 if there is none
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_delete_size( const char *dir, const char *name )
+{
+  struct sfsd_dir *d = sfs_dir_lookup( dir );
+  sfs_meta *m;
+  int ret;
+
+  if ((m = sfs_dir_store( d, 0 ))) {
+    sfs_dir_touch( d );
+    return sfs_meta_delete( m, SFS_META_SIZE, 0, name );
+  }
+  if (errno != ENOENT)
+    return -1;
+
+  ret = sfs_delete_file_size( dir, name );
+  sfs_dir_forget( d, SFSD_DIR_SIZES );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_change()
+// ~~~~~~~~~~~~~~~~
+// Makes change c of the records of file name in store m, the deletion of
+// a record which is not there is no error
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_dir_change( sfs_meta *m, const char *path, const char *name, const struct sfsd_dir_change *c )
+{
+  unsigned char key[SFS_MAX_KEY];
+  sfs_meta_record r;
+  uid_t id = ((c->kind == SFS_META_USER) || (c->kind == SFS_META_GROUP)) ? c->id : 0;
+  int ret;
+
+  if ((c->kind == SFS_META_SIZE) ? (c->size == -1) : !c->text) {
+    if (sfs_meta_find( m, c->kind, id, name, &r ) != 1)
+      return 0;
+    return sfs_meta_delete( m, c->kind, id, name );
+  }
+
+  memset( &r, 0, sizeof( r ));
+  if ((c->kind != SFS_META_SIZE) && (sfs_keyfile_parse_text( c->text, &r.e, key, SFS_MAX_KEY ) == -1)) {
+    sfs_debug( "sfs_dir_change", "bad key record of %s", name );
+    return -1;
+  }
+  r.kind = c->kind;
+  r.size = c->size;
+  r.e.id = id;
+  r.e.name = name;
+  ret = sfs_meta_put( m, path, &r );
+  memset( key, 0, sizeof( key ));
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_apply()
+// ~~~~~~~~~~~~~~~
+// Makes n changes of the records of file, like chmod does with its keys
+// and size.  A store gets them in one transaction, so they count all or
+// none after a crash, and one sync.  Metadata files get them one by one,
+// each file is rewritten once as a change touches one record of it.  The
+// deletion of a record which is not there is no error.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_apply( const char *dir, const char *name, const struct sfsd_dir_change *c, int n )
+{
+  struct sfsd_dir *d = sfs_dir_lookup( dir );
+  char path[SFS_MAX_PATH];
+  sfs_meta_record r;
+  sfs_meta *m;
+  int i, create = 0, ret = 0;
+
+  for (i=0;i<n;i++)
+    if ((c[i].kind == SFS_META_SIZE) ? (c[i].size != -1) : (c[i].text != NULL))
+      create = 1;
+
+  if ((m = sfs_dir_store( d, create ))) {
+    sfs_dir_touch( d );
+    if ((sfs_dir_path( path, dir, SFS_META_FILE ) == -1)
+        || (sfs_meta_begin( m, path, n ) == -1))
+      ret = -1;
+    for (i=0;(i<n) && (ret != -1);i++)
+      ret = sfs_dir_change( m, path, name, &c[i] );
+    if (ret == -1)
+      sfs_meta_abort( m );
+    else
+      ret = sfs_meta_end( m );
+    if (ret == -1) {
+      sfs_debug( "sfs_dir_apply", "changes of %s%s not written", dir, name );
+      sfs_dir_close( d );
+    }
+    return ret;
+  }
+  if (errno != ENOENT)
+    return -1;
+
+  for (i=0;(i<n) && (ret != -1);i++) {
+    if (c[i].kind == SFS_META_SIZE) {
+      if (c[i].size != -1)
+        ret = sfs_dir_write_size( dir, name, c[i].size, NULL );
+      else if (sfs_dir_find( dir, SFS_META_SIZE, 0, name, &r ) == 1)
+        ret = sfs_dir_delete_size( dir, name );
+    }
+    else if (c[i].text)
+      ret = sfs_dir_write_key( dir, name, c[i].kind, c[i].id, c[i].text );
+    else if (sfs_dir_find( dir, c[i].kind, c[i].id, name, &r ) == 1)
+      ret = sfs_dir_delete_key( dir, name, c[i].kind, c[i].id );
+  }
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_request()
+// ~~~~~~~~~~~~~~~~~
+// Tells which reply of the batch the following changes belong to, -1 for
+// changes made outside of requests
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_dir_request( int reply )
+{
+  dir_reply = reply;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_commit()
+// ~~~~~~~~~~~~~~~~
+// Syncs the changes of all stores made since the last commit, one
+// fdatasync() per changed store.  Returns 0 or -1 if some failed, the
+// replies which waited for them are told by sfs_dir_failed().
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_dir_commit( void )
+{
+  int i, ret = 0;
+
+  for (i=0;i<SFSD_MAX_DIRS;i++)
+    if (dirs[i].store && (sfs_dir_sync( &dirs[i] ) == -1))
+      ret = -1;
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_failed()
+// ~~~~~~~~~~~~~~~~
+// Returns replies of the batch whose changes were lost since the last
+// call, bit i for reply i, and forgets them
+// Status: finished
+//----------------------------------------------------------------------------
+unsigned long
+sfs_dir_failed( void )
+{
+  unsigned long failed = dir_failed;
+
+  dir_failed = 0;
+  return failed;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_dir_tidy()
+// ~~~~~~~~~~~~~~
+// Writes again the stores whose heaps are mostly deleted data, run by the
+// timer of the main loop
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_dir_tidy( void )
+{
+  char path[SFS_MAX_PATH];
+  int i;
+
+  for (i=0;i<SFSD_MAX_DIRS;i++) {
+    if (!dirs[i].store)
+      continue;
+    if ((sfs_dir_path( path, dirs[i].dir, SFS_META_FILE ) == -1)
+        || (sfs_meta_tidy( &dirs[i].meta, path ) == -1))
+      sfs_dir_close( &dirs[i] );
+  }
+}
@@ -0,0 +1,307 @@
+/*
+ * sfsd_job.c
+ *
+ * SFS daemon chmod conversions running in background.
+ *
+ * Copyright 1998 Michal Svec <rebel@atrey.karlin.mff.cuni.cz>
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define _SFS_DEBUG_DAEMON
+
+#include "sfs.h"
+#include "sfsd.h"
+#include "sfs_debug.h"
+
+
+/*
+ * Internal structures
+ *
+ */
+
+//----------------------------------------------------------------------------
+// jobs
+// ~~~~
+// Internal structure containing conversions running in background
+//----------------------------------------------------------------------------
+struct sfs_job jobs[SFSD_MAX_JOBS];
+
+//----------------------------------------------------------------------------
+// last_job_id
+// ~~~~~~~~~~~
+// Id of the last started job, ids are not reused so that a client polling
+// an old job does not get a new one
+//----------------------------------------------------------------------------
+int last_job_id = 0;
+
+
+//----------------------------------------------------------------------------
+// sfs_job_thread()
+// ~~~~~~~~~~~~~~~~
+// Converts file of the job, then wakes up the main thread by SIGUSR1
+// Status: finished
+//----------------------------------------------------------------------------
+static void *
+sfs_job_thread( void *p )
+{
+  struct sfs_job *job = p;
+
+  job->size = sfsd_convert( job->in, job->out, job->limit, sfs_conv_crypt, &job->conv, &job->done );
+  __close( job->in );
+  __close( job->out );
+  __atomic_store_n( &job->state, SFS_JOB_CONVERTED, __ATOMIC_RELEASE );
+  kill( getpid(), SIGUSR1 );
+  return NULL;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_start_job()
+// ~~~~~~~~~~~~~~~
+// Starts background conversion of in to out for chmod request, takes the
+// files and temppath over.  Returns id of the job or -1.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_start_job( struct sfs_chmod_request *req, int in, int out, char *temppath, off_t limit, struct sfs_conv_arg *conv, const char *wkey )
+{
+  struct sfs_job *job = NULL;
+  struct stat st;
+  sigset_t all, old;
+  int i, ret;
+
+  // Free entry or the oldest finished job, which is forgotten then
+  for (i=0;i<SFSD_MAX_JOBS;i++) {
+    if (jobs[i].state == SFS_JOB_FREE) {
+      job = &jobs[i];
+      break;
+    }
+    if (((jobs[i].state == SFS_JOB_DONE) || (jobs[i].state == SFS_JOB_FAILED))
+        && (!job || (jobs[i].id < job->id)))
+      job = &jobs[i];
+  }
+  if (!job) {
+    sfs_debug( "sfs_start_job", "too many jobs" );
+    return -1;
+  }
+
+  memset( job, 0, sizeof( struct sfs_job ));
+  job->req = *req;
+  job->in = in;
+  job->out = out;
+  job->temppath = temppath;
+  job->limit = limit;
+  job->total = (fstat( in, &st ) == -1) ? 0 : st.st_size;
+  if ((limit != -1) && (limit < job->total))
+    job->total = limit;
+
+  // the keys of the request are on its stack
+  job->ctx = *conv->ctx;
+  memcpy( job->nonce, conv->nonce, SFS_NONCE_SIZE );
+  job->conv.engine = conv->engine;
+  job->conv.ctx = &job->ctx;
+  job->conv.nonce = job->nonce;
+  job->conv.ecb = NULL;
+  if (conv->ecb) {
+    job->ecb = *conv->ecb;
+    job->conv.ecb = &job->ecb;
+  }
+  if (wkey && !(job->wkey = strdup( wkey ))) {
+    sfs_debug( "sfs_start_job", "memory error" );
+    memset( job, 0, sizeof( struct sfs_job ));
+    return -1;
+  }
+
+  job->id = ++last_job_id;
+  job->state = SFS_JOB_RUNNING;
+
+  // Signals stay with the main thread, the threads of the job inherit it
+  sigfillset( &all );
+  pthread_sigmask( SIG_SETMASK, &all, &old );
+  ret = pthread_create( &job->thread, NULL, sfs_job_thread, job );
+  pthread_sigmask( SIG_SETMASK, &old, NULL );
+  if (ret) {
+    sfs_debug( "sfs_start_job", "cannot start thread: %d", ret );
+    if (job->wkey) {
+      memset( job->wkey, 0, strlen( job->wkey ));
+      free( job->wkey );
+    }
+    memset( job, 0, sizeof( struct sfs_job ));
+    return -1;
+  }
+
+  sfs_debug( "sfs_start_job", "job %d: %s%s", job->id, req->dir, req->name );
+  return job->id;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_find_job_path()
+// ~~~~~~~~~~~~~~~~~~~
+// Returns index of running job converting the file or -1, the file is
+// locked against open, read, write and chmod until the job ends
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_find_job_path( const char *dir, const char *name )
+{
+  int i;
+
+  for (i=0;i<SFSD_MAX_JOBS;i++)
+    if (((jobs[i].state == SFS_JOB_RUNNING) || (jobs[i].state == SFS_JOB_CONVERTED))
+        && !strcmp( jobs[i].req.dir, dir ) && !strcmp( jobs[i].req.name, name ))
+      return i;
+  return -1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_jobs_active()
+// ~~~~~~~~~~~~~~~~~
+// Returns number of jobs not switched over yet
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_jobs_active( void )
+{
+  int i, n = 0;
+
+  for (i=0;i<SFSD_MAX_JOBS;i++)
+    if ((jobs[i].state == SFS_JOB_RUNNING) || (jobs[i].state == SFS_JOB_CONVERTED))
+      n++;
+  return n;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_job_status()
+// ~~~~~~~~~~~~~~~~
+// Fills job request with the state of job
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_job_status( struct sfs_job *job, struct sfs_job_request *req )
+{
+  req->job = job->id;
+  req->state = __atomic_load_n( &job->state, __ATOMIC_ACQUIRE );
+  req->done = __atomic_load_n( &job->done, __ATOMIC_RELAXED );
+  req->total = job->total;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_job_reply()
+// ~~~~~~~~~~~~~~~
+// Sends the end of job to the waiting clients
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_job_reply( struct sfs_job *job )
+{
+  struct s_msg msgb;
+  int i, reply_queue;
+
+  memset( &msgb, 0, sizeof( msgb ));
+  msgb.mtype = SFS_MESSAGE;
+  msgb.sfs_msg.sfs_req_type = SFS_REPLY_REQ;
+  msgb.sfs_msg.sfs_req_auth = job->result;
+  sfs_job_status( job, &msgb.sfs_msg.sfs_req.sfs_job );
+
+  for (i=0;i<job->nwaiters;i++) {
+    msgb.sfs_msg.sfs_req_reply_queue = job->waiters[i];
+    reply_queue = msgget( job->waiters[i], SFS_C_QUEUE_PERM );
+    if ((reply_queue == -1) || (msgsnd( reply_queue, &msgb, SFS_MSG_SIZE, IPC_NOWAIT ) == -1))
+      sfs_debug( "sfs_job_reply", "cannot send reply of job %d", job->id );
+  }
+  job->nwaiters = 0;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_finish_jobs()
+// ~~~~~~~~~~~~~~~~~
+// Switches over files of converted jobs and answers clients waiting for
+// them, called by the main loop
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_finish_jobs( void )
+{
+  struct sfs_job *job;
+  int i;
+
+  for (i=0;i<SFSD_MAX_JOBS;i++) {
+    job = &jobs[i];
+    if (__atomic_load_n( &job->state, __ATOMIC_ACQUIRE ) != SFS_JOB_CONVERTED)
+      continue;
+    pthread_join( job->thread, NULL );
+
+    job->result = sfs_chmod_finish( job );
+    // The client is answered at once, not with the next batch
+    if ((job->result == SFS_REPLY_OK) && (sfs_dir_commit() == -1))
+      job->result = SFS_REPLY_FAIL;
+    job->state = (job->result == SFS_REPLY_OK) ? SFS_JOB_DONE : SFS_JOB_FAILED;
+    sfs_debug( "sfs_finish_jobs", "job %d: %s%s %s", job->id, job->req.dir,
+               job->req.name, (job->result == SFS_REPLY_OK) ? "done" : "failed" );
+
+    free( job->temppath );
+    if (job->wkey) {
+      memset( job->wkey, 0, strlen( job->wkey ));
+      free( job->wkey );
+    }
+    job->temppath = NULL;
+    job->wkey = NULL;
+    memset( &job->ctx, 0, sizeof( job->ctx ));
+    memset( &job->ecb, 0, sizeof( job->ecb ));
+    sfs_job_reply( job );
+  }
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_job_request()
+// ~~~~~~~~~~~~~~~~~
+// Handle job request, the reply of a waiting client is sent by
+// sfs_finish_jobs()
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_job_request( struct sfs_job_request *req, uid_t uid, int reply_queue_id )
+{
+  struct sfs_job *job;
+  int i;
+
+  for (i=0;i<SFSD_MAX_JOBS;i++)
+    if ((jobs[i].state != SFS_JOB_FREE) && (jobs[i].id == req->job))
+      break;
+  if ((i == SFSD_MAX_JOBS) || ((uid != 0) && (uid != jobs[i].req.uid))) {
+    sfs_debug( "sfsd_job_request", "no job %d of user %d", req->job, uid );
+    req->state = SFS_JOB_FREE;
+    return SFS_REPLY_FAIL;
+  }
+  job = &jobs[i];
+
+  sfs_job_status( job, req );
+  if (job->state == SFS_JOB_DONE)
+    return SFS_REPLY_OK;
+  if (job->state == SFS_JOB_FAILED)
+    return SFS_REPLY_FAIL;
+
+  // If there are too many waiters the client gets the state and asks again
+  if (req->wait && (job->nwaiters < SFSD_JOB_WAITERS)) {
+    job->waiters[job->nwaiters++] = reply_queue_id;
+    return SFSD_REPLY_LATER;
+  }
+  return SFS_REPLY_OK;
+}
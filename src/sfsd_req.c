@@ -14,6 +14,7 @@
 
 #include <errno.h> 
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -22,9 +23,11 @@
 
 #include "sfs.h"
 #include "sfsd.h"
+#include "sfs_lib.h"
 #include "sfs_misc.h"
 #include "sfs_debug.h"
 #include "sfs_secure.h"
+#include "sfs_cipher.h"
 
 /*
  * Internal structures
@@ -46,6 +49,13 @@ int last_user  = 0;
 //----------------------------------------------------------------------------
 struct sfs_file files[SFS_MAX_FILES];
 
+//----------------------------------------------------------------------------
+// file_ctx
+// ~~~~~~~~
+// Key schedules of files, valid for files in SFS_FILE_READY state
+//----------------------------------------------------------------------------
+sfs_cipher_ctx file_ctx[SFS_MAX_FILES];
+
 //----------------------------------------------------------------------------
 // last_file
 // ~~~~~~~~~
@@ -53,6 +63,20 @@ struct sfs_file files[SFS_MAX_FILES];
 //----------------------------------------------------------------------------
 int last_file = 0;
 
+//----------------------------------------------------------------------------
+// reap_cursor
+// ~~~~~~~~~~~
+// Next file to be checked by the reaper
+//----------------------------------------------------------------------------
+int reap_cursor = 0;
+
+//----------------------------------------------------------------------------
+// sfs_reaped_files
+// ~~~~~~~~~~~~~~~~
+// Number of files reclaimed from dead processes
+//----------------------------------------------------------------------------
+long sfs_reaped_files = 0;
+
 
 /*
  * Requests
@@ -71,11 +95,144 @@ sfs_init_requests( void )
 {
   int i;
   
-  for (i=0;i<SFS_MAX_FILES;i++)
+  for (i=0;i<SFS_MAX_FILES;i++) {
+    files[i].state = SFS_FILE_FREE;
     files[i].key[0] = 0;
+  }
+  return SFS_REPLY_OK;
+}
+
+//----------------------------------------------------------------------------
+// sfs_save_state()
+// ~~~~~~~~~~~~~~~~
+// Writes logged in users and opened files to fd for restarted daemon
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_save_state( int fd )
+{
+  struct sfsd_state st;
+  size_t len;
+
+  st.magic = SFSD_STATE_MAGIC;
+  st.version = SFSD_STATE_VERSION;
+  st.user_size = sizeof( struct sfs_user );
+  st.file_size = sizeof( struct sfs_file );
+  st.last_user = last_user;
+  st.last_file = last_file;
+  st.reaped_files = sfs_reaped_files;
+
+  if (__write( fd, &st, sizeof( st )) != sizeof( st )) {
+    sfs_debug( "sfs_save_state", "cannot write header: %d", errno );
+    return SFS_REPLY_FAIL;
+  }
+
+  len = last_user * sizeof( struct sfs_user );
+  if (__write( fd, users, len ) != (ssize_t)len) {
+    sfs_debug( "sfs_save_state", "cannot write users: %d", errno );
+    return SFS_REPLY_FAIL;
+  }
+
+  len = last_file * sizeof( struct sfs_file );
+  if (__write( fd, files, len ) != (ssize_t)len) {
+    sfs_debug( "sfs_save_state", "cannot write files: %d", errno );
+    return SFS_REPLY_FAIL;
+  }
+
+  return SFS_REPLY_OK;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_load_state()
+// ~~~~~~~~~~~~~~~~
+// Reads logged in users and opened files saved by sfs_save_state()
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_load_state( int fd )
+{
+  struct sfsd_state st;
+  size_t len;
+  int i;
+
+  if (__read( fd, &st, sizeof( st )) != sizeof( st )) {
+    sfs_debug( "sfs_load_state", "cannot read header: %d", errno );
+    return SFS_REPLY_FAIL;
+  }
+
+  if ((st.magic != SFSD_STATE_MAGIC) || (st.version != SFSD_STATE_VERSION)
+      || (st.user_size != sizeof( struct sfs_user ))
+      || (st.file_size != sizeof( struct sfs_file ))
+      || (st.last_user < 0) || (st.last_user > SFS_MAX_USERS)
+      || (st.last_file < 0) || (st.last_file > SFS_MAX_FILES)) {
+    sfs_debug( "sfs_load_state", "incompatible state" );
+    return SFS_REPLY_FAIL;
+  }
+
+  len = st.last_user * sizeof( struct sfs_user );
+  if (__read( fd, users, len ) != (ssize_t)len) {
+    sfs_debug( "sfs_load_state", "cannot read users: %d", errno );
+    return SFS_REPLY_FAIL;
+  }
+
+  len = st.last_file * sizeof( struct sfs_file );
+  if (__read( fd, files, len ) != (ssize_t)len) {
+    sfs_debug( "sfs_load_state", "cannot read files: %d", errno );
+    sfs_init_requests();
+    return SFS_REPLY_FAIL;
+  }
+
+  last_user = st.last_user;
+  last_file = st.last_file;
+  sfs_reaped_files = st.reaped_files;
+
+  // key schedules are not in the state, the keys are
+  for (i=0;i<last_file;i++)
+    if ((files[i].state == SFS_FILE_READY)
+        && (sfs_cipher_set_key( files[i].engine, &file_ctx[i], files[i].key ) == -1)) {
+      files[i].key[0] = 0;
+      files[i].state = SFS_FILE_WRAPPED;
+    }
   return SFS_REPLY_OK;
 }
 
+
+//----------------------------------------------------------------------------
+// sfs_ecb_pad()
+// ~~~~~~~~~~~~~
+// Fills the bytes of the last ECB block of file past its tail bytes of
+// data by their count, so that the size can be recovered from the file
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_ecb_pad( unsigned char *block, int tail )
+{
+  memset( block + tail, SFS_BF_BLOCK_SIZE - tail, SFS_BF_BLOCK_SIZE - tail );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_ecb_padding()
+// ~~~~~~~~~~~~~~~~~
+// Returns count of the bytes filled by sfs_ecb_pad() in decrypted last
+// block of file, 0 if the block was not filled so
+// Status: finished
+//----------------------------------------------------------------------------
+static int
+sfs_ecb_padding( const unsigned char *block )
+{
+  int pad = block[SFS_BF_BLOCK_SIZE-1], i;
+
+  if ((pad < 1) || (pad > SFS_BF_BLOCK_SIZE))
+    return 0;
+  for (i=SFS_BF_BLOCK_SIZE-pad;i<SFS_BF_BLOCK_SIZE;i++)
+    if (block[i] != pad)
+      return 0;
+  return pad;
+}
+
+
 #undef DE
 #define DE DEB( "sfs_open_request" );
 
@@ -83,25 +240,22 @@ sfs_init_requests( void )
 // sfs_open_request()
 // ~~~~~~~~~~~~~~~~~~
 // Handle open request
+// Only locates the wrapped file key, the RSA unwrap is left for the first
+// read or write (see sfs_get_file_key())
 // Status: NOT finished
 //----------------------------------------------------------------------------
 int
 sfs_open_request( struct sfs_open_request *req )
 {
-  char *ekey, *dkey, *ekey_bin;
+  unsigned char ekey[SFS_MAX_KEY], nonce[SFS_NONCE_SIZE];
   struct sfs_user *user;
-  rsa_key *rk;
-  int len;
+  int i, f, len = 0, key_type, engine;
   off_t size;
 _DE
   
 DE
 //  sfs_debug( "sfsd_open_request", "open: %d, %s%s.", req->pid, req->dir, req->name );
-  if (last_file >= SFS_MAX_FILES) {
-    sfs_debug( "sfsd_open_request", "maximum number of files reached" );
-    return SFS_REPLY_FAIL;
-  }
-
+  // Full table is handled by sfs_add_file(), it can reap dead files first
 DE
   user = sfs_find_user( req->uid );
   if (!user) {
@@ -109,64 +263,64 @@ DE
     return SFS_REPLY_FAIL;
   }
 
-DE
-  ekey = sfs_read_file_key( req->dir, req->name, req->uid );
-  rk = sfs_asym_parse_key( user->key );
-
-  if (!ekey) {
-    ekey = sfs_read_g_file_key( req->dir, req->name, req->gid );
-    rk = sfs_asym_parse_key( user->gkey );
-    if (!ekey) {
-      ekey = sfs_read_a_file_key( req->dir, req->name );
-      rk = sfs_asym_parse_key( user->akey );
-      if (!ekey) {
-        sfs_debug( "sfsd_open_request", "file %s%s key read error -> O.K. (NOT encrypted)", req->dir, req->name );
-        return SFS_REPLY_OK;
-      }
-    }
-  }
-
-DE
-  if (!rk) {
-    sfs_debug( "sfsd_open_request", "rk error" );
+  // File being converted by chmod is locked until the switch over
+  if (sfs_find_job_path( req->dir, req->name ) != -1) {
+    sfs_debug( "sfsd_open_request", "file %s%s is being converted", req->dir, req->name );
     return SFS_REPLY_FAIL;
   }
 
 DE
-  ekey_bin = hex2bit( ekey, 0 );
-  if (!ekey_bin) {
-    sfs_debug( "sfsd_open_request", "bin_ekey error" );
-    return SFS_REPLY_FAIL;
+  // The user's key first, then the group's and all's
+  for (key_type=SFS_KEY_USER;key_type<=SFS_KEY_ALL;key_type++) {
+    len = sfs_dir_file_key( req->dir, req->name, key_type,
+                            (key_type == SFS_KEY_GROUP) ? req->gid : req->uid,
+                            &engine, nonce, ekey, SFS_MAX_KEY );
+    if (len)
+      break;
   }
-
-DE
-  len = strlen( ekey ) / 2;
-  dkey = sfs_asym_decrypt( rk, ekey_bin, &len );
-  if (!dkey) {
-    sfs_debug( "sfsd_open_request", "decrypt key error" );
-    return SFS_REPLY_FAIL;
+  if (!len) {
+    sfs_debug( "sfsd_open_request", "file %s%s key read error -> O.K. (NOT encrypted)", req->dir, req->name );
+    req->size = -1;
+    return SFS_REPLY_OK;
   }
-
-DE /*
-  dkey = bit2hex( dkey_bin, len );
-  if (!dkey) {
-    sfs_debug( "sfsd_open_request", "bin_dkey error" );
+  // The key record tells the format of the file
+  if ((len == -1) || (engine < 0) || (engine >= SFS_ENGINES)) {
+    sfs_debug( "sfsd_open_request", "file %s%s bad key record", req->dir, req->name );
     return SFS_REPLY_FAIL;
-  } */
+  }
 
 DE
-  if ((size = sfs_read_file_size( req->dir, req->name )) == -1) {
-    sfs_debug( "sfsd_open_request", "size getting error" );
-    return SFS_REPLY_FAIL;
+  // Size of a file opened already is newer than the one in .sfssizes
+  if ((i = sfs_find_file_path( req->dir, req->name )) != -1)
+    size = files[i].size;
+  else {
+    if ((size = sfs_dir_file_size( req->dir, req->name )) == -1) {
+      sfs_debug( "sfsd_open_request", "size getting error" );
+      return SFS_REPLY_FAIL;
+    }
+    if (sfs_cipher_engines[engine].mode == SFS_CIPHER_CTR)
+      size = sfs_recover_file_size( req->dir, req->name, SFS_CIPHER_CTR, size, NULL );
   }
 
 DE
-  if (sfs_add_file( req->pid, req->fd, dkey, size, req->dir, req->name ) != SFS_REPLY_OK) {
+  if (sfs_add_file( req->pid, req->fd, req->uid, key_type, engine, nonce, (char *)ekey, len, size, req->dir, req->name ) != SFS_REPLY_OK) {
     sfs_debug( "sfsd_open_request", "add key error" );
     return SFS_REPLY_FAIL;
   }
 
-//  sfs_debug( "sfsd_open_request", "opened: %d, %d, %s", req->pid, req->fd, dkey );
+  // The tail of ECB data is in its last block, the key is unwrapped now
+  if ((i == -1) && (sfs_cipher_engines[engine].mode != SFS_CIPHER_CTR)) {
+    f = sfs_find_file( req->pid, req->fd );
+    size = sfs_recover_file_size( req->dir, req->name, SFS_CIPHER_ECB, size,
+                                  sfs_get_file_key( req->pid, req->fd ) ? &file_ctx[f].bf : NULL );
+    if (size != files[f].size) {
+      files[f].size = size;
+      files[f].dirty = 1;
+    }
+  }
+
+  req->size = size;
+//  sfs_debug( "sfsd_open_request", "opened: %d, %d, %s", req->pid, req->fd, ekey );
   return SFS_REPLY_OK;
 }
 
@@ -180,8 +334,14 @@ DE
 int
 sfs_close_request( struct sfs_close_request *req )
 {
+  int i;
+
 //  sfs_debug( "sfsd_close_request", "close: %d, %d .", req->pid, req->fd );
   
+  if ((i = sfs_find_file( req->pid, req->fd )) != -1)
+    if (sfs_flush_file_size( i ) != SFS_REPLY_OK)
+      sfs_debug( "sfsd_close_request", "size flush error" );
+
   if (sfs_del_file_key( req->pid, req->fd) != SFS_REPLY_OK) {
     sfs_debug( "sfsd_close_request", "file delete error" );
     return SFS_REPLY_FAIL;
@@ -203,8 +363,8 @@ sfs_close_request( struct sfs_close_request *req )
 int
 sfs_read_request( struct sfs_read_request *req )
 {
-  char *key, *ret;
-  unsigned int i;
+  char *key;
+  int f;
 //  char *tmp_buf = (char*) malloc( req->count+1 );
 _DE
 
@@ -216,6 +376,28 @@ _DE
     sfs_debug( "sfsd_read_request", "file key not found!!!" );
     return SFS_REPLY_FAIL;
   }
+  if (req->count > SFS_MAX_BUF_SIZE) {
+    sfs_debug( "sfsd_read_request", "count %d too big", req->count );
+    return SFS_REPLY_FAIL;
+  }
+
+DE
+  // File being converted by chmod is locked until the switch over
+  f = sfs_find_file( req->pid, req->fd );
+  if (sfs_find_job_path( files[f].dir, files[f].name ) != -1) {
+    sfs_debug( "sfsd_read_request", "file %s%s is being converted", files[f].dir, files[f].name );
+    return SFS_REPLY_FAIL;
+  }
+
+  // CTR files are decrypted in place at any offset
+  if (sfs_cipher_engines[files[f].engine].mode == SFS_CIPHER_CTR) {
+    if (sfs_cipher_crypt( files[f].engine, &file_ctx[f], files[f].nonce, req->offset, req->buf, req->count ) == -1) {
+      sfs_debug( "sfsd_read_request", "decryption failed!!!" );
+      return SFS_REPLY_FAIL;
+    }
+    req->size = files[f].size;
+    return SFS_REPLY_OK;
+  }
 
 DE /*
   if (tmp_buf) {
@@ -226,19 +408,12 @@ DE /*
   } */
 
 DE // count=0 !!!!
-  ret = sfs_sym_decrypt( key, req->buf, req->count );
-  if (!ret) {
-    sfs_debug( "sfsd_read_request", "decryption failed!!!" );
-    return SFS_REPLY_FAIL;
-  }
-  
-DE
-  for (i=0; i<req->count; i++) {
-//    sfs_debug( "sfs_read_request", "%d: %c,%c", i, req->buf[i], ret[i] );
-    req->buf[i] = ret[i];
-  }
+  // ECB files are decrypted in place too, buf is aligned in the message
+  sfs_sym_decrypt_blocks( &file_ctx[f].bf, (bf_block *)req->buf, req->count );
 
 DE
+  // Client needs the size to cut the data at the end of file
+  sfs_get_file_size( req->pid, req->fd, &(req->size) );
   return SFS_REPLY_OK;
 }
 
@@ -255,8 +430,9 @@ DE
 int
 sfs_write_request( struct sfs_write_request *req )
 {
-  char *key, *ret;
-  int i, cnt = req->count;
+  char *key;
+  int f, cnt = req->count;
+  off_t size, end;
 _DE
 
   sfs_debug( "sfsd_write_request", "write: %d, %d, %d.", req->pid, req->fd, req->count );
@@ -267,22 +443,116 @@ DE
     sfs_debug( "sfsd_read_request", "file key not found!!!" );
     return SFS_REPLY_FAIL;
   }
+  if (req->count > SFS_MAX_BUF_SIZE) {
+    sfs_debug( "sfsd_write_request", "count %d too big", req->count );
+    return SFS_REPLY_FAIL;
+  }
 
 DE
-  ret = sfs_sym_encrypt( key, req->buf, &cnt );
+  // Data written now would be lost when the converted file is renamed
+  f = sfs_find_file( req->pid, req->fd );
+  if (sfs_find_job_path( files[f].dir, files[f].name ) != -1) {
+    sfs_debug( "sfsd_write_request", "file %s%s is being converted", files[f].dir, files[f].name );
+    return SFS_REPLY_FAIL;
+  }
+  // Client tells where the write ends, gets size of the file back
+  if (sfs_get_file_size( req->pid, req->fd, &size ) != SFS_REPLY_OK) {
+    sfs_debug( "sfsd_write_request", "file size not found!!!" );
+    return SFS_REPLY_FAIL;
+  }
 
-  sfs_debug( "sfsd_write_request", "write: %d, %d.", cnt, ret );
+  if (sfs_cipher_engines[files[f].engine].mode == SFS_CIPHER_CTR) {
+    // CTR files are encrypted in place at any offset, nothing is padded
+    if (sfs_cipher_crypt( files[f].engine, &file_ctx[f], files[f].nonce, req->offset, req->buf, cnt ) == -1) {
+      sfs_debug( "sfsd_write_request", "encryption failed!!!" );
+      return SFS_REPLY_FAIL;
+    }
+  }
+  else {
+    // The last block of the write holds its end, if the end of the file
+    // is there too the rest of the block tells the tail
+    end = (req->size > size) ? req->size : size;
+    if (req->size && (cnt >= SFS_BF_BLOCK_SIZE) && !(cnt % SFS_BF_BLOCK_SIZE)
+        && (req->size / SFS_BF_BLOCK_SIZE == end / SFS_BF_BLOCK_SIZE))
+      sfs_ecb_pad( (unsigned char *)req->buf + cnt - SFS_BF_BLOCK_SIZE, end % SFS_BF_BLOCK_SIZE );
+    // the padding fits, SFS_MAX_BUF_SIZE is a multiple of BF_BLOCK_SIZE
+    cnt = sfs_sym_encrypt_blocks( &file_ctx[f].bf, (bf_block *)req->buf, cnt );
+    sfs_debug( "sfsd_write_request", "write: %d.", cnt );
+    req->count = cnt;
+  }
 
 DE
-  for (i=0; i<cnt; i++)
-    req->buf[i] = ret[i];
+  if (req->size > size) {
+    sfs_set_file_size( req->pid, req->fd, req->size );
+    size = req->size;
+  }
+  req->size = size;
 
-  req->count = cnt;
 DE  
   return SFS_REPLY_OK;
 }
 
 
+//----------------------------------------------------------------------------
+// sfs_conv_crypt()
+// ~~~~~~~~~~~~~~~~
+// Converts chunk of file for sfsd_convert(), ECB blocks are decrypted
+// first if there is ecb key, then CTR engine crypts the data
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_conv_crypt( void *arg, off_t offset, char *buf, int len )
+{
+  struct sfs_conv_arg *conv = arg;
+
+  if (conv->ecb)
+    sfs_sym_decrypt_blocks( conv->ecb, (bf_block *)buf, len );
+  if (sfs_cipher_engines[conv->engine].mode != SFS_CIPHER_CTR)
+    return 0;
+  return sfs_cipher_crypt( conv->engine, conv->ctx, conv->nonce, offset, buf, len );
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_chmod_engine()
+// ~~~~~~~~~~~~~~~~~~
+// Returns engine asked for in chmod request or -1, only CTR engines are
+// used for new files
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_chmod_engine( struct sfs_chmod_request *req )
+{
+  int engine = SFS_ENGINE_DEFAULT;
+
+  if (req->engine[0]) {
+    req->engine[SFS_MAX_ENGINE_NAME-1] = 0;
+    engine = sfs_cipher_find( req->engine );
+  }
+  if ((engine == -1) || (sfs_cipher_engines[engine].mode != SFS_CIPHER_CTR)) {
+    sfs_debug( "sfsd_chmod_engine", "bad engine %s", req->engine );
+    return -1;
+  }
+  return engine;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_chmod_change()
+// ~~~~~~~~~~~~~~~~~~
+// Fills change of a record of file for sfs_dir_apply()
+// Status: finished
+//----------------------------------------------------------------------------
+static void
+sfs_chmod_change( struct sfsd_dir_change *c, int kind, uid_t id, const char *text, off_t size )
+{
+  c->kind = kind;
+  c->id = id;
+  c->text = text;
+  c->size = size;
+}
+
+
 #undef DE
 #define DE DEB( "sfs_chmod_request" );
 
@@ -295,12 +565,18 @@ DE
 int
 sfs_chmod_request( struct sfs_chmod_request *req )
 {
-  char *dkey_hex=NULL, *ekey=NULL, *ekey_bin=NULL, *temppath=NULL,*enc_buf = NULL, *ekey_hex=NULL;
+  char *dkey_hex=NULL, *ekey=NULL, *ekey_bin=NULL, *temppath=NULL, *ekey_hex=NULL, *wkey=NULL;
   char buf[SFS_MAX_PATH];  
+  struct sfs_conv_arg conv;
+  unsigned char nonce[SFS_NONCE_SIZE];
   //struct sfs_login_request *user=NULL;
   rsa_key *privkey=NULL;
   rsa_key *pubkey=NULL;
-  int size,len,file,tempfile,ret, filesize, orig_filesize;
+  char *keys[3] = { NULL, NULL, NULL };
+  struct sfsd_dir_change changes[3];
+  int len, file=-1, tempfile=-1, engine, i, ret=SFS_REPLY_FAIL, written=0, dkey_len=0;
+  off_t orig_filesize;
+  sfs_cipher_ctx ctx;
   struct sfs_user * user=NULL;
 _DE
   
@@ -313,29 +589,59 @@ _DE
   }
 DE
 
+  req->job = 0;
+  if (sfs_find_job_path( req->dir, req->name ) != -1) {
+    sfs_debug( "sfsd_chmod_request", "file %s%s is being converted", req->dir, req->name );
+    return SFS_REPLY_FAIL;
+  }
+  // Opened files would keep using the old key and format, and their
+  // writes would be lost when the converted file is renamed over them
+  if (sfs_find_file_path( req->dir, req->name ) != -1) {
+    sfs_debug( "sfsd_chmod_request", "file %s%s is open", req->dir, req->name );
+    return SFS_REPLY_FAIL;
+  }
+
+  if (req->mode == SFS_CHMOD_MIGRATE)
+    return sfs_migrate_file( req );
+
  /*
   * file is NOT encrypted && change 'encrypted' attribute ON
   *
   */
   
   if (req->mode) {
-    if (sfs_read_file_key( req->dir, req->name, req->uid )) {
+    // An encrypted file keeps its keys, sfs_dir_write_key() would replace them
+    if (sfs_dir_has_key( req->dir, req->name, SFS_KEY_USER, req->uid )
+        || sfs_dir_has_key( req->dir, req->name, SFS_KEY_GROUP, req->gid )
+        || sfs_dir_has_key( req->dir, req->name, SFS_KEY_ALL, 0 )) {
 //      sfs_debug( "sfsd_chmod_request1", "MODE got:%d", req->mode );
       sfs_debug( "sfsd_chmod_request1", "file already encrypted" );
       return SFS_REPLY_FAIL;
     }
 
 DE    
+    engine = sfs_chmod_engine( req );
+    if (engine == -1)
+      return SFS_REPLY_FAIL;
+
     // Generates random file key (hex)
-    dkey_hex = sfs_sym_generate_key( SFS_FILE_KEY_SIZE );
+    dkey_hex = sfs_sym_generate_key( sfs_cipher_engines[engine].key_size );
     if (!dkey_hex) {
       sfs_debug( "sfsd_chmod_request1", "random key error" );
       return SFS_REPLY_FAIL;
     }
     len = strlen( dkey_hex );
+    dkey_len = len;
 //    sfs_debug( "sfsd_chmod_request1", "%s%s", req->dir, req->name );
 //    sfs_debug( "sfsd_chmod_request1", "generated filekey:%s", dkey_hex );
 
+    // All three key records share the nonce
+    sfs_sym_generate_nonce( nonce );
+    if (sfs_cipher_set_key( engine, &ctx, dkey_hex ) == -1) {
+      sfs_debug( "sfsd_chmod_request1", "key schedule error" );
+      goto out;
+    }
+
 // USER ---------------------------- //
 
 DE
@@ -343,7 +649,7 @@ DE
     pubkey = sfs_asym_parse_key( sfs_read_user_public_key(req->uid) );
     if (!pubkey) {
       sfs_debug( "sfsd_chmod_request1", "pubkey parse error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 
 DE 
@@ -351,23 +657,27 @@ DE
     ekey_bin = sfs_asym_encrypt( pubkey, dkey_hex, &len );
     if (!ekey_bin) {
       sfs_debug( "sfsd_chmod_request1", "encrypt file key error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 DE
     // Converts encrypted file key to hex
     ekey_hex = bit2hex(ekey_bin,len);
     if (!ekey_hex) {
       sfs_debug( "sfsd_chmod_request1", "ekey error" );
-      return SFS_REPLY_FAIL;
+      goto out;
+    }
+    wkey = ekey_hex;
+    ekey_hex = sfs_sym_make_blob( engine, nonce, wkey );
+    free( wkey );
+    if (!ekey_hex) {
+      sfs_debug( "sfsd_chmod_request1", "key record error" );
+      goto out;
     }
 //    sfs_debug( "sfsd_chmod_request1", "encrypted filekey:%s\n", ekey_hex );
 
-DE
-    // and writes it to .sfsdir
-    if (sfs_write_file_key( req->dir, req->name, req->uid, ekey_hex ) == -1) {
-      sfs_debug( "sfsd_chmod_request1", "write key error" );
-      return SFS_REPLY_FAIL;
-    }
+    // and keeps it for .sfsdir
+    keys[0] = ekey_hex;
+    ekey_hex = NULL;
 
 // GROUP --------------------------------//
 
@@ -380,7 +690,7 @@ DE
     pubkey = sfs_asym_parse_key(sfs_read_group_public_key(req->gid));
     if (!pubkey) {
       sfs_debug( "sfsd_chmod_request1", "pubkey parse error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 
 DE      
@@ -394,28 +704,27 @@ DE
     ekey_bin = sfs_asym_encrypt( pubkey, dkey_hex, &len );
     if (!ekey_bin) {
       sfs_debug( "sfsd_chmod_request1", "encrypt file key error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 DE
     // Converts encrypted file key to hex
-    if(ekey_hex)
-    {
-      free(ekey_hex);
-      ekey_hex = NULL;
-    }
     ekey_hex = bit2hex(ekey_bin,len);
     if (!ekey_hex) {
       sfs_debug( "sfsd_chmod_request1", "ekey error" );
-      return SFS_REPLY_FAIL;
+      goto out;
+    }
+    wkey = ekey_hex;
+    ekey_hex = sfs_sym_make_blob( engine, nonce, wkey );
+    free( wkey );
+    if (!ekey_hex) {
+      sfs_debug( "sfsd_chmod_request1", "key record error" );
+      goto out;
     }
 //    sfs_debug( "sfsd_chmod_request1", "encrypted filekey:%s\n", ekey_hex );
 
-DE
-    // and writes it to .sfsgdir
-    if(sfs_write_g_file_key( req->dir, req->name, req->gid, ekey_hex ) == -1) {
-      sfs_debug( "sfsd_chmod_request1", "write key error" );
-      return SFS_REPLY_FAIL;
-    }
+    // and keeps it for .sfsgdir
+    keys[1] = ekey_hex;
+    ekey_hex = NULL;
 
 // ALL  --------------------------------//
 
@@ -428,7 +737,7 @@ DE
     pubkey = sfs_asym_parse_key(sfs_read_all_public_key());
     if (!pubkey) {
       sfs_debug( "sfsd_chmod_request1", "rk error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 
 DE      
@@ -442,28 +751,27 @@ DE
     ekey_bin = sfs_asym_encrypt( pubkey, dkey_hex, &len );
     if (!ekey_bin) {
       sfs_debug( "sfsd_chmod_request1", "encrypt file key error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 DE
     // Converts encrypted file key to hex
-    if(ekey_hex)
-    {
-      free(ekey_hex);
-      ekey_hex = NULL;
-    }
     ekey_hex = bit2hex(ekey_bin,len);
     if (!ekey_hex) {
       sfs_debug( "sfsd_chmod_request1", "ekey error" );
-      return SFS_REPLY_FAIL;
+      goto out;
+    }
+    wkey = ekey_hex;
+    ekey_hex = sfs_sym_make_blob( engine, nonce, wkey );
+    free( wkey );
+    if (!ekey_hex) {
+      sfs_debug( "sfsd_chmod_request1", "key record error" );
+      goto out;
     }
 //    sfs_debug( "sfsd_chmod_request1", "encrypted filekey:%s\n", ekey_hex );
 
-DE
-    // and writes it to .sfsadir
-    if (sfs_write_a_file_key( req->dir, req->name, ekey_hex ) == -1) {
-      sfs_debug( "sfsd_chmod_request1", "write key error" );
-      return SFS_REPLY_FAIL;
-    }
+    // and keeps it for .sfsadir
+    keys[2] = ekey_hex;
+    ekey_hex = NULL;
 
 // Encryption of the whole file --------//
 
@@ -475,60 +783,43 @@ DE
     file = __open( buf, O_EXCL|O_RDONLY );
     if (file == -1) {
       sfs_debug( "sfsd_chmod_request1", "error openning %s: %d", buf, errno );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
     
 DE
     temppath = sfs_tempname( req->dir );
     if (!temppath) {
       sfs_debug( "sfsd_chmod_request1", "error getting tempname" );
-      __close( file );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
     
 DE
     tempfile = __open( temppath, O_WRONLY|O_CREAT|O_EXCL, req->rights /*S_IREAD|S_IWRITE*/ );
     if (tempfile == -1) {
       sfs_debug( "sfsd_chmod_request1", "error openning %s: %d", temppath, errno );
-      __close( file );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
-    
 
 DE
-    while ((size = read( file, buf, BF_BLOCK_SIZE ))) {
-      if (size == -1) {
-        sfs_debug( "sfsd_chmod_request1", "read error" );
-        __close( file );
-        __close( tempfile );
-        return SFS_REPLY_FAIL;
-      }
-      enc_buf = sfs_sym_encrypt( dkey_hex, buf, &size );
-      __write( tempfile, enc_buf, BF_BLOCK_SIZE );
+    // Key records of user, group and all are written at once, when the
+    // job can start
+    sfs_chmod_change( &changes[0], SFS_KEY_USER, req->uid, keys[0], 0 );
+    sfs_chmod_change( &changes[1], SFS_KEY_GROUP, req->gid, keys[1], 0 );
+    sfs_chmod_change( &changes[2], SFS_KEY_ALL, 0, keys[2], 0 );
+    // a failed write may leave some of the records too
+    written = 1;
+    if (sfs_dir_apply( req->dir, req->name, changes, 3 ) == -1) {
+      sfs_debug( "sfsd_chmod_request1", "write key error" );
+      goto out;
     }
 
 DE
-    __close( file );
-    __close( tempfile );
-    sprintf( buf, "%s%s", req->dir, req->name);
-    rename( temppath, buf );
-    if(ret!=0)
-      sfs_debug("sfs_chmod_request1","rename error: %s -> %s :%d", temppath, buf, ret);
-    // restores rights to the file 
-    ret = __chmod(buf, req->rights);
-//    sfs_debug("sfs_chmod_request1","changing back rights");
-    if(ret == -1)
-      sfs_debug("sfs_chmod_request1","error setting back rights");
-    // if demon runs as root it changes back owner of file
-    ret = __chown(buf,req->uid,-1);
-    if(ret == -1)
-      sfs_debug("sfs_chmod_request1","error changing back owner");
-
-DE
-    if (sfs_write_file_size( req->dir, req->name, req->size ) == -1) {
-      sfs_debug( "sfsd_chmod_request1", "write size error" );
-      return SFS_REPLY_FAIL;
-    }
+    // The rest is done by sfs_chmod_finish() when the job ends
+    conv.engine = engine;
+    conv.ctx = &ctx;
+    conv.nonce = nonce;
+    conv.ecb = NULL;
+    req->job = sfs_start_job( req, file, tempfile, temppath, -1, &conv, NULL );
   }
   
  /*
@@ -537,18 +828,23 @@ DE
   */
   
   else {
-    ekey = sfs_read_file_key( req->dir, req->name, req->uid );
+    ekey = sfs_dir_file_key_text( req->dir, req->name, SFS_KEY_USER, req->uid );
     if (!ekey) {
       sfs_debug( "sfsd_chmod_requesto", "get file key error or file is NOT encrypted" );
       return SFS_REPLY_FAIL;
     }
 
 DE
-    len = strlen( ekey );
-    ekey_bin = hex2bit( ekey, 0 );
+    wkey = sfs_sym_parse_blob( ekey, &engine, nonce );
+    if (!wkey) {
+      sfs_debug( "sfsd_chmod_request0", "bad key record" );
+      goto out;
+    }
+    len = strlen( wkey );
+    ekey_bin = hex2bit( wkey, 0 );
     if (!ekey_bin) {
       sfs_debug( "sfsd_chmod_request0", "ekey_bin error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
     len = len/2;
     
@@ -556,7 +852,7 @@ DE
     privkey = sfs_asym_parse_key( user->key );
     if (!privkey) {
       sfs_debug( "sfsd_chmod_request0", "privkey parse error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
 
 DE
@@ -567,8 +863,9 @@ DE
     dkey_hex = sfs_asym_decrypt( privkey, ekey_bin, &len );
     if (!dkey_hex) {
       sfs_debug( "sfsd_chmod_request0", "decrypt key error" );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
+    dkey_len = len;
 
 DE    
 
@@ -585,100 +882,373 @@ DE
     file = __open( buf, O_EXCL|O_RDONLY );
     if (file == -1) {
       sfs_debug( "sfsd_chmod_request0", "buf - error openning %s: %d", buf, errno );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
     
 DE
     temppath = sfs_tempname( req->dir );
     if (!temppath) {
       sfs_debug( "sfsd_chmod_request0", "error getting tempname" );
-      __close( file );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
     
 DE
     tempfile = __open( temppath, O_WRONLY|O_CREAT|O_EXCL, req->rights /*S_IREAD|S_IWRITE*/ );
     if (tempfile == -1) {
       sfs_debug( "sfsd_chmod_request0", "temppath - error openning %s: %d", temppath, errno );
-      __close( file );
-      return SFS_REPLY_FAIL;
+      goto out;
     }
     
-    /* decrypt the whole file using sfs_decrypt(buf,count,dkey) */
+    /* decrypt the whole file in blocks, ECB files with ctx.bf */
 DE
-    filesize = 0;
-    orig_filesize = sfs_read_file_size(req->dir, req->name);
-    if(orig_filesize == -1)
-    {
-      sfs_debug( "sfsd_chmod_request0", "error getting file size" );
-      return SFS_REPLY_FAIL;
+    if (sfs_cipher_set_key( engine, &ctx, dkey_hex ) == -1) {
+      sfs_debug( "sfsd_chmod_request0", "key schedule error" );
+      goto out;
     }
-    while ((size = read( file, buf, BF_BLOCK_SIZE ))) {
-      if (size == -1) {
-        sfs_debug( "sfsd_chmod_request0", "read error" );
-        __close( file );
-        __close( tempfile );
-        return SFS_REPLY_FAIL;
-      }
-      enc_buf = sfs_sym_decrypt( dkey_hex, buf, BF_BLOCK_SIZE );
-      if((filesize + size) > orig_filesize)
-      {
-        __write( tempfile, enc_buf, orig_filesize-filesize );
-      }
-      else
+    conv.engine = engine;
+    conv.ctx = &ctx;
+    conv.nonce = nonce;
+    conv.ecb = NULL;
+    orig_filesize = -1;
+    if (sfs_cipher_engines[engine].mode != SFS_CIPHER_CTR) {
+      // ECB files are padded, the plain data ends at the recorded size
+      conv.ecb = &ctx.bf;
+      orig_filesize = sfs_dir_file_size(req->dir, req->name);
+      if (orig_filesize != -1)
+        orig_filesize = sfs_recover_file_size( req->dir, req->name, SFS_CIPHER_ECB, orig_filesize, &ctx.bf );
+      if(orig_filesize == -1)
       {
-        __write( tempfile, enc_buf, BF_BLOCK_SIZE );
+        sfs_debug( "sfsd_chmod_request0", "error getting file size" );
+        goto out;
       }
-      filesize += size;
     }
+    req->job = sfs_start_job( req, file, tempfile, temppath, orig_filesize, &conv, NULL );
+  }
 
-DE
-DE
-    __close( file );
+  if (req->job == -1) {
+    req->job = 0;
+    goto out;
+  }
+  // the files belong to the job now
+  file = tempfile = -1;
+  temppath = NULL;
+  ret = SFS_REPLY_OK;
+
+out:
+  // The temporary file was made here, a failed request removes it
+  if (tempfile != -1) {
     __close( tempfile );
-    sprintf( buf, "%s%s", req->dir, req->name);
-    ret = rename( temppath, buf );
-    if(ret!=0)
-      sfs_debug("sfs_chmod_request0","rename error: %s -> %s : %d", temppath, buf, ret); 
-
-    // restores rights to the file 
-    ret = __chmod(buf, req->rights);
-    if(ret == -1)
-      sfs_debug("sfs_chmod_request1","error changing back owner");
-    // if demon runs as root it changes back owner of file
-    ret = __chown(buf,req->uid,-1);
-    if(ret == -1)
-      sfs_debug("sfs_chmod_request1","error setting back rights");
+    unlink( temppath );
+  }
+  if (file != -1)
+    __close( file );
+  free( temppath );
+  if (written && (ret != SFS_REPLY_OK))
+    sfs_chmod_undo_keys( req );
+  for (i=0;i<3;i++)
+    free( keys[i] );
+  free( ekey_hex );
+  free( ekey_bin );
+  free( pubkey );
+  free( ekey );
+  // the keys are copied into the job
+  if (privkey) {
+    memset( privkey, 0, sizeof( rsa_key ));
+    free( privkey );
+  }
+  if (dkey_hex) {
+    memset( dkey_hex, 0, dkey_len );
+    free( dkey_hex );
+  }
+  memset( &ctx, 0, sizeof( ctx ));
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_chmod_undo_keys()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Removes key records of file that failed to get encrypted
+// Status: finished
+//----------------------------------------------------------------------------
+void
+sfs_chmod_undo_keys( struct sfs_chmod_request *req )
+{
+  struct sfsd_dir_change changes[3];
+
+  sfs_chmod_change( &changes[0], SFS_KEY_USER, req->uid, NULL, 0 );
+  sfs_chmod_change( &changes[1], SFS_KEY_GROUP, req->gid, NULL, 0 );
+  sfs_chmod_change( &changes[2], SFS_KEY_ALL, 0, NULL, 0 );
+  if (sfs_dir_apply( req->dir, req->name, changes, 3 ) == -1)
+    sfs_debug( "sfsd_chmod_undo_keys", "key records of %s%s left", req->dir, req->name );
+}
 
-DE
-    if (sfs_delete_file_key( req->dir, req->name, req->uid ) == -1) {
-      sfs_debug( "sfsd_chmod_request0", "delete file key error" );
-      return SFS_REPLY_FAIL;
-    }
+
+#undef DE
+#define DE DEB( "sfs_chmod_finish" );
+
+//----------------------------------------------------------------------------
+// sfs_chmod_finish()
+// ~~~~~~~~~~~~~~~~~~
+// Switches the converted file over when its job ends: the temporary file
+// replaces the file and its key records are changed
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_chmod_finish( struct sfs_job *job )
+{
+  struct sfs_chmod_request *req = &job->req;
+  struct sfsd_dir_change changes[4];
+  char buf[SFS_MAX_PATH];
+  int encrypt = req->mode && (req->mode != SFS_CHMOD_MIGRATE);
+_DE
+
+  // Encrypted file keeps being plain, its key records must go
+  if (job->size == -1) {
+    sfs_debug( "sfsd_chmod_finish", "conversion error" );
+    unlink( job->temppath );
+    if (encrypt)
+      sfs_chmod_undo_keys( req );
+    return SFS_REPLY_FAIL;
+  }
 
 DE
-    if (sfs_delete_g_file_key( req->dir, req->name, req->gid ) == -1) {
-      sfs_debug( "sfsd_chmod_request0", "delete g_file key error" );
-      return SFS_REPLY_FAIL;
-    }
+  sprintf( buf, "%s%s", req->dir, req->name );
+  if (rename( job->temppath, buf ) != 0) {
+    sfs_debug( "sfsd_chmod_finish", "rename error: %s -> %s : %d", job->temppath, buf, errno );
+    unlink( job->temppath );
+    if (encrypt)
+      sfs_chmod_undo_keys( req );
+    return SFS_REPLY_FAIL;
+  }
+
+  // restores rights to the file 
+  if (__chmod( buf, req->rights ) == -1)
+    sfs_debug( "sfsd_chmod_finish", "error setting back rights" );
+  // if demon runs as root it changes back owner of file
+  if (__chown( buf, req->uid, -1 ) == -1)
+    sfs_debug( "sfsd_chmod_finish", "error changing back owner" );
+
+  if (req->mode == SFS_CHMOD_MIGRATE)
+    return sfs_migrate_finish( job );
 
 DE
-    if (sfs_delete_a_file_key( req->dir, req->name ) == -1) {
-      sfs_debug( "sfsd_chmod_request0", "delete a_file key error" );
+  if (encrypt) {
+    if (sfs_dir_write_size( req->dir, req->name, job->size, NULL ) == -1) {
+      sfs_debug( "sfsd_chmod_finish", "write size error" );
       return SFS_REPLY_FAIL;
     }
+    return SFS_REPLY_OK;
+  }
 
 DE
-    if (sfs_delete_file_size( req->dir, req->name ) == -1) {
-      sfs_debug( "sfsd_chmod_request0", "delete file size error" );
-      return SFS_REPLY_FAIL;
-    }
+  // Key records and size of the decrypted file go at once
+  sfs_chmod_change( &changes[0], SFS_KEY_USER, req->uid, NULL, 0 );
+  sfs_chmod_change( &changes[1], SFS_KEY_GROUP, req->gid, NULL, 0 );
+  sfs_chmod_change( &changes[2], SFS_KEY_ALL, 0, NULL, 0 );
+  sfs_chmod_change( &changes[3], SFS_META_SIZE, 0, NULL, -1 );
+  if (sfs_dir_apply( req->dir, req->name, changes, 4 ) == -1) {
+    sfs_debug( "sfsd_chmod_finish", "delete key records error" );
+    return SFS_REPLY_FAIL;
   }
   
   return SFS_REPLY_OK;
 }
 
 
+//----------------------------------------------------------------------------
+// sfs_migrate_file()
+// ~~~~~~~~~~~~~~~~~~
+// Converts a file encrypted in ECB mode, the layout of older versions, to
+// a CTR engine.  The file key stays the same, so the wrapped keys of user,
+// group and all are only tagged with the engine and new nonce.  Files in
+// CTR mode are left as they are.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_migrate_file( struct sfs_chmod_request *req )
+{
+  char *ekey, *wkey, *ekey_bin, *dkey_hex=NULL, *temppath=NULL;
+  char buf[SFS_MAX_PATH];
+  struct sfs_conv_arg conv;
+  bf_key_schedule old_ks;
+  unsigned char nonce[SFS_NONCE_SIZE];
+  struct sfs_user *user;
+  rsa_key *privkey;
+  int file=-1, tempfile=-1, len, engine, ret=SFS_REPLY_FAIL;
+  off_t orig_filesize;
+  sfs_cipher_ctx ctx;
+
+  user = sfs_find_user( req->uid );
+  if (!user) {
+    sfs_debug( "sfsd_migrate_file", "find user %d error", req->uid );
+    return SFS_REPLY_FAIL;
+  }
+
+  ekey = sfs_dir_file_key_text( req->dir, req->name, SFS_KEY_USER, req->uid );
+  if (!ekey) {
+    sfs_debug( "sfsd_migrate_file", "file %s%s is NOT encrypted", req->dir, req->name );
+    return SFS_REPLY_FAIL;
+  }
+  wkey = sfs_sym_parse_blob( ekey, &engine, nonce );
+  if (!wkey) {
+    sfs_debug( "sfsd_migrate_file", "bad key record" );
+    goto out;
+  }
+  if (engine != SFS_ENGINE_BFECB) {
+    ret = SFS_REPLY_OK;
+    goto out;
+  }
+  engine = sfs_chmod_engine( req );
+  if (engine == -1)
+    goto out;
+
+  // Unwraps the file key
+  privkey = sfs_asym_parse_key( user->key );
+  if (!privkey) {
+    sfs_debug( "sfsd_migrate_file", "privkey parse error" );
+    goto out;
+  }
+  len = strlen( wkey ) / 2;
+  ekey_bin = hex2bit( wkey, 0 );
+  if (!ekey_bin)
+    sfs_debug( "sfsd_migrate_file", "ekey_bin error" );
+  else
+    dkey_hex = sfs_asym_decrypt( privkey, ekey_bin, &len );
+  free( ekey_bin );
+  memset( privkey, 0, sizeof( rsa_key ));
+  free( privkey );
+  if (!dkey_hex) {
+    sfs_debug( "sfsd_migrate_file", "decrypt key error" );
+    goto out;
+  }
+
+  // Old file keys are 20 bytes, too short for some engines
+  if (sfs_cipher_set_key( engine, &ctx, dkey_hex ) == -1) {
+    sfs_debug( "sfsd_migrate_file", "file key does not fit %s", sfs_cipher_engines[engine].name );
+    goto out;
+  }
+  sfs_sym_set_key( dkey_hex, &old_ks );
+
+  orig_filesize = sfs_dir_file_size( req->dir, req->name );
+  if (orig_filesize != -1)
+    orig_filesize = sfs_recover_file_size( req->dir, req->name, SFS_CIPHER_ECB, orig_filesize, &old_ks );
+  if (orig_filesize == -1) {
+    sfs_debug( "sfsd_migrate_file", "error getting file size" );
+    goto out;
+  }
+
+  // Decrypts whole blocks and encrypts them again at the same offset
+  sprintf( buf, "%s%s", req->dir, req->name );
+  file = __open( buf, O_RDONLY );
+  if (file == -1) {
+    sfs_debug( "sfsd_migrate_file", "error openning %s: %d", buf, errno );
+    goto out;
+  }
+  temppath = sfs_tempname( req->dir );
+  if (!temppath) {
+    sfs_debug( "sfsd_migrate_file", "error getting tempname" );
+    goto out;
+  }
+  tempfile = __open( temppath, O_WRONLY|O_CREAT|O_EXCL, req->rights );
+  if (tempfile == -1) {
+    sfs_debug( "sfsd_migrate_file", "error openning %s: %d", temppath, errno );
+    goto out;
+  }
+
+  // The rest is done by sfs_migrate_finish() when the job ends
+  sfs_sym_generate_nonce( nonce );
+  conv.engine = engine;
+  conv.ctx = &ctx;
+  conv.nonce = nonce;
+  conv.ecb = &old_ks;
+  req->job = sfs_start_job( req, file, tempfile, temppath, orig_filesize, &conv, wkey );
+  if (req->job == -1) {
+    req->job = 0;
+    goto out;
+  }
+  // the files belong to the job now
+  file = tempfile = -1;
+  temppath = NULL;
+  ret = SFS_REPLY_OK;
+
+out:
+  // The temporary file was made here, a failed request removes it
+  if (tempfile != -1) {
+    __close( tempfile );
+    unlink( temppath );
+  }
+  if (file != -1)
+    __close( file );
+  free( temppath );
+  // the keys are copied into the job
+  if (dkey_hex) {
+    memset( dkey_hex, 0, len );
+    free( dkey_hex );
+  }
+  memset( &ctx, 0, sizeof( ctx ));
+  memset( &old_ks, 0, sizeof( old_ks ));
+  free( ekey );
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_migrate_finish()
+// ~~~~~~~~~~~~~~~~~~~~
+// Tags the key records of user, group and all of migrated file with the
+// engine and nonce and writes its size in one change when its job ends,
+// the file is renamed already
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_migrate_finish( struct sfs_job *job )
+{
+  struct sfs_chmod_request *req = &job->req;
+  struct sfsd_dir_change changes[4];
+  int engine = job->conv.engine, ret, i, n = 0;
+  char *ekey, *blobs[3];
+
+  blobs[1] = blobs[2] = NULL;
+  blobs[0] = sfs_sym_make_blob( engine, job->nonce, job->wkey );
+  ret = (blobs[0] != NULL);
+  if (ret)
+    sfs_chmod_change( &changes[n++], SFS_KEY_USER, req->uid, blobs[0], 0 );
+
+  if (ret && (ekey = sfs_dir_file_key_text( req->dir, req->name, SFS_KEY_GROUP, req->gid ))) {
+    blobs[1] = sfs_sym_make_blob( engine, job->nonce, ekey );
+    free( ekey );
+    ret = (blobs[1] != NULL);
+    if (ret)
+      sfs_chmod_change( &changes[n++], SFS_KEY_GROUP, req->gid, blobs[1], 0 );
+  }
+
+  if (ret && (ekey = sfs_dir_file_key_text( req->dir, req->name, SFS_KEY_ALL, 0 ))) {
+    blobs[2] = sfs_sym_make_blob( engine, job->nonce, ekey );
+    free( ekey );
+    ret = (blobs[2] != NULL);
+    if (ret)
+      sfs_chmod_change( &changes[n++], SFS_KEY_ALL, 0, blobs[2], 0 );
+  }
+
+  // Tagged key records and the size go at once
+  if (ret) {
+    sfs_chmod_change( &changes[n++], SFS_META_SIZE, 0, NULL, job->size );
+    ret = (sfs_dir_apply( req->dir, req->name, changes, n ) != -1);
+  }
+  for (i=0;i<3;i++)
+    free( blobs[i] );
+
+  if (!ret) {
+    sfs_debug( "sfsd_migrate_finish", "key records of %s%s not converted", req->dir, req->name );
+    return SFS_REPLY_FAIL;
+  }
+
+  sfs_debug( "sfsd_migrate_finish", "%s%s converted to %s", req->dir, req->name, sfs_cipher_engines[engine].name );
+  return SFS_REPLY_OK;
+}
+
+
 //----------------------------------------------------------------------------
 // sfs_fchmod_request()
 // ~~~~~~~~~~~~~~~~~~~~
@@ -855,6 +1425,7 @@ sfs_dump_request( void  )
   int i;
   
 //  sfs_debug( "sfsd", "dumping db." );
+  sfs_debug( "sfsd", "reaped files: %ld", sfs_reaped_files );
   for (i=0;i<last_user;i++)
 //   sfs_debug( "sfsd", "  %s %s %d %d", users[i].name, users[i].key, users[i].uid, users[i].gid );
   sfs_debug( "sfsd", "dumping finished." );
@@ -865,19 +1436,20 @@ sfs_dump_request( void  )
 //----------------------------------------------------------------------------
 // sfs_is_request()
 // ~~~~~~~~~~~~~~~~
-// Handle is request
+// Handle is request, tells also which format the encrypted file has
 // Status: finished
 //----------------------------------------------------------------------------
 int
 sfs_is_request( struct sfs_is_request *req )
 {
-  char *f;
-  
+  int i;
+
 //  sfs_debug( "sfsd_is_request", "is: %d, %d.", req->fd, req->pid );
-  f = sfs_get_file_key( req->pid, req->fd );
-  
-  if(f) {
+  if ((i = sfs_find_file( req->pid, req->fd )) != -1) {
 //   sfs_debug( "sfsd_is_request", "is: %d, %d: YES.", req->fd, req->pid );
+    // CTR files need neither alignment nor read-modify-write
+    if (sfs_cipher_engines[files[i].engine].mode == SFS_CIPHER_CTR)
+      return SFS_REPLY_STREAM;
     return SFS_REPLY_ENCRYPTED;
   }
   else {
@@ -922,6 +1494,24 @@ sfs_setsize_request( struct sfs_size_request *req )
 }
 
 
+//----------------------------------------------------------------------------
+// sfs_sync_request()
+// ~~~~~~~~~~~~~~~~~~
+// Handle sync request, writes size of the file to .sfssizes
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_sync_request( struct sfs_sync_request *req )
+{
+  int i;
+
+  if ((i = sfs_find_file( req->pid, req->fd )) == -1)
+    return SFS_REPLY_FAIL;
+
+  return sfs_flush_file_size( i );
+}
+
+
 /*
 
 //----------------------------------------------------------------------------
@@ -971,17 +1561,21 @@ sfs_find_user( uid_t uid )
 //----------------------------------------------------------------------------
 // sfs_add_file()
 // ~~~~~~~~~~~~~~
-// Adds file to internal structure of demon
+// Adds file to internal structure of demon, the file key stays wrapped
 // Status: finished
 //----------------------------------------------------------------------------
 int
-sfs_add_file( pid_t pid, int fd, const char *key, off_t size, const char *dir, const char *name )
+sfs_add_file( pid_t pid, int fd, uid_t uid, int key_type, int engine, const unsigned char *nonce, const char *ekey, int ekey_len, off_t size, const char *dir, const char *name )
 {
   int i;
   
   for (i=0;i<SFS_MAX_FILES;i++)
-    if (files[i].key[0] == 0)
+    if (files[i].state == SFS_FILE_FREE)
       break;
+  if ((i >= SFS_MAX_FILES) && sfs_reap_files( SFS_MAX_FILES ))
+    for (i=0;i<SFS_MAX_FILES;i++)
+      if (files[i].state == SFS_FILE_FREE)
+        break;
   if (i >= SFS_MAX_FILES) {
     sfs_debug( "sfsd_add_file", "maximum number of files reached!!!" );
     return SFS_REPLY_FAIL;
@@ -994,24 +1588,137 @@ sfs_add_file( pid_t pid, int fd, const char *key, off_t size, const char *dir, c
 
   files[i].pid = pid;
   files[i].fd = fd;
+  files[i].uid = uid;
   files[i].size = size;
-  strncpy( files[i].key, key, SFS_MAX_PATH );
+  files[i].dirty = 0;
+  files[i].size_slot = 0;
+  files[i].key_type = key_type;
+  files[i].engine = engine;
+  memcpy( files[i].nonce, nonce, SFS_NONCE_SIZE );
+  files[i].key[0] = 0;
+  memcpy( files[i].ekey, ekey, ekey_len );
+  files[i].ekey_len = ekey_len;
   strncpy( files[i].dir, dir, SFS_MAX_PATH );
   strncpy( files[i].name, name, SFS_MAX_PATH );
+  files[i].state = SFS_FILE_WRAPPED;
 
   return SFS_REPLY_OK;
 }
 
 
-/*
- * Methods that work with internal structure containing file informations
- *
- */
+//----------------------------------------------------------------------------
+// sfs_find_file()
+// ~~~~~~~~~~~~~~~
+// returns index of the file in internal structure of demon or -1
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_find_file( pid_t pid, int fd )
+{
+  int i;
+  
+  for (i=0;i<last_file;i++) {
+//    sfs_debug( "sfs_find_file", "%d: %d,%d", i, files[i].pid, files[i].fd );
+    if ((files[i].state != SFS_FILE_FREE) && (files[i].pid == pid) && (files[i].fd == fd))
+      return i;
+  }
+  return -1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_find_file_path()
+// ~~~~~~~~~~~~~~~~~~~~
+// returns index of any opened instance of the file dir+name or -1
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_find_file_path( const char *dir, const char *name )
+{
+  int i;
+  
+  for (i=0;i<last_file;i++)
+    if ((files[i].state != SFS_FILE_FREE)
+        && !strncmp( files[i].name, name, SFS_MAX_PATH )
+        && !strncmp( files[i].dir, dir, SFS_MAX_PATH ))
+      return i;
+  return -1;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_unwrap_file_key()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Decrypts wrapped key of the file with the private key of its user.
+// Other pending entries wrapped by the same key for the same user are
+// unwrapped by the way, so e.g. a file opened several times costs one RSA.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_unwrap_file_key( int i )
+{
+  char *dkey, *pkey;
+  struct sfs_user *user;
+  rsa_key *rk;
+  int j, len;
+
+  user = sfs_find_user( files[i].uid );
+  if (!user) {
+    sfs_debug( "sfsd_unwrap_file_key", "find user %d error", files[i].uid );
+    return SFS_REPLY_FAIL;
+  }
+
+  switch (files[i].key_type) {
+    case SFS_KEY_USER:  pkey = user->key;  break;
+    case SFS_KEY_GROUP: pkey = user->gkey; break;
+    case SFS_KEY_ALL:   pkey = user->akey; break;
+    default:
+      sfs_debug( "sfsd_unwrap_file_key", "bad key type %d", files[i].key_type );
+      return SFS_REPLY_FAIL;
+  }
+
+  rk = sfs_asym_parse_key( pkey );
+  if (!rk) {
+    sfs_debug( "sfsd_unwrap_file_key", "rk error" );
+    return SFS_REPLY_FAIL;
+  }
+
+  len = files[i].ekey_len;
+  dkey = sfs_asym_decrypt( rk, files[i].ekey, &len );
+  free( rk );
+  if (!dkey) {
+    sfs_debug( "sfsd_unwrap_file_key", "decrypt key error" );
+    return SFS_REPLY_FAIL;
+  }
+
+  if (sfs_cipher_set_key( files[i].engine, &file_ctx[i], dkey ) == -1) {
+    sfs_debug( "sfsd_unwrap_file_key", "key schedule error" );
+    free( dkey );
+    return SFS_REPLY_FAIL;
+  }
+
+  for (j=0;j<last_file;j++)
+    if ((j == i) || ((files[j].state == SFS_FILE_WRAPPED)
+                     && (files[j].uid == files[i].uid)
+                     && (files[j].key_type == files[i].key_type)
+                     && (files[j].engine == files[i].engine)
+                     && (files[j].ekey_len == files[i].ekey_len)
+                     && !memcmp( files[j].ekey, files[i].ekey, files[i].ekey_len ))) {
+      strncpy( files[j].key, dkey, SFS_MAX_KEY );
+      file_ctx[j] = file_ctx[i];
+      files[j].state = SFS_FILE_READY;
+    }
+
+  free( dkey );
+  return SFS_REPLY_OK;
+}
+
 
 //----------------------------------------------------------------------------
 // sfs_get_file_key()
 // ~~~~~~~~~~~~~~~~~~
-// returns from internal structure of demon the symetric key for file
+// returns from internal structure of demon the symetric key for file,
+// unwraps it on the first use
 // Status: finished
 //----------------------------------------------------------------------------
 char*
@@ -1019,12 +1726,14 @@ sfs_get_file_key( pid_t pid, int fd )
 {
   int i;
   
-  for (i=0;i<last_file;i++) {
-//    sfs_debug( "sfs_get_file_key", "%d: %d,%d", i, files[i].pid, files[i].fd );
-    if ((files[i].pid == pid) && (files[i].fd == fd))
-      return files[i].key;
-  }
-  return NULL;
+  if ((i = sfs_find_file( pid, fd )) == -1)
+    return NULL;
+
+  if (files[i].state == SFS_FILE_WRAPPED)
+    if (sfs_unwrap_file_key( i ) != SFS_REPLY_OK)
+      return NULL;
+
+  return files[i].key;
 }
 
 
@@ -1039,14 +1748,63 @@ sfs_del_file_key( pid_t pid, int fd )
 {
   int i;
   
-  for (i=0;i<last_file;i++) {
-//    sfs_debug( "sfs_del_file_key", "%d: %d,%d", i, files[i].pid, files[i].fd );
-    if ((files[i].pid == pid) && (files[i].fd == fd)) {
-      files[i].key[0] = 0;
-      return SFS_REPLY_OK;
-    }
+  if ((i = sfs_find_file( pid, fd )) == -1)
+    return SFS_REPLY_FAIL;
+
+  files[i].state = SFS_FILE_FREE;
+  files[i].key[0] = 0;
+  files[i].ekey_len = 0;
+  return SFS_REPLY_OK;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_reap_files()
+// ~~~~~~~~~~~~~~~~
+// Checks at most count files from the reap cursor on and releases all files
+// of processes that do not exist any more. Returns number of files released.
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_reap_files( int count )
+{
+  pid_t pid;
+  int i, j, reaped = 0;
+
+  if (last_file == 0)
+    return 0;
+  if (count > last_file)
+    count = last_file;
+
+  for (i=0;i<count;i++) {
+    if (reap_cursor >= last_file)
+      reap_cursor = 0;
+    j = reap_cursor++;
+    if (files[j].state == SFS_FILE_FREE)
+      continue;
+
+    // Only a process known to be gone is reaped, a failed check is not
+    // proof of its death
+    pid = files[j].pid;
+    if ((pid <= 0) || (kill( pid, 0 ) == 0) || (errno != ESRCH))
+      continue;
+
+    for (j=0;j<last_file;j++)
+      if ((files[j].state != SFS_FILE_FREE) && (files[j].pid == pid)) {
+        sfs_flush_file_size( j );
+        memset( files[j].key, 0, SFS_MAX_KEY );
+        files[j].ekey_len = 0;
+        files[j].state = SFS_FILE_FREE;
+        reaped++;
+      }
+    sfs_debug( "sfsd_reap_files", "process %d is dead", pid );
   }
-  return SFS_REPLY_FAIL;
+
+  while ((last_file > 0) && (files[last_file-1].state == SFS_FILE_FREE))
+    last_file--;
+
+  sfs_reaped_files += reaped;
+  return reaped;
 }
 
 
@@ -1066,14 +1824,11 @@ sfs_get_file_size( pid_t pid, int fd, off_t *size )
 {
   int i;
   
-  for (i=0;i<last_file;i++) {
-//    sfs_debug( "sfs_get_file_size", "%d: %d,%d", i, files[i].pid, files[i].fd );
-    if ((files[i].pid == pid) && (files[i].fd == fd)) {
-      *size = files[i].size;
-      return SFS_REPLY_OK;
-    }
-  }
-  return SFS_REPLY_FAIL;
+  if ((i = sfs_find_file( pid, fd )) == -1)
+    return SFS_REPLY_FAIL;
+
+  *size = files[i].size;
+  return SFS_REPLY_OK;
 }
 
 
@@ -1081,25 +1836,134 @@ sfs_get_file_size( pid_t pid, int fd, off_t *size )
 // sfs_set_file_size()
 // ~~~~~~~~~~~~~~~~~~~
 // sets from internal structure of demon the file size for file
+// The size goes to all opened instances of the file, .sfssizes is written
+// later by sfs_flush_file_size()
 // Status: finished
 //----------------------------------------------------------------------------
 int
 sfs_set_file_size( pid_t pid, int fd, off_t size )
 {
-  int i;
+  int i, j;
   
-  for (i=0;i<last_file;i++) {
+  if ((i = sfs_find_file( pid, fd )) == -1)
+    return SFS_REPLY_FAIL;
+
 //    sfs_debug( "sfs_set_file_size", "%d: %d,%d,%d", i, files[i].pid, files[i].fd, files[i].size );
-    if ((files[i].pid == pid) && (files[i].fd == fd)) {
-      files[i].size = size;
-      if (sfs_write_file_size( files[i].dir, files[i].name, size) != SFS_REPLY_OK) {
-        sfs_debug( "sfsd_set_file_size", "writing size error" );
-        return SFS_REPLY_FAIL;
+  for (j=0;j<last_file;j++)
+    if ((j == i) || ((files[j].state != SFS_FILE_FREE)
+                     && !strncmp( files[j].name, files[i].name, SFS_MAX_PATH )
+                     && !strncmp( files[j].dir, files[i].dir, SFS_MAX_PATH ))) {
+      files[j].size = size;
+      files[j].dirty = 1;
+    }
+  return SFS_REPLY_OK;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_flush_file_size()
+// ~~~~~~~~~~~~~~~~~~~~~
+// Writes size of the file to .sfssizes if it has changed
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_flush_file_size( int i )
+{
+  int j, ret;
+
+  if (!files[i].dirty)
+    return SFS_REPLY_OK;
+
+  ret = sfs_dir_write_size( files[i].dir, files[i].name, files[i].size, &files[i].size_slot );
+  if (ret == -1) {
+    sfs_debug( "sfsd_flush_file_size", "writing size error" );
+    return SFS_REPLY_FAIL;
+  }
+
+  for (j=0;j<last_file;j++)
+    if ((files[j].state != SFS_FILE_FREE)
+        && !strncmp( files[j].name, files[i].name, SFS_MAX_PATH )
+        && !strncmp( files[j].dir, files[i].dir, SFS_MAX_PATH )) {
+      files[j].dirty = 0;
+      files[j].size_slot = files[i].size_slot;
+    }
+  return SFS_REPLY_OK;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_flush_files()
+// ~~~~~~~~~~~~~~~~~
+// Writes all changed sizes to .sfssizes or the stores and commits them
+// Status: finished
+//----------------------------------------------------------------------------
+int
+sfs_flush_files( void )
+{
+  int i, ret = SFS_REPLY_OK;
+
+  for (i=0;i<last_file;i++)
+    if ((files[i].state != SFS_FILE_FREE) && files[i].dirty)
+      if (sfs_flush_file_size( i ) != SFS_REPLY_OK)
+        ret = SFS_REPLY_FAIL;
+  if (sfs_dir_commit() == -1)
+    ret = SFS_REPLY_FAIL;
+  return ret;
+}
+
+
+//----------------------------------------------------------------------------
+// sfs_recover_file_size()
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Gives size of file from the size in .sfssizes, which may be stale after
+// a crash (sizes are flushed every few seconds).  CTR ciphertext is exactly
+// as long as the data, so its length is the size.  ECB ciphertext ends with
+// the block holding the end of the data, sfs_ecb_pad() fills the rest of
+// that block with the count of the bytes past the data, so the size is
+// read from the last block if ks is given.  Files written before that
+// carry no count, the stored size is taken if it fits the length and a
+// tail of stored size % 8 after the whole blocks otherwise.
+// Status: finished
+//----------------------------------------------------------------------------
+off_t
+sfs_recover_file_size( const char *dir, const char *name, int mode, off_t size, bf_key_schedule *ks )
+{
+  char path[SFS_MAX_PATH];
+  bf_block last;
+  struct stat st;
+  off_t len;
+  ssize_t n;
+  int fd, pad;
+
+  if (snprintf( path, SFS_MAX_PATH, "%s%s", dir, name ) >= SFS_MAX_PATH)
+    return size;
+  if (stat( path, &st ) == -1)
+    return size;
+
+  len = st.st_size;
+  if (mode == SFS_CIPHER_CTR)
+    return len;
+  if (len < SFS_BF_BLOCK_SIZE)
+    return 0;
+
+  if (ks && ((fd = __open( path, O_RDONLY )) != -1)) {
+    n = pread( fd, &last, SFS_BF_BLOCK_SIZE, len - SFS_BF_BLOCK_SIZE );
+    __close( fd );
+    if (n == SFS_BF_BLOCK_SIZE) {
+      sfs_sym_decrypt_blocks( ks, &last, SFS_BF_BLOCK_SIZE );
+      if ((pad = sfs_ecb_padding( (unsigned char *)&last ))) {
+        if (len - pad != size)
+          sfs_debug( "sfsd_recover_file_size", "%s%s: stored size %ld, recovered %ld", dir, name, (long)size, (long)(len - pad) );
+        return len - pad;
       }
-      return SFS_REPLY_OK;
     }
   }
-  return SFS_REPLY_FAIL;
+
+  // Files encrypted by chmod are padded by up to two blocks
+  if ((size <= len) && (len - size <= 2*SFS_BF_BLOCK_SIZE))
+    return size;
+  sfs_debug( "sfsd_recover_file_size", "%s%s: stored size %ld does not fit length %ld", dir, name, (long)size, (long)len );
+  return len - SFS_BF_BLOCK_SIZE + size % SFS_BF_BLOCK_SIZE;
 }
 
 
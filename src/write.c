@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/msg.h>
@@ -88,6 +89,37 @@ DE
     }
   }
 
+  if (rett == SFS_REPLY_STREAM) {
+    // CTR file needs neither aligned blocks nor the old data
+    off.offset = __lseek( fd, 0, SEEK_CUR );
+    if (off.offset == -1) {
+      sfs_debug( "write", "cannot get current position" );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+    if (!(write_buf = (char*)malloc( count ? count : 1 ))) {
+      sfs_debug( "write", "not enough memory" );
+      errno = SFS_ERRNO;
+      return -1;
+    }
+    memcpy( write_buf, what, count );
+    // The file grows only by the bytes really written, told after the write
+    size = 0;
+    if (sfs_stream_crypt( fd, uid, SFS_WRITE_REQ, off.offset, write_buf, count, &size ) == -1) {
+      sfs_debug( "write", "stream encryption error" );
+      free( write_buf );
+      return -1;
+    }
+    ret = __write( fd, write_buf, count );
+    free( write_buf );
+    if (ret > 0) {
+      size = off.offset + ret;
+      if (sfs_stream_crypt( fd, uid, SFS_WRITE_REQ, size, buf, 0, &size ) == -1)
+        sfs_debug( "write", "cannot tell new size" );
+    }
+    return ret;
+  }
+
 //  sfs_debug( "write", "file IS encrypted" );
   
   // off represents offset and caunt passed by user
@@ -215,6 +247,9 @@ DE
     msgb.sfs_msg.sfs_req.sfs_write.fd = fd;
     msgb.sfs_msg.sfs_req.sfs_write.count = SFS_BF_BLOCK_SIZE; //count;
     msgb.sfs_msg.sfs_req.sfs_write.pid = getpid();
+    // The last block tells daemon where the file may have grown to
+    msgb.sfs_msg.sfs_req.sfs_write.size = (i+SFS_BF_BLOCK_SIZE >= new_off->count) ?
+                                          off.offset+off.count : 0;
 
     // fill in data to be encrypted by demon
     for (j=0;j<SFS_BF_BLOCK_SIZE;j++) {
@@ -313,114 +348,6 @@ DE
     return -1; */
   }
 
-// Set the right size for the file
-
-  msgb.sfs_msg.sfs_req_auth = auth;
-  msgb.sfs_msg.sfs_req_type = SFS_GETSIZE_REQ;
-  msgb.sfs_msg.sfs_req.sfs_size.fd = fd;
-  msgb.sfs_msg.sfs_req.sfs_size.uid = uid;
-  msgb.sfs_msg.sfs_req.sfs_size.pid = getpid();
-
-DE
-  if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
-    sfs_debug( "write", "cannot send message" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    __lseek( fd, off.offset, SEEK_SET );
-    free( write_buf );
-    errno = SFS_ERRNO;
-    return -1;
-  }
-  
-DE  
-  if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
-    sfs_debug( "write", "receive message error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    __lseek( fd, off.offset, SEEK_SET );
-    free( write_buf );
-    errno = SFS_ERRNO;
-    return -1;
-  }
-  
-DE  
-  if (msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ) {
-    sfs_debug( "write", "receive reply message error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    __lseek( fd, off.offset, SEEK_SET );
-    free( write_buf );
-    errno = SFS_ERRNO;
-    return -1;
-  }
-  
-DE    
-  if (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK) {
-    sfs_debug( "write", "sfsd login error" );
-    msgctl( reply_queue, IPC_RMID, NULL );
-    __lseek( fd, off.offset, SEEK_SET );
-    free( write_buf );
-    errno = SFS_ERRNO;
-    return -1;
-  }
-  
-DE
-  if ((size = __lseek( fd, off.offset+off.count, SEEK_SET )) == -1) {
-    sfs_debug( "write", "getting size rror" );
-    __lseek( fd, off.offset, SEEK_SET );
-    free( write_buf );
-    errno = SFS_ERRNO;
-    return -1;
-  }
- 
-DE
-  if (size > msgb.sfs_msg.sfs_req.sfs_size.size ) {
-    msgb.sfs_msg.sfs_req_auth = auth;
-    msgb.sfs_msg.sfs_req_type = SFS_SETSIZE_REQ;
-    msgb.sfs_msg.sfs_req.sfs_size.fd = fd;
-    msgb.sfs_msg.sfs_req.sfs_size.uid = uid;
-    msgb.sfs_msg.sfs_req.sfs_size.pid = getpid();
-    msgb.sfs_msg.sfs_req.sfs_size.size = size;
-
-DE
-    if (msgsnd( sfs_queue, &msgb, SFS_MSG_SIZE, 0 ) == -1) {
-      sfs_debug( "write", "cannot send message" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( write_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-DE  
-    if (msgrcv( reply_queue, &msgb, SFS_MSG_SIZE, SFS_MESSAGE, 0 ) == -1) {
-      sfs_debug( "write", "receive message error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( write_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-DE  
-    if (msgb.sfs_msg.sfs_req_type != SFS_REPLY_REQ) {
-      sfs_debug( "write", "receive reply message error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( write_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-DE    
-    if (msgb.sfs_msg.sfs_req_auth != SFS_REPLY_OK) {
-      sfs_debug( "write", "sfsd login error" );
-      msgctl( reply_queue, IPC_RMID, NULL );
-      __lseek( fd, off.offset, SEEK_SET );
-      free( write_buf );
-      errno = SFS_ERRNO;
-      return -1;
-    }
-    
-  }
-
 // Finish him!
 
 DE  